@@ -0,0 +1,494 @@
+/*
+ * bench.c: benchmark driver for the RSSB VM and assembler
+ * Creation date: Sat Oct  6 20:01:54 2018
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "parser.h"
+#include "perf.h"
+
+#define BENCH_VM_MEMORY_SIZE  65536
+#define BENCH_ASM_MEMORY_SIZE (1 << 23)
+#define BENCH_DATA_LABELS     64
+
+enum bench_kind {
+  BENCH_KIND_VM,
+  BENCH_KIND_ASM
+};
+
+struct bench_workload {
+  enum bench_kind kind;
+  const char *name;
+  const char *file;       /* VM workloads */
+  unsigned int statements; /* Assembler workloads */
+};
+
+/* Sent from the child running a workload back to the driver */
+struct bench_result {
+  BOOL ok;
+  uint64_t words;
+  double assembly_ms;
+  struct rssb_vm_stats stats;
+  struct rssb_perf_sample perf;
+};
+
+PRIVATE const struct bench_workload g_workloads[] = {
+  {BENCH_KIND_VM,  "vm/output",  "output.rssb",  0},
+  {BENCH_KIND_VM,  "vm/arith",   "arith.rssb",   0},
+  {BENCH_KIND_VM,  "vm/selfmod", "selfmod.rssb", 0},
+  {BENCH_KIND_VM,  "vm/macros",  "macros.rssb",  0},
+  {BENCH_KIND_ASM, "asm/1e3",    NULL,           1000},
+  {BENCH_KIND_ASM, "asm/1e4",    NULL,           10000},
+  {BENCH_KIND_ASM, "asm/1e5",    NULL,           100000},
+  {BENCH_KIND_ASM, "asm/1e6",    NULL,           1000000},
+};
+
+#define BENCH_WORKLOAD_COUNT (sizeof(g_workloads) / sizeof(g_workloads[0]))
+
+PRIVATE double
+bench_elapsed_ms(const struct timeval *start)
+{
+  struct timeval end, diff;
+
+  gettimeofday(&end, NULL);
+  timersub(&end, start, &diff);
+
+  return 1e3 * diff.tv_sec + 1e-3 * diff.tv_usec;
+}
+
+/*
+ * Generated assembler input: straight-line code made of plain
+ * instructions, labels and macro calls, all referring to a data area
+ * at the end of the program, as hand-written RSSB code does.
+ */
+PRIVATE BOOL
+bench_generate_source(FILE *fp, unsigned int statements)
+{
+  unsigned int i;
+
+  for (i = 0; i < statements; ++i)
+    switch (i % 8) {
+      case 0:
+        fprintf(fp, "L%u:\n", i);
+        break;
+
+      case 1:
+      case 4:
+        fprintf(fp, "  rssb D%u\n", i % BENCH_DATA_LABELS);
+        break;
+
+      case 2:
+        fprintf(
+            fp,
+            "  ADD D%u, D%u, ONE\n",
+            i % BENCH_DATA_LABELS,
+            (i / 8) % BENCH_DATA_LABELS);
+        break;
+
+      case 3:
+      case 6:
+        fprintf(fp, "  rssb $a\n");
+        break;
+
+      case 5:
+        fprintf(fp, "  MOVE D%u, D%u\n", i % BENCH_DATA_LABELS, 0);
+        break;
+
+      case 7:
+        fprintf(fp, "  CLEAR D%u\n", (i / 8) % BENCH_DATA_LABELS);
+        break;
+    }
+
+  fprintf(fp, "  EXIT\n");
+
+  for (i = 0; i < BENCH_DATA_LABELS; ++i)
+    fprintf(fp, "D%u:\n  rssb %u\n", i, i);
+
+  return !ferror(fp);
+}
+
+PRIVATE BOOL
+bench_assemble(
+    const char *path,
+    const char *lib,
+    unsigned int size,
+    rssb_vm_t **vm,
+    struct bench_result *result)
+{
+  rssb_program_t *program = NULL;
+  struct timeval start;
+  BOOL ok = FALSE;
+
+  gettimeofday(&start, NULL);
+
+  TRYCATCH(program = rssb_program_new(), goto done);
+  TRYCATCH(*vm = rssb_vm_new(size), goto done);
+  TRYCATCH(rssb_program_load_file(program, path), goto done);
+  TRYCATCH(rssb_program_load_file(program, lib), goto done);
+  TRYCATCH(rssb_program_compile(program, *vm), goto done);
+
+  result->assembly_ms = bench_elapsed_ms(&start);
+  result->words = (*vm)->footprint + 1;
+
+  ok = TRUE;
+
+done:
+  if (program != NULL)
+    rssb_program_destroy(program);
+
+  return ok;
+}
+
+PRIVATE BOOL
+bench_run_vm(
+    const struct bench_workload *wl,
+    const char *dir,
+    struct bench_result *result)
+{
+  rssb_vm_t *vm = NULL;
+  rssb_perf_t *perf = NULL;
+  char *path = NULL, *lib = NULL;
+  BOOL ok = FALSE;
+  int fd;
+
+  if ((path = strbuild("%s/%s", dir, wl->file)) == NULL)
+    goto done;
+  if ((lib = strbuild("%s/lib.rssb", dir)) == NULL)
+    goto done;
+
+  TRYCATCH(
+      bench_assemble(path, lib, BENCH_VM_MEMORY_SIZE, &vm, result),
+      goto done);
+
+  /* Output-heavy workloads must not measure the terminal */
+  TRYCATCH((fd = open("/dev/null", O_WRONLY)) != -1, goto done);
+  fflush(stdout);
+  dup2(fd, STDOUT_FILENO);
+  close(fd);
+
+  /* Counters are optional: containers and VMs often hide the PMU */
+  if ((perf = rssb_perf_new()) != NULL)
+    rssb_perf_start(perf);
+
+  TRYCATCH(rssb_vm_run(vm), goto done);
+
+  if (perf != NULL) {
+    rssb_perf_stop(perf);
+    rssb_perf_read(perf, &result->perf);
+  }
+
+  fflush(stdout);
+
+  rssb_vm_get_stats(vm, &result->stats);
+
+  ok = TRUE;
+
+done:
+  if (perf != NULL)
+    rssb_perf_destroy(perf);
+
+  if (vm != NULL)
+    rssb_vm_destroy(vm);
+
+  if (path != NULL)
+    free(path);
+
+  if (lib != NULL)
+    free(lib);
+
+  return ok;
+}
+
+PRIVATE BOOL
+bench_run_asm(
+    const struct bench_workload *wl,
+    const char *dir,
+    struct bench_result *result)
+{
+  rssb_vm_t *vm = NULL;
+  char path[] = "/tmp/rssb-bench-XXXXXX";
+  char *lib = NULL;
+  FILE *fp = NULL;
+  BOOL ok = FALSE;
+  int fd = -1;
+
+  if ((lib = strbuild("%s/lib.rssb", dir)) == NULL)
+    goto done;
+  TRYCATCH((fd = mkstemp(path)) != -1, goto done);
+  TRYCATCH(fp = fdopen(fd, "w"), goto done);
+  fd = -1;
+
+  TRYCATCH(bench_generate_source(fp, wl->statements), goto done);
+  TRYCATCH(fclose(fp) == 0, fp = NULL; goto done);
+  fp = NULL;
+
+  TRYCATCH(
+      bench_assemble(path, lib, BENCH_ASM_MEMORY_SIZE, &vm, result),
+      goto done);
+
+  ok = TRUE;
+
+done:
+  if (fp != NULL)
+    fclose(fp);
+
+  if (fd != -1)
+    close(fd);
+
+  unlink(path);
+
+  if (vm != NULL)
+    rssb_vm_destroy(vm);
+
+  if (lib != NULL)
+    free(lib);
+
+  return ok;
+}
+
+/*
+ * Every workload runs in its own child so peak RSS is measured per
+ * workload and a crashing workload does not take the driver down.
+ */
+PRIVATE BOOL
+bench_run(
+    const struct bench_workload *wl,
+    const char *dir,
+    struct bench_result *result,
+    long *max_rss_kb)
+{
+  struct rusage usage;
+  pid_t pid;
+  int pfd[2], status;
+  ssize_t got;
+
+  /* Children must not inherit (and flush again) buffered results */
+  fflush(NULL);
+
+  TRYCATCH(pipe(pfd) == 0, return FALSE);
+  TRYCATCH((pid = fork()) != -1, close(pfd[0]); close(pfd[1]); return FALSE);
+
+  if (pid == 0) {
+    close(pfd[0]);
+    memset(result, 0, sizeof(struct bench_result));
+
+    if (wl->kind == BENCH_KIND_VM)
+      result->ok = bench_run_vm(wl, dir, result);
+    else
+      result->ok = bench_run_asm(wl, dir, result);
+
+    _exit(
+        write(pfd[1], result, sizeof(struct bench_result))
+        == sizeof(struct bench_result) ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+
+  close(pfd[1]);
+  got = read(pfd[0], result, sizeof(struct bench_result));
+  close(pfd[0]);
+
+  TRYCATCH(wait4(pid, &status, 0, &usage) == pid, return FALSE);
+
+  *max_rss_kb = usage.ru_maxrss;
+
+  return got == sizeof(struct bench_result)
+      && WIFEXITED(status)
+      && WEXITSTATUS(status) == EXIT_SUCCESS
+      && result->ok;
+}
+
+/* Raw counts and counts per retired RSSB instruction, null if none */
+PRIVATE void
+bench_print_counters(FILE *fp, const struct bench_result *result)
+{
+  const struct rssb_perf_sample *perf = &result->perf;
+  uint64_t steps = result->stats.steps;
+  BOOL first = TRUE;
+  unsigned int i;
+
+  fprintf(fp, ",\n      \"counters\": ");
+
+  for (i = 0; i < RSSB_PERF_COUNTER_COUNT; ++i)
+    if (perf->valid[i]) {
+      fprintf(
+          fp,
+          "%s\n        \"%s\": {\"total\": %" PRIu64 ", \"per_instruction\": %.4f}",
+          first ? "{" : ",",
+          rssb_perf_counter_name(i),
+          perf->value[i],
+          steps > 0 ? (double) perf->value[i] / steps : 0);
+      first = FALSE;
+    }
+
+  if (first) {
+    fprintf(fp, "null");
+    return;
+  }
+
+  if (perf->valid[RSSB_PERF_CYCLES]
+      && perf->valid[RSSB_PERF_INSTRUCTIONS]
+      && perf->value[RSSB_PERF_CYCLES] > 0)
+    fprintf(
+        fp,
+        ",\n        \"ipc\": %.3f",
+        (double) perf->value[RSSB_PERF_INSTRUCTIONS]
+        / perf->value[RSSB_PERF_CYCLES]);
+
+  fprintf(fp, "\n      }");
+}
+
+PRIVATE void
+bench_print_result(
+    FILE *fp,
+    const struct bench_workload *wl,
+    const struct bench_result *result,
+    long max_rss_kb,
+    BOOL ok)
+{
+  double seconds;
+
+  fprintf(fp, "    {\n");
+  fprintf(fp, "      \"name\": \"%s\",\n", wl->name);
+  fprintf(fp, "      \"kind\": \"%s\",\n", wl->kind == BENCH_KIND_VM ? "vm" : "asm");
+  fprintf(fp, "      \"ok\": %s", ok ? "true" : "false");
+
+  if (ok) {
+    fprintf(fp, ",\n      \"words\": %" PRIu64, result->words);
+    fprintf(fp, ",\n      \"assembly_ms\": %.3f", result->assembly_ms);
+
+    if (wl->kind == BENCH_KIND_VM) {
+      seconds = result->stats.wall_time.tv_sec
+          + 1e-6 * result->stats.wall_time.tv_usec;
+
+      fprintf(fp, ",\n      \"instructions\": %" PRIu64, result->stats.steps);
+      fprintf(fp, ",\n      \"run_ms\": %.3f", 1e3 * seconds);
+      fprintf(
+          fp,
+          ",\n      \"instructions_per_second\": %.0f",
+          seconds > 0 ? result->stats.steps / seconds : 0);
+      bench_print_counters(fp, result);
+    } else {
+      fprintf(fp, ",\n      \"statements\": %u", wl->statements);
+    }
+
+    fprintf(fp, ",\n      \"peak_rss_kb\": %ld", max_rss_kb);
+  }
+
+  fprintf(fp, "\n    }");
+}
+
+PRIVATE void
+help(const char *argv0)
+{
+  fprintf(stderr, "Usage:\n");
+  fprintf(stderr, "  %s [options] [workload [...]]\n\n", argv0);
+  fprintf(stderr, "Runs all workloads, or those whose name starts with one of the\n");
+  fprintf(stderr, "given prefixes, and prints the results as JSON.\n\n");
+  fprintf(stderr, "Options:\n\n");
+  fprintf(stderr, "  -w, --workloads=DIR       Directory with the VM workloads\n");
+  fprintf(stderr, "  -o, --output=FILE         Write results to FILE instead of stdout\n");
+  fprintf(stderr, "  -l, --list                List workload names and exit\n");
+  fprintf(stderr, "  -h, --help                This help\n\n");
+}
+
+PRIVATE BOOL
+bench_selected(const struct bench_workload *wl, int argc, char *argv[])
+{
+  int i;
+
+  if (optind >= argc)
+    return TRUE;
+
+  for (i = optind; i < argc; ++i)
+    if (strncmp(wl->name, argv[i], strlen(argv[i])) == 0)
+      return TRUE;
+
+  return FALSE;
+}
+
+int
+main (int argc, char *argv[])
+{
+  const char *dir = "workloads";
+  struct bench_result result;
+  FILE *fp = stdout;
+  unsigned int i, failures = 0;
+  BOOL ok, first = TRUE;
+  long max_rss_kb;
+  int c;
+
+  static const struct option long_options[] = {
+    {"workloads", required_argument, NULL, 'w'},
+    {"output", required_argument, NULL, 'o'},
+    {"list", no_argument, NULL, 'l'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+
+  while ((c = getopt_long(argc, argv, "w:o:lh", long_options, NULL)) != -1) {
+    switch (c) {
+      case 'w':
+        dir = optarg;
+        break;
+
+      case 'o':
+        if ((fp = fopen(optarg, "w")) == NULL) {
+          fprintf(stderr, "%s: cannot open %s: %s\n", argv[0], optarg, strerror(errno));
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      case 'l':
+        for (i = 0; i < BENCH_WORKLOAD_COUNT; ++i)
+          printf("%s\n", g_workloads[i].name);
+        exit(EXIT_SUCCESS);
+
+      case 'h':
+        help(argv[0]);
+        exit(EXIT_SUCCESS);
+
+      default:
+        help(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  fprintf(fp, "{\n  \"version\": 1,\n  \"results\": [\n");
+
+  for (i = 0; i < BENCH_WORKLOAD_COUNT; ++i) {
+    if (!bench_selected(g_workloads + i, argc, argv))
+      continue;
+
+    fprintf(stderr, "%s: running %s\n", argv[0], g_workloads[i].name);
+
+    max_rss_kb = 0;
+    if (!(ok = bench_run(g_workloads + i, dir, &result, &max_rss_kb))) {
+      fprintf(stderr, "%s: workload %s failed\n", argv[0], g_workloads[i].name);
+      ++failures;
+    }
+
+    if (!first)
+      fprintf(fp, ",\n");
+    first = FALSE;
+
+    bench_print_result(fp, g_workloads + i, &result, max_rss_kb, ok);
+    fflush(fp);
+  }
+
+  fprintf(fp, "\n  ]\n}\n");
+
+  if (fp != stdout)
+    fclose(fp);
+
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,151 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "async.h"
+
+PRIVATE void *
+rssb_async_output_thread(void *private)
+{
+  rssb_async_output_t *async = private;
+  rssb_ring_t *ring = async->ring;
+  struct iovec iov[2];
+  unsigned int count;
+  ssize_t sent;
+
+  while (rssb_ring_ready(ring) || rssb_ring_wait_data(ring)) {
+    count = rssb_ring_spans(ring, iov);
+
+    if ((sent = writev(async->fd, iov, count)) == -1) {
+      if (errno == EINTR)
+        continue;
+
+      /* The VM sees its next $OUT fail */
+      async->error = errno;
+      rssb_ring_abandon(ring);
+      break;
+    }
+
+    ++async->writes;
+    async->bytes += sent;
+
+    rssb_ring_consume(ring, sent);
+  }
+
+  return NULL;
+}
+
+PRIVATE enum rssb_vm_input
+rssb_async_output_input(void *private, word_t *ch)
+{
+  rssb_async_output_t *async = private;
+  int c;
+
+  if (async->mode == RSSB_ASYNC_MODE_ORDERED)
+    (void) rssb_ring_drain(async->ring);
+  else
+    rssb_ring_flush(async->ring);
+
+  if ((c = getchar()) == EOF)
+    return RSSB_VM_INPUT_EOF;
+
+  *ch = c;
+
+  return RSSB_VM_INPUT_READY;
+}
+
+PRIVATE BOOL
+rssb_async_output_put(void *private, word_t ch)
+{
+  rssb_async_output_t *async = private;
+
+  return rssb_ring_push(async->ring, ch);
+}
+
+void
+rssb_async_output_attach(rssb_async_output_t *async, rssb_vm_t *vm)
+{
+  rssb_vm_set_io(vm, async, rssb_async_output_input, rssb_async_output_put);
+}
+
+/* Flushes whatever is left and stops the writer. FALSE on write errors */
+BOOL
+rssb_async_output_close(rssb_async_output_t *async)
+{
+  if (async->running) {
+    rssb_ring_close(async->ring);
+    pthread_join(async->thread, NULL);
+    async->running = FALSE;
+
+    if (async->error != 0)
+      fprintf(
+          stderr,
+          "%s: write failed: %s\n",
+          __FUNCTION__,
+          strerror(async->error));
+  }
+
+  return async->error == 0;
+}
+
+void
+rssb_async_output_destroy(rssb_async_output_t *async)
+{
+  (void) rssb_async_output_close(async);
+
+  if (async->ring != NULL)
+    rssb_ring_destroy(async->ring);
+
+  free(async);
+}
+
+rssb_async_output_t *
+rssb_async_output_new(int fd, enum rssb_async_mode mode)
+{
+  rssb_async_output_t *new = NULL;
+
+  TRYCATCH(new = calloc(1, sizeof(rssb_async_output_t)), goto fail);
+  TRYCATCH(new->ring = rssb_ring_new(RSSB_ASYNC_RING_SIZE, FALSE), goto fail);
+
+  rssb_ring_set_wake_batch(new->ring, RSSB_ASYNC_WAKE_BATCH);
+
+  new->fd   = fd;
+  new->mode = mode;
+
+  TRYCATCH(
+      pthread_create(&new->thread, NULL, rssb_async_output_thread, new) == 0,
+      goto fail);
+
+  new->running = TRUE;
+
+  return new;
+
+fail:
+  if (new != NULL)
+    rssb_async_output_destroy(new);
+
+  return NULL;
+}
@@ -0,0 +1,64 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+
+#ifndef _RSSB_ASYNC_H
+#define _RSSB_ASYNC_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "rssb.h"
+#include "ring.h"
+
+#define RSSB_ASYNC_RING_SIZE  (1 << 20)
+#define RSSB_ASYNC_WAKE_BATCH (1 << 16) /* Bytes worth a writev() */
+
+enum rssb_async_mode {
+  RSSB_ASYNC_MODE_FREE,    /* Output may lag behind $IN reads */
+  RSSB_ASYNC_MODE_ORDERED  /* Every $IN read waits for output to drain */
+};
+
+/*
+ * $OUT goes into a ring that a dedicated thread drains to `fd' with
+ * one writev() per batch, so the VM never blocks on a slow reader
+ * unless the ring fills up. The writer is woken up once
+ * RSSB_ASYNC_WAKE_BATCH bytes are waiting, on every $IN read and on
+ * close.
+ */
+typedef struct rssb_async_output {
+  rssb_ring_t *ring;
+  int fd;
+  enum rssb_async_mode mode;
+  pthread_t thread;
+  BOOL running;
+
+  /* Written by the I/O thread, read after it is joined */
+  int error;
+  uint64_t writes;
+  uint64_t bytes;
+} rssb_async_output_t;
+
+rssb_async_output_t *rssb_async_output_new(int fd, enum rssb_async_mode mode);
+void rssb_async_output_attach(rssb_async_output_t *async, rssb_vm_t *vm);
+BOOL rssb_async_output_close(rssb_async_output_t *async);
+void rssb_async_output_destroy(rssb_async_output_t *async);
+
+#endif /* _RSSB_ASYNC_H */
@@ -0,0 +1,830 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "lockstep.h"
+#include "uring.h"
+
+#define RSSB_BATCH_BUFFER_SIZE 65536
+#define RSSB_BATCH_SLOTS       32 /* Inputs in flight per thread with uring */
+#define RSSB_BATCH_SLOT_IOS    3  /* One read and two writes at most */
+
+struct rssb_batch_result {
+  BOOL done;
+  BOOL ok;
+  uint64_t steps;
+  uint64_t lockstep_steps;
+  const char *error; /* Static string, NULL if ok */
+};
+
+struct rssb_batch {
+  const rssb_vm_t *base;
+  char *const *inputs;
+  char *const *outputs;
+  unsigned int count;
+  unsigned int group;    /* Inputs claimed at once: lanes in lockstep */
+  BOOL lockstep;
+  struct rssb_batch_result *results;
+
+  unsigned int next;     /* Next input to claim, atomic */
+
+  pthread_mutex_t lock;  /* Protects the fields below */
+  unsigned int reported; /* Results written to `report' */
+  FILE *report;
+  const char *io_backend;
+  uint64_t io_syscalls;
+  uint64_t io_read;
+  uint64_t io_written;
+};
+
+enum rssb_batch_slot_state {
+  RSSB_BATCH_SLOT_FREE,
+  RSSB_BATCH_SLOT_RUNNABLE,
+  RSSB_BATCH_SLOT_WAIT_INPUT,
+  RSSB_BATCH_SLOT_WAIT_OUTPUT,
+  RSSB_BATCH_SLOT_DRAINING
+};
+
+/*
+ * One input in flight with batched I/O. The VM reads from `in_buf' and
+ * suspends when it runs dry; it writes to one of two output buffers
+ * while the other one may be on its way to the file.
+ */
+struct rssb_batch_slot {
+  enum rssb_batch_slot_state state;
+  unsigned int index;
+  struct rssb_batch_result result;
+  rssb_vm_t *vm;
+  int in_fd;
+  int out_fd;
+
+  uint8_t *in_buf;
+  size_t in_pos;
+  size_t in_len;
+  uint64_t in_offset;
+  BOOL in_eof;
+  BOOL in_busy;         /* Being read */
+
+  uint8_t *out_buf[2];
+  size_t out_len[2];
+  size_t out_sent[2];
+  uint64_t out_at[2];   /* File offset of each buffer */
+  BOOL out_busy[2];     /* Being written */
+  unsigned int out_cur;
+  uint64_t out_offset;
+
+  BOOL broken;          /* I/O failed: nothing else goes to the files */
+};
+
+/* Each VM owns its streams: no locking needed per character */
+struct rssb_batch_io {
+  FILE *in;
+  FILE *out;
+};
+
+PRIVATE enum rssb_vm_input
+rssb_batch_input(void *private, word_t *ch)
+{
+  struct rssb_batch_io *io = private;
+  int c;
+
+  if ((c = getc_unlocked(io->in)) == EOF)
+    return RSSB_VM_INPUT_EOF;
+
+  *ch = (unsigned char) c;
+
+  return RSSB_VM_INPUT_READY;
+}
+
+PRIVATE BOOL
+rssb_batch_output(void *private, word_t ch)
+{
+  struct rssb_batch_io *io = private;
+
+  return putc_unlocked(ch, io->out) != EOF;
+}
+
+PRIVATE BOOL
+rssb_batch_open(
+    const struct rssb_batch *batch,
+    unsigned int i,
+    struct rssb_batch_io *io,
+    struct rssb_batch_result *result)
+{
+  if ((io->in = fopen(batch->inputs[i], "rb")) == NULL) {
+    result->error = "cannot open input";
+    return FALSE;
+  }
+
+  if ((io->out = fopen(batch->outputs[i], "wb")) == NULL) {
+    result->error = "cannot open output";
+    return FALSE;
+  }
+
+  setvbuf(io->in, NULL, _IOFBF, RSSB_BATCH_BUFFER_SIZE);
+  setvbuf(io->out, NULL, _IOFBF, RSSB_BATCH_BUFFER_SIZE);
+
+  return TRUE;
+}
+
+PRIVATE void
+rssb_batch_close(struct rssb_batch_io *io, struct rssb_batch_result *result)
+{
+  if (io->in != NULL)
+    fclose(io->in);
+
+  if (io->out != NULL && fclose(io->out) != 0 && result->ok) {
+    result->ok = FALSE;
+    result->error = "cannot write output";
+  }
+}
+
+PRIVATE void
+rssb_batch_run_vm(
+    rssb_vm_t *vm,
+    struct rssb_batch_io *io,
+    struct rssb_batch_result *result)
+{
+  rssb_vm_set_io(vm, io, rssb_batch_input, rssb_batch_output);
+
+  result->ok = rssb_vm_run(vm);
+  result->steps = vm->stats.steps;
+
+  if (!result->ok)
+    result->error = "VM fault";
+}
+
+/*
+ * Runs the opened inputs of a group as lanes of one lockstep engine.
+ * Lanes that leave lockstep are finished here, one after another.
+ */
+PRIVATE BOOL
+rssb_batch_run_lockstep(
+    const struct rssb_batch *batch,
+    unsigned int count,
+    const unsigned int *index,
+    struct rssb_batch_io *io,
+    struct rssb_batch_result *results)
+{
+  rssb_lockstep_t *ls;
+  struct rssb_lockstep_lane *lane;
+  struct rssb_batch_result *result;
+  unsigned int i;
+
+  if ((ls = rssb_lockstep_new(batch->base, count)) == NULL)
+    return FALSE;
+
+  for (i = 0; i < count; ++i)
+    rssb_lockstep_set_io(
+        ls,
+        i,
+        io + index[i],
+        rssb_batch_input,
+        rssb_batch_output);
+
+  rssb_lockstep_run(ls);
+
+  for (i = 0; i < count; ++i) {
+    lane   = ls->lanes + i;
+    result = results + index[i];
+
+    result->lockstep_steps = lane->steps;
+
+    if (lane->vm != NULL) {
+      rssb_batch_run_vm(lane->vm, io + index[i], result);
+    } else {
+      result->ok    = lane->ok;
+      result->steps = lane->steps;
+      if (!result->ok)
+        result->error = "VM fault";
+    }
+  }
+
+  rssb_lockstep_destroy(ls);
+
+  return TRUE;
+}
+
+/* Runs inputs first to first + count - 1 */
+PRIVATE void
+rssb_batch_run_group(
+    const struct rssb_batch *batch,
+    unsigned int first,
+    unsigned int count,
+    struct rssb_batch_result *results)
+{
+  struct rssb_batch_io io[RSSB_LOCKSTEP_MAX_LANES];
+  unsigned int index[RSSB_LOCKSTEP_MAX_LANES];
+  unsigned int i, opened = 0;
+  rssb_vm_t *vm;
+
+  memset(io, 0, sizeof(io));
+
+  for (i = 0; i < count; ++i)
+    if (rssb_batch_open(batch, first + i, io + i, results + i))
+      index[opened++] = i;
+
+  if (opened > 1
+      && batch->lockstep
+      && rssb_batch_run_lockstep(batch, opened, index, io, results))
+    opened = 0;
+
+  /* Without lockstep (or lanes to share it), each input gets a clone */
+  for (i = 0; i < opened; ++i) {
+    if ((vm = rssb_vm_clone(batch->base)) == NULL) {
+      results[index[i]].error = "cannot create VM";
+      continue;
+    }
+
+    rssb_batch_run_vm(vm, io + index[i], results + index[i]);
+    rssb_vm_destroy(vm);
+  }
+
+  for (i = 0; i < count; ++i)
+    rssb_batch_close(io + i, results + i);
+}
+
+/* Results are written as soon as every earlier input has finished */
+PRIVATE void
+rssb_batch_report(struct rssb_batch *batch)
+{
+  const struct rssb_batch_result *result;
+
+  for (; batch->reported < batch->count; ++batch->reported) {
+    result = batch->results + batch->reported;
+    if (!result->done)
+      break;
+
+    if (batch->report == NULL)
+      continue;
+
+    if (result->ok)
+      fprintf(
+          batch->report,
+          "%s: ok, %" PRIu64 " steps\n",
+          batch->inputs[batch->reported],
+          result->steps);
+    else
+      fprintf(
+          batch->report,
+          "%s: failed, %s\n",
+          batch->inputs[batch->reported],
+          result->error);
+  }
+}
+
+PRIVATE void
+rssb_batch_store(
+    struct rssb_batch *batch,
+    unsigned int first,
+    unsigned int count,
+    const struct rssb_batch_result *results)
+{
+  unsigned int i;
+
+  pthread_mutex_lock(&batch->lock);
+  for (i = 0; i < count; ++i) {
+    batch->results[first + i] = results[i];
+    batch->results[first + i].done = TRUE;
+  }
+  rssb_batch_report(batch);
+  pthread_mutex_unlock(&batch->lock);
+}
+
+PRIVATE void *
+rssb_batch_worker(void *data)
+{
+  struct rssb_batch *batch = data;
+  struct rssb_batch_result results[RSSB_LOCKSTEP_MAX_LANES];
+  unsigned int first, count;
+
+  while ((first = __atomic_fetch_add(&batch->next, batch->group, __ATOMIC_RELAXED))
+      < batch->count) {
+    count = batch->count - first;
+    if (count > batch->group)
+      count = batch->group;
+
+    memset(results, 0, sizeof(results));
+    rssb_batch_run_group(batch, first, count, results);
+    rssb_batch_store(batch, first, count, results);
+  }
+
+  return NULL;
+}
+
+/************************** BATCHED I/O (io_uring) ***************************/
+PRIVATE enum rssb_vm_input
+rssb_batch_slot_input(void *private, word_t *ch)
+{
+  struct rssb_batch_slot *slot = private;
+
+  if (slot->in_pos < slot->in_len) {
+    *ch = slot->in_buf[slot->in_pos++];
+    return RSSB_VM_INPUT_READY;
+  }
+
+  return slot->in_eof ? RSSB_VM_INPUT_EOF : RSSB_VM_INPUT_AGAIN;
+}
+
+/* Slices never produce more than what is left in the buffer */
+PRIVATE BOOL
+rssb_batch_slot_output(void *private, word_t ch)
+{
+  struct rssb_batch_slot *slot = private;
+  unsigned int cur = slot->out_cur;
+
+  if (slot->out_len[cur] == RSSB_BATCH_BUFFER_SIZE)
+    return FALSE;
+
+  slot->out_buf[cur][slot->out_len[cur]++] = ch;
+
+  return TRUE;
+}
+
+/* user_data is the slot number times RSSB_BATCH_SLOT_IOS plus the I/O */
+PRIVATE uint64_t
+rssb_batch_slot_tag(unsigned int slot, unsigned int io)
+{
+  return (uint64_t) slot * RSSB_BATCH_SLOT_IOS + io;
+}
+
+PRIVATE BOOL
+rssb_batch_slot_write(
+    rssb_uring_t *ring,
+    struct rssb_batch_slot *slot,
+    unsigned int n,
+    unsigned int b)
+{
+  return rssb_uring_write(
+      ring,
+      slot->out_fd,
+      slot->out_buf[b] + slot->out_sent[b],
+      slot->out_len[b] - slot->out_sent[b],
+      slot->out_at[b] + slot->out_sent[b],
+      n * RSSB_BATCH_SLOT_IOS + 1 + b,
+      rssb_batch_slot_tag(n, 1 + b));
+}
+
+/* Sends the current output buffer to the file and switches to the other */
+PRIVATE BOOL
+rssb_batch_slot_flush(rssb_uring_t *ring, struct rssb_batch_slot *slot, unsigned int n)
+{
+  unsigned int b = slot->out_cur;
+
+  if (slot->out_len[b] == 0)
+    return TRUE;
+
+  slot->out_sent[b]  = 0;
+  slot->out_at[b]    = slot->out_offset;
+  slot->out_busy[b]  = TRUE;
+  slot->out_offset  += slot->out_len[b];
+  slot->out_cur      = !b;
+  slot->out_len[!b]  = 0;
+
+  return rssb_batch_slot_write(ring, slot, n, b);
+}
+
+PRIVATE void
+rssb_batch_slot_fail(struct rssb_batch_slot *slot, const char *error)
+{
+  if (slot->result.error == NULL)
+    slot->result.error = error;
+
+  slot->result.ok = FALSE;
+  slot->broken    = TRUE;
+  slot->state     = RSSB_BATCH_SLOT_DRAINING;
+}
+
+PRIVATE BOOL
+rssb_batch_slot_start(
+    struct rssb_batch *batch,
+    struct rssb_batch_slot *slot,
+    unsigned int index,
+    uint64_t *syscalls)
+{
+  memset(&slot->result, 0, sizeof(struct rssb_batch_result));
+
+  slot->index      = index;
+  slot->in_pos     = slot->in_len = 0;
+  slot->in_offset  = 0;
+  slot->in_eof     = FALSE;
+  slot->in_busy    = FALSE;
+  slot->broken     = FALSE;
+  slot->out_len[0] = slot->out_len[1] = 0;
+  slot->out_cur    = 0;
+  slot->out_offset = 0;
+  slot->out_fd     = -1;
+
+  *syscalls += 2;
+
+  if ((slot->in_fd = open(batch->inputs[index], O_RDONLY | O_CLOEXEC)) == -1) {
+    slot->result.error = "cannot open input";
+    return FALSE;
+  }
+
+  if ((slot->out_fd = open(
+      batch->outputs[index],
+      O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+      0644)) == -1) {
+    slot->result.error = "cannot open output";
+    return FALSE;
+  }
+
+  if ((slot->vm = rssb_vm_clone(batch->base)) == NULL) {
+    slot->result.error = "cannot create VM";
+    return FALSE;
+  }
+
+  rssb_vm_set_io(slot->vm, slot, rssb_batch_slot_input, rssb_batch_slot_output);
+
+  slot->state = RSSB_BATCH_SLOT_RUNNABLE;
+
+  return TRUE;
+}
+
+PRIVATE void
+rssb_batch_slot_finish(
+    struct rssb_batch *batch,
+    struct rssb_batch_slot *slot,
+    uint64_t *syscalls)
+{
+  if (slot->vm != NULL) {
+    slot->result.steps = slot->vm->stats.steps;
+    rssb_vm_destroy(slot->vm);
+    slot->vm = NULL;
+  }
+
+  if (slot->in_fd != -1) {
+    close(slot->in_fd);
+    ++*syscalls;
+  }
+
+  if (slot->out_fd != -1) {
+    close(slot->out_fd);
+    ++*syscalls;
+  }
+
+  slot->in_fd = slot->out_fd = -1;
+  slot->state = RSSB_BATCH_SLOT_FREE;
+
+  rssb_batch_store(batch, slot->index, 1, &slot->result);
+}
+
+/* Runs a slot for one slice and queues the I/O it is left waiting for */
+PRIVATE void
+rssb_batch_slot_turn(rssb_uring_t *ring, struct rssb_batch_slot *slot, unsigned int n)
+{
+  enum rssb_vm_reason reason;
+  unsigned int b = slot->out_cur;
+  size_t room;
+
+  /* Half a buffer is worth a write, if the other one is available */
+  if (slot->out_len[b] >= RSSB_BATCH_BUFFER_SIZE / 2 && !slot->out_busy[!b]) {
+    if (!rssb_batch_slot_flush(ring, slot, n)) {
+      rssb_batch_slot_fail(slot, "cannot write output");
+      return;
+    }
+    b = slot->out_cur;
+  }
+
+  /* Each step writes a byte at most, or a word in binary mode */
+  room = RSSB_BATCH_BUFFER_SIZE - slot->out_len[b];
+  if (slot->vm->binary_io)
+    room /= sizeof(word_t);
+
+  if (room == 0) {
+    slot->state = RSSB_BATCH_SLOT_WAIT_OUTPUT;
+    return;
+  }
+
+  (void) rssb_vm_run_for(slot->vm, room, &reason);
+
+  switch (reason) {
+    case RSSB_VM_REASON_BUDGET:
+      break;
+
+    case RSSB_VM_REASON_INPUT:
+      slot->state   = RSSB_BATCH_SLOT_WAIT_INPUT;
+      slot->in_busy = TRUE;
+      if (!rssb_uring_read(
+          ring,
+          slot->in_fd,
+          slot->in_buf,
+          RSSB_BATCH_BUFFER_SIZE,
+          slot->in_offset,
+          n * RSSB_BATCH_SLOT_IOS,
+          rssb_batch_slot_tag(n, 0))) {
+        slot->in_busy = FALSE;
+        rssb_batch_slot_fail(slot, "cannot read input");
+      }
+      break;
+
+    default:
+      slot->result.ok = reason == RSSB_VM_REASON_HALTED;
+      if (!slot->result.ok)
+        slot->result.error = "VM fault";
+
+      /* With the other buffer still on its way, its completion flushes */
+      slot->state = RSSB_BATCH_SLOT_DRAINING;
+      if (!slot->out_busy[!b] && !rssb_batch_slot_flush(ring, slot, n))
+        rssb_batch_slot_fail(slot, "cannot write output");
+  }
+}
+
+PRIVATE void
+rssb_batch_slot_complete(
+    rssb_uring_t *ring,
+    struct rssb_batch_slot *slot,
+    unsigned int n,
+    unsigned int io,
+    int32_t res,
+    uint64_t *read,
+    uint64_t *written)
+{
+  unsigned int b = io - 1;
+
+  if (io == 0) {
+    slot->in_busy = FALSE;
+
+    if (res < 0) {
+      rssb_batch_slot_fail(slot, "cannot read input");
+      return;
+    }
+
+    *read += res;
+
+    slot->in_pos     = 0;
+    slot->in_len     = res;
+    slot->in_offset += res;
+    slot->in_eof     = res == 0;
+
+    if (slot->state == RSSB_BATCH_SLOT_WAIT_INPUT)
+      slot->state = RSSB_BATCH_SLOT_RUNNABLE;
+    return;
+  }
+
+  if (res <= 0) {
+    slot->out_busy[b] = FALSE;
+    rssb_batch_slot_fail(slot, "cannot write output");
+    return;
+  }
+
+  *written += res;
+
+  /* Short writes go again with what is left */
+  if ((slot->out_sent[b] += res) < slot->out_len[b]) {
+    if (!rssb_batch_slot_write(ring, slot, n, b)) {
+      slot->out_busy[b] = FALSE;
+      rssb_batch_slot_fail(slot, "cannot write output");
+    }
+    return;
+  }
+
+  slot->out_busy[b] = FALSE;
+
+  if (slot->state == RSSB_BATCH_SLOT_WAIT_OUTPUT)
+    slot->state = RSSB_BATCH_SLOT_RUNNABLE;
+  else if (slot->state == RSSB_BATCH_SLOT_DRAINING
+      && !slot->broken
+      && !rssb_batch_slot_flush(ring, slot, n))
+    rssb_batch_slot_fail(slot, "cannot write output");
+}
+
+/*
+ * Keeps up to RSSB_BATCH_SLOTS inputs going on this thread. Runnable
+ * VMs get a slice each, then all the reads and writes they are left
+ * waiting for go out in a single submission.
+ */
+PRIVATE void *
+rssb_batch_worker_uring(void *data)
+{
+  struct rssb_batch *batch = data;
+  struct rssb_batch_slot slots[RSSB_BATCH_SLOTS];
+  struct iovec iov[RSSB_BATCH_SLOTS * RSSB_BATCH_SLOT_IOS];
+  struct rssb_uring_cqe cqe;
+  struct rssb_batch_slot *slot;
+  rssb_uring_t *ring = NULL;
+  uint8_t *buffers = NULL;
+  uint64_t syscalls = 0, read = 0, written = 0;
+  unsigned int i, n, index, active = 0, runnable;
+  BOOL exhausted = FALSE;
+
+  memset(slots, 0, sizeof(slots));
+
+  TRYCATCH(
+      ring = rssb_uring_new(RSSB_BATCH_SLOTS * RSSB_BATCH_SLOT_IOS * 2, TRUE),
+      goto done);
+  TRYCATCH(
+      posix_memalign(
+          (void **) &buffers,
+          4096,
+          sizeof(iov) / sizeof(iov[0]) * RSSB_BATCH_BUFFER_SIZE) == 0,
+      goto done);
+
+  for (i = 0; i < sizeof(iov) / sizeof(iov[0]); ++i) {
+    iov[i].iov_base = buffers + (size_t) i * RSSB_BATCH_BUFFER_SIZE;
+    iov[i].iov_len  = RSSB_BATCH_BUFFER_SIZE;
+  }
+
+  (void) rssb_uring_register(ring, iov, sizeof(iov) / sizeof(iov[0]));
+
+  for (n = 0; n < RSSB_BATCH_SLOTS; ++n) {
+    slots[n].in_fd      = slots[n].out_fd = -1;
+    slots[n].in_buf     = iov[n * RSSB_BATCH_SLOT_IOS].iov_base;
+    slots[n].out_buf[0] = iov[n * RSSB_BATCH_SLOT_IOS + 1].iov_base;
+    slots[n].out_buf[1] = iov[n * RSSB_BATCH_SLOT_IOS + 2].iov_base;
+  }
+
+  for (;;) {
+    for (n = 0; n < RSSB_BATCH_SLOTS && !exhausted; ++n) {
+      if (slots[n].state != RSSB_BATCH_SLOT_FREE)
+        continue;
+
+      if ((index = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED))
+          >= batch->count) {
+        exhausted = TRUE;
+        break;
+      }
+
+      if (rssb_batch_slot_start(batch, slots + n, index, &syscalls))
+        ++active;
+      else
+        rssb_batch_slot_finish(batch, slots + n, &syscalls);
+    }
+
+    if (active == 0)
+      break;
+
+    runnable = 0;
+    for (n = 0; n < RSSB_BATCH_SLOTS; ++n) {
+      if (slots[n].state == RSSB_BATCH_SLOT_RUNNABLE)
+        rssb_batch_slot_turn(ring, slots + n, n);
+      runnable += slots[n].state == RSSB_BATCH_SLOT_RUNNABLE;
+    }
+
+    if (!rssb_uring_submit(ring, runnable > 0 ? 0 : 1))
+      break;
+
+    while (rssb_uring_complete(ring, &cqe)) {
+      slot = slots + cqe.user_data / RSSB_BATCH_SLOT_IOS;
+      rssb_batch_slot_complete(
+          ring,
+          slot,
+          slot - slots,
+          cqe.user_data % RSSB_BATCH_SLOT_IOS,
+          cqe.res,
+          &read,
+          &written);
+    }
+
+    for (n = 0; n < RSSB_BATCH_SLOTS; ++n) {
+      slot = slots + n;
+      if (slot->state == RSSB_BATCH_SLOT_DRAINING
+          && !slot->in_busy
+          && !slot->out_busy[0]
+          && !slot->out_busy[1]) {
+        rssb_batch_slot_finish(batch, slot, &syscalls);
+        --active;
+      }
+    }
+  }
+
+done:
+  /* Only reached with work left if io_uring itself broke down */
+  for (n = 0; n < RSSB_BATCH_SLOTS; ++n)
+    if (slots[n].state != RSSB_BATCH_SLOT_FREE) {
+      rssb_batch_slot_fail(slots + n, "I/O failure");
+      rssb_batch_slot_finish(batch, slots + n, &syscalls);
+    }
+
+  pthread_mutex_lock(&batch->lock);
+  if (ring != NULL) {
+    batch->io_backend   = rssb_uring_backend(ring);
+    batch->io_syscalls += ring->syscalls;
+  }
+  batch->io_syscalls += syscalls;
+  batch->io_read     += read;
+  batch->io_written  += written;
+  pthread_mutex_unlock(&batch->lock);
+
+  if (ring != NULL)
+    rssb_uring_destroy(ring);
+
+  if (buffers != NULL)
+    free(buffers);
+
+  return NULL;
+}
+
+BOOL
+rssb_batch_run(
+    const rssb_vm_t *base,
+    char *const *inputs,
+    char *const *outputs,
+    unsigned int count,
+    unsigned int threads,
+    BOOL lockstep,
+    BOOL uring,
+    FILE *report,
+    struct rssb_batch_summary *summary)
+{
+  void *(*worker) (void *) = uring ? rssb_batch_worker_uring : rssb_batch_worker;
+  struct rssb_batch batch;
+  struct timeval start, end;
+  pthread_t *tids = NULL;
+  unsigned int i, started = 0;
+  BOOL ok = FALSE;
+
+  memset(&batch, 0, sizeof(struct rssb_batch));
+  memset(summary, 0, sizeof(struct rssb_batch_summary));
+
+  batch.base     = base;
+  batch.inputs   = inputs;
+  batch.outputs  = outputs;
+  batch.count    = count;
+  batch.report   = report;
+  /* Lockstep lanes do byte I/O only */
+  batch.lockstep = lockstep && !uring && !base->binary_io;
+  batch.group    = batch.lockstep ? rssb_lockstep_width() : 1;
+
+  if (threads == 0)
+    threads = 1;
+  if (threads > (count + batch.group - 1) / batch.group && count > 0)
+    threads = (count + batch.group - 1) / batch.group;
+
+  TRYCATCH(
+      batch.results = calloc(count + 1, sizeof(struct rssb_batch_result)),
+      goto done);
+  TRYCATCH(tids = calloc(threads, sizeof(pthread_t)), goto done);
+  TRYCATCH(pthread_mutex_init(&batch.lock, NULL) == 0, goto done);
+
+  gettimeofday(&start, NULL);
+
+  for (i = 0; i < threads; ++i) {
+    if (pthread_create(tids + i, NULL, worker, &batch) != 0) {
+      fprintf(stderr, "%s: cannot start thread: %s\n", __FUNCTION__, strerror(errno));
+      break;
+    }
+    ++started;
+  }
+
+  /* With no threads at all, do the work here */
+  if (started == 0)
+    (worker) (&batch);
+
+  for (i = 0; i < started; ++i)
+    pthread_join(tids[i], NULL);
+
+  gettimeofday(&end, NULL);
+  timersub(&end, &start, &summary->wall_time);
+
+  pthread_mutex_destroy(&batch.lock);
+
+  summary->inputs      = count;
+  summary->io_backend  = batch.io_backend;
+  summary->io_syscalls = batch.io_syscalls;
+  summary->io_read     = batch.io_read;
+  summary->io_written  = batch.io_written;
+
+  for (i = 0; i < count; ++i) {
+    summary->steps += batch.results[i].steps;
+    summary->lockstep_steps += batch.results[i].lockstep_steps;
+    summary->failures += !batch.results[i].ok;
+  }
+
+  ok = TRUE;
+
+done:
+  if (batch.results != NULL)
+    free(batch.results);
+
+  if (tids != NULL)
+    free(tids);
+
+  return ok;
+}
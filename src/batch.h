@@ -0,0 +1,63 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _RSSB_BATCH_H
+#define _RSSB_BATCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#include "rssb.h"
+
+struct rssb_batch_summary {
+  unsigned int inputs;
+  unsigned int failures;
+  uint64_t steps;
+  uint64_t lockstep_steps; /* Part of `steps' run in lockstep */
+  struct timeval wall_time;
+
+  /* Batched I/O only */
+  const char *io_backend;
+  uint64_t io_syscalls;    /* Including opens and closes */
+  uint64_t io_read;
+  uint64_t io_written;
+};
+
+/*
+ * Runs a clone of `base' per input, `threads' at a time, reading $IN
+ * from inputs[i] and writing $OUT to outputs[i]. One line per input is
+ * written to `report' (if not NULL), always in input order. With
+ * `lockstep', consecutive inputs are grouped into the lanes of a
+ * lockstep engine instead. With `uring', each thread keeps several
+ * inputs in flight and batches their file I/O through rssb_uring.
+ */
+BOOL rssb_batch_run(
+    const rssb_vm_t *base,
+    char *const *inputs,
+    char *const *outputs,
+    unsigned int count,
+    unsigned int threads,
+    BOOL lockstep,
+    BOOL uring,
+    FILE *report,
+    struct rssb_batch_summary *summary);
+
+#endif /* _RSSB_BATCH_H */
@@ -0,0 +1,512 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE /* SEEK_DATA */
+#endif /* _GNU_SOURCE */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "rssb.h"
+
+/*
+ * Checkpoint layout. Everything is native-endian and page aligned:
+ *
+ *   header page   struct rssb_checkpoint_header
+ *   base image    page_count pages, page N at offset (N + 1) pages.
+ *                 Pages never written are holes
+ *   records...    Appended by later checkpoints: a record header
+ *                 (struct rssb_checkpoint_record, then `count' page
+ *                 numbers), padded to a page, then the pages themselves
+ *
+ * The header's `end' only moves forward once a record is on disk, so
+ * a checkpoint interrupted halfway leaves the previous one intact.
+ */
+
+#define RSSB_CHECKPOINT_MAGIC  "RSSBCKP"
+#define RSSB_RECORD_MAGIC      "RSSBREC"
+#define RSSB_CHECKPOINT_VERSION 2
+
+/* Everything that is not in memory */
+struct rssb_checkpoint_state {
+  uint32_t dumb_mode;
+  uint32_t footprint;
+  uint32_t mem_ptr;
+  uint32_t binary_io; /* Zero in checkpoints older than the flag */
+  struct rssb_vm_stats stats; /* Includes $IN and $OUT byte offsets */
+};
+
+struct rssb_checkpoint_header {
+  char     magic[8];
+  uint32_t version;
+  uint32_t page_size;
+  uint32_t word_size;
+  uint32_t mem_size;
+  uint64_t end; /* Valid length of the file */
+  struct rssb_checkpoint_state state;
+};
+
+struct rssb_checkpoint_record {
+  char     magic[8];
+  uint64_t count; /* Pages in this record */
+  struct rssb_checkpoint_state state;
+};
+
+PRIVATE uint64_t
+rssb_checkpoint_align(uint64_t size)
+{
+  return (size + RSSB_VM_PAGE_SIZE - 1) & ~(uint64_t) (RSSB_VM_PAGE_SIZE - 1);
+}
+
+PRIVATE BOOL
+rssb_checkpoint_pwrite(int fd, const void *data, size_t size, uint64_t off)
+{
+  ssize_t got;
+
+  while (size > 0) {
+    if ((got = pwrite(fd, data, size, off)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return FALSE;
+    }
+
+    data  = (const char *) data + got;
+    size -= got;
+    off  += got;
+  }
+
+  return TRUE;
+}
+
+PRIVATE BOOL
+rssb_checkpoint_pread(int fd, void *data, size_t size, uint64_t off)
+{
+  ssize_t got;
+
+  while (size > 0) {
+    if ((got = pread(fd, data, size, off)) <= 0) {
+      if (got < 0 && errno == EINTR)
+        continue;
+      return FALSE;
+    }
+
+    data  = (char *) data + got;
+    size -= got;
+    off  += got;
+  }
+
+  return TRUE;
+}
+
+PRIVATE void
+rssb_checkpoint_save_state(
+    const rssb_vm_t *vm,
+    struct rssb_checkpoint_state *state)
+{
+  memset(state, 0, sizeof(struct rssb_checkpoint_state));
+
+  state->dumb_mode = vm->dumb_mode;
+  state->binary_io = vm->binary_io;
+  state->footprint = vm->footprint;
+  state->mem_ptr   = vm->mem_ptr;
+  state->stats     = vm->stats;
+}
+
+PRIVATE void
+rssb_checkpoint_load_state(
+    rssb_vm_t *vm,
+    const struct rssb_checkpoint_state *state)
+{
+  vm->dumb_mode = state->dumb_mode;
+  vm->binary_io = state->binary_io;
+  vm->footprint = state->footprint;
+  vm->mem_ptr   = state->mem_ptr;
+  vm->stats     = state->stats;
+}
+
+PRIVATE const void *
+rssb_checkpoint_page(const rssb_vm_t *vm, size_t page)
+{
+  return (const char *) vm->mem + (page << RSSB_VM_PAGE_SHIFT);
+}
+
+PRIVATE BOOL
+rssb_checkpoint_page_is_zero(const rssb_vm_t *vm, size_t page)
+{
+  const uint64_t *words = rssb_checkpoint_page(vm, page);
+  unsigned int i;
+
+  for (i = 0; i < RSSB_VM_PAGE_SIZE / sizeof(uint64_t); ++i)
+    if (words[i] != 0)
+      return FALSE;
+
+  return TRUE;
+}
+
+PRIVATE void
+rssb_checkpoint_clean(rssb_vm_t *vm)
+{
+  size_t i;
+
+  for (i = 0; i < vm->page_count; ++i)
+    vm->pages[i] &= ~RSSB_VM_PAGE_DIRTY;
+}
+
+/* Full image: written aside and renamed over `path' once complete */
+PRIVATE BOOL
+rssb_checkpoint_write_base(rssb_vm_t *vm, const char *path)
+{
+  struct rssb_checkpoint_header header;
+  char *tmp = NULL;
+  uint64_t end;
+  size_t i;
+  int fd = -1;
+  BOOL ok = FALSE;
+
+  if ((tmp = strbuild("%s.tmp", path)) == NULL)
+    goto done;
+
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+    fprintf(
+        stderr,
+        "%s: cannot open `%s': %s\n",
+        __FUNCTION__,
+        tmp,
+        strerror(errno));
+    goto done;
+  }
+
+  end = RSSB_VM_PAGE_SIZE + ((uint64_t) vm->page_count << RSSB_VM_PAGE_SHIFT);
+  TRYCATCH(ftruncate(fd, end) == 0, goto done);
+
+  for (i = 0; i < vm->page_count; ++i)
+    if ((vm->pages[i] & RSSB_VM_PAGE_USED)
+        && !rssb_checkpoint_page_is_zero(vm, i))
+      TRYCATCH(
+          rssb_checkpoint_pwrite(
+              fd,
+              rssb_checkpoint_page(vm, i),
+              RSSB_VM_PAGE_SIZE,
+              RSSB_VM_PAGE_SIZE + ((uint64_t) i << RSSB_VM_PAGE_SHIFT)),
+          goto done);
+
+  memset(&header, 0, sizeof(struct rssb_checkpoint_header));
+  memcpy(header.magic, RSSB_CHECKPOINT_MAGIC, sizeof(RSSB_CHECKPOINT_MAGIC));
+  header.version   = RSSB_CHECKPOINT_VERSION;
+  header.page_size = RSSB_VM_PAGE_SIZE;
+  header.word_size = vm->word_size;
+  header.mem_size  = vm->mem_size;
+  header.end       = end;
+  rssb_checkpoint_save_state(vm, &header.state);
+
+  TRYCATCH(
+      rssb_checkpoint_pwrite(fd, &header, sizeof(header), 0),
+      goto done);
+  TRYCATCH(fsync(fd) == 0, goto done);
+  TRYCATCH(close(fd) == 0, fd = -1; goto done);
+  fd = -1;
+
+  TRYCATCH(rename(tmp, path) == 0, goto done);
+
+  if (vm->checkpoint_path != NULL)
+    free(vm->checkpoint_path);
+  TRYCATCH(vm->checkpoint_path = strdup(path), goto done);
+  vm->checkpoint_end = end;
+
+  rssb_checkpoint_clean(vm);
+
+  ok = TRUE;
+
+done:
+  if (fd != -1) {
+    close(fd);
+    unlink(tmp);
+  }
+
+  if (tmp != NULL)
+    free(tmp);
+
+  return ok;
+}
+
+/* Dirty pages only, appended past the current end */
+PRIVATE BOOL
+rssb_checkpoint_append(rssb_vm_t *vm)
+{
+  struct rssb_checkpoint_header header;
+  struct rssb_checkpoint_record *record = NULL;
+  uint32_t *index;
+  uint64_t count = 0, head_size, off;
+  size_t i;
+  int fd = -1;
+  BOOL ok = FALSE;
+
+  /* $IP and $A live in page 0 and change on every step */
+  vm->pages[0] |= RSSB_VM_PAGE_DIRTY;
+
+  for (i = 0; i < vm->page_count; ++i)
+    count += vm->pages[i] & RSSB_VM_PAGE_DIRTY;
+
+  head_size = rssb_checkpoint_align(
+      sizeof(struct rssb_checkpoint_record) + count * sizeof(uint32_t));
+
+  TRYCATCH(record = calloc(1, head_size), goto done);
+  memcpy(record->magic, RSSB_RECORD_MAGIC, sizeof(RSSB_RECORD_MAGIC));
+  record->count = count;
+  rssb_checkpoint_save_state(vm, &record->state);
+
+  index = (uint32_t *) (record + 1);
+  for (i = 0; i < vm->page_count; ++i)
+    if (vm->pages[i] & RSSB_VM_PAGE_DIRTY)
+      *index++ = i;
+
+  if ((fd = open(vm->checkpoint_path, O_RDWR)) == -1) {
+    fprintf(
+        stderr,
+        "%s: cannot open `%s': %s\n",
+        __FUNCTION__,
+        vm->checkpoint_path,
+        strerror(errno));
+    goto done;
+  }
+
+  TRYCATCH(
+      rssb_checkpoint_pread(fd, &header, sizeof(header), 0)
+      && header.end == vm->checkpoint_end,
+      goto done);
+
+  off = vm->checkpoint_end;
+  TRYCATCH(rssb_checkpoint_pwrite(fd, record, head_size, off), goto done);
+  off += head_size;
+
+  for (i = 0; i < vm->page_count; ++i)
+    if (vm->pages[i] & RSSB_VM_PAGE_DIRTY) {
+      TRYCATCH(
+          rssb_checkpoint_pwrite(
+              fd,
+              rssb_checkpoint_page(vm, i),
+              RSSB_VM_PAGE_SIZE,
+              off),
+          goto done);
+      off += RSSB_VM_PAGE_SIZE;
+    }
+
+  /* Data first, then the header that makes it visible */
+  TRYCATCH(fsync(fd) == 0, goto done);
+
+  header.end = off;
+  TRYCATCH(
+      rssb_checkpoint_pwrite(fd, &header, sizeof(header), 0),
+      goto done);
+  TRYCATCH(fsync(fd) == 0, goto done);
+
+  vm->checkpoint_end = off;
+  rssb_checkpoint_clean(vm);
+
+  ok = TRUE;
+
+done:
+  if (fd != -1)
+    close(fd);
+
+  if (record != NULL)
+    free(record);
+
+  return ok;
+}
+
+/*
+ * The first checkpoint to a path writes the whole image. Later ones to
+ * the same path (including the one a VM was restored from) append the
+ * pages written since.
+ */
+BOOL
+rssb_vm_checkpoint(rssb_vm_t *vm, const char *path)
+{
+  if (vm->checkpoint_path != NULL && strcmp(vm->checkpoint_path, path) == 0)
+    return rssb_checkpoint_append(vm);
+
+  return rssb_checkpoint_write_base(vm, path);
+}
+
+/* Pages of the base image that hold data (are not holes) were used */
+PRIVATE void
+rssb_checkpoint_mark_base(rssb_vm_t *vm, int fd)
+{
+  off_t base = RSSB_VM_PAGE_SIZE;
+  off_t end = base + ((off_t) vm->page_count << RSSB_VM_PAGE_SHIFT);
+  off_t data, hole;
+  size_t i;
+
+#ifdef SEEK_DATA
+  for (data = base; data < end; data = hole) {
+    if ((data = lseek(fd, data, SEEK_DATA)) == -1) {
+      if (errno == ENXIO)
+        return;
+      break;
+    }
+
+    if ((hole = lseek(fd, data, SEEK_HOLE)) == -1)
+      break;
+
+    for (i = (data - base) >> RSSB_VM_PAGE_SHIFT;
+         i < vm->page_count && (off_t) (i << RSSB_VM_PAGE_SHIFT) + base < hole;
+         ++i)
+      vm->pages[i] = RSSB_VM_PAGE_USED;
+  }
+
+  if (data >= end)
+    return;
+#endif /* SEEK_DATA */
+
+  /* No hole information: assume everything was used */
+  for (i = 0; i < vm->page_count; ++i)
+    vm->pages[i] = RSSB_VM_PAGE_USED;
+}
+
+/*
+ * The base image is mapped copy-on-write straight from the file, so
+ * restoring costs the same whatever the memory size: pages are read
+ * in when the program first touches them. Appended records are few
+ * and small, and are copied over it.
+ */
+rssb_vm_t *
+rssb_vm_restore(const char *path)
+{
+  struct rssb_checkpoint_header header;
+  struct rssb_checkpoint_record record;
+  struct rssb_checkpoint_state state;
+  rssb_vm_t *vm = NULL;
+  uint32_t *index = NULL;
+  uint64_t off, i, image;
+  int fd = -1;
+  BOOL ok = FALSE;
+
+  if ((fd = open(path, O_RDONLY)) == -1) {
+    fprintf(
+        stderr,
+        "%s: cannot open `%s': %s\n",
+        __FUNCTION__,
+        path,
+        strerror(errno));
+    goto done;
+  }
+
+  if (!rssb_checkpoint_pread(fd, &header, sizeof(header), 0)
+      || memcmp(header.magic, RSSB_CHECKPOINT_MAGIC, sizeof(RSSB_CHECKPOINT_MAGIC)) != 0
+      || header.version != RSSB_CHECKPOINT_VERSION
+      || header.page_size != RSSB_VM_PAGE_SIZE) {
+    fprintf(stderr, "%s: `%s' is not a checkpoint\n", __FUNCTION__, path);
+    goto done;
+  }
+
+  TRYCATCH(vm = rssb_vm_new(header.mem_size), goto done);
+  TRYCATCH(vm->word_size == header.word_size, goto done);
+
+  image = (uint64_t) vm->page_count << RSSB_VM_PAGE_SHIFT;
+  TRYCATCH(header.end >= RSSB_VM_PAGE_SIZE + image, goto done);
+
+  if (sysconf(_SC_PAGESIZE) == RSSB_VM_PAGE_SIZE) {
+    TRYCATCH(
+        mmap(
+            vm->mem,
+            image,
+            PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_FIXED,
+            fd,
+            RSSB_VM_PAGE_SIZE) != MAP_FAILED,
+        goto done);
+  } else {
+    /* File offsets would not be aligned to system pages */
+    TRYCATCH(
+        rssb_checkpoint_pread(fd, vm->mem, vm->mem_bytes, RSSB_VM_PAGE_SIZE),
+        goto done);
+  }
+
+  rssb_checkpoint_mark_base(vm, fd);
+
+  state = header.state;
+
+  for (off = RSSB_VM_PAGE_SIZE + image; off < header.end;) {
+    TRYCATCH(
+        rssb_checkpoint_pread(fd, &record, sizeof(record), off)
+        && memcmp(record.magic, RSSB_RECORD_MAGIC, sizeof(RSSB_RECORD_MAGIC)) == 0,
+        goto done);
+
+    /* Each page is stored at most once per record */
+    TRYCATCH(record.count <= vm->page_count, goto done);
+
+    TRYCATCH(index = malloc(record.count * sizeof(uint32_t) + 1), goto done);
+    TRYCATCH(
+        rssb_checkpoint_pread(
+            fd,
+            index,
+            record.count * sizeof(uint32_t),
+            off + sizeof(record)),
+        goto done);
+
+    off += rssb_checkpoint_align(
+        sizeof(record) + record.count * sizeof(uint32_t));
+
+    for (i = 0; i < record.count; ++i) {
+      TRYCATCH(index[i] < vm->page_count, goto done);
+      TRYCATCH(
+          rssb_checkpoint_pread(
+              fd,
+              (char *) vm->mem + ((size_t) index[i] << RSSB_VM_PAGE_SHIFT),
+              RSSB_VM_PAGE_SIZE,
+              off),
+          goto done);
+      vm->pages[index[i]] = RSSB_VM_PAGE_USED;
+      off += RSSB_VM_PAGE_SIZE;
+    }
+
+    free(index);
+    index = NULL;
+
+    state = record.state;
+  }
+
+  rssb_checkpoint_load_state(vm, &state);
+
+  TRYCATCH(vm->checkpoint_path = strdup(path), goto done);
+  vm->checkpoint_end = header.end;
+
+  ok = TRUE;
+
+done:
+  if (fd != -1)
+    close(fd);
+
+  if (index != NULL)
+    free(index);
+
+  if (!ok && vm != NULL) {
+    rssb_vm_destroy(vm);
+    vm = NULL;
+  }
+
+  return vm;
+}
@@ -0,0 +1,674 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "parser.h"
+#include "dbginfo.h"
+
+void
+rssb_dbginfo_destroy(rssb_dbginfo_t *info)
+{
+  unsigned int i;
+
+  if (info->strings != NULL)
+    rssb_atom_table_destroy(info->strings);
+
+  if (info->frames != NULL)
+    free(info->frames);
+
+  if (info->frame_index != NULL)
+    free(info->frame_index);
+
+  if (info->loc_pages != NULL) {
+    for (i = 0; i < info->loc_page_count; ++i)
+      if (info->loc_pages[i] != NULL)
+        free(info->loc_pages[i]);
+
+    free(info->loc_pages);
+  }
+
+  free(info);
+}
+
+rssb_dbginfo_t *
+rssb_dbginfo_new(void)
+{
+  rssb_dbginfo_t *new = NULL;
+
+  TRYCATCH(new = calloc(1, sizeof(rssb_dbginfo_t)), goto fail);
+  TRYCATCH(new->strings = rssb_atom_table_new(), goto fail);
+
+  new->frame_alloc = 16;
+  TRYCATCH(
+      new->frames = calloc(
+          new->frame_alloc,
+          sizeof(struct rssb_dbginfo_frame)),
+      goto fail);
+
+  /* Root frame: the main program */
+  new->frame_count = 1;
+
+  return new;
+
+fail:
+  if (new != NULL)
+    rssb_dbginfo_destroy(new);
+
+  return NULL;
+}
+
+void
+rssb_dbginfo_clear_locs(rssb_dbginfo_t *info)
+{
+  unsigned int i;
+
+  for (i = 0; i < info->loc_page_count; ++i)
+    if (info->loc_pages[i] != NULL)
+      memset(
+          info->loc_pages[i],
+          0,
+          RSSB_DBGINFO_LOC_PAGE_SIZE * sizeof(struct rssb_dbginfo_loc));
+}
+
+/*
+ * Programs placed with .origin may use a few scattered regions of a
+ * huge address space: keep one table slot per page, not per address.
+ */
+PRIVATE struct rssb_dbginfo_loc *
+rssb_dbginfo_loc_at(const rssb_dbginfo_t *info, word_t addr)
+{
+  word_t page = addr >> RSSB_DBGINFO_LOC_PAGE_BITS;
+
+  if (page >= info->loc_page_count || info->loc_pages[page] == NULL)
+    return NULL;
+
+  return info->loc_pages[page] + (addr & (RSSB_DBGINFO_LOC_PAGE_SIZE - 1));
+}
+
+PRIVATE unsigned int
+rssb_dbginfo_frame_hash(unsigned int parent, const void *key)
+{
+  uintptr_t h = (uintptr_t) key ^ ((uintptr_t) parent * 0x9e3779b1u);
+
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+
+  return (unsigned int) h;
+}
+
+PRIVATE void
+rssb_dbginfo_index_insert(
+    const rssb_dbginfo_t *info,
+    unsigned int *index,
+    unsigned int size,
+    unsigned int frame)
+{
+  unsigned int i, mask = size - 1;
+
+  for (i = rssb_dbginfo_frame_hash(
+          info->frames[frame].parent,
+          info->frames[frame].key) & mask;
+       index[i] != 0;
+       i = (i + 1) & mask);
+
+  index[i] = frame;
+}
+
+PRIVATE BOOL
+rssb_dbginfo_grow_index(rssb_dbginfo_t *info)
+{
+  unsigned int *index;
+  unsigned int i, size;
+
+  size = info->frame_index_size == 0 ? 64 : info->frame_index_size << 1;
+
+  TRYCATCH(index = calloc(size, sizeof(unsigned int)), return FALSE);
+
+  /* Entry 0 means empty: the root frame is never indexed */
+  for (i = 1; i < info->frame_count; ++i)
+    rssb_dbginfo_index_insert(info, index, size, i);
+
+  if (info->frame_index != NULL)
+    free(info->frame_index);
+
+  info->frame_index = index;
+  info->frame_index_size = size;
+
+  return TRUE;
+}
+
+/*
+ * Macros are recompiled on every pass, so the same (parent, call) pair
+ * shows up many times. Frames are deduplicated on that pair and the
+ * existing frame is returned when found.
+ */
+BOOL
+rssb_dbginfo_enter_frame(
+    rssb_dbginfo_t *info,
+    unsigned int parent,
+    const void *key,
+    const char *macro,
+    const char *file,
+    int line,
+    unsigned int *frame)
+{
+  struct rssb_dbginfo_frame *tmp;
+  unsigned int i, mask;
+
+  if (info->frame_index_size != 0) {
+    mask = info->frame_index_size - 1;
+
+    for (i = rssb_dbginfo_frame_hash(parent, key) & mask;
+         info->frame_index[i] != 0;
+         i = (i + 1) & mask)
+      if (info->frames[info->frame_index[i]].parent == parent
+          && info->frames[info->frame_index[i]].key == key) {
+        *frame = info->frame_index[i];
+        return TRUE;
+      }
+  }
+
+  if (info->frame_count == info->frame_alloc) {
+    TRYCATCH(
+        tmp = realloc(
+            info->frames,
+            2 * info->frame_alloc * sizeof(struct rssb_dbginfo_frame)),
+        return FALSE);
+
+    info->frames = tmp;
+    info->frame_alloc <<= 1;
+  }
+
+  tmp = info->frames + info->frame_count;
+  tmp->parent = parent;
+  tmp->key    = key;
+  tmp->line   = line;
+  tmp->macro  = NULL;
+  tmp->file   = NULL;
+
+  if (macro != NULL)
+    TRYCATCH(
+        tmp->macro = rssb_atom_table_intern(info->strings, macro),
+        return FALSE);
+
+  if (file != NULL)
+    TRYCATCH(
+        tmp->file = rssb_atom_table_intern(info->strings, file),
+        return FALSE);
+
+  *frame = info->frame_count++;
+
+  if (2 * info->frame_count > info->frame_index_size) {
+    TRYCATCH(rssb_dbginfo_grow_index(info), return FALSE);
+  } else {
+    rssb_dbginfo_index_insert(
+        info,
+        info->frame_index,
+        info->frame_index_size,
+        *frame);
+  }
+
+  return TRUE;
+}
+
+BOOL
+rssb_dbginfo_set_loc(
+    rssb_dbginfo_t *info,
+    word_t addr,
+    unsigned int frame,
+    const char *file,
+    int line)
+{
+  struct rssb_dbginfo_loc **tmp, *loc;
+  word_t page = addr >> RSSB_DBGINFO_LOC_PAGE_BITS;
+  word_t count;
+
+  if (page >= info->loc_page_count) {
+    count = info->loc_page_count == 0 ? 16 : info->loc_page_count;
+    while (count <= page)
+      count <<= 1;
+
+    TRYCATCH(
+        tmp = realloc(
+            info->loc_pages,
+            count * sizeof(struct rssb_dbginfo_loc *)),
+        return FALSE);
+
+    memset(
+        tmp + info->loc_page_count,
+        0,
+        (count - info->loc_page_count) * sizeof(struct rssb_dbginfo_loc *));
+
+    info->loc_pages = tmp;
+    info->loc_page_count = count;
+  }
+
+  if (info->loc_pages[page] == NULL)
+    TRYCATCH(
+        info->loc_pages[page] = calloc(
+            RSSB_DBGINFO_LOC_PAGE_SIZE,
+            sizeof(struct rssb_dbginfo_loc)),
+        return FALSE);
+
+  loc = rssb_dbginfo_loc_at(info, addr);
+
+  loc->frame = frame;
+  loc->line  = line;
+  loc->file  = NULL;
+
+  if (file != NULL) {
+    if (file != info->last_file) {
+      TRYCATCH(
+          info->last_file_atom = rssb_atom_table_intern(info->strings, file),
+          return FALSE);
+      info->last_file = file;
+    }
+
+    loc->file = info->last_file_atom;
+  }
+
+  return TRUE;
+}
+
+const struct rssb_dbginfo_loc *
+rssb_dbginfo_get_loc(const rssb_dbginfo_t *info, word_t addr)
+{
+  const struct rssb_dbginfo_loc *loc = rssb_dbginfo_loc_at(info, addr);
+
+  if (loc == NULL || loc->file == NULL)
+    return NULL;
+
+  return loc;
+}
+
+const struct rssb_dbginfo_frame *
+rssb_dbginfo_get_frame(const rssb_dbginfo_t *info, unsigned int frame)
+{
+  if (frame >= info->frame_count)
+    return NULL;
+
+  return info->frames + frame;
+}
+
+void
+rssb_dbginfo_print_stack(
+    const rssb_dbginfo_t *info,
+    unsigned int frame,
+    FILE *fp)
+{
+  const struct rssb_dbginfo_frame *this;
+
+  if ((this = rssb_dbginfo_get_frame(info, frame)) == NULL
+      || frame == RSSB_DBGINFO_ROOT) {
+    fprintf(fp, "<main program>");
+    return;
+  }
+
+  rssb_dbginfo_print_stack(info, this->parent, fp);
+  fprintf(fp, " > %s (%s:%d)", this->macro, this->file, this->line);
+}
+
+/****************************** SERIALIZATION ********************************/
+/*
+ * On-disk layout. All integers are LEB128 varints, signed ones zigzag
+ * encoded:
+ *
+ *   "RSSBDBG" version
+ *   string count, then (length, bytes) per string
+ *   frame count - 1, then (parent, macro, file, line) per non-root frame
+ *   run count, then (length, frame delta, file delta, line delta) per run
+ *
+ * A run covers `length' consecutive addresses, starting right after the
+ * previous run, sharing the same location. String ids are 1-based: file
+ * id 0 marks addresses that received no word. Deltas are taken against
+ * the previous run, so long macro expansions shrink to a few bytes per
+ * distinct line.
+ */
+
+#define RSSB_DBGINFO_MAGIC   "RSSBDBG"
+#define RSSB_DBGINFO_VERSION 1
+
+PRIVATE BOOL
+rssb_dbginfo_write_uint(FILE *fp, uint64_t value)
+{
+  do {
+    if (fputc((value & 0x7f) | (value > 0x7f ? 0x80 : 0), fp) == EOF)
+      return FALSE;
+    value >>= 7;
+  } while (value != 0);
+
+  return TRUE;
+}
+
+PRIVATE BOOL
+rssb_dbginfo_write_int(FILE *fp, int64_t value)
+{
+  return rssb_dbginfo_write_uint(
+      fp,
+      ((uint64_t) value << 1) ^ (uint64_t) (value >> 63));
+}
+
+PRIVATE BOOL
+rssb_dbginfo_read_uint(FILE *fp, uint64_t *value)
+{
+  unsigned int shift = 0;
+  int c;
+
+  *value = 0;
+
+  do {
+    if ((c = fgetc(fp)) == EOF || shift > 63)
+      return FALSE;
+    *value |= (uint64_t) (c & 0x7f) << shift;
+    shift += 7;
+  } while (c & 0x80);
+
+  return TRUE;
+}
+
+PRIVATE BOOL
+rssb_dbginfo_read_int(FILE *fp, int64_t *value)
+{
+  uint64_t raw;
+
+  if (!rssb_dbginfo_read_uint(fp, &raw))
+    return FALSE;
+
+  *value = (int64_t) (raw >> 1) ^ -(int64_t) (raw & 1);
+
+  return TRUE;
+}
+
+PRIVATE int
+rssb_dbginfo_ptr_cmp(const void *a, const void *b)
+{
+  uintptr_t pa = (uintptr_t) *(const char * const *) a;
+  uintptr_t pb = (uintptr_t) *(const char * const *) b;
+
+  return pa < pb ? -1 : pa > pb;
+}
+
+/* Returns the 1-based id of an interned string, 0 for NULL */
+PRIVATE uint64_t
+rssb_dbginfo_string_id(
+    const char **strings,
+    unsigned int count,
+    const char *string)
+{
+  const char **found;
+
+  if (string == NULL)
+    return 0;
+
+  found = bsearch(
+      &string,
+      strings,
+      count,
+      sizeof(const char *),
+      rssb_dbginfo_ptr_cmp);
+
+  return found == NULL ? 0 : found - strings + 1;
+}
+
+BOOL
+rssb_dbginfo_save(const rssb_dbginfo_t *info, word_t limit, const char *path)
+{
+  const char **strings = NULL;
+  const struct rssb_dbginfo_loc *loc, *prev = NULL;
+  struct rssb_dbginfo_loc none;
+  uint64_t runs = 0;
+  int64_t frame = 0, file = 0, line = 0;
+  unsigned int i, count = 0;
+  word_t addr, start;
+  FILE *fp = NULL;
+  BOOL ok = FALSE;
+
+  if (limit > (info->loc_page_count << RSSB_DBGINFO_LOC_PAGE_BITS))
+    limit = info->loc_page_count << RSSB_DBGINFO_LOC_PAGE_BITS;
+
+  memset(&none, 0, sizeof(struct rssb_dbginfo_loc));
+
+  if ((fp = fopen(path, "wb")) == NULL) {
+    fprintf(
+        stderr,
+        "%s: cannot open `%s': %s\n",
+        __FUNCTION__,
+        path,
+        strerror(errno));
+    goto done;
+  }
+
+  TRYCATCH(
+      strings = calloc(info->strings->count + 1, sizeof(const char *)),
+      goto done);
+
+  for (i = 0; i < info->strings->size; ++i)
+    if (info->strings->atoms[i] != NULL)
+      strings[count++] = info->strings->atoms[i];
+
+  qsort(strings, count, sizeof(const char *), rssb_dbginfo_ptr_cmp);
+
+  TRYCATCH(fwrite(RSSB_DBGINFO_MAGIC, 1, 7, fp) == 7, goto done);
+  TRYCATCH(rssb_dbginfo_write_uint(fp, RSSB_DBGINFO_VERSION), goto done);
+
+  TRYCATCH(rssb_dbginfo_write_uint(fp, count), goto done);
+  for (i = 0; i < count; ++i) {
+    TRYCATCH(rssb_dbginfo_write_uint(fp, strlen(strings[i])), goto done);
+    TRYCATCH(
+        fwrite(strings[i], 1, strlen(strings[i]), fp) == strlen(strings[i]),
+        goto done);
+  }
+
+  TRYCATCH(rssb_dbginfo_write_uint(fp, info->frame_count - 1), goto done);
+  for (i = 1; i < info->frame_count; ++i) {
+    TRYCATCH(
+        rssb_dbginfo_write_uint(fp, info->frames[i].parent),
+        goto done);
+    TRYCATCH(
+        rssb_dbginfo_write_uint(
+            fp,
+            rssb_dbginfo_string_id(strings, count, info->frames[i].macro)),
+        goto done);
+    TRYCATCH(
+        rssb_dbginfo_write_uint(
+            fp,
+            rssb_dbginfo_string_id(strings, count, info->frames[i].file)),
+        goto done);
+    TRYCATCH(rssb_dbginfo_write_int(fp, info->frames[i].line), goto done);
+  }
+
+  /* Count runs first, then emit them */
+  for (addr = 0; addr < limit; ++addr) {
+    if ((loc = rssb_dbginfo_get_loc(info, addr)) == NULL)
+      loc = &none;
+    if (prev == NULL
+        || loc->frame != prev->frame
+        || loc->file != prev->file
+        || loc->line != prev->line)
+      ++runs;
+    prev = loc;
+  }
+
+  TRYCATCH(rssb_dbginfo_write_uint(fp, runs), goto done);
+
+  for (addr = 0; addr < limit; addr = start) {
+    if ((loc = rssb_dbginfo_get_loc(info, addr)) == NULL)
+      loc = &none;
+
+    for (start = addr + 1; start < limit; ++start) {
+      if ((prev = rssb_dbginfo_get_loc(info, start)) == NULL)
+        prev = &none;
+      if (loc->frame != prev->frame
+          || loc->file != prev->file
+          || loc->line != prev->line)
+        break;
+    }
+
+    TRYCATCH(rssb_dbginfo_write_uint(fp, start - addr), goto done);
+    TRYCATCH(
+        rssb_dbginfo_write_int(fp, (int64_t) loc->frame - frame),
+        goto done);
+    TRYCATCH(
+        rssb_dbginfo_write_int(
+            fp,
+            (int64_t) rssb_dbginfo_string_id(strings, count, loc->file) - file),
+        goto done);
+    TRYCATCH(rssb_dbginfo_write_int(fp, loc->line - line), goto done);
+
+    frame = loc->frame;
+    file  = rssb_dbginfo_string_id(strings, count, loc->file);
+    line  = loc->line;
+  }
+
+  ok = TRUE;
+
+done:
+  if (strings != NULL)
+    free(strings);
+
+  if (fp != NULL)
+    if (fclose(fp) == EOF)
+      ok = FALSE;
+
+  return ok;
+}
+
+rssb_dbginfo_t *
+rssb_dbginfo_load(const char *path)
+{
+  rssb_dbginfo_t *new = NULL;
+  const char **strings = NULL;
+  char magic[7];
+  char *string = NULL;
+  uint64_t version, count = 0, len, parent, id, runs;
+  int64_t frame = 0, file = 0, line = 0, delta;
+  struct rssb_dbginfo_frame *tmp;
+  word_t addr = 0;
+  unsigned int i;
+  FILE *fp = NULL;
+  BOOL ok = FALSE;
+
+  if ((fp = fopen(path, "rb")) == NULL) {
+    fprintf(
+        stderr,
+        "%s: cannot open `%s': %s\n",
+        __FUNCTION__,
+        path,
+        strerror(errno));
+    goto done;
+  }
+
+  if (fread(magic, 1, 7, fp) != 7
+      || memcmp(magic, RSSB_DBGINFO_MAGIC, 7) != 0
+      || !rssb_dbginfo_read_uint(fp, &version)
+      || version != RSSB_DBGINFO_VERSION) {
+    fprintf(stderr, "%s: `%s' is not a debug info file\n", __FUNCTION__, path);
+    goto done;
+  }
+
+  TRYCATCH(new = rssb_dbginfo_new(), goto done);
+
+  TRYCATCH(rssb_dbginfo_read_uint(fp, &count), goto done);
+  TRYCATCH(strings = calloc(count + 1, sizeof(const char *)), goto done);
+
+  for (i = 1; i <= count; ++i) {
+    TRYCATCH(rssb_dbginfo_read_uint(fp, &len), goto done);
+    TRYCATCH(string = calloc(len + 1, 1), goto done);
+    TRYCATCH(fread(string, 1, len, fp) == len, goto done);
+    TRYCATCH(
+        strings[i] = rssb_atom_table_intern(new->strings, string),
+        goto done);
+    free(string);
+    string = NULL;
+  }
+
+  TRYCATCH(rssb_dbginfo_read_uint(fp, &len), goto done);
+  TRYCATCH(
+      tmp = realloc(new->frames, (len + 1) * sizeof(struct rssb_dbginfo_frame)),
+      goto done);
+  new->frames = tmp;
+  new->frame_alloc = new->frame_count = len + 1;
+
+  for (i = 1; i <= len; ++i) {
+    TRYCATCH(rssb_dbginfo_read_uint(fp, &parent), goto done);
+    TRYCATCH(parent < i, goto done);
+    new->frames[i].parent = parent;
+    new->frames[i].key = NULL;
+
+    TRYCATCH(rssb_dbginfo_read_uint(fp, &id), goto done);
+    TRYCATCH(id <= count, goto done);
+    new->frames[i].macro = strings[id];
+
+    TRYCATCH(rssb_dbginfo_read_uint(fp, &id), goto done);
+    TRYCATCH(id <= count, goto done);
+    new->frames[i].file = strings[id];
+
+    TRYCATCH(rssb_dbginfo_read_int(fp, &delta), goto done);
+    new->frames[i].line = delta;
+  }
+
+  TRYCATCH(rssb_dbginfo_read_uint(fp, &runs), goto done);
+
+  while (runs-- > 0) {
+    TRYCATCH(rssb_dbginfo_read_uint(fp, &len), goto done);
+    TRYCATCH(rssb_dbginfo_read_int(fp, &delta), goto done);
+    frame += delta;
+    TRYCATCH(rssb_dbginfo_read_int(fp, &delta), goto done);
+    file += delta;
+    TRYCATCH(rssb_dbginfo_read_int(fp, &delta), goto done);
+    line += delta;
+
+    TRYCATCH(frame >= 0 && frame < new->frame_count, goto done);
+    TRYCATCH(file >= 0 && (uint64_t) file <= count, goto done);
+
+    if (file != 0)
+      for (i = 0; i < len; ++i)
+        TRYCATCH(
+            rssb_dbginfo_set_loc(new, addr + i, frame, strings[file], line),
+            goto done);
+
+    addr += len;
+  }
+
+  ok = TRUE;
+
+done:
+  if (!ok) {
+    if (new != NULL)
+      rssb_dbginfo_destroy(new);
+    new = NULL;
+  }
+
+  if (string != NULL)
+    free(string);
+
+  if (strings != NULL)
+    free(strings);
+
+  if (fp != NULL)
+    fclose(fp);
+
+  return new;
+}
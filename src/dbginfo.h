@@ -0,0 +1,105 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _RSSB_DBGINFO_H
+#define _RSSB_DBGINFO_H
+
+#include <stdio.h>
+
+#include "rssb.h"
+
+#define RSSB_DBGINFO_ROOT 0
+
+#define RSSB_DBGINFO_LOC_PAGE_BITS 12
+#define RSSB_DBGINFO_LOC_PAGE_SIZE (1 << RSSB_DBGINFO_LOC_PAGE_BITS)
+
+/*
+ * A frame is one macro expansion: the macro being called plus the
+ * source location of the call. Frame RSSB_DBGINFO_ROOT stands for the
+ * main program and has no call site.
+ */
+struct rssb_dbginfo_frame {
+  unsigned int parent;
+  const char *macro;
+  const char *file;
+  int line;
+
+  const void *key; /* Call statement, only meaningful while compiling */
+};
+
+struct rssb_dbginfo_loc {
+  unsigned int frame;
+  const char *file; /* NULL if nothing was emitted here */
+  int line;
+};
+
+typedef struct rssb_dbginfo {
+  struct rssb_atom_table *strings;
+
+  struct rssb_dbginfo_frame *frames;
+  unsigned int frame_count;
+  unsigned int frame_alloc;
+
+  unsigned int *frame_index; /* (parent, key) -> frame, open addressing */
+  unsigned int frame_index_size;
+
+  /* Indexed by address. Pages are allocated when first written */
+  struct rssb_dbginfo_loc **loc_pages;
+  word_t loc_page_count;
+
+  /* Most source files emit long runs of words: cache the last intern */
+  const char *last_file;
+  const char *last_file_atom;
+} rssb_dbginfo_t;
+
+rssb_dbginfo_t *rssb_dbginfo_new(void);
+void rssb_dbginfo_clear_locs(rssb_dbginfo_t *info);
+BOOL rssb_dbginfo_enter_frame(
+    rssb_dbginfo_t *info,
+    unsigned int parent,
+    const void *key,
+    const char *macro,
+    const char *file,
+    int line,
+    unsigned int *frame);
+BOOL rssb_dbginfo_set_loc(
+    rssb_dbginfo_t *info,
+    word_t addr,
+    unsigned int frame,
+    const char *file,
+    int line);
+const struct rssb_dbginfo_loc *rssb_dbginfo_get_loc(
+    const rssb_dbginfo_t *info,
+    word_t addr);
+const struct rssb_dbginfo_frame *rssb_dbginfo_get_frame(
+    const rssb_dbginfo_t *info,
+    unsigned int frame);
+void rssb_dbginfo_print_stack(
+    const rssb_dbginfo_t *info,
+    unsigned int frame,
+    FILE *fp);
+BOOL rssb_dbginfo_save(
+    const rssb_dbginfo_t *info,
+    word_t limit,
+    const char *path);
+rssb_dbginfo_t *rssb_dbginfo_load(const char *path);
+void rssb_dbginfo_destroy(rssb_dbginfo_t *info);
+
+#endif /* _RSSB_DBGINFO_H */
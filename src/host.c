@@ -0,0 +1,766 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "host.h"
+
+#define RSSB_HOST_EVENTS      64
+#define RSSB_HOST_OUTPUT_LOW  (RSSB_HOST_OUTPUT_HIGH / 2)
+
+PRIVATE BOOL
+rssb_host_set_nonblocking(int fd)
+{
+  int flags;
+
+  if ((flags = fcntl(fd, F_GETFL)) == -1)
+    return FALSE;
+
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+PRIVATE size_t
+rssb_host_pending(const rssb_host_session_t *s)
+{
+  return s->out_failed ? 0 : s->out_len - s->out_pos;
+}
+
+enum rssb_vm_input
+rssb_host_getc(rssb_host_session_t *s, uint8_t *c)
+{
+  ssize_t got;
+
+  if (s->in_pos == s->in_len && !s->in_eof) {
+    got = read(s->in_fd, s->in_buf, sizeof(s->in_buf));
+
+    if (got > 0) {
+      s->in_pos = 0;
+      s->in_len = got;
+    } else if (got == 0
+        || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+      s->in_eof = TRUE;
+    } else {
+      return RSSB_VM_INPUT_AGAIN;
+    }
+  }
+
+  if (s->in_pos == s->in_len)
+    return RSSB_VM_INPUT_EOF;
+
+  *c = s->in_buf[s->in_pos++];
+
+  return RSSB_VM_INPUT_READY;
+}
+
+PRIVATE enum rssb_vm_input
+rssb_host_input(void *private, word_t *ch)
+{
+  enum rssb_vm_input result;
+  uint8_t c;
+
+  if ((result = rssb_host_getc(private, &c)) == RSSB_VM_INPUT_READY)
+    *ch = c;
+
+  return result;
+}
+
+/* Makes room for `size' more bytes of output */
+PRIVATE BOOL
+rssb_host_reserve(rssb_host_session_t *s, size_t size)
+{
+  size_t alloc;
+  uint8_t *buf;
+
+  if (s->out_alloc - s->out_len >= size)
+    return TRUE;
+
+  if (s->out_pos > 0) {
+    memmove(s->out_buf, s->out_buf + s->out_pos, s->out_len - s->out_pos);
+    s->out_len -= s->out_pos;
+    s->out_pos  = 0;
+  }
+
+  alloc = s->out_alloc > 0 ? s->out_alloc : RSSB_HOST_BUFFER_SIZE;
+  while (alloc - s->out_len < size)
+    alloc <<= 1;
+
+  if (alloc != s->out_alloc) {
+    if ((buf = realloc(s->out_buf, alloc)) == NULL)
+      return FALSE;
+
+    s->out_buf   = buf;
+    s->out_alloc = alloc;
+  }
+
+  return TRUE;
+}
+
+PRIVATE BOOL
+rssb_host_output(void *private, word_t ch)
+{
+  rssb_host_session_t *s = private;
+
+  /* Nobody is listening any more: drop it */
+  if (s->out_failed)
+    return TRUE;
+
+  if (s->out_len == s->out_alloc && !rssb_host_reserve(s, 1))
+    return FALSE;
+
+  s->out_buf[s->out_len++] = ch;
+
+  return TRUE;
+}
+
+/* Queues raw bytes after whatever the VM has written so far */
+BOOL
+rssb_host_write(rssb_host_session_t *s, const void *data, size_t size)
+{
+  if (s->out_failed)
+    return TRUE;
+
+  TRYCATCH(rssb_host_reserve(s, size), return FALSE);
+
+  memcpy(s->out_buf + s->out_len, data, size);
+  s->out_len += size;
+
+  return TRUE;
+}
+
+/* Writes as much pending output as the fd takes without blocking */
+PRIVATE void
+rssb_host_flush(rssb_host_session_t *s)
+{
+  ssize_t sent;
+
+  while (s->out_pos < s->out_len && !s->out_failed) {
+    if ((sent = write(
+        s->out_fd,
+        s->out_buf + s->out_pos,
+        s->out_len - s->out_pos)) == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return;
+      s->out_failed = TRUE;
+      break;
+    }
+
+    s->out_pos += sent;
+  }
+
+  s->out_pos = s->out_len = 0;
+}
+
+/*
+ * Brings the epoll registration of `fd' to `wanted'. Regular files
+ * cannot be polled, but never block either: they are just marked so.
+ */
+PRIVATE BOOL
+rssb_host_ctl(
+    rssb_host_session_t *s,
+    int fd,
+    uint32_t *current,
+    uint32_t wanted,
+    BOOL *polled)
+{
+  struct epoll_event ev;
+  int op;
+
+  if (!*polled || wanted == *current)
+    return TRUE;
+
+  if (wanted == 0)
+    op = EPOLL_CTL_DEL;
+  else if (*current == 0)
+    op = EPOLL_CTL_ADD;
+  else
+    op = EPOLL_CTL_MOD;
+
+  memset(&ev, 0, sizeof(struct epoll_event));
+  ev.events   = wanted;
+  ev.data.ptr = s;
+
+  if (epoll_ctl(s->host->epoll_fd, op, fd, &ev) == -1) {
+    if (errno != EPERM) {
+      fprintf(stderr, "%s: epoll_ctl: %s\n", __FUNCTION__, strerror(errno));
+      return FALSE;
+    }
+
+    *polled  = FALSE;
+    *current = 0;
+    return TRUE;
+  }
+
+  *current = wanted;
+
+  return TRUE;
+}
+
+PRIVATE BOOL
+rssb_host_watch(rssb_host_session_t *s)
+{
+  uint32_t in  = s->state == RSSB_HOST_WAIT_INPUT ? EPOLLIN : 0;
+  uint32_t out = rssb_host_pending(s) > 0 ? EPOLLOUT : 0;
+
+  if (s->state == RSSB_HOST_DEAD)
+    in = out = 0;
+
+  if (s->in_fd == s->out_fd)
+    return rssb_host_ctl(s, s->in_fd, &s->in_events, in | out, &s->in_polled);
+
+  return rssb_host_ctl(s, s->in_fd, &s->in_events, in, &s->in_polled)
+      && rssb_host_ctl(s, s->out_fd, &s->out_events, out, &s->out_polled);
+}
+
+PRIVATE void
+rssb_host_finish(rssb_host_session_t *s, enum rssb_vm_reason reason)
+{
+  if (s->finished)
+    return;
+
+  s->finished = TRUE;
+  s->reason   = reason;
+
+  if (s->done != NULL)
+    (s->done) (s);
+}
+
+/* Sessions are freed later: epoll may still hold events for them */
+PRIVATE void
+rssb_host_close(rssb_host_session_t *s)
+{
+  rssb_host_t *host = s->host;
+
+  rssb_host_finish(s, RSSB_VM_REASON_FAULT);
+
+  s->state = RSSB_HOST_DEAD;
+  (void) rssb_host_watch(s);
+
+  close(s->in_fd);
+  if (s->out_fd != s->in_fd)
+    close(s->out_fd);
+
+  if (s->vm != NULL)
+    rssb_vm_destroy(s->vm);
+  s->vm = NULL;
+
+  if (s->prev_session != NULL)
+    s->prev_session->next_session = s->next_session;
+  else
+    host->session_list = s->next_session;
+  if (s->next_session != NULL)
+    s->next_session->prev_session = s->prev_session;
+
+  --host->sessions;
+
+  s->next = host->dead;
+  host->dead = s;
+}
+
+PRIVATE void
+rssb_host_reap(rssb_host_t *host)
+{
+  rssb_host_session_t *s;
+
+  while ((s = host->dead) != NULL) {
+    host->dead = s->next;
+
+    if (s->out_buf != NULL)
+      free(s->out_buf);
+    free(s);
+  }
+}
+
+PRIVATE void
+rssb_host_enqueue(rssb_host_session_t *s)
+{
+  rssb_host_t *host = s->host;
+
+  s->state = RSSB_HOST_RUNNABLE;
+  s->next  = NULL;
+
+  if (host->run_tail != NULL)
+    host->run_tail->next = s;
+  else
+    host->run_head = s;
+  host->run_tail = s;
+
+  if (!rssb_host_watch(s))
+    s->out_failed = TRUE;
+}
+
+/* Puts a session aside until epoll reports what it waits for */
+PRIVATE void
+rssb_host_park(rssb_host_session_t *s, enum rssb_host_state state)
+{
+  s->state = state;
+
+  if (state == RSSB_HOST_DRAINING && rssb_host_pending(s) == 0) {
+    rssb_host_close(s);
+    return;
+  }
+
+  if (!rssb_host_watch(s)) {
+    rssb_host_close(s);
+    return;
+  }
+
+  /* Unpollable input never makes us wait */
+  if (state == RSSB_HOST_WAIT_INPUT && !s->in_polled)
+    rssb_host_enqueue(s);
+}
+
+/* Fills in the frame header reserved at `start' bytes past out_pos */
+PRIVATE void
+rssb_host_close_frame(rssb_host_session_t *s, size_t start)
+{
+  char header[RSSB_HOST_FRAME_HEADER + 1];
+  uint8_t *frame = s->out_buf + s->out_pos + start;
+  size_t size = s->out_len - s->out_pos - start - RSSB_HOST_FRAME_HEADER;
+
+  if (size == 0) {
+    s->out_len -= RSSB_HOST_FRAME_HEADER;
+    return;
+  }
+
+  snprintf(header, sizeof(header), "O %08x\n", (unsigned int) size);
+  memcpy(frame, header, RSSB_HOST_FRAME_HEADER);
+}
+
+PRIVATE void
+rssb_host_turn(rssb_host_t *host, rssb_host_session_t *s)
+{
+  enum rssb_vm_reason reason;
+  size_t start = 0;
+  BOOL framed;
+
+  if (s->vm == NULL) {
+    if (s->prepare == NULL || !(s->prepare) (s)) {
+      rssb_host_flush(s);
+      rssb_host_finish(s, RSSB_VM_REASON_FAULT);
+      rssb_host_park(s, RSSB_HOST_DRAINING);
+      return;
+    }
+
+    if (s->vm == NULL) {
+      rssb_host_flush(s);
+      rssb_host_park(s, RSSB_HOST_WAIT_INPUT);
+      return;
+    }
+  }
+
+  framed = s->framed && !s->out_failed;
+
+  if (framed) {
+    start = s->out_len - s->out_pos;
+    if (!rssb_host_write(s, "O 00000000\n", RSSB_HOST_FRAME_HEADER))
+      framed = FALSE;
+  }
+
+  rssb_vm_run_for(s->vm, host->slice, &reason);
+
+  if (framed && !s->out_failed)
+    rssb_host_close_frame(s, start);
+
+  if (reason != RSSB_VM_REASON_BUDGET && reason != RSSB_VM_REASON_INPUT)
+    rssb_host_finish(s, reason);
+
+  rssb_host_flush(s);
+
+  /* The other end went away: nobody to run for */
+  if (s->out_failed) {
+    rssb_host_close(s);
+    return;
+  }
+
+  switch (reason) {
+    case RSSB_VM_REASON_BUDGET:
+      if (rssb_host_pending(s) > RSSB_HOST_OUTPUT_HIGH)
+        rssb_host_park(s, RSSB_HOST_WAIT_OUTPUT);
+      else
+        rssb_host_enqueue(s);
+      break;
+
+    case RSSB_VM_REASON_INPUT:
+      rssb_host_park(s, RSSB_HOST_WAIT_INPUT);
+      break;
+
+    default:
+      rssb_host_park(s, RSSB_HOST_DRAINING);
+  }
+}
+
+PRIVATE void
+rssb_host_event(rssb_host_session_t *s, uint32_t events)
+{
+  if (s->state == RSSB_HOST_DEAD)
+    return;
+
+  if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+    rssb_host_flush(s);
+
+  switch (s->state) {
+    case RSSB_HOST_WAIT_INPUT:
+      if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        rssb_host_enqueue(s);
+        return;
+      }
+      break;
+
+    case RSSB_HOST_WAIT_OUTPUT:
+      if (rssb_host_pending(s) <= RSSB_HOST_OUTPUT_LOW) {
+        rssb_host_enqueue(s);
+        return;
+      }
+      break;
+
+    case RSSB_HOST_DRAINING:
+      if (rssb_host_pending(s) == 0) {
+        rssb_host_close(s);
+        return;
+      }
+      break;
+
+    default:
+      return;
+  }
+
+  if (!rssb_host_watch(s))
+    rssb_host_close(s);
+}
+
+void
+rssb_host_destroy(rssb_host_t *host)
+{
+  while (host->session_list != NULL)
+    rssb_host_close(host->session_list);
+
+  rssb_host_reap(host);
+
+  if (host->epoll_fd != -1)
+    close(host->epoll_fd);
+
+  free(host);
+}
+
+rssb_host_t *
+rssb_host_new(uint64_t slice)
+{
+  rssb_host_t *new = NULL;
+
+  TRYCATCH(new = calloc(1, sizeof(rssb_host_t)), goto fail);
+
+  new->slice     = slice > 0 ? slice : RSSB_HOST_DEFAULT_SLICE;
+  new->listen_fd = -1;
+  new->stop_fd   = -1;
+
+  if ((new->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+    fprintf(stderr, "%s: epoll_create1: %s\n", __FUNCTION__, strerror(errno));
+    goto fail;
+  }
+
+  /* Peers that go away must make writes fail, not kill the process */
+  signal(SIGPIPE, SIG_IGN);
+
+  return new;
+
+fail:
+  if (new != NULL)
+    rssb_host_destroy(new);
+
+  return NULL;
+}
+
+void
+rssb_host_attach(rssb_host_session_t *s, rssb_vm_t *vm)
+{
+  s->vm = vm;
+  rssb_vm_set_io(vm, s, rssb_host_input, rssb_host_output);
+}
+
+/*
+ * Hands `vm' over to the host, with $IN read from `in_fd' and $OUT
+ * written to `out_fd'. Both are made non-blocking and are closed, and
+ * the VM destroyed, when the session ends. `vm' may be NULL if the
+ * caller sets `prepare' to attach one later.
+ */
+rssb_host_session_t *
+rssb_host_add(rssb_host_t *host, rssb_vm_t *vm, int in_fd, int out_fd)
+{
+  rssb_host_session_t *new;
+
+  if (!rssb_host_set_nonblocking(in_fd) || !rssb_host_set_nonblocking(out_fd)) {
+    fprintf(stderr, "%s: cannot make fds non-blocking\n", __FUNCTION__);
+    return NULL;
+  }
+
+  TRYCATCH(new = calloc(1, sizeof(rssb_host_session_t)), return NULL);
+
+  new->host       = host;
+  new->in_fd      = in_fd;
+  new->out_fd     = out_fd;
+  new->in_polled  = TRUE;
+  new->out_polled = TRUE;
+
+  if (vm != NULL)
+    rssb_host_attach(new, vm);
+
+  new->next_session = host->session_list;
+  if (host->session_list != NULL)
+    host->session_list->prev_session = new;
+  host->session_list = new;
+
+  ++host->sessions;
+
+  rssb_host_enqueue(new);
+
+  return new;
+}
+
+/* Calls `accept' whenever `fd' has connections waiting */
+BOOL
+rssb_host_listen(
+    rssb_host_t *host,
+    int fd,
+    void (*accept) (rssb_host_t *host, int fd, void *private),
+    void *private)
+{
+  struct epoll_event ev;
+
+  TRYCATCH(rssb_host_set_nonblocking(fd), return FALSE);
+
+  memset(&ev, 0, sizeof(struct epoll_event));
+  ev.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+  /* Several hosts may listen on the same socket: wake only one */
+  ev.events |= EPOLLEXCLUSIVE;
+#endif /* EPOLLEXCLUSIVE */
+  ev.data.ptr = NULL;
+
+  if (epoll_ctl(host->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+    fprintf(stderr, "%s: epoll_ctl: %s\n", __FUNCTION__, strerror(errno));
+    return FALSE;
+  }
+
+  host->listen_fd      = fd;
+  host->accept         = accept;
+  host->accept_private = private;
+
+  return TRUE;
+}
+
+/*
+ * Makes rssb_host_run return as soon as `fd' is readable, leaving the
+ * sessions still open. Several hosts may watch the same fd.
+ */
+BOOL
+rssb_host_stop_on(rssb_host_t *host, int fd)
+{
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(struct epoll_event));
+  ev.events = EPOLLIN;
+  ev.data.ptr = host;
+
+  if (epoll_ctl(host->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+    fprintf(stderr, "%s: epoll_ctl: %s\n", __FUNCTION__, strerror(errno));
+    return FALSE;
+  }
+
+  host->stop_fd = fd;
+
+  return TRUE;
+}
+
+/*
+ * Runs until every session has ended, or forever with a listening
+ * socket, unless the stop fd fires. Each round gives one turn to every session runnable when it
+ * starts, then picks up whatever epoll has for the rest.
+ */
+BOOL
+rssb_host_run(rssb_host_t *host)
+{
+  struct epoll_event events[RSSB_HOST_EVENTS];
+  rssb_host_session_t *s, *last;
+  int i, n;
+
+  while (host->sessions > 0 || host->listen_fd != -1) {
+    last = host->run_tail;
+
+    while (last != NULL && (s = host->run_head) != NULL) {
+      if ((host->run_head = s->next) == NULL)
+        host->run_tail = NULL;
+
+      rssb_host_turn(host, s);
+
+      if (s == last)
+        break;
+    }
+
+    rssb_host_reap(host);
+
+    n = epoll_wait(
+        host->epoll_fd,
+        events,
+        RSSB_HOST_EVENTS,
+        host->run_head != NULL ? 0 : -1);
+
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "%s: epoll_wait: %s\n", __FUNCTION__, strerror(errno));
+      return FALSE;
+    }
+
+    for (i = 0; i < n; ++i)
+      if (events[i].data.ptr == host)
+        return TRUE;
+      else if (events[i].data.ptr == NULL)
+        (host->accept) (host, host->listen_fd, host->accept_private);
+      else
+        rssb_host_event(events[i].data.ptr, events[i].events);
+
+    rssb_host_reap(host);
+  }
+
+  return TRUE;
+}
+
+PRIVATE void *
+rssb_host_thread(void *private)
+{
+  rssb_host_t *host = private;
+
+  return (void *) (uintptr_t) rssb_host_run(host);
+}
+
+/*
+ * Listens on the Unix socket `path' with `threads' hosts, each running
+ * on its own thread and calling `accept' for the connections it wins.
+ * Only returns on errors, after stopping every host through an eventfd
+ * they all watch.
+ */
+BOOL
+rssb_host_serve_unix(
+    const char *path,
+    unsigned int threads,
+    void (*accept) (rssb_host_t *host, int fd, void *private),
+    void *private)
+{
+  struct sockaddr_un addr;
+  struct stat sbuf;
+  rssb_host_t **hosts = NULL;
+  pthread_t *tids = NULL;
+  unsigned int i, started = 0;
+  uint64_t one = 1;
+  int fd = -1, stop_fd = -1;
+  BOOL ok = FALSE;
+
+  memset(&addr, 0, sizeof(struct sockaddr_un));
+  addr.sun_family = AF_UNIX;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "%s: socket path too long\n", __FUNCTION__);
+    goto done;
+  }
+
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  /* A socket left behind by a previous run */
+  if (stat(path, &sbuf) == 0 && S_ISSOCK(sbuf.st_mode))
+    (void) unlink(path);
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1
+      || bind(fd, (struct sockaddr *) &addr, sizeof(struct sockaddr_un)) == -1
+      || listen(fd, SOMAXCONN) == -1) {
+    fprintf(
+        stderr,
+        "%s: cannot listen on `%s': %s\n",
+        __FUNCTION__,
+        path,
+        strerror(errno));
+    goto done;
+  }
+
+  if ((stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1) {
+    fprintf(stderr, "%s: eventfd: %s\n", __FUNCTION__, strerror(errno));
+    goto done;
+  }
+
+  TRYCATCH(hosts = calloc(threads, sizeof(rssb_host_t *)), goto done);
+  TRYCATCH(tids = calloc(threads, sizeof(pthread_t)), goto done);
+
+  for (i = 0; i < threads; ++i) {
+    TRYCATCH(hosts[i] = rssb_host_new(RSSB_HOST_DEFAULT_SLICE), goto done);
+    TRYCATCH(rssb_host_listen(hosts[i], fd, accept, private), goto done);
+    TRYCATCH(rssb_host_stop_on(hosts[i], stop_fd), goto done);
+  }
+
+  /* The first host runs on the calling thread */
+  for (i = 1; i < threads; ++i) {
+    TRYCATCH(
+        pthread_create(&tids[i], NULL, rssb_host_thread, hosts[i]) == 0,
+        goto done);
+    ++started;
+  }
+
+  ok = rssb_host_run(hosts[0]);
+
+done:
+  /* The other hosts would otherwise serve on forever */
+  if (started > 0 && write(stop_fd, &one, sizeof(uint64_t)) == -1)
+    fprintf(stderr, "%s: cannot stop hosts: %s\n", __FUNCTION__, strerror(errno));
+
+  for (i = 1; i <= started; ++i)
+    pthread_join(tids[i], NULL);
+
+  if (hosts != NULL) {
+    for (i = 0; i < threads; ++i)
+      if (hosts[i] != NULL)
+        rssb_host_destroy(hosts[i]);
+    free(hosts);
+  }
+
+  if (tids != NULL)
+    free(tids);
+
+  if (stop_fd != -1)
+    close(stop_fd);
+
+  if (fd != -1) {
+    close(fd);
+    (void) unlink(path);
+  }
+
+  return ok;
+}
@@ -0,0 +1,130 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+
+#ifndef _RSSB_HOST_H
+#define _RSSB_HOST_H
+
+#include <stdint.h>
+
+#include "rssb.h"
+
+#define RSSB_HOST_DEFAULT_SLICE  (1 << 16) /* Steps per turn */
+#define RSSB_HOST_BUFFER_SIZE    4096
+#define RSSB_HOST_OUTPUT_HIGH    (1 << 16) /* Pending output that pauses a VM */
+#define RSSB_HOST_FRAME_HEADER   11        /* "O xxxxxxxx\n" */
+
+enum rssb_host_state {
+  RSSB_HOST_RUNNABLE,     /* In the run queue */
+  RSSB_HOST_WAIT_INPUT,   /* Suspended on $IN */
+  RSSB_HOST_WAIT_OUTPUT,  /* Paused until its output drains */
+  RSSB_HOST_DRAINING,     /* Finished, flushing its output */
+  RSSB_HOST_DEAD
+};
+
+struct rssb_host;
+
+typedef struct rssb_host_session {
+  struct rssb_host *host;
+  rssb_vm_t *vm;          /* Owned */
+  int in_fd;              /* Owned, may be the same as out_fd */
+  int out_fd;
+  enum rssb_host_state state;
+  enum rssb_vm_reason reason; /* Why the VM finished */
+
+  uint8_t in_buf[RSSB_HOST_BUFFER_SIZE];
+  size_t in_pos;
+  size_t in_len;
+  BOOL in_eof;
+
+  uint8_t *out_buf;
+  size_t out_pos;
+  size_t out_len;
+  size_t out_alloc;
+  BOOL out_failed;        /* Output fd gone: drop what is left */
+  BOOL framed;            /* Each turn's output goes in an "O <hex len>\n" frame */
+
+  uint32_t in_events;     /* What epoll watches now */
+  uint32_t out_events;
+  BOOL in_polled;         /* Pollable at all (regular files are not) */
+  BOOL out_polled;
+
+  /*
+   * Sessions added without a VM call `prepare' on every turn until it
+   * attaches one. It returns FALSE to give up on the session, or TRUE
+   * with no VM yet to wait for more input.
+   */
+  BOOL (*prepare) (struct rssb_host_session *session);
+
+  /* Called once when the run ends, before the remaining output drains */
+  void (*done) (struct rssb_host_session *session);
+  BOOL finished;
+  void *private;
+
+  struct rssb_host_session *next; /* Run queue or dead list */
+  struct rssb_host_session *prev_session;
+  struct rssb_host_session *next_session;
+} rssb_host_session_t;
+
+/*
+ * Runs many VMs on one thread. Each gets RSSB_HOST_DEFAULT_SLICE steps
+ * per turn and is put aside while it waits for input, or for its
+ * output to drain; epoll tells when to pick it up again.
+ */
+typedef struct rssb_host {
+  int epoll_fd;
+  uint64_t slice;
+  unsigned int sessions;
+  rssb_host_session_t *session_list; /* Every live session */
+  rssb_host_session_t *run_head;
+  rssb_host_session_t *run_tail;
+  rssb_host_session_t *dead;
+
+  int listen_fd;          /* -1 if none */
+  void (*accept) (struct rssb_host *host, int fd, void *private);
+  void *accept_private;
+
+  int stop_fd;            /* Readable once the host must return, or -1 */
+} rssb_host_t;
+
+rssb_host_t *rssb_host_new(uint64_t slice);
+rssb_host_session_t *rssb_host_add(
+    rssb_host_t *host,
+    rssb_vm_t *vm,
+    int in_fd,
+    int out_fd);
+void rssb_host_attach(rssb_host_session_t *session, rssb_vm_t *vm);
+enum rssb_vm_input rssb_host_getc(rssb_host_session_t *session, uint8_t *c);
+BOOL rssb_host_write(rssb_host_session_t *session, const void *data, size_t size);
+BOOL rssb_host_listen(
+    rssb_host_t *host,
+    int fd,
+    void (*accept) (rssb_host_t *host, int fd, void *private),
+    void *private);
+BOOL rssb_host_stop_on(rssb_host_t *host, int fd);
+BOOL rssb_host_run(rssb_host_t *host);
+BOOL rssb_host_serve_unix(
+    const char *path,
+    unsigned int threads,
+    void (*accept) (rssb_host_t *host, int fd, void *private),
+    void *private);
+void rssb_host_destroy(rssb_host_t *host);
+
+#endif /* _RSSB_HOST_H */
@@ -0,0 +1,519 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "lockstep.h"
+
+#ifdef HAVE_X86_SIMD_TARGETS
+#  include <immintrin.h>
+#elif defined(__SSE2__)
+#  include <emmintrin.h>
+#endif /* HAVE_X86_SIMD_TARGETS */
+
+typedef int32_t rssb_lockstep_v8si_t __attribute__((vector_size(32)));
+typedef int32_t rssb_lockstep_v4si_t __attribute__((vector_size(16)));
+
+/*
+ * Lane masks of comparison results (all ones or all zeroes per lane),
+ * one per kernel. Never reduce vectors element by element in the hot
+ * loop: GCC spills them to the stack to do it.
+ */
+#define RSSB_LOCKSTEP_MASK_AVX512(v)                                    \
+  ((unsigned int) _mm512_test_epi32_mask((__m512i) (v), (__m512i) (v)))
+
+#define RSSB_LOCKSTEP_MASK_AVX2(v)                                      \
+  ((unsigned int) _mm256_movemask_ps((__m256) (v)))
+
+#ifdef __SSE2__
+#  define RSSB_LOCKSTEP_MASK_GENERIC(v)                                 \
+  ({                                                                    \
+    rssb_lockstep_v8si_t __v = (v);                                     \
+    rssb_lockstep_v4si_t __lo, __hi;                                    \
+    memcpy(&__lo, &__v, sizeof(__lo));                                  \
+    memcpy(&__hi, (char *) &__v + sizeof(__lo), sizeof(__hi));          \
+    (unsigned int) (_mm_movemask_ps((__m128) __lo)                      \
+        | _mm_movemask_ps((__m128) __hi) << 4);                         \
+  })
+#else
+#  define RSSB_LOCKSTEP_MASK_GENERIC(v)                                 \
+  ({                                                                    \
+    rssb_lockstep_v8si_t __v = (v);                                     \
+    unsigned int __mask = 0, __i;                                       \
+    for (__i = 0; __i < 8; ++__i)                                       \
+      __mask |= (__v[__i] != 0) << __i;                                 \
+    __mask;                                                             \
+  })
+#endif /* __SSE2__ */
+
+/* Builds a regular VM from lane `lane', which leaves lockstep */
+PRIVATE void
+rssb_lockstep_eject(
+    rssb_lockstep_t *ls,
+    unsigned int lane,
+    word_t ip,
+    word_t acc,
+    uint64_t steps)
+{
+  struct rssb_lockstep_lane *this = ls->lanes + lane;
+  rssb_vm_t *vm;
+  const uint32_t *word;
+  word_t addr, first, last;
+  size_t i;
+
+  this->steps = steps;
+
+  if ((vm = rssb_vm_new_with_backing(
+      ls->base->mem_size,
+      ls->base->backing)) == NULL) {
+    fprintf(stderr, "%s: cannot create VM for lane %u\n", __FUNCTION__, lane);
+    this->halted = TRUE;
+    this->ok     = FALSE;
+    return;
+  }
+
+  for (i = 0; i < ls->page_count; ++i) {
+    if (!ls->pages[i])
+      continue;
+
+    first = i << RSSB_LOCKSTEP_PAGE_BITS;
+    last  = first + (1 << RSSB_LOCKSTEP_PAGE_BITS);
+    if (last > ls->base->mem_size)
+      last = ls->base->mem_size;
+
+    word = ls->mem + (size_t) first * ls->width + lane;
+    for (addr = first; addr < last; ++addr, word += ls->width)
+      if (*word != 0)
+        rssb_vm_poke(vm, addr, *word);
+  }
+
+  rssb_vm_poke(vm, RSSB_ADDR_IP, ip);
+  rssb_vm_poke(vm, RSSB_ADDR_A, acc);
+
+  vm->dumb_mode   = ls->base->dumb_mode;
+  vm->footprint   = ls->base->footprint;
+  vm->mem_ptr     = ls->base->mem_ptr;
+  vm->stats.steps = steps;
+
+  rssb_vm_set_io(vm, this->private, this->input, this->output);
+
+  this->vm = vm;
+}
+
+PRIVATE void
+rssb_lockstep_eject_all(
+    rssb_lockstep_t *ls,
+    unsigned int lanes,
+    word_t ip,
+    const uint32_t *accs,
+    uint64_t steps)
+{
+  unsigned int i;
+
+  for (i = 0; i < ls->width; ++i)
+    if ((lanes >> i) & 1)
+      rssb_lockstep_eject(ls, i, ip, accs[i], steps);
+}
+
+/*
+ * Keeps the lanes that agree on `values' with most others and ejects
+ * the rest, each at its own $IP. Returns the lanes left.
+ */
+PRIVATE unsigned int
+rssb_lockstep_split(
+    rssb_lockstep_t *ls,
+    unsigned int lanes,
+    const uint32_t *values,
+    const uint32_t *ips,
+    const uint32_t *accs,
+    uint64_t steps)
+{
+  unsigned int i, j, count, best = 0, best_count = 0;
+
+  for (i = 0; i < ls->width; ++i) {
+    if (!((lanes >> i) & 1))
+      continue;
+
+    for (count = 0, j = 0; j < ls->width; ++j)
+      count += ((lanes >> j) & 1) && values[j] == values[i];
+
+    if (count > best_count) {
+      best       = i;
+      best_count = count;
+    }
+  }
+
+  for (i = 0; i < ls->width; ++i)
+    if (((lanes >> i) & 1) && values[i] != values[best]) {
+      rssb_lockstep_eject(ls, i, ips[i], accs[i], steps);
+      lanes &= ~(1U << i);
+    }
+
+  return lanes;
+}
+
+/* Lanes at $IP = 2 with $A = 1 are done. Returns the lanes left */
+PRIVATE unsigned int
+rssb_lockstep_halt(
+    rssb_lockstep_t *ls,
+    unsigned int lanes,
+    const uint32_t *accs,
+    uint64_t steps)
+{
+  unsigned int i;
+
+  for (i = 0; i < ls->width; ++i)
+    if (((lanes >> i) & 1) && accs[i] == 1) {
+      ls->lanes[i].halted = TRUE;
+      ls->lanes[i].ok     = TRUE;
+      ls->lanes[i].steps  = steps;
+      lanes &= ~(1U << i);
+    }
+
+  return lanes;
+}
+
+/*
+ * A step on a register operand, lane by lane, exactly as in the scalar
+ * loop. Leaves the next $IP of every lane in `ips' and returns the
+ * lanes left: those failing to write $OUT stop here, and those with no
+ * input yet leave lockstep before the step.
+ */
+PRIVATE unsigned int
+rssb_lockstep_registers(
+    rssb_lockstep_t *ls,
+    unsigned int lanes,
+    word_t addr,
+    word_t ip,
+    uint32_t *ips,
+    uint32_t *accs,
+    uint64_t steps)
+{
+  struct rssb_lockstep_lane *this;
+  const word_t mask = ls->base->mem_mask;
+  word_t word, acc, result;
+  unsigned int i;
+  BOOL skip;
+
+  for (i = 0; i < ls->width; ++i) {
+    if (!((lanes >> i) & 1))
+      continue;
+
+    this = ls->lanes + i;
+    acc  = accs[i] & mask;
+
+    switch (addr) {
+      case RSSB_ADDR_IP:
+        word = ip & mask;
+        break;
+
+      case RSSB_ADDR_A:
+        word = acc;
+        break;
+
+      case RSSB_ADDR_IN:
+        if (this->input == NULL)
+          word = getchar();
+        else
+          switch ((this->input) (this->private, &word)) {
+            case RSSB_VM_INPUT_READY:
+              break;
+
+            case RSSB_VM_INPUT_EOF:
+              word = (word_t) EOF;
+              break;
+
+            default:
+              rssb_lockstep_eject(ls, i, ip, accs[i], steps - 1);
+              lanes &= ~(1U << i);
+              continue;
+          }
+        break;
+
+      default:
+        word = ls->mem[(size_t) addr * ls->width + i] & mask;
+    }
+
+    if (ls->base->dumb_mode) {
+      result = addr == RSSB_ADDR_OUT ? acc : word - acc;
+      skip   = !!(result & ls->base->mem_neg_mask);
+    } else {
+      skip   = acc > word;
+      result = word - acc;
+    }
+
+    result &= ls->word_mask;
+    accs[i] = result;
+    ips[i]  = (ip + 1 + skip) & ls->word_mask;
+
+    switch (addr) {
+      case RSSB_ADDR_IP:
+        ips[i] = (result + 1 + skip) & ls->word_mask;
+        break;
+
+      case RSSB_ADDR_IN:
+        ls->mem[(size_t) addr * ls->width + i] = result;
+        ls->pages[0] = 1;
+        break;
+
+      case RSSB_ADDR_OUT:
+        if (this->output == NULL) {
+          putchar(result);
+        } else if (!(this->output) (this->private, result)) {
+          fprintf(stderr, "vm: output failed at 0x%x\n", ip & mask);
+          this->halted = TRUE;
+          this->ok     = FALSE;
+          this->steps  = steps;
+          lanes &= ~(1U << i);
+        }
+        break;
+    }
+  }
+
+  return lanes;
+}
+
+#define RSSB_LOCKSTEP_LOOP_NAME  rssb_lockstep_loop_generic
+#define RSSB_LOCKSTEP_LOOP_LANES 8
+#define RSSB_LOCKSTEP_LOOP_MASK  RSSB_LOCKSTEP_MASK_GENERIC
+#include "lockstep_loop.h"
+
+#ifdef HAVE_X86_SIMD_TARGETS
+#  pragma GCC push_options
+#  pragma GCC target("avx2")
+#  define RSSB_LOCKSTEP_LOOP_NAME  rssb_lockstep_loop_avx2
+#  define RSSB_LOCKSTEP_LOOP_LANES 8
+#  define RSSB_LOCKSTEP_LOOP_MASK  RSSB_LOCKSTEP_MASK_AVX2
+#  include "lockstep_loop.h"
+#  pragma GCC pop_options
+
+#  pragma GCC push_options
+#  pragma GCC target("avx512f")
+#  define RSSB_LOCKSTEP_LOOP_NAME  rssb_lockstep_loop_avx512
+#  define RSSB_LOCKSTEP_LOOP_LANES 16
+#  define RSSB_LOCKSTEP_LOOP_MASK  RSSB_LOCKSTEP_MASK_AVX512
+#  include "lockstep_loop.h"
+#  pragma GCC pop_options
+#endif /* HAVE_X86_SIMD_TARGETS */
+
+struct rssb_lockstep_isa {
+  const char *name;
+  unsigned int width;
+  void (*loop) (rssb_lockstep_t *);
+};
+
+/* Best first. The generic kernel is SSE2 code on x86-64 */
+PRIVATE const struct rssb_lockstep_isa g_rssb_lockstep_isas[] = {
+#ifdef HAVE_X86_SIMD_TARGETS
+  {"avx512f", 16, rssb_lockstep_loop_avx512},
+  {"avx2",     8, rssb_lockstep_loop_avx2},
+#endif /* HAVE_X86_SIMD_TARGETS */
+#ifdef __SSE2__
+  {"sse2",     8, rssb_lockstep_loop_generic},
+#else
+  {"scalar",   8, rssb_lockstep_loop_generic},
+#endif /* __SSE2__ */
+};
+
+#define RSSB_LOCKSTEP_ISA_COUNT \
+  (sizeof(g_rssb_lockstep_isas) / sizeof(g_rssb_lockstep_isas[0]))
+
+/* Set by rssb_lockstep_force_isa */
+PRIVATE const struct rssb_lockstep_isa *g_rssb_lockstep_forced = NULL;
+
+/* Whether this CPU runs the i-th kernel */
+PRIVATE BOOL
+rssb_lockstep_runs(unsigned int i)
+{
+#ifdef HAVE_X86_SIMD_TARGETS
+  if (i == 0)
+    return __builtin_cpu_supports("avx512f");
+
+  if (i == 1)
+    return __builtin_cpu_supports("avx2");
+#endif /* HAVE_X86_SIMD_TARGETS */
+
+  return i < RSSB_LOCKSTEP_ISA_COUNT;
+}
+
+PRIVATE const struct rssb_lockstep_isa *
+rssb_lockstep_select_isa(void)
+{
+  unsigned int i;
+
+  if (g_rssb_lockstep_forced != NULL)
+    return g_rssb_lockstep_forced;
+
+  for (i = 0; !rssb_lockstep_runs(i); ++i);
+
+  return g_rssb_lockstep_isas + i;
+}
+
+/*
+ * Makes lockstep use the kernel named `name' (as rssb_lockstep_isa
+ * gives it) rather than the best this CPU runs. Fails if there is no
+ * such kernel in this build or this CPU cannot run it.
+ */
+BOOL
+rssb_lockstep_force_isa(const char *name)
+{
+  unsigned int i;
+
+  for (i = 0; i < RSSB_LOCKSTEP_ISA_COUNT; ++i)
+    if (strcmp(g_rssb_lockstep_isas[i].name, name) == 0) {
+      if (!rssb_lockstep_runs(i))
+        return FALSE;
+
+      g_rssb_lockstep_forced = g_rssb_lockstep_isas + i;
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+unsigned int
+rssb_lockstep_width(void)
+{
+  return rssb_lockstep_select_isa()->width;
+}
+
+const char *
+rssb_lockstep_isa(void)
+{
+  return rssb_lockstep_select_isa()->name;
+}
+
+void
+rssb_lockstep_destroy(rssb_lockstep_t *ls)
+{
+  unsigned int i;
+
+  for (i = 0; i < ls->lane_count; ++i)
+    if (ls->lanes[i].vm != NULL)
+      rssb_vm_destroy(ls->lanes[i].vm);
+
+  if (ls->mem != NULL)
+    munmap(ls->mem, ls->mem_bytes);
+
+  if (ls->pages != NULL)
+    free(ls->pages);
+
+  free(ls);
+}
+
+rssb_lockstep_t *
+rssb_lockstep_new(const rssb_vm_t *base, unsigned int lanes)
+{
+  rssb_lockstep_t *new = NULL;
+  uint32_t *column;
+  word_t addr, first, last, word;
+  size_t i;
+  unsigned int j;
+  void *mem;
+
+  if (lanes == 0 || lanes > rssb_lockstep_width()) {
+    fprintf(stderr, "%s: invalid lane count %u\n", __FUNCTION__, lanes);
+    return NULL;
+  }
+
+  TRYCATCH(new = calloc(1, sizeof(rssb_lockstep_t)), goto fail);
+
+  new->base       = base;
+  new->width      = rssb_lockstep_width();
+  new->lane_count = lanes;
+  new->word_mask  = base->word_size == 4
+      ? 0xffffffff
+      : (1U << (8 * base->word_size)) - 1;
+  new->mem_bytes  = (size_t) base->mem_size * new->width * sizeof(uint32_t);
+  new->page_count =
+      (base->mem_size + (1 << RSSB_LOCKSTEP_PAGE_BITS) - 1)
+      >> RSSB_LOCKSTEP_PAGE_BITS;
+
+  /* Like VM memory: reserved here, committed as lanes touch it */
+  if ((mem = mmap(
+      NULL,
+      new->mem_bytes,
+      PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+      -1,
+      0)) == MAP_FAILED) {
+    fprintf(stderr, "%s: cannot reserve lane memory\n", __FUNCTION__);
+    goto fail;
+  }
+
+  new->mem = mem;
+
+  TRYCATCH(new->pages = calloc(new->page_count, 1), goto fail);
+
+  /* Every lane starts from the words the base image has written */
+  for (i = 0; i < base->page_count; ++i) {
+    if (!(base->pages[i] & RSSB_VM_PAGE_USED))
+      continue;
+
+    first = i << base->page_shift;
+    last  = first + (1 << base->page_shift);
+    if (last > base->mem_size)
+      last = base->mem_size;
+
+    for (addr = first; addr < last; ++addr) {
+      if ((word = rssb_vm_peek(base, addr)) == 0)
+        continue;
+
+      column = new->mem + (size_t) addr * new->width;
+      for (j = 0; j < new->width; ++j)
+        column[j] = word;
+      new->pages[addr >> RSSB_LOCKSTEP_PAGE_BITS] = 1;
+    }
+  }
+
+  return new;
+
+fail:
+  if (new != NULL)
+    rssb_lockstep_destroy(new);
+
+  return NULL;
+}
+
+void
+rssb_lockstep_set_io(
+    rssb_lockstep_t *ls,
+    unsigned int lane,
+    void *private,
+    rssb_vm_input_t input,
+    rssb_vm_output_t output)
+{
+  ls->lanes[lane].private = private;
+  ls->lanes[lane].input   = input;
+  ls->lanes[lane].output  = output;
+}
+
+/*
+ * Runs until every lane has halted, failed or left lockstep. Lanes
+ * that left carry a VM in `vm' to be finished with rssb_vm_run.
+ */
+void
+rssb_lockstep_run(rssb_lockstep_t *ls)
+{
+  (rssb_lockstep_select_isa()->loop) (ls);
+}
@@ -0,0 +1,74 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _RSSB_LOCKSTEP_H
+#define _RSSB_LOCKSTEP_H
+
+#include <stdint.h>
+
+#include "rssb.h"
+
+#define RSSB_LOCKSTEP_MAX_LANES 16
+#define RSSB_LOCKSTEP_PAGE_BITS 10 /* Addresses per written-page flag */
+
+struct rssb_lockstep_lane {
+  void *private;
+  rssb_vm_input_t input;
+  rssb_vm_output_t output;
+
+  BOOL halted;    /* Finished in lockstep. `ok' tells how */
+  BOOL ok;
+  rssb_vm_t *vm;  /* Left lockstep: resume it with rssb_vm_run */
+  uint64_t steps; /* Steps taken in lockstep */
+};
+
+/*
+ * Several instances of the same image, run as the lanes of a vector
+ * while they follow the same instruction stream. Memory is laid out
+ * lane-interleaved, so an operand of every lane is a single vector
+ * load. A lane whose $IP or operand differs from the majority leaves
+ * lockstep as a regular VM.
+ */
+typedef struct rssb_lockstep {
+  const rssb_vm_t *base;
+  unsigned int width;      /* Lanes per vector */
+  unsigned int lane_count; /* Lanes in use */
+  word_t word_mask;        /* Storage width of a memory word */
+  uint32_t *mem;           /* Word `addr' of lane `l' at mem[addr * width + l] */
+  size_t mem_bytes;
+  uint8_t *pages;          /* Address pages ever written, by any lane */
+  size_t page_count;
+  struct rssb_lockstep_lane lanes[RSSB_LOCKSTEP_MAX_LANES];
+} rssb_lockstep_t;
+
+unsigned int rssb_lockstep_width(void);
+const char *rssb_lockstep_isa(void);
+BOOL rssb_lockstep_force_isa(const char *name);
+rssb_lockstep_t *rssb_lockstep_new(const rssb_vm_t *base, unsigned int lanes);
+void rssb_lockstep_set_io(
+    rssb_lockstep_t *ls,
+    unsigned int lane,
+    void *private,
+    rssb_vm_input_t input,
+    rssb_vm_output_t output);
+void rssb_lockstep_run(rssb_lockstep_t *ls);
+void rssb_lockstep_destroy(rssb_lockstep_t *ls);
+
+#endif /* _RSSB_LOCKSTEP_H */
@@ -0,0 +1,175 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+/*
+ * Lockstep kernel. Like vm_loop.h, this file has no include guard:
+ * lockstep.c includes it once per instruction set, with
+ *
+ *   RSSB_LOCKSTEP_LOOP_NAME   Name of the generated function
+ *   RSSB_LOCKSTEP_LOOP_LANES  Lanes per vector
+ *   RSSB_LOCKSTEP_LOOP_MASK   Bit mask of the lanes set in a vector
+ *                             comparison result
+ *
+ * and the matching `#pragma GCC target' in effect. Vectors are GCC
+ * vector extensions, so the same code becomes AVX-512, AVX2, SSE2 or
+ * plain scalar code depending on the target.
+ *
+ * Only plain memory operands are handled as vectors. Register operands
+ * go lane by lane through rssb_lockstep_registers. Lanes that disagree
+ * on an operand or on the next $IP are split off to scalar VMs, and so
+ * is everything the scalar loop would report as a fault.
+ */
+
+PRIVATE void
+RSSB_LOCKSTEP_LOOP_NAME(rssb_lockstep_t *ls)
+{
+  typedef uint32_t vec_t
+      __attribute__((vector_size(4 * RSSB_LOCKSTEP_LOOP_LANES)));
+  vec_t *mem = (vec_t *) ls->mem;
+  uint8_t *pages = ls->pages;
+  const word_t mask = ls->base->mem_mask;
+  const word_t neg_mask = ls->base->mem_neg_mask;
+  const word_t word_mask = ls->word_mask;
+  const word_t size = ls->base->mem_size;
+  const BOOL dumb = ls->base->dumb_mode;
+  uint32_t ips[RSSB_LOCKSTEP_LOOP_LANES];
+  uint32_t accs[RSSB_LOCKSTEP_LOOP_LANES];
+  uint32_t addrs[RSSB_LOCKSTEP_LOOP_LANES];
+  vec_t acc, vaddr, word, result;
+  word_t ip, pc, addr;
+  uint64_t steps = 0;
+  unsigned int lanes, prev, lead, skips, i;
+
+  ip  = rssb_vm_peek(ls->base, RSSB_ADDR_IP) & word_mask;
+  acc = (vec_t) {0} + (rssb_vm_peek(ls->base, RSSB_ADDR_A) & word_mask);
+  lanes = (1U << ls->lane_count) - 1;
+
+  while (lanes != 0) {
+    memcpy(accs, &acc, sizeof(vec_t));
+
+    /* A lane on its own runs faster in the scalar loop */
+    if ((lanes & (lanes - 1)) == 0) {
+      rssb_lockstep_eject_all(ls, lanes, ip, accs, steps);
+      break;
+    }
+
+    lead = __builtin_ctz(lanes);
+
+    for (;;) {
+      if (ip == 2 && (RSSB_LOCKSTEP_LOOP_MASK(acc == 1) & lanes)) {
+        memcpy(accs, &acc, sizeof(vec_t));
+        lanes = rssb_lockstep_halt(ls, lanes, accs, steps);
+        break;
+      }
+
+      pc = ip & mask;
+      if (pc < RSSB_ADDR_MIN || pc >= size) {
+        memcpy(accs, &acc, sizeof(vec_t));
+        rssb_lockstep_eject_all(ls, lanes, ip, accs, steps);
+        lanes = 0;
+        break;
+      }
+
+      /* The lead lane's copy is already in cache: no vector extract */
+      vaddr = mem[pc] & mask;
+      addr  = ls->mem[pc * RSSB_LOCKSTEP_LOOP_LANES + lead] & mask;
+
+      if (RSSB_LOCKSTEP_LOOP_MASK(vaddr != addr) & lanes) {
+        memcpy(accs, &acc, sizeof(vec_t));
+        memcpy(addrs, &vaddr, sizeof(vec_t));
+        for (i = 0; i < RSSB_LOCKSTEP_LOOP_LANES; ++i)
+          ips[i] = ip;
+        lanes = rssb_lockstep_split(ls, lanes, addrs, ips, accs, steps);
+        break;
+      }
+
+      if (addr >= size) {
+        memcpy(accs, &acc, sizeof(vec_t));
+        rssb_lockstep_eject_all(ls, lanes, ip, accs, steps);
+        lanes = 0;
+        break;
+      }
+
+      ++steps;
+
+      /* Common case: a plain memory operand, all lanes at once */
+      if (addr >= RSSB_ADDR_MIN) {
+        word   = mem[addr] & mask;
+        result = (word - (acc & mask)) & word_mask;
+
+        if (dumb)
+          skips = RSSB_LOCKSTEP_LOOP_MASK((result & neg_mask) != 0) & lanes;
+        else
+          skips = RSSB_LOCKSTEP_LOOP_MASK((acc & mask) > word) & lanes;
+
+        acc       = result;
+        mem[addr] = result;
+        pages[addr >> RSSB_LOCKSTEP_PAGE_BITS] = 1;
+
+        if (skips == 0) {
+          ip = (ip + 1) & word_mask;
+          continue;
+        }
+
+        if (skips == lanes) {
+          ip = (ip + 2) & word_mask;
+          continue;
+        }
+
+        memcpy(accs, &acc, sizeof(vec_t));
+        for (i = 0; i < RSSB_LOCKSTEP_LOOP_LANES; ++i)
+          ips[i] = (ip + 1 + ((skips >> i) & 1)) & word_mask;
+        lanes = rssb_lockstep_split(ls, lanes, ips, ips, accs, steps);
+        ip = ips[__builtin_ctz(lanes)];
+        break;
+      }
+
+      /* Registers: $IN and $OUT belong to each lane */
+      prev = lanes;
+      memcpy(accs, &acc, sizeof(vec_t));
+      lanes = rssb_lockstep_registers(ls, lanes, addr, ip, ips, accs, steps);
+      memcpy(&acc, accs, sizeof(vec_t));
+
+      if (lanes == 0)
+        break;
+
+      lead = __builtin_ctz(lanes);
+      for (i = lead + 1; i < RSSB_LOCKSTEP_LOOP_LANES; ++i)
+        if (((lanes >> i) & 1) && ips[i] != ips[lead])
+          break;
+
+      if (i < RSSB_LOCKSTEP_LOOP_LANES) {
+        lanes = rssb_lockstep_split(ls, lanes, ips, ips, accs, steps);
+        ip = ips[__builtin_ctz(lanes)];
+        break;
+      }
+
+      ip = ips[lead];
+
+      /* Lanes that failed on $OUT are gone */
+      if (lanes != prev)
+        break;
+    }
+  }
+}
+
+#undef RSSB_LOCKSTEP_LOOP_NAME
+#undef RSSB_LOCKSTEP_LOOP_LANES
+#undef RSSB_LOCKSTEP_LOOP_MASK
@@ -0,0 +1,206 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+
+#include "loopcheck.h"
+
+rssb_loop_check_t *
+rssb_loop_check_new(uint64_t every)
+{
+  rssb_loop_check_t *new = NULL;
+
+  TRYCATCH(new = calloc(1, sizeof(rssb_loop_check_t)), return NULL);
+
+  new->every = every > 0 ? every : RSSB_LOOP_CHECK_DEFAULT_EVERY;
+
+  return new;
+}
+
+PRIVATE const uint8_t *
+rssb_loop_check_page(const rssb_vm_t *vm, size_t page)
+{
+  return (const uint8_t *) vm->mem + (page << RSSB_VM_PAGE_SHIFT);
+}
+
+PRIVATE BOOL
+rssb_loop_check_snapshot(rssb_loop_check_t *check, const rssb_vm_t *vm)
+{
+  size_t i, count = 0;
+  size_t *pages;
+  uint8_t *data;
+
+  for (i = 0; i < vm->page_count; ++i)
+    count += !!(vm->pages[i] & RSSB_VM_PAGE_USED);
+
+  if (count > check->snap_alloc) {
+    TRYCATCH(
+        pages = realloc(check->snap_pages, count * sizeof(size_t)),
+        goto fail);
+    check->snap_pages = pages;
+
+    TRYCATCH(
+        data = realloc(check->snap_data, count << RSSB_VM_PAGE_SHIFT),
+        goto fail);
+    check->snap_data = data;
+
+    check->snap_alloc = count;
+  }
+
+  check->snap_count = 0;
+  for (i = 0; i < vm->page_count; ++i)
+    if (vm->pages[i] & RSSB_VM_PAGE_USED) {
+      check->snap_pages[check->snap_count] = i;
+      memcpy(
+          check->snap_data + (check->snap_count++ << RSSB_VM_PAGE_SHIFT),
+          rssb_loop_check_page(vm, i),
+          RSSB_VM_PAGE_SIZE);
+    }
+
+  return TRUE;
+
+fail:
+  check->snap_count = SIZE_MAX;
+
+  return FALSE;
+}
+
+PRIVATE BOOL
+rssb_loop_check_page_is_zero(const uint8_t *data)
+{
+  return data[0] == 0 && memcmp(data, data + 1, RSSB_VM_PAGE_SIZE - 1) == 0;
+}
+
+/* Is memory exactly as in the snapshot? */
+PRIVATE BOOL
+rssb_loop_check_matches(const rssb_loop_check_t *check, const rssb_vm_t *vm)
+{
+  size_t i, j = 0;
+
+  if (check->snap_count == SIZE_MAX)
+    return FALSE;
+
+  for (i = 0; i < vm->page_count; ++i) {
+    if (j < check->snap_count && check->snap_pages[j] == i) {
+      if (memcmp(
+          check->snap_data + (j++ << RSSB_VM_PAGE_SHIFT),
+          rssb_loop_check_page(vm, i),
+          RSSB_VM_PAGE_SIZE) != 0)
+        return FALSE;
+    } else if ((vm->pages[i] & RSSB_VM_PAGE_USED)
+        && !rssb_loop_check_page_is_zero(rssb_loop_check_page(vm, i))) {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+PRIVATE void
+rssb_loop_check_save(rssb_loop_check_t *check, const rssb_vm_t *vm)
+{
+  check->saved = rssb_loop_check_state(
+      check->hash,
+      rssb_vm_peek(vm, RSSB_ADDR_IP),
+      rssb_vm_peek(vm, RSSB_ADDR_A));
+  check->start = vm->stats.steps;
+  check->next  = check->start + check->power;
+  check->io    = vm->stats.inputs + vm->stats.outputs;
+  check->lo    = (word_t) -1;
+  check->hi    = 0;
+  check->armed = TRUE;
+
+  (void) rssb_loop_check_snapshot(check, vm);
+}
+
+/*
+ * Hashes memory from scratch and starts over. Needed whenever memory
+ * changed behind the VM's back, as when it is attached.
+ */
+void
+rssb_loop_check_reset(rssb_loop_check_t *check, const rssb_vm_t *vm)
+{
+  word_t addr, end, per_page = RSSB_VM_PAGE_SIZE / vm->word_size;
+  size_t i;
+
+  check->hash = 0;
+
+  for (i = 0; i < vm->page_count; ++i)
+    if (vm->pages[i] & RSSB_VM_PAGE_USED) {
+      end = (i + 1) * per_page;
+      for (addr = i * per_page; addr < end && addr < vm->mem_size; ++addr)
+        if (addr >= RSSB_ADDR_IN)
+          check->hash += rssb_vm_peek(vm, addr) * rssb_loop_check_key(addr);
+    }
+
+  check->power = check->every;
+
+  rssb_loop_check_save(check, vm);
+}
+
+/* Called at step `next': moves the saved state here */
+void
+rssb_loop_check_advance(rssb_loop_check_t *check, const rssb_vm_t *vm)
+{
+  /* I/O is progress: only stretches without it can loop forever */
+  if (!check->armed || vm->stats.inputs + vm->stats.outputs != check->io)
+    check->power = check->every;
+  else
+    check->power <<= 1;
+
+  rssb_loop_check_save(check, vm);
+}
+
+/*
+ * Called when the VM finds the saved state hash again. Returns TRUE if
+ * the state really repeats, with no I/O in between.
+ */
+BOOL
+rssb_loop_check_confirm(rssb_loop_check_t *check, const rssb_vm_t *vm)
+{
+  if (vm->stats.inputs + vm->stats.outputs != check->io) {
+    /* Not a loop. Wait for the next save to look again */
+    check->armed = FALSE;
+    return FALSE;
+  }
+
+  if (!rssb_loop_check_matches(check, vm))
+    return FALSE;
+
+  check->period = vm->stats.steps - check->start;
+  check->first  = check->lo;
+  check->last   = check->hi;
+
+  return TRUE;
+}
+
+void
+rssb_loop_check_destroy(rssb_loop_check_t *check)
+{
+  if (check->snap_pages != NULL)
+    free(check->snap_pages);
+
+  if (check->snap_data != NULL)
+    free(check->snap_data);
+
+  free(check);
+}
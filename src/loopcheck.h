@@ -0,0 +1,91 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+
+#ifndef _RSSB_LOOPCHECK_H
+#define _RSSB_LOOPCHECK_H
+
+#include <stdint.h>
+
+#include "rssb.h"
+
+#define RSSB_LOOP_CHECK_DEFAULT_EVERY (1 << 20)
+
+/*
+ * Non-termination detector. The VM keeps `hash' up to date on every
+ * store, as the sum of value * rssb_loop_check_key(addr) over memory
+ * from $IN up, so the hash of the whole state costs a few operations.
+ * It compares it after every step against a saved state, which Brent's
+ * algorithm moves forward after `every', 2 * `every', 4 * `every'...
+ * steps, so any loop is found within a small multiple of its length
+ * plus the steps it took to get there. Any I/O starts over.
+ *
+ * A match is confirmed against a copy of memory taken along with the
+ * saved state, so a hash collision cannot stop a program that is
+ * making progress.
+ */
+typedef struct rssb_loop_check {
+  uint64_t every;
+  uint64_t hash;
+  word_t lo, hi;        /* $IP range since `saved', kept by the VM */
+
+  BOOL armed;           /* `saved' is valid */
+  uint64_t saved;       /* State hash at step `start' */
+  uint64_t start;
+  uint64_t power;
+  uint64_t next;        /* start + power, when `saved' moves forward */
+  uint64_t io;          /* $IN reads plus $OUT writes at `start' */
+
+  /* Memory at `start': used pages only */
+  size_t *snap_pages;
+  uint8_t *snap_data;
+  size_t snap_count;
+  size_t snap_alloc;
+
+  /* Set once a loop is found */
+  uint64_t period;      /* A multiple of the loop period, in steps */
+  word_t first;
+  word_t last;
+} rssb_loop_check_t;
+
+static inline uint64_t
+rssb_loop_check_key(word_t addr)
+{
+  uint64_t x = (addr + 1) * 0x9e3779b97f4a7c15ull;
+
+  return (x ^ (x >> 31)) | 1;
+}
+
+/* Hash of memory plus the registers, as the VM compares it */
+static inline uint64_t
+rssb_loop_check_state(uint64_t hash, word_t ip, word_t a)
+{
+  return hash
+    + ip * rssb_loop_check_key(RSSB_ADDR_IP)
+    + a * rssb_loop_check_key(RSSB_ADDR_A);
+}
+
+rssb_loop_check_t *rssb_loop_check_new(uint64_t every);
+void rssb_loop_check_reset(rssb_loop_check_t *check, const rssb_vm_t *vm);
+void rssb_loop_check_advance(rssb_loop_check_t *check, const rssb_vm_t *vm);
+BOOL rssb_loop_check_confirm(rssb_loop_check_t *check, const rssb_vm_t *vm);
+void rssb_loop_check_destroy(rssb_loop_check_t *check);
+
+#endif /* _RSSB_LOOPCHECK_H */
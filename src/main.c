@@ -3,55 +3,1418 @@
  * Creation date: Sat Oct  6 20:01:54 2018
  */
 
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE /* accept4 */
+#endif /* _GNU_SOURCE */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <getopt.h>
+#include <signal.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 
 #include "parser.h"
+#include "profile.h"
+#include "trace.h"
+#include "perf.h"
+#include "batch.h"
+#include "lockstep.h"
+#include "host.h"
+#include "serve.h"
+#include "pipeline.h"
+#include "async.h"
+#include "mapio.h"
+#include "replay.h"
+#include "loopcheck.h"
+#include "regions.h"
+
+#define RSSB_MEMORY_DEFAULT_SIZE 65536
+#define RSSB_TRACE_DEFAULT_OUTPUT "rssb.trace"
+
+struct rssb_options {
+  uint64_t memory_size;
+  enum rssb_vm_backing backing;
+  BOOL profile;
+  enum rssb_profile_view profile_view;
+  const char *profile_output;
+  const char *debug_info;
+  BOOL disas;
+  BOOL regions;
+  uint64_t trace_size;
+  const char *trace_output;
+  const char *trace_decode;
+  BOOL stats;
+  const char *checkpoint;
+  uint64_t checkpoint_every;
+  uint64_t max_steps;
+  const char *restore;
+  const char *preinit;
+  const char *preinit_stop;
+  const char *batch;
+  const char *batch_output;
+  unsigned int jobs;
+  BOOL lockstep;
+  BOOL io_uring;
+  const char *listen;
+  const char *serve;
+  struct strlist *pipe_to;
+  BOOL pipe_spin;
+  BOOL async_output;
+  enum rssb_async_mode async_mode;
+  const char *input_file;
+  const char *output_file;
+  const char *record_input;
+  const char *replay_input;
+  uint64_t loop_check;
+};
+
+PRIVATE const char *g_backing_names[] = {
+  "default pages",
+  "transparent huge pages",
+  "explicit huge pages"
+};
+
+PRIVATE void
+help(const char *argv0)
+{
+  fprintf(stderr, "Usage:\n");
+  fprintf(stderr, "  %s [options] file1.rssb [file2.rssb [...]]\n\n", argv0);
+  fprintf(stderr, "Options:\n\n");
+  fprintf(stderr, "  -m, --memory=WORDS        VM memory size in words (default %d,\n", RSSB_MEMORY_DEFAULT_SIZE);
+  fprintf(stderr, "                            at most 2G). Accepts k, M and G\n");
+  fprintf(stderr, "                            suffixes. Pages are committed on use\n");
+  fprintf(stderr, "  -H, --huge-pages[=MODE]   Back VM memory with 2 MiB pages. MODE is\n");
+  fprintf(stderr, "                            `transparent' (default, madvise) or\n");
+  fprintf(stderr, "                            `explicit' (MAP_HUGETLB, needs reserved\n");
+  fprintf(stderr, "                            pages). Falls back to smaller pages\n");
+  fprintf(stderr, "  -p, --profile[=VIEW]      Count executed steps per address and print\n");
+  fprintf(stderr, "                            a report on exit. VIEW is one of `flat'\n");
+  fprintf(stderr, "                            (default), `tree' or `collapsed'\n");
+  fprintf(stderr, "  -P, --profile-output=FILE Write the profile report to FILE instead\n");
+  fprintf(stderr, "                            of stderr\n");
+  fprintf(stderr, "  -g, --debug-info=FILE     Save the address to source map of the\n");
+  fprintf(stderr, "                            assembled image to FILE\n");
+  fprintf(stderr, "  -d, --disas               Print the assembled image with source\n");
+  fprintf(stderr, "                            annotations and exit\n");
+  fprintf(stderr, "  -R, --regions             Print which words of the assembled image\n");
+  fprintf(stderr, "                            are code, data or may be written, and\n");
+  fprintf(stderr, "                            exit. With -d, tag the disassembly\n");
+  fprintf(stderr, "  -t, --trace[=N]           Keep the last N executed steps (default\n");
+  fprintf(stderr, "                            %d) in memory. They are dumped on exit,\n", RSSB_TRACE_DEFAULT_SIZE);
+  fprintf(stderr, "                            on SIGUSR1 and on fatal signals\n");
+  fprintf(stderr, "  -T, --trace-output=FILE   Dump traces to FILE (default %s)\n", RSSB_TRACE_DEFAULT_OUTPUT);
+  fprintf(stderr, "      --loop-check[=N]      Stop the program if its state repeats\n");
+  fprintf(stderr, "                            without I/O in between. Checks start\n");
+  fprintf(stderr, "                            after N steps (default %d)\n", RSSB_LOOP_CHECK_DEFAULT_EVERY);
+  fprintf(stderr, "      --trace-decode=FILE   Print a trace dump as text and exit. Use\n");
+  fprintf(stderr, "                            -g to annotate it with a saved source map\n");
+  fprintf(stderr, "  -s, --stats               Print execution statistics on exit,\n");
+  fprintf(stderr, "                            including hardware counters per\n");
+  fprintf(stderr, "                            executed instruction when available\n");
+  fprintf(stderr, "      --async-output[=MODE] Write $OUT from a separate thread, in\n");
+  fprintf(stderr, "                            batches. MODE is `free' (default) or\n");
+  fprintf(stderr, "                            `ordered', which lets all output out\n");
+  fprintf(stderr, "                            before every $IN read\n");
+  fprintf(stderr, "      --input-file=FILE     Map FILE into memory and read $IN from\n");
+  fprintf(stderr, "                            it instead of the standard input\n");
+  fprintf(stderr, "      --output-file=FILE    Write $OUT to FILE through a growing\n");
+  fprintf(stderr, "                            memory mapping instead of the standard\n");
+  fprintf(stderr, "                            output\n");
+  fprintf(stderr, "      --record-input=FILE   Log every $IN read, with the step it\n");
+  fprintf(stderr, "                            happens at, to FILE\n");
+  fprintf(stderr, "      --replay-input=FILE   Feed $IN from a log saved with\n");
+  fprintf(stderr, "                            --record-input instead of the standard\n");
+  fprintf(stderr, "                            input\n");
+  fprintf(stderr, "  -c, --checkpoint=FILE     Save the VM state to FILE when the run\n");
+  fprintf(stderr, "                            ends. If FILE is the checkpoint given\n");
+  fprintf(stderr, "                            to --restore, only changed pages are\n");
+  fprintf(stderr, "                            appended to it\n");
+  fprintf(stderr, "      --checkpoint-every=N  Also save the checkpoint every N steps\n");
+  fprintf(stderr, "                            (k, M and G suffixes accepted)\n");
+  fprintf(stderr, "      --max-steps=N         Stop the program with an error after N\n");
+  fprintf(stderr, "                            steps\n");
+  fprintf(stderr, "  -r, --restore=FILE        Resume from a checkpoint instead of\n");
+  fprintf(stderr, "                            assembling source files. --input-file,\n");
+  fprintf(stderr, "                            --output-file and a file on standard\n");
+  fprintf(stderr, "                            input resume where the checkpoint was\n");
+  fprintf(stderr, "      --preinit=FILE        Run the program up to its first $IN or\n");
+  fprintf(stderr, "                            $OUT access and save the VM state to\n");
+  fprintf(stderr, "                            FILE, to be started with --restore\n");
+  fprintf(stderr, "      --preinit-stop=LABEL  Stop preinitialization earlier, when\n");
+  fprintf(stderr, "                            $IP reaches LABEL (or an address)\n");
+  fprintf(stderr, "      --batch=LIST          Run the program once per input file named\n");
+  fprintf(stderr, "                            in LIST (one per line, - for stdin),\n");
+  fprintf(stderr, "                            writing $OUT of each to INPUT.out\n");
+  fprintf(stderr, "      --batch-output=DIR    Write batch outputs to DIR instead\n");
+  fprintf(stderr, "      --listen=PATH         Serve the program on the Unix socket PATH:\n");
+  fprintf(stderr, "                            every connection runs its own copy, with\n");
+  fprintf(stderr, "                            $IN and $OUT on the socket\n");
+  fprintf(stderr, "      --pipe-to=FILES       Pipe $OUT into the program assembled\n");
+  fprintf(stderr, "                            from FILES (comma-separated), which\n");
+  fprintf(stderr, "                            runs on its own thread. Repeat to\n");
+  fprintf(stderr, "                            chain more stages\n");
+  fprintf(stderr, "      --pipe-spin           Busy-wait between pipeline stages\n");
+  fprintf(stderr, "                            instead of sleeping\n");
+  fprintf(stderr, "      --serve=PATH          Run as a daemon on the Unix socket PATH,\n");
+  fprintf(stderr, "                            assembling the programs that clients\n");
+  fprintf(stderr, "                            send (and caching the result) and\n");
+  fprintf(stderr, "                            running each request in a fresh copy\n");
+  fprintf(stderr, "  -j, --jobs=N              Run up to N batch inputs at once, or\n");
+  fprintf(stderr, "                            serve --listen or --serve from N threads\n");
+  fprintf(stderr, "                            (default: one per online CPU)\n");
+  fprintf(stderr, "      --lockstep[=ISA]      Run batch inputs in groups, as the SIMD\n");
+  fprintf(stderr, "                            lanes of one VM while they execute the\n");
+  fprintf(stderr, "                            same instructions. ISA picks the kernel\n");
+  fprintf(stderr, "                            (avx512f, avx2, sse2 or scalar) instead\n");
+  fprintf(stderr, "                            of the best this CPU runs\n");
+  fprintf(stderr, "      --io-uring            Keep many batch inputs in flight per\n");
+  fprintf(stderr, "                            thread, reading and writing their files\n");
+  fprintf(stderr, "                            through io_uring\n");
+  fprintf(stderr, "  -h, --help                This help\n\n");
+}
+
+PRIVATE BOOL
+parse_profile_view(const char *name, enum rssb_profile_view *view)
+{
+  if (name == NULL || strcmp(name, "flat") == 0)
+    *view = RSSB_PROFILE_VIEW_FLAT;
+  else if (strcmp(name, "tree") == 0)
+    *view = RSSB_PROFILE_VIEW_TREE;
+  else if (strcmp(name, "collapsed") == 0)
+    *view = RSSB_PROFILE_VIEW_COLLAPSED;
+  else
+    return FALSE;
+
+  return TRUE;
+}
+
+PRIVATE BOOL
+parse_async_mode(const char *name, enum rssb_async_mode *mode)
+{
+  if (name == NULL || strcmp(name, "free") == 0)
+    *mode = RSSB_ASYNC_MODE_FREE;
+  else if (strcmp(name, "ordered") == 0)
+    *mode = RSSB_ASYNC_MODE_ORDERED;
+  else
+    return FALSE;
+
+  return TRUE;
+}
+
+PRIVATE BOOL
+parse_backing(const char *name, enum rssb_vm_backing *backing)
+{
+  if (name == NULL || strcmp(name, "transparent") == 0)
+    *backing = RSSB_VM_BACKING_THP;
+  else if (strcmp(name, "explicit") == 0)
+    *backing = RSSB_VM_BACKING_HUGETLB;
+  else
+    return FALSE;
+
+  return TRUE;
+}
+
+PRIVATE BOOL
+parse_count(const char *string, uint64_t *count)
+{
+  char *end;
+  unsigned long long value;
+
+  errno = 0;
+  value = strtoull(string, &end, 0);
+
+  if (errno != 0 || end == string)
+    return FALSE;
+
+  switch (*end) {
+    case 'k':
+    case 'K':
+      value <<= 10;
+      ++end;
+      break;
+
+    case 'm':
+    case 'M':
+      value <<= 20;
+      ++end;
+      break;
+
+    case 'g':
+    case 'G':
+      value <<= 30;
+      ++end;
+      break;
+  }
+
+  if (*end != '\0' || value == 0)
+    return FALSE;
+
+  *count = value;
+
+  return TRUE;
+}
+
+PRIVATE int
+decode_trace(const char *argv0, const struct rssb_options *opts)
+{
+  rssb_dbginfo_t *dbg = NULL;
+  BOOL ok;
+
+  if (opts->debug_info != NULL
+      && (dbg = rssb_dbginfo_load(opts->debug_info)) == NULL) {
+    fprintf(stderr, "%s: failed to load debug info\n", argv0);
+    return EXIT_FAILURE;
+  }
+
+  ok = rssb_trace_decode(opts->trace_decode, dbg, stdout);
+
+  if (dbg != NULL)
+    rssb_dbginfo_destroy(dbg);
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+PRIVATE void
+print_counters(const rssb_perf_t *perf, uint64_t steps)
+{
+  struct rssb_perf_sample sample;
+  unsigned int i;
+
+  if (perf == NULL || !rssb_perf_available(perf)) {
+    fprintf(stderr, "  Hardware counters:    unavailable\n");
+    return;
+  }
+
+  rssb_perf_read(perf, &sample);
+
+  for (i = 0; i < RSSB_PERF_COUNTER_COUNT; ++i)
+    if (sample.valid[i])
+      fprintf(
+          stderr,
+          "  %s:%*s %" PRIu64 " (%.2f per instruction)\n",
+          rssb_perf_counter_name(i),
+          (int) (20 - strlen(rssb_perf_counter_name(i))),
+          "",
+          sample.value[i],
+          steps > 0 ? (double) sample.value[i] / steps : 0);
+
+  if (sample.valid[RSSB_PERF_CYCLES]
+      && sample.valid[RSSB_PERF_INSTRUCTIONS]
+      && sample.value[RSSB_PERF_CYCLES] > 0)
+    fprintf(
+        stderr,
+        "  IPC:                  %.3f\n",
+        (double) sample.value[RSSB_PERF_INSTRUCTIONS]
+        / sample.value[RSSB_PERF_CYCLES]);
+}
+
+PRIVATE void
+print_stats(const char *argv0, const rssb_vm_t *vm, const rssb_perf_t *perf)
+{
+  struct rssb_vm_stats stats;
+  double seconds;
+
+  rssb_vm_get_stats(vm, &stats);
+
+  seconds = stats.wall_time.tv_sec + 1e-6 * stats.wall_time.tv_usec;
+
+  fprintf(stderr, "%s: execution statistics\n", argv0);
+  fprintf(stderr, "  Instructions retired: %" PRIu64 "\n", stats.steps);
+  fprintf(
+      stderr,
+      "  Skips taken:          %" PRIu64 " (%.2f%%)\n",
+      stats.skips,
+      stats.steps > 0 ? 100. * stats.skips / stats.steps : 0);
+  fprintf(stderr, "  $IN reads:            %" PRIu64 "\n", stats.inputs);
+  fprintf(stderr, "  $OUT writes:          %" PRIu64 "\n", stats.outputs);
+  fprintf(stderr, "  $IP writes:           %" PRIu64 "\n", stats.ip_writes);
+  fprintf(stderr, "  Code writes:          %" PRIu64 "\n", stats.code_writes);
+  fprintf(
+      stderr,
+      "  Resident memory:      %zu KiB of %zu KiB\n",
+      rssb_vm_get_resident(vm) >> 10,
+      vm->mem_bytes >> 10);
+  fprintf(
+      stderr,
+      "  Memory backing:       %s, %zu KiB in huge pages\n",
+      g_backing_names[vm->backing],
+      rssb_vm_get_huge_resident(vm) >> 10);
+  fprintf(stderr, "  Wall time:            %.6f s\n", seconds);
+
+  if (seconds > 0)
+    fprintf(
+        stderr,
+        "  Instructions/s:       %.0f\n",
+        stats.steps / seconds);
+
+  print_counters(perf, stats.steps);
+}
+
+PRIVATE const char *g_reason_names[] = {
+  "program halted",
+  "VM fault",
+  "about to read $IN",
+  "about to write $OUT",
+  "reached stop address",
+  "ran out of steps",
+  "stuck in a loop"
+};
+
+_Static_assert(
+    sizeof(g_reason_names) / sizeof(g_reason_names[0]) == RSSB_VM_REASON_COUNT,
+    "g_reason_names must name every enum rssb_vm_reason");
+
+/*
+ * A restored VM has already read vm->stats.in_bytes of its input. When
+ * stdin is a file, skip them. Pipes are left as they are: whoever
+ * feeds them is expected to send the rest only.
+ */
+PRIVATE BOOL
+resume_stdin(const char *argv0, const rssb_vm_t *vm)
+{
+  struct stat sbuf;
+
+  if (vm->stats.in_bytes == 0
+      || fstat(STDIN_FILENO, &sbuf) == -1
+      || !S_ISREG(sbuf.st_mode))
+    return TRUE;
+
+  if ((uint64_t) sbuf.st_size < vm->stats.in_bytes) {
+    fprintf(
+        stderr,
+        "%s: standard input has %" PRIu64 " bytes, but %" PRIu64 " were read\n",
+        argv0,
+        (uint64_t) sbuf.st_size,
+        vm->stats.in_bytes);
+    return FALSE;
+  }
+
+  if (lseek(STDIN_FILENO, vm->stats.in_bytes, SEEK_SET) == -1) {
+    fprintf(stderr, "%s: cannot seek standard input: %s\n", argv0, strerror(errno));
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+PRIVATE BOOL
+parse_stop(const rssb_program_t *program, const char *name, word_t *addr)
+{
+  char *end;
+  unsigned long value;
+
+  errno = 0;
+  value = strtoul(name, &end, 0);
+
+  if (errno == 0 && end != name && *end == '\0') {
+    *addr = value;
+    return TRUE;
+  }
+
+  return rssb_program_lookup_label(program, name, addr);
+}
+
+/*
+ * Runs the deterministic start of the program once and saves where it
+ * got, so that launches can start from there.
+ */
+PRIVATE BOOL
+preinit(
+    const char *argv0,
+    const struct rssb_options *opts,
+    rssb_vm_t *vm,
+    const rssb_program_t *program)
+{
+  enum rssb_vm_reason reason;
+  word_t stop = RSSB_VM_NO_BREAKPOINT;
+
+  if (opts->preinit_stop != NULL
+      && !parse_stop(program, opts->preinit_stop, &stop)) {
+    fprintf(stderr, "%s: unknown preinit stop `%s'\n", argv0, opts->preinit_stop);
+    return FALSE;
+  }
+
+  reason = rssb_vm_run_until(
+      vm,
+      stop,
+      opts->max_steps > 0 ? opts->max_steps : RSSB_VM_UNLIMITED);
+
+  if (reason == RSSB_VM_REASON_FAULT || reason == RSSB_VM_REASON_BUDGET) {
+    fprintf(
+        stderr,
+        "%s: preinitialization stopped after %" PRIu64 " steps: %s\n",
+        argv0,
+        vm->stats.steps,
+        g_reason_names[reason]);
+    return FALSE;
+  }
+
+  fprintf(
+      stderr,
+      "%s: preinitialized %" PRIu64 " steps, %s at 0x%x\n",
+      argv0,
+      vm->stats.steps,
+      g_reason_names[reason],
+      rssb_vm_peek(vm, RSSB_ADDR_IP) & vm->mem_mask);
+
+  if (!rssb_vm_checkpoint(vm, opts->preinit)) {
+    fprintf(stderr, "%s: failed to save %s\n", argv0, opts->preinit);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+PRIVATE struct strlist *
+read_batch_list(const char *argv0, const char *path)
+{
+  struct strlist *list = NULL;
+  FILE *fp = stdin;
+  char *line;
+
+  if (strcmp(path, "-") != 0 && (fp = fopen(path, "r")) == NULL) {
+    fprintf(stderr, "%s: cannot open %s: %s\n", argv0, path, strerror(errno));
+    return NULL;
+  }
+
+  TRYCATCH(list = strlist_new(), goto done);
+
+  while ((line = fread_line(fp)) != NULL) {
+    if (*line != '\0')
+      strlist_append_string(list, line);
+    free(line);
+  }
+
+done:
+  if (fp != stdin)
+    fclose(fp);
+
+  return list;
+}
+
+PRIVATE char *
+batch_output_path(const struct rssb_options *opts, const char *input)
+{
+  const char *base;
+
+  if (opts->batch_output == NULL)
+    return strbuild("%s.out", input);
+
+  if ((base = strrchr(input, '/')) != NULL)
+    ++base;
+  else
+    base = input;
+
+  return strbuild("%s/%s.out", opts->batch_output, base);
+}
+
+PRIVATE rssb_vm_t *
+assemble(
+    const char *argv0,
+    const struct rssb_options *opts,
+    char *const *files,
+    unsigned int count,
+    rssb_program_t **program_out)
+{
+  rssb_program_t *program = NULL;
+  rssb_vm_t *vm = NULL;
+  unsigned int i;
+
+  if ((program = rssb_program_new()) == NULL) {
+    fprintf(stderr, "%s: failed to create program\n", argv0);
+    goto fail;
+  }
+
+  if ((vm = rssb_vm_new_with_backing(opts->memory_size, opts->backing)) == NULL) {
+    fprintf(stderr, "%s: failed to create RSSB VM\n", argv0);
+    goto fail;
+  }
+
+  for (i = 0; i < count; ++i) {
+    if (!rssb_program_load_file(program, files[i])) {
+      fprintf(stderr, "%s: failed to load source file %s\n", argv0, files[i]);
+      goto fail;
+    }
+  }
+
+  if (!rssb_program_compile(program, vm)) {
+    fprintf(stderr, "%s: compilation failed\n", argv0);
+    goto fail;
+  }
+
+  if (program_out != NULL)
+    *program_out = program;
+  else
+    rssb_program_destroy(program);
+
+  return vm;
+
+fail:
+  if (vm != NULL)
+    rssb_vm_destroy(vm);
+
+  if (program != NULL)
+    rssb_program_destroy(program);
+
+  return NULL;
+}
+
+/*
+ * Every input runs in its own clone of `vm', which is never run itself
+ * and acts as the shared starting image.
+ */
+PRIVATE BOOL
+run_batch(const char *argv0, const struct rssb_options *opts, const rssb_vm_t *vm)
+{
+  struct rssb_batch_summary summary;
+  struct strlist *inputs = NULL;
+  char **outputs = NULL;
+  double seconds;
+  unsigned int i;
+  BOOL ok = FALSE;
+
+  if ((inputs = read_batch_list(argv0, opts->batch)) == NULL)
+    goto done;
+
+  if (inputs->strings_count > 0)
+    TRYCATCH(
+        outputs = calloc(inputs->strings_count, sizeof(char *)),
+        goto done);
+
+  for (i = 0; i < inputs->strings_count; ++i)
+    if ((outputs[i] = batch_output_path(opts, inputs->strings_list[i])) == NULL)
+      goto done;
+
+  if (!rssb_batch_run(
+      vm,
+      inputs->strings_list,
+      outputs,
+      inputs->strings_count,
+      opts->jobs,
+      opts->lockstep,
+      opts->io_uring,
+      stderr,
+      &summary))
+    goto done;
+
+  seconds = summary.wall_time.tv_sec + 1e-6 * summary.wall_time.tv_usec;
+
+  fprintf(stderr, "%s: batch summary\n", argv0);
+  fprintf(stderr, "  Inputs:               %u\n", summary.inputs);
+  fprintf(stderr, "  Failures:             %u\n", summary.failures);
+  fprintf(stderr, "  Jobs:                 %u\n", opts->jobs);
+  fprintf(stderr, "  Instructions retired: %" PRIu64 "\n", summary.steps);
+
+  if (opts->lockstep)
+    fprintf(
+        stderr,
+        "  In lockstep:          %" PRIu64 " (%.2f%%, %s, %u lanes)\n",
+        summary.lockstep_steps,
+        summary.steps > 0 ? 100. * summary.lockstep_steps / summary.steps : 0,
+        rssb_lockstep_isa(),
+        rssb_lockstep_width());
+
+  if (opts->io_uring) {
+    fprintf(stderr, "  I/O backend:          %s\n", summary.io_backend);
+    fprintf(stderr, "  I/O syscalls:         %" PRIu64 "\n", summary.io_syscalls);
+    fprintf(
+        stderr,
+        "  Bytes read/written:   %" PRIu64 " / %" PRIu64 "\n",
+        summary.io_read,
+        summary.io_written);
+  }
+
+  fprintf(stderr, "  Wall time:            %.6f s\n", seconds);
+
+  if (seconds > 0) {
+    fprintf(stderr, "  Instructions/s:       %.0f\n", summary.steps / seconds);
+    fprintf(stderr, "  Inputs/s:             %.2f\n", summary.inputs / seconds);
+    if (opts->io_uring)
+      fprintf(
+          stderr,
+          "  I/O throughput:       %.2f MB/s\n",
+          (summary.io_read + summary.io_written) / seconds / 1e6);
+  }
+
+  ok = summary.failures == 0;
+
+done:
+  if (outputs != NULL) {
+    for (i = 0; i < inputs->strings_count; ++i)
+      if (outputs[i] != NULL)
+        free(outputs[i]);
+    free(outputs);
+  }
+
+  if (inputs != NULL)
+    strlist_destroy(inputs);
+
+  return ok;
+}
+
+PRIVATE void
+listen_accept(rssb_host_t *host, int fd, void *private)
+{
+  const rssb_vm_t *base = private;
+  rssb_vm_t *vm;
+  int conn;
+
+  while ((conn = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) != -1) {
+    if ((vm = rssb_vm_clone(base)) == NULL) {
+      close(conn);
+      continue;
+    }
+
+    if (rssb_host_add(host, vm, conn, conn) == NULL) {
+      rssb_vm_destroy(vm);
+      close(conn);
+    }
+  }
+}
+
+/*
+ * Every connection to --listen gets a clone of `vm' reading $IN from
+ * and writing $OUT to the socket. Clones suspend on $IN instead of
+ * blocking, so each of the --jobs threads multiplexes many of them.
+ */
+PRIVATE BOOL
+run_listen(const char *argv0, const struct rssb_options *opts, rssb_vm_t *vm)
+{
+  fprintf(stderr, "%s: listening on %s\n", argv0, opts->listen);
+
+  return rssb_host_serve_unix(opts->listen, opts->jobs, listen_accept, vm);
+}
+
+/*
+ * Stage 0 is a clone of `vm', the others are assembled from --pipe-to.
+ * Only the last stage decides the exit status, as in a shell.
+ */
+PRIVATE BOOL
+run_pipeline(const char *argv0, const struct rssb_options *opts, const rssb_vm_t *vm)
+{
+  rssb_pipeline_t *pipeline = NULL;
+  rssb_vm_t **vms = NULL;
+  arg_list_t *files;
+  unsigned int i, count = opts->pipe_to->strings_count + 1;
+  char *label;
+  BOOL ok = FALSE;
+
+  TRYCATCH(vms = calloc(count, sizeof(rssb_vm_t *)), goto done);
+  TRYCATCH(vms[0] = rssb_vm_clone(vm), goto done);
+
+  for (i = 1; i < count; ++i) {
+    files = csv_split_line(opts->pipe_to->strings_list[i - 1]);
+    vms[i] = assemble(argv0, opts, files->al_argv, files->al_argc, NULL);
+    free_al(files);
+
+    if (vms[i] == NULL)
+      goto done;
+  }
+
+  if ((pipeline = rssb_pipeline_new(vms, count, opts->pipe_spin)) == NULL) {
+    fprintf(stderr, "%s: failed to create pipeline\n", argv0);
+    goto done;
+  }
+
+  ok = rssb_pipeline_run(pipeline);
+
+  for (i = 0; i < count; ++i) {
+    if (pipeline->stages[i].reason != RSSB_VM_REASON_HALTED)
+      fprintf(
+          stderr,
+          "%s: stage %u: %s\n",
+          argv0,
+          i,
+          g_reason_names[pipeline->stages[i].reason]);
+
+    if (opts->stats && (label = strbuild("%s: stage %u", argv0, i)) != NULL) {
+      print_stats(label, pipeline->stages[i].vm, NULL);
+      free(label);
+    }
+  }
 
-#define RSSB_MEMORY_SIZE 65536
+done:
+  if (pipeline != NULL)
+    rssb_pipeline_destroy(pipeline);
+
+  if (vms != NULL) {
+    for (i = 0; i < count; ++i)
+      if (vms[i] != NULL)
+        rssb_vm_destroy(vms[i]);
+    free(vms);
+  }
+
+  return ok;
+}
+
+PRIVATE int
+run_serve(const char *argv0, const struct rssb_options *opts)
+{
+  rssb_serve_t *serve;
+  BOOL ok;
+
+  if ((serve = rssb_serve_new(opts->memory_size, opts->backing)) == NULL) {
+    fprintf(stderr, "%s: failed to create daemon\n", argv0);
+    return EXIT_FAILURE;
+  }
+
+  fprintf(stderr, "%s: serving on %s\n", argv0, opts->serve);
+
+  ok = rssb_serve_run(serve, opts->serve, opts->jobs);
+
+  rssb_serve_destroy(serve);
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * Runs the program in slices of --checkpoint-every steps, saving a
+ * checkpoint between them, for at most --max-steps steps in total.
+ */
+PRIVATE enum rssb_vm_reason
+run(const char *argv0, const struct rssb_options *opts, rssb_vm_t *vm)
+{
+  enum rssb_vm_reason reason;
+  uint64_t left, slice;
+
+  left = opts->max_steps > 0 ? opts->max_steps : RSSB_VM_UNLIMITED;
+
+  for (;;) {
+    slice = left;
+    if (opts->checkpoint_every > 0 && opts->checkpoint_every < slice)
+      slice = opts->checkpoint_every;
+
+    left -= rssb_vm_run_for(vm, slice, &reason);
+
+    if (reason != RSSB_VM_REASON_BUDGET)
+      break;
+
+    if (left == 0) {
+      fprintf(
+          stderr,
+          "%s: stopped after %" PRIu64 " steps at 0x%x\n",
+          argv0,
+          opts->max_steps,
+          rssb_vm_peek(vm, RSSB_ADDR_IP) & vm->mem_mask);
+      break;
+    }
+
+    if (!rssb_vm_checkpoint(vm, opts->checkpoint)) {
+      fprintf(stderr, "%s: failed to save checkpoint\n", argv0);
+      return RSSB_VM_REASON_FAULT;
+    }
+  }
+
+  return reason;
+}
+
+/* Points at the source of a loop found by --loop-check, if known */
+PRIVATE void
+report_loop(
+    const char *argv0,
+    const rssb_loop_check_t *check,
+    const rssb_program_t *program)
+{
+  const struct rssb_dbginfo_loc *first, *last;
+
+  if (program == NULL
+      || (first = rssb_dbginfo_get_loc(program->dbginfo, check->first)) == NULL
+      || (last = rssb_dbginfo_get_loc(program->dbginfo, check->last)) == NULL)
+    return;
+
+  fprintf(
+      stderr,
+      "%s: loop spans %s:%d to %s:%d\n",
+      argv0,
+      first->file,
+      first->line,
+      last->file,
+      last->line);
+}
+
+PRIVATE BOOL
+write_profile(
+    const char *argv0,
+    const struct rssb_options *opts,
+    const rssb_profile_t *prof,
+    const rssb_program_t *program)
+{
+  FILE *fp = stderr;
+  BOOL ok;
+
+  if (opts->profile_output != NULL
+      && (fp = fopen(opts->profile_output, "w")) == NULL) {
+    fprintf(
+        stderr,
+        "%s: cannot open %s: %s\n",
+        argv0,
+        opts->profile_output,
+        strerror(errno));
+    return FALSE;
+  }
+
+  ok = rssb_profile_report(
+      prof,
+      program != NULL ? program->dbginfo : NULL,
+      opts->profile_view,
+      fp);
+
+  if (fp != stderr)
+    fclose(fp);
+
+  return ok;
+}
 
 int
 main (int argc, char *argv[], char *envp[])
 {
   rssb_vm_t *vm = NULL;
   rssb_program_t *program = NULL;
-  unsigned int i;
+  rssb_profile_t *prof = NULL;
+  rssb_trace_t *trace = NULL;
+  rssb_perf_t *perf = NULL;
+  rssb_async_output_t *async = NULL;
+  rssb_mapio_t *mapio = NULL;
+  rssb_replay_t *replay = NULL;
+  rssb_loop_check_t *check = NULL;
+  rssb_regions_t *regions = NULL;
+  struct rssb_options opts;
+  enum rssb_vm_reason reason;
+  BOOL ok;
+  long cpus;
+  int c, status = EXIT_SUCCESS;
+
+  static const struct option long_options[] = {
+    {"memory", required_argument, NULL, 'm'},
+    {"huge-pages", optional_argument, NULL, 'H'},
+    {"profile", optional_argument, NULL, 'p'},
+    {"profile-output", required_argument, NULL, 'P'},
+    {"debug-info", required_argument, NULL, 'g'},
+    {"disas", no_argument, NULL, 'd'},
+    {"regions", no_argument, NULL, 'R'},
+    {"trace", optional_argument, NULL, 't'},
+    {"loop-check", optional_argument, NULL, 'K'},
+    {"trace-output", required_argument, NULL, 'T'},
+    {"trace-decode", required_argument, NULL, 'D'},
+    {"stats", no_argument, NULL, 's'},
+    {"checkpoint", required_argument, NULL, 'c'},
+    {"checkpoint-every", required_argument, NULL, 'E'},
+    {"max-steps", required_argument, NULL, 'M'},
+    {"restore", required_argument, NULL, 'r'},
+    {"preinit", required_argument, NULL, 'I'},
+    {"preinit-stop", required_argument, NULL, 'S'},
+    {"batch", required_argument, NULL, 'B'},
+    {"batch-output", required_argument, NULL, 'O'},
+    {"jobs", required_argument, NULL, 'j'},
+    {"lockstep", optional_argument, NULL, 'L'},
+    {"io-uring", no_argument, NULL, 'U'},
+    {"listen", required_argument, NULL, 'l'},
+    {"serve", required_argument, NULL, 'V'},
+    {"pipe-to", required_argument, NULL, 'e'},
+    {"pipe-spin", no_argument, NULL, 'W'},
+    {"async-output", optional_argument, NULL, 'Q'},
+    {"input-file", required_argument, NULL, 'i'},
+    {"output-file", required_argument, NULL, 'o'},
+    {"record-input", required_argument, NULL, 'y'},
+    {"replay-input", required_argument, NULL, 'Y'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+
+  memset(&opts, 0, sizeof(struct rssb_options));
+  opts.memory_size  = RSSB_MEMORY_DEFAULT_SIZE;
+  opts.trace_output = RSSB_TRACE_DEFAULT_OUTPUT;
+  opts.jobs         = (cpus = sysconf(_SC_NPROCESSORS_ONLN)) > 0 ? cpus : 1;
+
+  while ((c = getopt_long(argc, argv, "m:H::p::P:g:dRt::T:sc:r:j:h", long_options, NULL)) != -1) {
+    switch (c) {
+      case 'm':
+        if (!parse_count(optarg, &opts.memory_size)
+            || opts.memory_size <= RSSB_ADDR_MIN
+            || opts.memory_size > RSSB_MEMORY_MAX) {
+          fprintf(stderr, "%s: invalid memory size `%s'\n", argv[0], optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
 
-  if (argc < 2) {
-    fprintf(stderr, "%s: not files given\n", argv[0]);
+      case 'H':
+        if (!parse_backing(optarg, &opts.backing)) {
+          fprintf(stderr, "%s: unknown huge page mode `%s'\n", argv[0], optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      case 'p':
+        opts.profile = TRUE;
+        if (!parse_profile_view(optarg, &opts.profile_view)) {
+          fprintf(stderr, "%s: unknown profile view `%s'\n", argv[0], optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      case 'P':
+        opts.profile_output = optarg;
+        break;
+
+      case 'g':
+        opts.debug_info = optarg;
+        break;
+
+      case 'd':
+        opts.disas = TRUE;
+        break;
+
+      case 'R':
+        opts.regions = TRUE;
+        break;
+
+      case 't':
+        opts.trace_size = RSSB_TRACE_DEFAULT_SIZE;
+        if (optarg != NULL && !parse_count(optarg, &opts.trace_size)) {
+          fprintf(stderr, "%s: invalid trace size `%s'\n", argv[0], optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      case 'T':
+        opts.trace_output = optarg;
+        break;
+
+      case 'K':
+        opts.loop_check = RSSB_LOOP_CHECK_DEFAULT_EVERY;
+        if (optarg != NULL
+            && (!parse_count(optarg, &opts.loop_check) || opts.loop_check == 0)) {
+          fprintf(stderr, "%s: invalid loop check interval `%s'\n", argv[0], optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      case 'D':
+        opts.trace_decode = optarg;
+        break;
+
+      case 's':
+        opts.stats = TRUE;
+        break;
+
+      case 'c':
+        opts.checkpoint = optarg;
+        break;
+
+      case 'E':
+        if (!parse_count(optarg, &opts.checkpoint_every)) {
+          fprintf(stderr, "%s: invalid checkpoint interval `%s'\n", argv[0], optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      case 'M':
+        if (!parse_count(optarg, &opts.max_steps)) {
+          fprintf(stderr, "%s: invalid step limit `%s'\n", argv[0], optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      case 'r':
+        opts.restore = optarg;
+        break;
+
+      case 'I':
+        opts.preinit = optarg;
+        break;
+
+      case 'S':
+        opts.preinit_stop = optarg;
+        break;
+
+      case 'B':
+        opts.batch = optarg;
+        break;
+
+      case 'O':
+        opts.batch_output = optarg;
+        break;
+
+      case 'L':
+        opts.lockstep = TRUE;
+        if (optarg != NULL && !rssb_lockstep_force_isa(optarg)) {
+          fprintf(stderr, "%s: lockstep kernel `%s' not available\n", argv[0], optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      case 'U':
+        opts.io_uring = TRUE;
+        break;
+
+      case 'l':
+        opts.listen = optarg;
+        break;
+
+      case 'V':
+        opts.serve = optarg;
+        break;
+
+      case 'e':
+        if (opts.pipe_to == NULL)
+          opts.pipe_to = strlist_new();
+        strlist_append_string(opts.pipe_to, optarg);
+        break;
+
+      case 'W':
+        opts.pipe_spin = TRUE;
+        break;
+
+      case 'Q':
+        opts.async_output = TRUE;
+        if (!parse_async_mode(optarg, &opts.async_mode)) {
+          fprintf(stderr, "%s: unknown output mode `%s'\n", argv[0], optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      case 'i':
+        opts.input_file = optarg;
+        break;
+
+      case 'o':
+        opts.output_file = optarg;
+        break;
+
+      case 'y':
+        opts.record_input = optarg;
+        break;
+
+      case 'Y':
+        opts.replay_input = optarg;
+        break;
+
+      case 'j':
+        if (sscanf(optarg, "%u", &opts.jobs) != 1 || opts.jobs == 0) {
+          fprintf(stderr, "%s: invalid job count `%s'\n", argv[0], optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      case 'h':
+        help(argv[0]);
+        exit(EXIT_SUCCESS);
+
+      default:
+        help(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  if (opts.trace_decode != NULL)
+    exit(decode_trace(argv[0], &opts));
+
+  if (opts.serve != NULL)
+    exit(run_serve(argv[0], &opts));
+
+  if (opts.io_uring && opts.lockstep) {
+    fprintf(stderr, "%s: --io-uring cannot be combined with --lockstep\n", argv[0]);
     exit(EXIT_FAILURE);
   }
 
-  if ((program = rssb_program_new()) == NULL) {
-    fprintf(stderr, "%s: failed to create program\n", argv[0]);
+  /* Each of these takes over the VM I/O callbacks */
+  if ((opts.record_input != NULL)
+      + (opts.replay_input != NULL)
+      + (opts.input_file != NULL || opts.output_file != NULL)
+      + opts.async_output > 1) {
+    fprintf(
+        stderr,
+        "%s: only one of --record-input, --replay-input, --input-file/--output-file and --async-output can be used\n",
+        argv[0]);
     exit(EXIT_FAILURE);
   }
 
-  if ((vm = rssb_vm_new(RSSB_MEMORY_SIZE)) == NULL) {
-    fprintf(stderr, "%s: failed to create RSSB VM\n", argv[0]);
+  if ((opts.input_file != NULL
+      || opts.output_file != NULL
+      || opts.record_input != NULL
+      || opts.replay_input != NULL
+      || opts.loop_check > 0)
+      && (opts.batch != NULL
+          || opts.pipe_to != NULL
+          || opts.listen != NULL)) {
+    fprintf(
+        stderr,
+        "%s: --input-file, --output-file, --record-input, --replay-input and --loop-check only apply to plain runs\n",
+        argv[0]);
     exit(EXIT_FAILURE);
   }
 
-  for (i = 1; i < argc; ++i) {
-    if (!rssb_program_load_file(program, argv[i])) {
-      fprintf(stderr, "%s: failed to load source file %s\n", argv[0], argv[i]);
+  if (opts.checkpoint_every > 0 && opts.checkpoint == NULL) {
+    fprintf(stderr, "%s: --checkpoint-every needs --checkpoint\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  if (opts.restore != NULL) {
+    if (optind < argc) {
+      fprintf(stderr, "%s: source files cannot be given with --restore\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+
+    if ((vm = rssb_vm_restore(opts.restore)) == NULL) {
+      fprintf(stderr, "%s: failed to restore %s\n", argv[0], opts.restore);
+      exit(EXIT_FAILURE);
+    }
+
+    if (opts.input_file == NULL && !resume_stdin(argv[0], vm))
+      exit(EXIT_FAILURE);
+  } else {
+    if (optind >= argc) {
+      fprintf(stderr, "%s: not files given\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+
+    if ((vm = assemble(
+        argv[0],
+        &opts,
+        argv + optind,
+        argc - optind,
+        &program)) == NULL)
+      exit(EXIT_FAILURE);
+
+    if (opts.debug_info != NULL
+        && !rssb_dbginfo_save(
+            program->dbginfo,
+            vm->footprint + 1,
+            opts.debug_info)) {
+      fprintf(stderr, "%s: failed to save debug info\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+
+    if (opts.preinit != NULL) {
+      if (!preinit(argv[0], &opts, vm, program))
+        exit(EXIT_FAILURE);
+      goto done;
+    }
+  }
+
+  if (opts.batch != NULL) {
+    if (!run_batch(argv[0], &opts, vm))
+      status = EXIT_FAILURE;
+    goto done;
+  }
+
+  if (opts.pipe_to != NULL) {
+    if (!run_pipeline(argv[0], &opts, vm))
+      status = EXIT_FAILURE;
+    goto done;
+  }
+
+  if (opts.listen != NULL) {
+    if (!run_listen(argv[0], &opts, vm))
+      status = EXIT_FAILURE;
+    goto done;
+  }
+
+  if (opts.regions) {
+    if ((regions = rssb_regions_new(vm)) == NULL) {
+      fprintf(stderr, "%s: failed to analyse the image\n", argv[0]);
       exit(EXIT_FAILURE);
     }
+
+    rssb_vm_set_regions(vm, regions);
+
+    if (!opts.disas) {
+      if (!rssb_regions_report(
+          regions,
+          program != NULL ? program->dbginfo : NULL,
+          vm->footprint + 1,
+          stdout))
+        status = EXIT_FAILURE;
+      goto done;
+    }
   }
 
-  if (!rssb_program_compile(program, vm)) {
-    fprintf(stderr, "%s: compilation failed\n", argv[0]);
-    exit(EXIT_FAILURE);
+  if (opts.disas) {
+    rssb_vm_disas(vm, program != NULL ? program->dbginfo : NULL);
+    goto done;
+  }
+
+  if (opts.profile) {
+    if ((prof = rssb_profile_new(vm->mem_size)) == NULL) {
+      fprintf(stderr, "%s: failed to allocate profile counters\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+
+    rssb_vm_set_profile(vm, prof);
+  }
+
+  if (opts.trace_size > 0) {
+    if ((trace = rssb_trace_new(opts.trace_size)) == NULL) {
+      fprintf(stderr, "%s: failed to allocate trace buffer\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+
+    if (!rssb_trace_dump_on_signal(trace, opts.trace_output)) {
+      fprintf(stderr, "%s: failed to install trace signal handlers\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+
+    rssb_vm_set_trace(vm, trace);
+  }
+
+  if (opts.loop_check > 0) {
+    if ((check = rssb_loop_check_new(opts.loop_check)) == NULL) {
+      fprintf(stderr, "%s: failed to allocate loop check\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+
+    rssb_vm_set_loop_check(vm, check);
+  }
+
+  if (opts.async_output) {
+    fflush(stdout);
+
+    if ((async = rssb_async_output_new(STDOUT_FILENO, opts.async_mode)) == NULL) {
+      fprintf(stderr, "%s: failed to start output thread\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+
+    rssb_async_output_attach(async, vm);
+  }
+
+  if (opts.input_file != NULL || opts.output_file != NULL) {
+    if ((mapio = rssb_mapio_new(opts.input_file, opts.output_file)) == NULL) {
+      fprintf(stderr, "%s: failed to map I/O files\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+
+    if (!rssb_mapio_attach(mapio, vm)) {
+      fprintf(stderr, "%s: cannot resume I/O files where the VM left them\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
   }
 
-  (void) rssb_vm_run(vm);
+  if (opts.record_input != NULL || opts.replay_input != NULL) {
+    if ((replay = rssb_replay_new(
+        opts.record_input != NULL ? opts.record_input : opts.replay_input,
+        opts.record_input != NULL
+            ? RSSB_REPLAY_MODE_RECORD
+            : RSSB_REPLAY_MODE_REPLAY)) == NULL) {
+      fprintf(stderr, "%s: failed to open input log\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+
+    rssb_replay_attach(replay, vm);
+  }
+
+  if (opts.stats && (perf = rssb_perf_new()) != NULL)
+    rssb_perf_start(perf);
+
+  reason = run(argv[0], &opts, vm);
+  ok = reason == RSSB_VM_REASON_HALTED;
+
+  /* Flushed on faults too: the output so far may explain them */
+  if (async != NULL && !rssb_async_output_close(async))
+    status = EXIT_FAILURE;
+
+  if (mapio != NULL && !rssb_mapio_close(mapio))
+    status = EXIT_FAILURE;
+
+  if (replay != NULL && !rssb_replay_close(replay))
+    status = EXIT_FAILURE;
+
+  if (reason == RSSB_VM_REASON_LOOP)
+    report_loop(argv[0], check, program);
+
+  /* Faults, budgets and loops alike: only a halt is a success */
+  if (!ok)
+    status = EXIT_FAILURE;
+
+  if (perf != NULL)
+    rssb_perf_stop(perf);
 
+  if (opts.stats) {
+    fflush(stdout);
+    print_stats(argv[0], vm, perf);
+
+    if (async != NULL)
+      fprintf(
+          stderr,
+          "  Async output:         %" PRIu64 " bytes in %" PRIu64 " writes\n",
+          async->bytes,
+          async->writes);
+
+    if (mapio != NULL)
+      fprintf(
+          stderr,
+          "  Mapped I/O:           %" PRIu64 " bytes in, %" PRIu64 " bytes out, %u remaps\n",
+          mapio->read,
+          mapio->written,
+          mapio->grows);
+
+    if (replay != NULL)
+      fprintf(
+          stderr,
+          "  Input log:            %" PRIu64 " reads %s\n",
+          replay->count,
+          replay->mode == RSSB_REPLAY_MODE_RECORD ? "recorded" : "replayed");
+  }
+
+  if (perf != NULL)
+    rssb_perf_destroy(perf);
+
+  if (async != NULL)
+    rssb_async_output_destroy(async);
+
+  if (mapio != NULL)
+    rssb_mapio_destroy(mapio);
+
+  if (replay != NULL)
+    rssb_replay_destroy(replay);
+
+  if (check != NULL) {
+    rssb_vm_set_loop_check(vm, NULL);
+    rssb_loop_check_destroy(check);
+  }
+
+  if (opts.checkpoint != NULL && !rssb_vm_checkpoint(vm, opts.checkpoint))
+    fprintf(stderr, "%s: failed to save checkpoint\n", argv[0]);
+
+  if (trace != NULL) {
+    if (!rssb_trace_dump(trace, opts.trace_output))
+      fprintf(stderr, "%s: failed to dump trace\n", argv[0]);
+    else if (!ok)
+      fprintf(
+          stderr,
+          "%s: %s, trace saved to %s\n",
+          argv[0],
+          g_reason_names[reason],
+          opts.trace_output);
+  }
+
+  if (prof != NULL) {
+    fflush(stdout);
+    if (!write_profile(argv[0], &opts, prof, program))
+      fprintf(stderr, "%s: failed to write profile report\n", argv[0]);
+    rssb_profile_destroy(prof);
+  }
+
+  if (trace != NULL) {
+    signal(SIGUSR1, SIG_IGN);
+    rssb_trace_destroy(trace);
+  }
+
+done:
   rssb_vm_destroy(vm);
-  rssb_program_destroy(program);
 
-  return 0;
-}
+  if (regions != NULL)
+    rssb_regions_destroy(regions);
+
+  if (program != NULL)
+    rssb_program_destroy(program);
 
+  if (opts.pipe_to != NULL)
+    strlist_destroy(opts.pipe_to);
+
+  return status;
+}
@@ -0,0 +1,298 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE /* mremap */
+#endif /* _GNU_SOURCE */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mapio.h"
+
+/* The input window is used up: there is nothing after the file */
+PRIVATE enum rssb_vm_input
+rssb_mapio_input(void *private, word_t *ch)
+{
+  (void) private;
+  (void) ch;
+
+  return RSSB_VM_INPUT_EOF;
+}
+
+PRIVATE BOOL
+rssb_mapio_grow(rssb_mapio_t *io)
+{
+  size_t size = io->out_size << 1;
+  void *base;
+
+  if (ftruncate(io->out_fd, size) == -1) {
+    fprintf(stderr, "%s: cannot grow output: %s\n", __FUNCTION__, strerror(errno));
+    return FALSE;
+  }
+
+  if ((base = mremap(io->out_base, io->out_size, size, MREMAP_MAYMOVE))
+      == MAP_FAILED) {
+    fprintf(stderr, "%s: cannot remap output: %s\n", __FUNCTION__, strerror(errno));
+    return FALSE;
+  }
+
+  io->out_base = base;
+  io->out_size = size;
+  ++io->grows;
+
+  return TRUE;
+}
+
+/* The output window is full: grow it and carry on where it was */
+PRIVATE BOOL
+rssb_mapio_output(void *private, word_t ch)
+{
+  rssb_mapio_t *io = private;
+  rssb_vm_t *vm = io->vm;
+  size_t used = vm->out_ptr - io->out_base;
+
+  if (!rssb_mapio_grow(io))
+    return FALSE;
+
+  vm->out_ptr = io->out_base + used;
+  vm->out_end = io->out_base + io->out_size;
+
+  *vm->out_ptr++ = ch;
+
+  return TRUE;
+}
+
+PRIVATE BOOL
+rssb_mapio_open_input(rssb_mapio_t *io, const char *path)
+{
+  struct stat sbuf;
+  void *base;
+
+  if ((io->in_fd = open(path, O_RDONLY | O_CLOEXEC)) == -1
+      || fstat(io->in_fd, &sbuf) == -1) {
+    fprintf(stderr, "%s: cannot open `%s': %s\n", __FUNCTION__, path, strerror(errno));
+    return FALSE;
+  }
+
+  /* Empty files cannot be mapped, and read as EOF right away */
+  if ((io->in_size = sbuf.st_size) == 0)
+    return TRUE;
+
+  if ((base = mmap(NULL, io->in_size, PROT_READ, MAP_PRIVATE, io->in_fd, 0))
+      == MAP_FAILED) {
+    fprintf(stderr, "%s: cannot map `%s': %s\n", __FUNCTION__, path, strerror(errno));
+    return FALSE;
+  }
+
+  (void) madvise(base, io->in_size, MADV_SEQUENTIAL);
+
+  io->in_base = base;
+
+  return TRUE;
+}
+
+/* Not truncated yet: a resumed VM keeps what it had written */
+PRIVATE BOOL
+rssb_mapio_open_output(rssb_mapio_t *io, const char *path)
+{
+  if ((io->out_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1) {
+    fprintf(stderr, "%s: cannot open `%s': %s\n", __FUNCTION__, path, strerror(errno));
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Maps the output with room for more after its first `keep' bytes */
+PRIVATE BOOL
+rssb_mapio_map_output(rssb_mapio_t *io, uint64_t keep)
+{
+  struct stat sbuf;
+  size_t size = RSSB_MAPIO_INITIAL_SIZE;
+  void *base;
+
+  if (fstat(io->out_fd, &sbuf) == -1) {
+    fprintf(stderr, "%s: cannot stat output: %s\n", __FUNCTION__, strerror(errno));
+    return FALSE;
+  }
+
+  if ((uint64_t) sbuf.st_size < keep) {
+    fprintf(
+        stderr,
+        "%s: output has %" PRIu64 " bytes, but %" PRIu64 " were written\n",
+        __FUNCTION__,
+        (uint64_t) sbuf.st_size,
+        keep);
+    return FALSE;
+  }
+
+  while (size <= keep)
+    size <<= 1;
+
+  if (ftruncate(io->out_fd, size) == -1
+      || (base = mmap(
+          NULL,
+          size,
+          PROT_READ | PROT_WRITE,
+          MAP_SHARED,
+          io->out_fd,
+          0)) == MAP_FAILED) {
+    fprintf(stderr, "%s: cannot map output: %s\n", __FUNCTION__, strerror(errno));
+    return FALSE;
+  }
+
+  io->out_base = base;
+  io->out_size = size;
+
+  return TRUE;
+}
+
+/* Either path may be NULL, leaving that side to stdio */
+rssb_mapio_t *
+rssb_mapio_new(const char *input, const char *output)
+{
+  rssb_mapio_t *new = NULL;
+
+  TRYCATCH(new = calloc(1, sizeof(rssb_mapio_t)), goto fail);
+
+  new->in_fd  = -1;
+  new->out_fd = -1;
+
+  if (input != NULL && !rssb_mapio_open_input(new, input))
+    goto fail;
+
+  if (output != NULL && !rssb_mapio_open_output(new, output))
+    goto fail;
+
+  return new;
+
+fail:
+  if (new != NULL)
+    rssb_mapio_destroy(new);
+
+  return NULL;
+}
+
+/*
+ * Both files pick up where the VM's byte counters say, so a VM
+ * restored from a checkpoint skips the input it has already read and
+ * writes after the output it had produced.
+ */
+BOOL
+rssb_mapio_attach(rssb_mapio_t *io, rssb_vm_t *vm)
+{
+  uint64_t skip = vm->stats.in_bytes;
+  uint64_t keep = vm->stats.out_bytes;
+
+  if (io->in_fd != -1 && skip > io->in_size) {
+    fprintf(
+        stderr,
+        "%s: input has %zu bytes, but %" PRIu64 " were read\n",
+        __FUNCTION__,
+        io->in_size,
+        skip);
+    return FALSE;
+  }
+
+  if (io->out_fd != -1 && !rssb_mapio_map_output(io, keep))
+    return FALSE;
+
+  io->vm = vm;
+
+  rssb_vm_set_io(
+      vm,
+      io,
+      io->in_fd != -1 ? rssb_mapio_input : NULL,
+      io->out_fd != -1 ? rssb_mapio_output : NULL);
+  rssb_vm_set_io_window(
+      vm,
+      io->in_fd != -1 ? io->in_base + skip : NULL,
+      io->in_fd != -1 ? io->in_size - skip : 0,
+      io->out_fd != -1 ? io->out_base + keep : NULL,
+      io->out_fd != -1 ? io->out_size - keep : 0);
+
+  return TRUE;
+}
+
+/* Unmaps both files, leaving the output exactly as long as written */
+BOOL
+rssb_mapio_close(rssb_mapio_t *io)
+{
+  BOOL ok = TRUE;
+
+  if (io->vm != NULL) {
+    if (io->in_base != NULL)
+      io->read = io->vm->in_ptr - io->in_base;
+    if (io->out_base != NULL)
+      io->written = io->vm->out_ptr - io->out_base;
+
+    rssb_vm_set_io(io->vm, NULL, NULL, NULL);
+    rssb_vm_set_io_window(io->vm, NULL, 0, NULL, 0);
+    io->vm = NULL;
+  }
+
+  if (io->in_base != NULL) {
+    munmap((void *) io->in_base, io->in_size);
+    io->in_base = NULL;
+  }
+
+  if (io->in_fd != -1) {
+    close(io->in_fd);
+    io->in_fd = -1;
+  }
+
+  /* Left alone if it was never mapped */
+  if (io->out_base != NULL) {
+    munmap(io->out_base, io->out_size);
+    io->out_base = NULL;
+
+    if (ftruncate(io->out_fd, io->written) == -1) {
+      fprintf(stderr, "%s: cannot truncate output: %s\n", __FUNCTION__, strerror(errno));
+      ok = FALSE;
+    }
+  }
+
+  if (io->out_fd != -1) {
+    if (close(io->out_fd) == -1) {
+      fprintf(stderr, "%s: cannot close output: %s\n", __FUNCTION__, strerror(errno));
+      ok = FALSE;
+    }
+
+    io->out_fd = -1;
+  }
+
+  return ok;
+}
+
+void
+rssb_mapio_destroy(rssb_mapio_t *io)
+{
+  (void) rssb_mapio_close(io);
+
+  free(io);
+}
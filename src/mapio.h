@@ -0,0 +1,59 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+
+#ifndef _RSSB_MAPIO_H
+#define _RSSB_MAPIO_H
+
+#include <stdint.h>
+
+#include "rssb.h"
+
+#define RSSB_MAPIO_INITIAL_SIZE (1 << 20) /* Output mapping to start with */
+
+/*
+ * File I/O through mappings. The input file is mapped read-only and
+ * becomes the VM's input window. The output file is mapped shared and
+ * becomes its output window: when it fills up, the file and the
+ * mapping double in size. Closing truncates the output to the bytes
+ * actually written. Both start at the VM's byte counters, which are
+ * not zero in a VM restored from a checkpoint.
+ */
+typedef struct rssb_mapio {
+  int in_fd;
+  const uint8_t *in_base;
+  size_t in_size;
+
+  int out_fd;
+  uint8_t *out_base;
+  size_t out_size;  /* Both mapped and file size, until closed */
+
+  rssb_vm_t *vm;    /* Attached VM, whose windows hold the positions */
+  uint64_t read;    /* Set on close */
+  uint64_t written;
+  unsigned int grows;
+} rssb_mapio_t;
+
+rssb_mapio_t *rssb_mapio_new(const char *input, const char *output);
+BOOL rssb_mapio_attach(rssb_mapio_t *io, rssb_vm_t *vm);
+BOOL rssb_mapio_close(rssb_mapio_t *io);
+void rssb_mapio_destroy(rssb_mapio_t *io);
+
+#endif /* _RSSB_MAPIO_H */
@@ -21,6 +21,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
 #include <assert.h>
 
 #include "parser.h"
@@ -29,6 +30,104 @@
 void rssb_macro_destroy(rssb_macro_t *macro);
 
 /* Implementation */
+void
+rssb_atom_table_destroy(rssb_atom_table_t *table)
+{
+  unsigned int i;
+
+  for (i = 0; i < table->size; ++i)
+    if (table->atoms[i] != NULL)
+      free(table->atoms[i]);
+
+  if (table->atoms != NULL)
+    free(table->atoms);
+
+  free(table);
+}
+
+rssb_atom_table_t *
+rssb_atom_table_new(void)
+{
+  rssb_atom_table_t *new = NULL;
+
+  TRYCATCH(new = calloc(1, sizeof(rssb_atom_table_t)), goto fail);
+
+  new->size = 64;
+  TRYCATCH(new->atoms = calloc(new->size, sizeof(char *)), goto fail);
+
+  return new;
+
+fail:
+  if (new != NULL)
+    rssb_atom_table_destroy(new);
+
+  return NULL;
+}
+
+PRIVATE unsigned int
+rssb_atom_str_hash(const char *string)
+{
+  unsigned int h = 2166136261u; /* FNV-1a */
+
+  while (*string != '\0')
+    h = (h ^ (unsigned char) *string++) * 16777619u;
+
+  return h;
+}
+
+PRIVATE BOOL
+rssb_atom_table_grow(rssb_atom_table_t *table)
+{
+  char **atoms;
+  unsigned int i, j, size, mask;
+
+  size = table->size << 1;
+  mask = size - 1;
+
+  TRYCATCH(atoms = calloc(size, sizeof(char *)), return FALSE);
+
+  for (i = 0; i < table->size; ++i)
+    if (table->atoms[i] != NULL) {
+      for (j = rssb_atom_str_hash(table->atoms[i]) & mask;
+           atoms[j] != NULL;
+           j = (j + 1) & mask);
+      atoms[j] = table->atoms[i];
+    }
+
+  free(table->atoms);
+
+  table->atoms = atoms;
+  table->size  = size;
+
+  return TRUE;
+}
+
+/*
+ * Returns the unique copy of `string' owned by the table. Interned
+ * strings can be compared by address and live as long as the table.
+ */
+const char *
+rssb_atom_table_intern(rssb_atom_table_t *table, const char *string)
+{
+  unsigned int i, mask;
+
+  if (2 * (table->count + 1) > table->size)
+    TRYCATCH(rssb_atom_table_grow(table), return NULL);
+
+  mask = table->size - 1;
+
+  for (i = rssb_atom_str_hash(string) & mask;
+       table->atoms[i] != NULL;
+       i = (i + 1) & mask)
+    if (strcmp(table->atoms[i], string) == 0)
+      return table->atoms[i];
+
+  TRYCATCH(table->atoms[i] = strdup(string), return NULL);
+  ++table->count;
+
+  return table->atoms[i];
+}
+
 void
 rssb_value_destroy(struct rssb_value *value)
 {
@@ -84,8 +183,9 @@ rssb_stmt_destroy(rssb_stmt_t *stmt)
 }
 
 PRIVATE inline void
-rssb_stmt_set_line(rssb_stmt_t *stmt, int line)
+rssb_stmt_set_line(rssb_stmt_t *stmt, const char *file, int line)
 {
+  stmt->file = file;
   stmt->line = line;
 }
 
@@ -209,14 +309,6 @@ rssb_stmt_inst_new(
   return rssb_stmt_new_with_args(RSSB_STMT_TYPE_INST, label, al);
 }
 
-BOOL
-rssb_macro_set_put_macro(rssb_macro_set_t *set, rssb_macro_t *macro)
-{
-  TRYCATCH(PTR_LIST_APPEND_CHECK(set->macro, macro) != -1, return FALSE);
-
-  return TRUE;
-}
-
 void
 rssb_macro_set_destroy(rssb_macro_set_t *set)
 {
@@ -229,22 +321,102 @@ rssb_macro_set_destroy(rssb_macro_set_t *set)
   if (set->macro_list != NULL)
     free(set->macro_list);
 
+  if (set->index != NULL)
+    free(set->index);
+
   free(set);
 }
 
+/*
+ * Macro sets are indexed by atom address: two names are the same macro
+ * iff they were interned to the same pointer, so lookups never touch
+ * the string itself.
+ */
+PRIVATE inline unsigned int
+rssb_atom_ptr_hash(const char *atom)
+{
+  uintptr_t h = (uintptr_t) atom;
+
+  h ^= h >> 17;
+  h *= 0x9e3779b1u;
+  h ^= h >> 15;
+
+  return (unsigned int) h;
+}
+
 rssb_macro_t *
-rssb_macro_set_find_macro(const rssb_macro_set_t *set, const char *name)
+rssb_macro_set_find_macro(const rssb_macro_set_t *set, const char *atom)
 {
-  unsigned int i;
+  unsigned int i, mask;
 
-  for (i = 0; i < set->macro_count; ++i)
-    if (set->macro_list[i] != NULL)
-      if (strcmp(set->macro_list[i]->name, name) == 0)
-        return set->macro_list[i];
+  if (set->index_size == 0)
+    return NULL;
+
+  mask = set->index_size - 1;
+
+  for (i = rssb_atom_ptr_hash(atom) & mask;
+       set->index[i] != NULL;
+       i = (i + 1) & mask)
+    if (set->index[i]->atom == atom)
+      return set->index[i];
 
   return NULL;
 }
 
+PRIVATE void
+rssb_macro_set_index_insert(
+    rssb_macro_t **index,
+    unsigned int size,
+    rssb_macro_t *macro)
+{
+  unsigned int i, mask = size - 1;
+
+  for (i = rssb_atom_ptr_hash(macro->atom) & mask;
+       index[i] != NULL;
+       i = (i + 1) & mask)
+    if (index[i]->atom == macro->atom)
+      return; /* First definition wins */
+
+  index[i] = macro;
+}
+
+PRIVATE BOOL
+rssb_macro_set_index_macro(rssb_macro_set_t *set, rssb_macro_t *macro)
+{
+  rssb_macro_t **index;
+  unsigned int i, size;
+
+  /* Keep load factor under 1/2 */
+  if (2 * (unsigned int) set->macro_count > set->index_size) {
+    size = set->index_size == 0 ? 16 : set->index_size << 1;
+
+    TRYCATCH(index = calloc(size, sizeof(rssb_macro_t *)), return FALSE);
+
+    for (i = 0; i < set->index_size; ++i)
+      if (set->index[i] != NULL)
+        rssb_macro_set_index_insert(index, size, set->index[i]);
+
+    if (set->index != NULL)
+      free(set->index);
+
+    set->index = index;
+    set->index_size = size;
+  }
+
+  rssb_macro_set_index_insert(set->index, set->index_size, macro);
+
+  return TRUE;
+}
+
+BOOL
+rssb_macro_set_put_macro(rssb_macro_set_t *set, rssb_macro_t *macro)
+{
+  TRYCATCH(PTR_LIST_APPEND_CHECK(set->macro, macro) != -1, return FALSE);
+  TRYCATCH(rssb_macro_set_index_macro(set, macro), return FALSE);
+
+  return TRUE;
+}
+
 rssb_macro_set_t *
 rssb_macro_set_new(void)
 {
@@ -262,7 +434,24 @@ rssb_scope_put_macro(rssb_scope_t *scope, rssb_macro_t *macro)
 BOOL
 rssb_scope_put_stmt(rssb_scope_t *scope, rssb_stmt_t *stmt)
 {
-  TRYCATCH(PTR_LIST_APPEND_CHECK(scope->stmt, stmt) != -1, return FALSE);
+  rssb_stmt_t **tmp;
+
+  /*
+   * Statements are never removed, so there are no holes to reuse as
+   * PTR_LIST_APPEND_CHECK does. Grow in powers of two instead: appending
+   * one slot at a time made loading large sources quadratic.
+   */
+  if ((scope->stmt_count & (scope->stmt_count - 1)) == 0) {
+    TRYCATCH(
+        tmp = realloc(
+            scope->stmt_list,
+            (scope->stmt_count == 0 ? 1 : 2 * scope->stmt_count)
+            * sizeof(rssb_stmt_t *)),
+        return FALSE);
+    scope->stmt_list = tmp;
+  }
+
+  scope->stmt_list[scope->stmt_count++] = stmt;
 
   return TRUE;
 }
@@ -371,6 +560,12 @@ rssb_program_destroy(rssb_program_t *prog)
   if (prog->options != NULL)
     strlist_destroy(prog->options);
 
+  if (prog->atoms != NULL)
+    rssb_atom_table_destroy(prog->atoms);
+
+  if (prog->dbginfo != NULL)
+    rssb_dbginfo_destroy(prog->dbginfo);
+
   free(prog);
 }
 
@@ -383,6 +578,9 @@ rssb_program_new(void)
 
   TRYCATCH(new->scope = rssb_scope_new(0), goto fail);
   TRYCATCH(new->options = strlist_new(), goto fail);
+  TRYCATCH(new->atoms = rssb_atom_table_new(), goto fail);
+  TRYCATCH(new->dbginfo = rssb_dbginfo_new(), goto fail);
+
   return new;
 
 fail:
@@ -392,11 +590,17 @@ fail:
   return NULL;
 }
 
+struct rssb_source {
+  FILE *fp;
+  const char *path; /* Interned */
+  int line;
+};
+
 PRIVATE BOOL
 rssb_scope_parse_from_fp(
     rssb_program_t *prog,
     rssb_scope_t *scope,
-    FILE *fp)
+    struct rssb_source *src)
 {
   BOOL ok = FALSE;
   BOOL parsing = TRUE;
@@ -407,14 +611,19 @@ rssb_scope_parse_from_fp(
   rssb_scope_t *macro_scope;
   unsigned int i;
 
-  while (parsing && (line = fread_line(fp)) != NULL) {
+  while (parsing && (line = fread_line(src->fp)) != NULL) {
+    ++src->line;
     TRYCATCH(al = rssb_split_line(line), goto done);
 
     if (al->al_argc > 0) {
       stmt = NULL;
       if (strcmp(al->al_argv[0], "rssb") == 0) {
         if (al->al_argc != 2) {
-          fprintf(stderr, "syntax error: invalid RSSB syntax\n");
+          fprintf(
+              stderr,
+              "%s:%d: syntax error: invalid RSSB syntax\n",
+              src->path,
+              src->line);
           goto done;
         }
 
@@ -423,7 +632,11 @@ rssb_scope_parse_from_fp(
             goto done);
       } else if (strcmp(al->al_argv[0], ".origin") == 0) {
         if (al->al_argc != 2) {
-          fprintf(stderr, "syntax error: invalid origin directive\n");
+          fprintf(
+              stderr,
+              "%s:%d: syntax error: invalid origin directive\n",
+              src->path,
+              src->line);
           goto done;
         }
 
@@ -432,20 +645,31 @@ rssb_scope_parse_from_fp(
             goto done);
       } else if (strcmp(al->al_argv[0], ".option") == 0) {
         if (al->al_argc != 2) {
-          fprintf(stderr, "syntax error: invalid origin directive\n");
+          fprintf(
+              stderr,
+              "%s:%d: syntax error: invalid origin directive\n",
+              src->path,
+              src->line);
           goto done;
         }
 
         strlist_append_string(prog->options, al->al_argv[1]);
       } else if (strcmp(al->al_argv[0], ".macro") == 0) {
         if (al->al_argc < 2) {
-          fprintf(stderr, "syntax error: invalid macro definition syntax\n");
+          fprintf(
+              stderr,
+              "%s:%d: syntax error: invalid macro definition syntax\n",
+              src->path,
+              src->line);
           goto done;
         }
 
         TRYCATCH(
             macro = rssb_macro_new(al->al_argv[1], al->al_argc - 2),
             goto done);
+        TRYCATCH(
+            macro->atom = rssb_atom_table_intern(prog->atoms, macro->name),
+            goto done);
 
         for (i = 2; i < al->al_argc; ++i)
           TRYCATCH(
@@ -458,10 +682,14 @@ rssb_scope_parse_from_fp(
         TRYCATCH(rssb_scope_put_macro(scope, macro), goto done);
         macro = NULL;
 
-        TRYCATCH(rssb_scope_parse_from_fp(prog, macro_scope, fp), goto done);
+        TRYCATCH(rssb_scope_parse_from_fp(prog, macro_scope, src), goto done);
       } else if (strcmp(al->al_argv[0], ".end") == 0) {
         if (al->al_argc != 1) {
-          fprintf(stderr, "syntax error: invalid macro end syntax\n");
+          fprintf(
+              stderr,
+              "%s:%d: syntax error: invalid macro end syntax\n",
+              src->path,
+              src->line);
           goto done;
         }
 
@@ -481,9 +709,13 @@ rssb_scope_parse_from_fp(
                 al->al_argv[0],
                 al),
             goto done);
+        TRYCATCH(
+            stmt->atom = rssb_atom_table_intern(prog->atoms, stmt->name),
+            goto done);
       }
 
       if (stmt != NULL) {
+        rssb_stmt_set_line(stmt, src->path, src->line);
         TRYCATCH(rssb_scope_put_stmt(scope, stmt), goto done);
         stmt = NULL;
       }
@@ -514,6 +746,18 @@ done:
   return ok;
 }
 
+PRIVATE BOOL
+rssb_program_load_fp(rssb_program_t *prog, FILE *fp, const char *path)
+{
+  struct rssb_source src;
+
+  src.fp   = fp;
+  src.line = 0;
+  TRYCATCH(src.path = rssb_atom_table_intern(prog->atoms, path), return FALSE);
+
+  return rssb_scope_parse_from_fp(prog, prog->scope, &src);
+}
+
 BOOL
 rssb_program_load_file(rssb_program_t *prog, const char *path)
 {
@@ -530,7 +774,37 @@ rssb_program_load_file(rssb_program_t *prog, const char *path)
     goto done;
   }
 
-  TRYCATCH(rssb_scope_parse_from_fp(prog, prog->scope, fp), goto done);
+  TRYCATCH(rssb_program_load_fp(prog, fp, path), goto done);
+
+  ok = TRUE;
+
+done:
+  if (fp != NULL)
+    fclose(fp);
+
+  return ok;
+}
+
+/* Parses source held in memory. `name' is used in diagnostics */
+BOOL
+rssb_program_load_buffer(
+    rssb_program_t *prog,
+    const char *name,
+    const void *data,
+    size_t size)
+{
+  FILE *fp = NULL;
+  BOOL ok = FALSE;
+
+  if (size == 0)
+    return TRUE;
+
+  if ((fp = fmemopen((void *) data, size, "r")) == NULL) {
+    fprintf(stderr, "%s: fmemopen: %s\n", __FUNCTION__, strerror(errno));
+    goto done;
+  }
+
+  TRYCATCH(rssb_program_load_fp(prog, fp, name), goto done);
 
   ok = TRUE;
 
@@ -571,18 +845,66 @@ rssb_scope_reset(rssb_scope_t *scope)
 }
 
 PRIVATE rssb_macro_t *
-rssb_scope_find_macro(const rssb_scope_t *scope, const char *name)
+rssb_scope_find_macro(const rssb_scope_t *scope, const char *atom)
+{
+  rssb_macro_t *macro;
+
+  do
+    if ((macro = rssb_macro_set_find_macro(scope->macro_set, atom)) != NULL)
+      return macro;
+  while ((scope = scope->parent) != NULL);
+
+  return NULL;
+}
+
+/*
+ * Macro scoping is lexical, so every macro call can be bound to its
+ * definition once, before the first pass. Compilation passes then
+ * follow stmt->macro directly. Only bodies that get expanded are
+ * bound: like in the compiler, macros never called are not checked.
+ */
+PRIVATE BOOL
+rssb_scope_bind_macros(rssb_scope_t *scope)
 {
   unsigned int i;
+  rssb_stmt_t *stmt;
   rssb_macro_t *macro;
 
-  if ((macro = rssb_macro_set_find_macro(scope->macro_set, name)) != NULL)
-    return macro;
+  for (i = 0; i < scope->stmt_count; ++i)
+    if ((stmt = scope->stmt_list[i]) != NULL
+        && stmt->type == RSSB_STMT_TYPE_MACRO) {
+      if ((macro = rssb_scope_find_macro(scope, stmt->atom)) == NULL) {
+        fprintf(
+            stderr,
+            "error: macro `%s' not defined at %s+%d\n",
+            stmt->name,
+            scope->owner ? scope->owner->name : "<main program>",
+            i);
+        return FALSE;
+      }
 
-  if (scope->parent != NULL)
-    return rssb_scope_find_macro(scope->parent, name);
+      if (macro->args->strings_count != stmt->value_count) {
+        fprintf(
+            stderr,
+            "error: macro `%s' expects %d args, but only %d were passed at %s+%d\n",
+            stmt->name,
+            macro->args->strings_count,
+            stmt->value_count,
+            scope->owner ? scope->owner->name : "<main program>",
+            i);
+        return FALSE;
+      }
 
-  return NULL;
+      stmt->macro = macro;
+
+      if (!macro->bound) {
+        macro->bound = TRUE;
+        if (!rssb_scope_bind_macros(macro->scope))
+          return FALSE;
+      }
+    }
+
+  return TRUE;
 }
 
 PRIVATE BOOL
@@ -679,9 +1001,14 @@ rssb_scope_get_value(
 }
 
 PRIVATE BOOL
-rssb_scope_compile(rssb_scope_t *scope, rssb_vm_t *vm)
+rssb_scope_compile(
+    rssb_scope_t *scope,
+    rssb_vm_t *vm,
+    rssb_dbginfo_t *dbg,
+    unsigned int frame)
 {
   unsigned int i, j;
+  unsigned int callee;
   rssb_macro_t *macro;
   word_t value;
   unsigned int unresolved, last_unresolved;
@@ -706,6 +1033,15 @@ rssb_scope_compile(rssb_scope_t *scope, rssb_vm_t *vm)
             return FALSE;
           }
 
+          TRYCATCH(
+              rssb_dbginfo_set_loc(
+                  dbg,
+                  rssb_vm_get_ptr(vm),
+                  frame,
+                  scope->stmt_list[i]->file,
+                  scope->stmt_list[i]->line),
+              return FALSE);
+
           TRYCATCH(
               rssb_vm_put_word(
                   vm,
@@ -730,33 +1066,23 @@ rssb_scope_compile(rssb_scope_t *scope, rssb_vm_t *vm)
           break;
 
         case RSSB_STMT_TYPE_MACRO:
-          if ((macro = rssb_scope_find_macro(
-              scope,
-              scope->stmt_list[i]->name)) == NULL) {
-            fprintf(
-                stderr,
-                "error: macro `%s' not defined at %s+%d\n",
-                scope->stmt_list[i]->name,
-                scope->owner ? scope->owner->name : "<main program>",
-                i);
-            return FALSE;
-          }
-
-          if (macro->args->strings_count != scope->stmt_list[i]->value_count) {
-            fprintf(
-                stderr,
-                "error: macro `%s' expects %d args, but only %d were passed at %s+%d\n",
-                scope->stmt_list[i]->name,
-                macro->args->strings_count,
-                scope->stmt_list[i]->value_count,
-                scope->owner ? scope->owner->name : "<main program>",
-                i);
-            return FALSE;
-          }
+          macro = scope->stmt_list[i]->macro;
+          assert(macro != NULL);
 
           rssb_scope_reset(macro->scope);
           macro->scope->caller = scope->owner;
 
+          TRYCATCH(
+              rssb_dbginfo_enter_frame(
+                  dbg,
+                  frame,
+                  scope->stmt_list[i],
+                  macro->name,
+                  scope->stmt_list[i]->file,
+                  scope->stmt_list[i]->line,
+                  &callee),
+              return FALSE);
+
           for (j = 0; j < scope->stmt_list[i]->value_count; ++j) {
             if (!rssb_scope_get_value(
                 scope,
@@ -785,7 +1111,7 @@ rssb_scope_compile(rssb_scope_t *scope, rssb_vm_t *vm)
             rssb_vm_set_ptr(vm, scope->stmt_list[i]->current_value);
             rssb_scope_reset_unresolved(macro->scope);
 
-            if (!rssb_scope_compile(macro->scope, vm)) {
+            if (!rssb_scope_compile(macro->scope, vm, dbg, callee)) {
               fprintf(
                   stderr,
                   "error: while calling `%s' at %s+%d\n",
@@ -819,6 +1145,14 @@ rssb_program_compile(rssb_program_t *prog, rssb_vm_t *vm)
   if (strlist_have_element(prog->options, "dumb"))
     rssb_vm_set_dumb(vm, TRUE);
 
+  if (strlist_have_element(prog->options, "binary"))
+    rssb_vm_set_binary(vm, TRUE);
+
+  if (!rssb_scope_bind_macros(prog->scope)) {
+    fprintf(stderr, "error: macro binding failed\n");
+    return FALSE;
+  }
+
   last_addr = rssb_vm_get_ptr(vm);
 
   unresolved = 0;
@@ -827,7 +1161,12 @@ rssb_program_compile(rssb_program_t *prog, rssb_vm_t *vm)
 
     rssb_vm_set_ptr(vm, last_addr);
     rssb_scope_reset_unresolved(prog->scope);
-    if (!rssb_scope_compile(prog->scope, vm)) {
+    rssb_dbginfo_clear_locs(prog->dbginfo);
+    if (!rssb_scope_compile(
+        prog->scope,
+        vm,
+        prog->dbginfo,
+        RSSB_DBGINFO_ROOT)) {
       fprintf(stderr, "error: main program compilation failed\n");
       return FALSE;
     }
@@ -841,3 +1180,24 @@ rssb_program_compile(rssb_program_t *prog, rssb_vm_t *vm)
 
   return TRUE;
 }
+
+/* Address of a top-level label, once the program has been compiled */
+BOOL
+rssb_program_lookup_label(
+    const rssb_program_t *prog,
+    const char *name,
+    word_t *addr)
+{
+  unsigned int i;
+
+  for (i = 0; i < prog->scope->stmt_count; ++i)
+    if (prog->scope->stmt_list[i] != NULL
+        && prog->scope->stmt_list[i]->type == RSSB_STMT_TYPE_LABEL
+        && prog->scope->stmt_list[i]->assembled
+        && strcmp(prog->scope->stmt_list[i]->label, name) == 0) {
+      *addr = prog->scope->stmt_list[i]->current_value;
+      return TRUE;
+    }
+
+  return FALSE;
+}
@@ -24,6 +24,7 @@
 #include <util.h>
 
 #include "rssb.h"
+#include "dbginfo.h"
 
 enum rssb_stmt_type {
   RSSB_STMT_TYPE_INST,
@@ -41,8 +42,11 @@ struct rssb_value {
   };
 };
 
+struct rssb_macro;
+
 typedef struct rssb_stmt {
   enum rssb_stmt_type type;
+  const char *file; /* Interned */
   int line;
 
   BOOL   assembled;
@@ -54,11 +58,14 @@ typedef struct rssb_stmt {
     char *string;
   };
 
+  /* Macro calls only */
+  const char *atom;          /* Interned macro name */
+  struct rssb_macro *macro;  /* Bound once scoping is resolved */
+
   PTR_LIST(struct rssb_value, value);
 } rssb_stmt_t;
 
 struct rssb_macro_set;
-struct rssb_macro;
 
 typedef struct rssb_scope {
   struct rssb_scope *parent;
@@ -74,24 +81,51 @@ typedef struct rssb_scope {
 
 typedef struct rssb_macro {
   char *name;
+  const char *atom;
   struct strlist *args;
   rssb_scope_t *scope;
+  BOOL bound; /* Calls in its body are bound */
 } rssb_macro_t;
 
 typedef struct rssb_macro_set {
   PTR_LIST(rssb_macro_t, macro);
+
+  /* Open-addressing index, keyed by atom address */
+  rssb_macro_t **index;
+  unsigned int index_size;
 } rssb_macro_set_t;
 
+typedef struct rssb_atom_table {
+  char **atoms;
+  unsigned int size;  /* Always a power of two */
+  unsigned int count;
+} rssb_atom_table_t;
+
 typedef struct rssb_program {
   word_t origin;
   rssb_scope_t *scope;
   struct strlist *options;
+  rssb_atom_table_t *atoms;
+  rssb_dbginfo_t *dbginfo; /* Filled by rssb_program_compile */
 } rssb_program_t;
 
+rssb_atom_table_t *rssb_atom_table_new(void);
+const char *rssb_atom_table_intern(rssb_atom_table_t *table, const char *string);
+void rssb_atom_table_destroy(rssb_atom_table_t *table);
+
 void rssb_program_destroy(rssb_program_t *prog);
 rssb_program_t *rssb_program_new(void);
 
 BOOL rssb_program_compile(rssb_program_t *prog, rssb_vm_t *vm);
 BOOL rssb_program_load_file(rssb_program_t *prog, const char *path);
+BOOL rssb_program_load_buffer(
+    rssb_program_t *prog,
+    const char *name,
+    const void *data,
+    size_t size);
+BOOL rssb_program_lookup_label(
+    const rssb_program_t *prog,
+    const char *name,
+    word_t *addr);
 
 #endif /* _RSSB_PARSER_H */
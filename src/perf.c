@@ -0,0 +1,179 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#  include <linux/perf_event.h>
+#  include <sys/ioctl.h>
+#  include <sys/syscall.h>
+#endif /* HAVE_LINUX_PERF_EVENT_H */
+
+#include "perf.h"
+
+PRIVATE const char *g_counter_names[RSSB_PERF_COUNTER_COUNT] = {
+  "cycles",
+  "instructions",
+  "branch-misses",
+  "L1d-misses",
+  "LLC-misses",
+  "dTLB-misses"
+};
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#  define RSSB_PERF_CACHE(cache) \
+  ((cache)                                       \
+   | (PERF_COUNT_HW_CACHE_OP_READ << 8)          \
+   | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+PRIVATE const struct {
+  uint32_t type;
+  uint64_t config;
+} g_counter_events[RSSB_PERF_COUNTER_COUNT] = {
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+  {PERF_TYPE_HW_CACHE, RSSB_PERF_CACHE(PERF_COUNT_HW_CACHE_L1D)},
+  {PERF_TYPE_HW_CACHE, RSSB_PERF_CACHE(PERF_COUNT_HW_CACHE_LL)},
+  {PERF_TYPE_HW_CACHE, RSSB_PERF_CACHE(PERF_COUNT_HW_CACHE_DTLB)}
+};
+
+PRIVATE int
+rssb_perf_open(uint32_t type, uint64_t config)
+{
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(struct perf_event_attr));
+
+  attr.size           = sizeof(struct perf_event_attr);
+  attr.type           = type;
+  attr.config         = config;
+  attr.disabled       = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv     = 1;
+  attr.read_format    =
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif /* HAVE_LINUX_PERF_EVENT_H */
+
+const char *
+rssb_perf_counter_name(enum rssb_perf_counter counter)
+{
+  return g_counter_names[counter];
+}
+
+void
+rssb_perf_destroy(rssb_perf_t *perf)
+{
+  unsigned int i;
+
+  for (i = 0; i < RSSB_PERF_COUNTER_COUNT; ++i)
+    if (perf->fd[i] != -1)
+      close(perf->fd[i]);
+
+  free(perf);
+}
+
+rssb_perf_t *
+rssb_perf_new(void)
+{
+  rssb_perf_t *new = NULL;
+  unsigned int i;
+
+  TRYCATCH(new = malloc(sizeof(rssb_perf_t)), return NULL);
+
+  for (i = 0; i < RSSB_PERF_COUNTER_COUNT; ++i) {
+#ifdef HAVE_LINUX_PERF_EVENT_H
+    new->fd[i] = rssb_perf_open(
+        g_counter_events[i].type,
+        g_counter_events[i].config);
+#else
+    new->fd[i] = -1;
+#endif /* HAVE_LINUX_PERF_EVENT_H */
+  }
+
+  return new;
+}
+
+BOOL
+rssb_perf_available(const rssb_perf_t *perf)
+{
+  unsigned int i;
+
+  for (i = 0; i < RSSB_PERF_COUNTER_COUNT; ++i)
+    if (perf->fd[i] != -1)
+      return TRUE;
+
+  return FALSE;
+}
+
+void
+rssb_perf_start(rssb_perf_t *perf)
+{
+#ifdef HAVE_LINUX_PERF_EVENT_H
+  unsigned int i;
+
+  for (i = 0; i < RSSB_PERF_COUNTER_COUNT; ++i)
+    if (perf->fd[i] != -1) {
+      ioctl(perf->fd[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(perf->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif /* HAVE_LINUX_PERF_EVENT_H */
+}
+
+void
+rssb_perf_stop(rssb_perf_t *perf)
+{
+#ifdef HAVE_LINUX_PERF_EVENT_H
+  unsigned int i;
+
+  for (i = 0; i < RSSB_PERF_COUNTER_COUNT; ++i)
+    if (perf->fd[i] != -1)
+      ioctl(perf->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+#endif /* HAVE_LINUX_PERF_EVENT_H */
+}
+
+/* Counters that were multiplexed out part of the time are scaled up */
+void
+rssb_perf_read(const rssb_perf_t *perf, struct rssb_perf_sample *sample)
+{
+  unsigned int i;
+  uint64_t data[3]; /* value, time enabled, time running */
+
+  memset(sample, 0, sizeof(struct rssb_perf_sample));
+
+  for (i = 0; i < RSSB_PERF_COUNTER_COUNT; ++i)
+    if (perf->fd[i] != -1
+        && read(perf->fd[i], data, sizeof(data)) == sizeof(data)
+        && data[2] > 0) {
+      sample->valid[i] = TRUE;
+      sample->value[i] = data[2] < data[1]
+          ? (uint64_t) ((double) data[0] * data[1] / data[2])
+          : data[0];
+    }
+}
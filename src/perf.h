@@ -0,0 +1,60 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _RSSB_PERF_H
+#define _RSSB_PERF_H
+
+#include <stdint.h>
+
+#include "rssb.h"
+
+enum rssb_perf_counter {
+  RSSB_PERF_CYCLES,
+  RSSB_PERF_INSTRUCTIONS,
+  RSSB_PERF_BRANCH_MISSES,
+  RSSB_PERF_L1D_MISSES,
+  RSSB_PERF_LLC_MISSES,
+  RSSB_PERF_DTLB_MISSES,
+  RSSB_PERF_COUNTER_COUNT
+};
+
+/*
+ * Hardware counters for the calling thread, user space only. Each
+ * counter is opened on its own so that a PMU lacking one event (or a
+ * hypervisor hiding it) still gives us the rest.
+ */
+typedef struct rssb_perf {
+  int fd[RSSB_PERF_COUNTER_COUNT];
+} rssb_perf_t;
+
+struct rssb_perf_sample {
+  BOOL valid[RSSB_PERF_COUNTER_COUNT];
+  uint64_t value[RSSB_PERF_COUNTER_COUNT];
+};
+
+rssb_perf_t *rssb_perf_new(void);
+BOOL rssb_perf_available(const rssb_perf_t *perf);
+void rssb_perf_start(rssb_perf_t *perf);
+void rssb_perf_stop(rssb_perf_t *perf);
+void rssb_perf_read(const rssb_perf_t *perf, struct rssb_perf_sample *sample);
+const char *rssb_perf_counter_name(enum rssb_perf_counter counter);
+void rssb_perf_destroy(rssb_perf_t *perf);
+
+#endif /* _RSSB_PERF_H */
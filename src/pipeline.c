@@ -0,0 +1,171 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+
+#include "pipeline.h"
+
+PRIVATE enum rssb_vm_input
+rssb_pipeline_input(void *private, word_t *ch)
+{
+  struct rssb_pipeline_stage *stage = private;
+  uint8_t c;
+
+  /* About to wait: let the next stage see what we have so far */
+  if (!rssb_ring_ready(stage->in)) {
+    if (stage->out != NULL)
+      rssb_ring_flush(stage->out);
+    else
+      fflush(stdout);
+  }
+
+  if (!rssb_ring_pop(stage->in, &c))
+    return RSSB_VM_INPUT_EOF;
+
+  *ch = c;
+
+  return RSSB_VM_INPUT_READY;
+}
+
+PRIVATE BOOL
+rssb_pipeline_output(void *private, word_t ch)
+{
+  struct rssb_pipeline_stage *stage = private;
+
+  /* The same bytes a pipe between two processes would carry */
+  return rssb_ring_push(stage->out, (uint8_t) ch);
+}
+
+PRIVATE void *
+rssb_pipeline_thread(void *private)
+{
+  struct rssb_pipeline_stage *stage = private;
+
+  (void) rssb_vm_run_for(stage->vm, RSSB_VM_UNLIMITED, &stage->reason);
+
+  if (stage->out != NULL)
+    rssb_ring_close(stage->out);
+  else
+    fflush(stdout);
+
+  if (stage->in != NULL)
+    rssb_ring_abandon(stage->in);
+
+  return NULL;
+}
+
+void
+rssb_pipeline_destroy(rssb_pipeline_t *pipeline)
+{
+  unsigned int i;
+
+  if (pipeline->stages != NULL) {
+    for (i = 0; i < pipeline->count; ++i) {
+      if (pipeline->stages[i].vm != NULL)
+        rssb_vm_destroy(pipeline->stages[i].vm);
+
+      if (pipeline->stages[i].out != NULL)
+        rssb_ring_destroy(pipeline->stages[i].out);
+    }
+
+    free(pipeline->stages);
+  }
+
+  free(pipeline);
+}
+
+/* Takes ownership of the VMs, even on failure */
+rssb_pipeline_t *
+rssb_pipeline_new(rssb_vm_t **vms, unsigned int count, BOOL spin)
+{
+  rssb_pipeline_t *new = NULL;
+  struct rssb_pipeline_stage *stage;
+  unsigned int i;
+
+  TRYCATCH(new = calloc(1, sizeof(rssb_pipeline_t)), goto fail);
+  TRYCATCH(
+      new->stages = calloc(count, sizeof(struct rssb_pipeline_stage)),
+      goto fail);
+
+  new->count = count;
+
+  for (i = 0; i < count; ++i) {
+    stage = new->stages + i;
+    stage->vm = vms[i];
+    vms[i] = NULL;
+
+    if (i > 0)
+      stage->in = new->stages[i - 1].out;
+
+    if (i + 1 < count)
+      TRYCATCH(
+          stage->out = rssb_ring_new(RSSB_PIPELINE_RING_SIZE, spin),
+          goto fail);
+
+    rssb_vm_set_io(
+        stage->vm,
+        stage,
+        stage->in != NULL ? rssb_pipeline_input : NULL,
+        stage->out != NULL ? rssb_pipeline_output : NULL);
+  }
+
+  return new;
+
+fail:
+  for (i = 0; i < count; ++i)
+    if (vms[i] != NULL) {
+      rssb_vm_destroy(vms[i]);
+      vms[i] = NULL;
+    }
+
+  if (new != NULL)
+    rssb_pipeline_destroy(new);
+
+  return NULL;
+}
+
+/* TRUE if the last stage halted */
+BOOL
+rssb_pipeline_run(rssb_pipeline_t *pipeline)
+{
+  unsigned int i, started;
+
+  for (started = 0; started < pipeline->count; ++started)
+    if (pthread_create(
+        &pipeline->stages[started].thread,
+        NULL,
+        rssb_pipeline_thread,
+        pipeline->stages + started) != 0) {
+      fprintf(stderr, "%s: cannot start stage %u\n", __FUNCTION__, started);
+
+      /* What already runs must not wait for it forever */
+      if (pipeline->stages[started].in != NULL)
+        rssb_ring_abandon(pipeline->stages[started].in);
+      break;
+    }
+
+  for (i = 0; i < started; ++i)
+    pthread_join(pipeline->stages[i].thread, NULL);
+
+  return started == pipeline->count
+      && pipeline->stages[pipeline->count - 1].reason == RSSB_VM_REASON_HALTED;
+}
@@ -0,0 +1,56 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+
+#ifndef _RSSB_PIPELINE_H
+#define _RSSB_PIPELINE_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "rssb.h"
+#include "ring.h"
+
+#define RSSB_PIPELINE_RING_SIZE (1 << 16)
+
+struct rssb_pipeline_stage {
+  rssb_vm_t *vm;       /* Owned */
+  rssb_ring_t *in;     /* NULL for the first stage: it reads stdin */
+  rssb_ring_t *out;    /* NULL for the last stage: it writes stdout */
+  enum rssb_vm_reason reason;
+  pthread_t thread;
+};
+
+/*
+ * VMs chained like a shell pipeline, each on its own thread: $OUT of
+ * every stage is $IN of the next one. A stage that finishes closes its
+ * output (the next one reads EOF) and abandons its input (writes from
+ * the previous one fail, as on a broken pipe).
+ */
+typedef struct rssb_pipeline {
+  struct rssb_pipeline_stage *stages;
+  unsigned int count;
+} rssb_pipeline_t;
+
+rssb_pipeline_t *rssb_pipeline_new(rssb_vm_t **vms, unsigned int count, BOOL spin);
+BOOL rssb_pipeline_run(rssb_pipeline_t *pipeline);
+void rssb_pipeline_destroy(rssb_pipeline_t *pipeline);
+
+#endif /* _RSSB_PIPELINE_H */
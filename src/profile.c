@@ -0,0 +1,398 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "profile.h"
+
+/* One row of a report: a (frame, file, line) triple and its counters */
+struct rssb_profile_entry {
+  unsigned int frame;
+  const char *file;
+  int line;
+  uint64_t exec;
+  uint64_t skip;
+};
+
+void
+rssb_profile_destroy(rssb_profile_t *prof)
+{
+  if (prof->exec != NULL)
+    free(prof->exec);
+
+  if (prof->skip != NULL)
+    free(prof->skip);
+
+  free(prof);
+}
+
+rssb_profile_t *
+rssb_profile_new(unsigned int size)
+{
+  rssb_profile_t *new = NULL;
+
+  TRYCATCH(new = calloc(1, sizeof(rssb_profile_t)), goto fail);
+  TRYCATCH(new->exec = calloc(size, sizeof(uint64_t)), goto fail);
+  TRYCATCH(new->skip = calloc(size, sizeof(uint64_t)), goto fail);
+
+  new->size = size;
+
+  return new;
+
+fail:
+  if (new != NULL)
+    rssb_profile_destroy(new);
+
+  return NULL;
+}
+
+PRIVATE int
+rssb_profile_entry_cmp_loc(const void *a, const void *b)
+{
+  const struct rssb_profile_entry *ea = a;
+  const struct rssb_profile_entry *eb = b;
+
+  if (ea->frame != eb->frame)
+    return ea->frame < eb->frame ? -1 : 1;
+
+  /* Files are interned: compare by address */
+  if (ea->file != eb->file)
+    return (uintptr_t) ea->file < (uintptr_t) eb->file ? -1 : 1;
+
+  return ea->line - eb->line;
+}
+
+PRIVATE int
+rssb_profile_entry_cmp_exec(const void *a, const void *b)
+{
+  const struct rssb_profile_entry *ea = a;
+  const struct rssb_profile_entry *eb = b;
+
+  if (ea->exec != eb->exec)
+    return ea->exec > eb->exec ? -1 : 1;
+
+  return rssb_profile_entry_cmp_loc(a, b);
+}
+
+/*
+ * Turns per-address counters into per-location entries. Addresses
+ * without debug info get one entry each, with the address as line.
+ * When `by_frame' is FALSE, all expansions of a line are merged.
+ */
+PRIVATE struct rssb_profile_entry *
+rssb_profile_collect(
+    const rssb_profile_t *prof,
+    const rssb_dbginfo_t *dbg,
+    BOOL by_frame,
+    unsigned int *count)
+{
+  struct rssb_profile_entry *entries = NULL;
+  const struct rssb_dbginfo_loc *loc;
+  unsigned int i, n = 0, p;
+
+  for (i = 0; i < prof->size; ++i)
+    if (prof->exec[i] > 0)
+      ++n;
+
+  TRYCATCH(
+      entries = calloc(n + 1, sizeof(struct rssb_profile_entry)),
+      return NULL);
+
+  for (i = 0, p = 0; i < prof->size; ++i)
+    if (prof->exec[i] > 0) {
+      if (dbg != NULL && (loc = rssb_dbginfo_get_loc(dbg, i)) != NULL) {
+        entries[p].frame = by_frame ? loc->frame : RSSB_DBGINFO_ROOT;
+        entries[p].file  = loc->file;
+        entries[p].line  = loc->line;
+      } else {
+        entries[p].frame = RSSB_DBGINFO_ROOT;
+        entries[p].file  = NULL;
+        entries[p].line  = i;
+      }
+
+      entries[p].exec = prof->exec[i];
+      entries[p].skip = prof->skip[i];
+      ++p;
+    }
+
+  qsort(entries, n, sizeof(struct rssb_profile_entry), rssb_profile_entry_cmp_loc);
+
+  /* Merge entries with the same location */
+  for (i = 0, p = 0; i < n; ++i)
+    if (p > 0 && rssb_profile_entry_cmp_loc(entries + p - 1, entries + i) == 0) {
+      entries[p - 1].exec += entries[i].exec;
+      entries[p - 1].skip += entries[i].skip;
+    } else {
+      entries[p++] = entries[i];
+    }
+
+  *count = p;
+
+  return entries;
+}
+
+PRIVATE void
+rssb_profile_print_loc(FILE *fp, const struct rssb_profile_entry *entry)
+{
+  if (entry->file != NULL)
+    fprintf(fp, "%s:%d", entry->file, entry->line);
+  else
+    fprintf(fp, "0x%08x", entry->line);
+}
+
+PRIVATE BOOL
+rssb_profile_report_flat(
+    const rssb_profile_t *prof,
+    const rssb_dbginfo_t *dbg,
+    FILE *fp)
+{
+  struct rssb_profile_entry *entries;
+  uint64_t total = 0, skips = 0;
+  unsigned int i, count;
+
+  TRYCATCH(entries = rssb_profile_collect(prof, dbg, FALSE, &count), return FALSE);
+
+  qsort(entries, count, sizeof(struct rssb_profile_entry), rssb_profile_entry_cmp_exec);
+
+  for (i = 0; i < count; ++i) {
+    total += entries[i].exec;
+    skips += entries[i].skip;
+  }
+
+  fprintf(
+      fp,
+      "# flat profile: %" PRIu64 " steps, %" PRIu64 " skips\n",
+      total,
+      skips);
+  fprintf(fp, "# %14s %7s %14s  location\n", "steps", "%", "skips");
+
+  for (i = 0; i < count; ++i) {
+    fprintf(
+        fp,
+        "  %14" PRIu64 " %6.2f%% %14" PRIu64 "  ",
+        entries[i].exec,
+        100. * entries[i].exec / total,
+        entries[i].skip);
+    rssb_profile_print_loc(fp, entries + i);
+    fputc('\n', fp);
+  }
+
+  free(entries);
+
+  return TRUE;
+}
+
+struct rssb_profile_node {
+  uint64_t self;
+  uint64_t incl;
+  unsigned int first_child;
+  unsigned int next_sibling;
+};
+
+struct rssb_profile_rank {
+  uint64_t incl;
+  unsigned int frame;
+};
+
+PRIVATE int
+rssb_profile_rank_cmp(const void *a, const void *b)
+{
+  const struct rssb_profile_rank *ra = a;
+  const struct rssb_profile_rank *rb = b;
+
+  if (ra->incl != rb->incl)
+    return ra->incl < rb->incl ? -1 : 1;
+
+  return ra->frame < rb->frame ? 1 : -1;
+}
+
+PRIVATE void
+rssb_profile_print_node(
+    FILE *fp,
+    const rssb_dbginfo_t *dbg,
+    const struct rssb_profile_node *nodes,
+    unsigned int frame,
+    unsigned int depth,
+    uint64_t total)
+{
+  const struct rssb_dbginfo_frame *info;
+  unsigned int i;
+
+  if (nodes[frame].incl == 0)
+    return;
+
+  fprintf(
+      fp,
+      "  %14" PRIu64 " %14" PRIu64 " %6.2f%%  %*s",
+      nodes[frame].incl,
+      nodes[frame].self,
+      100. * nodes[frame].incl / total,
+      2 * depth,
+      "");
+
+  if (frame == RSSB_DBGINFO_ROOT) {
+    fprintf(fp, "<main program>\n");
+  } else {
+    info = rssb_dbginfo_get_frame(dbg, frame);
+    fprintf(fp, "%s (%s:%d)\n", info->macro, info->file, info->line);
+  }
+
+  for (i = nodes[frame].first_child; i != 0; i = nodes[i].next_sibling)
+    rssb_profile_print_node(fp, dbg, nodes, i, depth + 1, total);
+}
+
+PRIVATE BOOL
+rssb_profile_report_tree(
+    const rssb_profile_t *prof,
+    const rssb_dbginfo_t *dbg,
+    FILE *fp)
+{
+  struct rssb_profile_node *nodes = NULL;
+  struct rssb_profile_entry *entries = NULL;
+  const struct rssb_dbginfo_frame *info;
+  unsigned int frames = dbg != NULL ? dbg->frame_count : 1;
+  struct rssb_profile_rank *order = NULL;
+  unsigned int i, count;
+  BOOL ok = FALSE;
+
+  TRYCATCH(entries = rssb_profile_collect(prof, dbg, TRUE, &count), goto done);
+  TRYCATCH(nodes = calloc(frames, sizeof(struct rssb_profile_node)), goto done);
+  TRYCATCH(order = calloc(frames, sizeof(struct rssb_profile_rank)), goto done);
+
+  for (i = 0; i < count; ++i)
+    nodes[entries[i].frame].self += entries[i].exec;
+
+  /* Children always have higher indices than their parents */
+  for (i = 0; i < frames; ++i)
+    nodes[i].incl = nodes[i].self;
+
+  for (i = frames; i-- > 1;) {
+    info = rssb_dbginfo_get_frame(dbg, i);
+    nodes[info->parent].incl += nodes[i].incl;
+  }
+
+  /* Link children, hottest first: insert in ascending order at head */
+  for (i = 1; i < frames; ++i) {
+    order[i - 1].incl  = nodes[i].incl;
+    order[i - 1].frame = i;
+  }
+
+  qsort(order, frames - 1, sizeof(struct rssb_profile_rank), rssb_profile_rank_cmp);
+
+  for (i = 0; i < frames - 1; ++i) {
+    info = rssb_dbginfo_get_frame(dbg, order[i].frame);
+    nodes[order[i].frame].next_sibling = nodes[info->parent].first_child;
+    nodes[info->parent].first_child = order[i].frame;
+  }
+
+  fprintf(
+      fp,
+      "# call tree: %" PRIu64 " steps\n",
+      nodes[RSSB_DBGINFO_ROOT].incl);
+  fprintf(fp, "# %14s %14s %7s  frame\n", "inclusive", "self", "%");
+
+  if (nodes[RSSB_DBGINFO_ROOT].incl > 0)
+    rssb_profile_print_node(
+        fp,
+        dbg,
+        nodes,
+        RSSB_DBGINFO_ROOT,
+        0,
+        nodes[RSSB_DBGINFO_ROOT].incl);
+
+  ok = TRUE;
+
+done:
+  if (entries != NULL)
+    free(entries);
+
+  if (nodes != NULL)
+    free(nodes);
+
+  if (order != NULL)
+    free(order);
+
+  return ok;
+}
+
+PRIVATE void
+rssb_profile_print_stack(
+    FILE *fp,
+    const rssb_dbginfo_t *dbg,
+    unsigned int frame)
+{
+  const struct rssb_dbginfo_frame *info;
+
+  if (frame == RSSB_DBGINFO_ROOT) {
+    fprintf(fp, "main");
+    return;
+  }
+
+  info = rssb_dbginfo_get_frame(dbg, frame);
+  rssb_profile_print_stack(fp, dbg, info->parent);
+  fprintf(fp, ";%s@%s:%d", info->macro, info->file, info->line);
+}
+
+/* Brendan Gregg's collapsed stack format, one line per stack */
+PRIVATE BOOL
+rssb_profile_report_collapsed(
+    const rssb_profile_t *prof,
+    const rssb_dbginfo_t *dbg,
+    FILE *fp)
+{
+  struct rssb_profile_entry *entries;
+  unsigned int i, count;
+
+  TRYCATCH(entries = rssb_profile_collect(prof, dbg, TRUE, &count), return FALSE);
+
+  for (i = 0; i < count; ++i) {
+    rssb_profile_print_stack(fp, dbg, entries[i].frame);
+    fputc(';', fp);
+    rssb_profile_print_loc(fp, entries + i);
+    fprintf(fp, " %" PRIu64 "\n", entries[i].exec);
+  }
+
+  free(entries);
+
+  return TRUE;
+}
+
+BOOL
+rssb_profile_report(
+    const rssb_profile_t *prof,
+    const rssb_dbginfo_t *dbg,
+    enum rssb_profile_view view,
+    FILE *fp)
+{
+  switch (view) {
+    case RSSB_PROFILE_VIEW_FLAT:
+      return rssb_profile_report_flat(prof, dbg, fp);
+
+    case RSSB_PROFILE_VIEW_TREE:
+      return rssb_profile_report_tree(prof, dbg, fp);
+
+    case RSSB_PROFILE_VIEW_COLLAPSED:
+      return rssb_profile_report_collapsed(prof, dbg, fp);
+  }
+
+  return FALSE;
+}
@@ -0,0 +1,51 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _RSSB_PROFILE_H
+#define _RSSB_PROFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "rssb.h"
+#include "dbginfo.h"
+
+enum rssb_profile_view {
+  RSSB_PROFILE_VIEW_FLAT,
+  RSSB_PROFILE_VIEW_TREE,
+  RSSB_PROFILE_VIEW_COLLAPSED
+};
+
+/* Per-address counters, same layout as vm->mem */
+typedef struct rssb_profile {
+  unsigned int size;
+  uint64_t *exec;
+  uint64_t *skip;
+} rssb_profile_t;
+
+rssb_profile_t *rssb_profile_new(unsigned int size);
+BOOL rssb_profile_report(
+    const rssb_profile_t *prof,
+    const rssb_dbginfo_t *dbg,
+    enum rssb_profile_view view,
+    FILE *fp);
+void rssb_profile_destroy(rssb_profile_t *prof);
+
+#endif /* _RSSB_PROFILE_H */
@@ -0,0 +1,1877 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "regions.h"
+
+/*
+ * What a word (or $A) may hold: up to RSSB_REGIONS_SET_MAX values, or
+ * every value from v[0] to v[1] once there are more. Values are as
+ * masked reads see them.
+ */
+#define RSSB_REGIONS_SET_MAX 8
+#define RSSB_REGIONS_RANGE   (RSSB_REGIONS_SET_MAX + 1)
+
+/* Ranges that keep growing are widened to the end they grow towards */
+#define RSSB_REGIONS_WIDEN   8
+
+/* Pairs subtracted one by one before falling back to ranges */
+#define RSSB_REGIONS_PAIRS   64
+
+/*
+ * Most values of a word tried one by one to split it between the two
+ * branches of a skip, and most addresses a computed jump is followed to
+ */
+#define RSSB_REGIONS_SPREAD  4096
+
+/* Rows and nodes allocated at first, doubled as needed */
+#define RSSB_REGIONS_SLOTS   16
+#define RSSB_REGIONS_NODES   256
+
+/*
+ * Skips whose two sides are told apart: getting to a word after each
+ * way the last few went makes a node of its own
+ */
+#define RSSB_REGIONS_TRAIL   6
+
+/* A term that is a value of its own */
+#define RSSB_REGIONS_NO_ROOT 0xffffffffu
+
+/* The exit sequence: the VM halts before fetching with these */
+#define RSSB_REGIONS_EXIT_IP 2
+#define RSSB_REGIONS_EXIT_A  1
+
+struct rssb_regions_value {
+  unsigned int count;  /* 0 if nothing yet */
+  unsigned int widen;  /* Times the range grew */
+  word_t v[RSSB_REGIONS_SET_MAX];
+};
+
+/*
+ * What $A or a word holds: `value', or k * (what `root' holds) + o.
+ * The latter keeps track of `rssb X' leaving $A and X the same, and of
+ * the negations and offsets the macro library builds comparisons with,
+ * so that X - $A comes out exact however little is known about either.
+ */
+struct rssb_regions_term {
+  struct rssb_regions_value value;
+  word_t root;
+  word_t k;
+  word_t o;
+};
+
+struct rssb_regions_pass {
+  const rssb_vm_t *vm;
+  rssb_regions_t *regions;
+  BOOL full; /* Masked reads see whole words */
+
+  /*
+   * Nodes: words reached from $IP, each as many times as it is got to
+   * after different skips. Per word, 1 + index in `acc' of its last
+   * node, or 0.
+   */
+  unsigned int *node;
+  struct rssb_regions_term *acc; /* $A on getting there */
+  word_t *reached;               /* Per node, its word */
+  unsigned int *next;            /* Per node, the one before at its word */
+  unsigned int *trail;           /* Per node, how the last skips went */
+  unsigned int reached_count;
+  unsigned int node_alloc;
+  unsigned int path; /* Trail of the node flowed to */
+
+  /*
+   * Words stored to by instructions that name a single address are
+   * followed along each path: `env' holds what each of them holds on
+   * getting to each node, one row per node, with an empty value for a
+   * word still as in the image.
+   */
+  unsigned int *slot; /* Per word, 1 + index in `slot_addr', or 0 */
+  word_t *slot_addr;
+  unsigned int slot_count;
+  unsigned int slot_alloc;
+  struct rssb_regions_term *env;
+  struct rssb_regions_term *scratch; /* Row of the node being stepped */
+  struct rssb_regions_term *out;     /* Row it flows out with */
+
+  /*
+   * Words stored to through a range of addresses: what they may hold
+   * anywhere. Per word, 1 + index in `values', or 0.
+   */
+  unsigned int *contents;
+  struct rssb_regions_value *values;
+  unsigned int value_count;
+  unsigned int value_alloc;
+  BOOL grown; /* Some `contents' grew since the last round */
+
+  uint8_t *queued; /* Per node */
+  unsigned int *stack;
+  unsigned int stack_count;
+
+  uint8_t *written;
+  word_t *stores;
+  unsigned int store_count;
+};
+
+PRIVATE const char *g_region_names[] = {
+  "data",
+  "code",
+  "written"
+};
+
+const char *
+rssb_regions_name(enum rssb_region region)
+{
+  return g_region_names[region];
+}
+
+void
+rssb_regions_destroy(rssb_regions_t *regions)
+{
+  if (regions->class != NULL)
+    free(regions->class);
+
+  free(regions);
+}
+
+PRIVATE void
+rssb_regions_pass_finalize(struct rssb_regions_pass *pass)
+{
+  if (pass->node != NULL)
+    free(pass->node);
+
+  if (pass->acc != NULL)
+    free(pass->acc);
+
+  if (pass->reached != NULL)
+    free(pass->reached);
+
+  if (pass->next != NULL)
+    free(pass->next);
+
+  if (pass->trail != NULL)
+    free(pass->trail);
+
+  if (pass->slot != NULL)
+    free(pass->slot);
+
+  if (pass->slot_addr != NULL)
+    free(pass->slot_addr);
+
+  if (pass->env != NULL)
+    free(pass->env);
+
+  if (pass->scratch != NULL)
+    free(pass->scratch);
+
+  if (pass->out != NULL)
+    free(pass->out);
+
+  if (pass->contents != NULL)
+    free(pass->contents);
+
+  if (pass->values != NULL)
+    free(pass->values);
+
+  if (pass->queued != NULL)
+    free(pass->queued);
+
+  if (pass->stack != NULL)
+    free(pass->stack);
+
+  if (pass->written != NULL)
+    free(pass->written);
+
+  if (pass->stores != NULL)
+    free(pass->stores);
+}
+
+/* Memory holds word_size bytes per word: stores drop the rest */
+PRIVATE word_t
+rssb_regions_truncate(const rssb_vm_t *vm, word_t word)
+{
+  if (vm->word_size == sizeof(uint32_t))
+    return word;
+
+  return word & ((1u << (8 * vm->word_size)) - 1);
+}
+
+PRIVATE void
+rssb_regions_value_clear(struct rssb_regions_value *value)
+{
+  value->count = 0;
+  value->widen = 0;
+}
+
+PRIVATE void
+rssb_regions_value_const(struct rssb_regions_value *value, word_t word)
+{
+  value->count = 1;
+  value->widen = 0;
+  value->v[0]  = word;
+}
+
+PRIVATE void
+rssb_regions_value_range(
+    struct rssb_regions_value *value,
+    word_t lo,
+    word_t hi)
+{
+  value->count = RSSB_REGIONS_RANGE;
+  value->v[0]  = lo;
+  value->v[1]  = hi;
+}
+
+PRIVATE void
+rssb_regions_value_any(
+    const struct rssb_regions_pass *pass,
+    struct rssb_regions_value *value)
+{
+  rssb_regions_value_range(value, 0, pass->vm->mem_mask);
+}
+
+PRIVATE void
+rssb_regions_value_hull(
+    const struct rssb_regions_value *value,
+    word_t *lo,
+    word_t *hi)
+{
+  unsigned int i;
+
+  if (value->count == RSSB_REGIONS_RANGE) {
+    *lo = value->v[0];
+    *hi = value->v[1];
+    return;
+  }
+
+  *lo = *hi = value->v[0];
+  for (i = 1; i < value->count; ++i) {
+    if (value->v[i] < *lo)
+      *lo = value->v[i];
+    if (value->v[i] > *hi)
+      *hi = value->v[i];
+  }
+}
+
+/* How many values it stands for */
+PRIVATE uint64_t
+rssb_regions_value_size(const struct rssb_regions_value *value)
+{
+  if (value->count == RSSB_REGIONS_RANGE)
+    return (uint64_t) value->v[1] - value->v[0] + 1;
+
+  return value->count;
+}
+
+/* The i-th of the values it stands for */
+PRIVATE word_t
+rssb_regions_value_at(const struct rssb_regions_value *value, uint64_t i)
+{
+  if (value->count == RSSB_REGIONS_RANGE)
+    return value->v[0] + i;
+
+  return value->v[i];
+}
+
+/* Grows `value' to hold every word from lo to hi. Returns TRUE if it grew */
+PRIVATE BOOL
+rssb_regions_value_extend(
+    struct rssb_regions_value *value,
+    word_t lo,
+    word_t hi)
+{
+  word_t old_lo, old_hi;
+
+  if (value->count == 0) {
+    rssb_regions_value_range(value, lo, hi);
+    return TRUE;
+  }
+
+  rssb_regions_value_hull(value, &old_lo, &old_hi);
+
+  if (value->count == RSSB_REGIONS_RANGE && lo >= old_lo && hi <= old_hi)
+    return FALSE;
+
+  rssb_regions_value_range(
+      value,
+      lo < old_lo ? lo : old_lo,
+      hi > old_hi ? hi : old_hi);
+
+  return TRUE;
+}
+
+PRIVATE BOOL
+rssb_regions_value_add(struct rssb_regions_value *value, word_t word)
+{
+  unsigned int i;
+
+  if (value->count == RSSB_REGIONS_RANGE)
+    return rssb_regions_value_extend(value, word, word);
+
+  for (i = 0; i < value->count; ++i)
+    if (value->v[i] == word)
+      return FALSE;
+
+  if (value->count == RSSB_REGIONS_SET_MAX)
+    return rssb_regions_value_extend(value, word, word);
+
+  value->v[value->count++] = word;
+
+  return TRUE;
+}
+
+/* Adds everything in `from' to `value' */
+PRIVATE BOOL
+rssb_regions_value_join(
+    struct rssb_regions_value *value,
+    const struct rssb_regions_value *from)
+{
+  BOOL grown = FALSE;
+  unsigned int i;
+
+  if (from->count == RSSB_REGIONS_RANGE)
+    grown = rssb_regions_value_extend(value, from->v[0], from->v[1]);
+  else
+    for (i = 0; i < from->count; ++i)
+      grown |= rssb_regions_value_add(value, from->v[i]);
+
+  return grown;
+}
+
+/*
+ * Joins into what is kept for a node. A range that keeps growing is
+ * widened to the end it grows towards, so that loops stepping a
+ * pointer or a counter do not take one round per value.
+ */
+PRIVATE BOOL
+rssb_regions_value_merge(
+    const struct rssb_regions_pass *pass,
+    struct rssb_regions_value *value,
+    const struct rssb_regions_value *from)
+{
+  word_t lo = 0, hi = 0;
+  BOOL ranged = value->count == RSSB_REGIONS_RANGE;
+
+  if (ranged)
+    rssb_regions_value_hull(value, &lo, &hi);
+
+  if (!rssb_regions_value_join(value, from))
+    return FALSE;
+
+  if (ranged && ++value->widen > RSSB_REGIONS_WIDEN) {
+    if (value->v[0] < lo)
+      value->v[0] = 0;
+    if (value->v[1] > hi)
+      value->v[1] = pass->vm->mem_mask;
+  }
+
+  return TRUE;
+}
+
+/* k * v + o for every v in `value' */
+PRIVATE void
+rssb_regions_value_affine(
+    const struct rssb_regions_pass *pass,
+    const struct rssb_regions_value *value,
+    word_t k,
+    word_t o,
+    struct rssb_regions_value *result)
+{
+  word_t mask = pass->vm->mem_mask;
+  uint64_t lo, hi;
+  unsigned int i;
+
+  k &= mask;
+  o &= mask;
+
+  if (value->count != RSSB_REGIONS_RANGE) {
+    rssb_regions_value_clear(result);
+    for (i = 0; i < value->count; ++i)
+      rssb_regions_value_add(result, (k * value->v[i] + o) & mask);
+    return;
+  }
+
+  if (k == 0) {
+    rssb_regions_value_const(result, o);
+    return;
+  }
+
+  /* Negated: -hi to -lo, as long as 0 is not in there */
+  if (k == mask) {
+    if (value->v[0] == 0) {
+      rssb_regions_value_any(pass, result);
+      return;
+    }
+
+    lo = (uint64_t) mask + 1 - value->v[1];
+    hi = (uint64_t) mask + 1 - value->v[0];
+  } else {
+    lo = (uint64_t) k * value->v[0];
+    hi = (uint64_t) k * value->v[1];
+  }
+
+  lo += o;
+  hi += o;
+
+  /* Ranges that wrap around are every value */
+  if (hi - lo > mask || (lo > mask) != (hi > mask)) {
+    rssb_regions_value_any(pass, result);
+    return;
+  }
+
+  rssb_regions_value_range(result, lo & mask, hi & mask);
+}
+
+PRIVATE BOOL
+rssb_regions_skips(const rssb_vm_t *vm, word_t word, word_t acc)
+{
+  if (vm->dumb_mode)
+    return !!((word - acc) & vm->mem_neg_mask);
+
+  return acc > word;
+}
+
+/* Adds word - acc to `noskip' or `skip', for every pair of values */
+PRIVATE void
+rssb_regions_sub(
+    const struct rssb_regions_pass *pass,
+    const struct rssb_regions_value *word,
+    const struct rssb_regions_value *acc,
+    struct rssb_regions_value *noskip,
+    struct rssb_regions_value *skip)
+{
+  const rssb_vm_t *vm = pass->vm;
+  int64_t m = (int64_t) vm->mem_mask + 1;
+  int64_t half = vm->mem_neg_mask;
+  int64_t lo, hi, part_lo[2], part_hi[2];
+  word_t word_lo, word_hi, acc_lo, acc_hi;
+  unsigned int i, j;
+
+  if (word->count == 0 || acc->count == 0)
+    return;
+
+  if (word->count != RSSB_REGIONS_RANGE
+      && acc->count != RSSB_REGIONS_RANGE
+      && word->count * acc->count <= RSSB_REGIONS_PAIRS) {
+    for (i = 0; i < word->count; ++i)
+      for (j = 0; j < acc->count; ++j)
+        rssb_regions_value_add(
+            rssb_regions_skips(vm, word->v[i], acc->v[j]) ? skip : noskip,
+            (word->v[i] - acc->v[j]) & vm->mem_mask);
+
+    return;
+  }
+
+  rssb_regions_value_hull(word, &word_lo, &word_hi);
+  rssb_regions_value_hull(acc, &acc_lo, &acc_hi);
+
+  /* Differences before wrapping, borrowed below 0 and not borrowed */
+  lo = (int64_t) word_lo - acc_hi;
+  hi = (int64_t) word_hi - acc_lo;
+
+  part_lo[0] = lo < 0 ? 0 : lo;
+  part_hi[0] = hi;
+  part_lo[1] = lo + m;
+  part_hi[1] = (hi < 0 ? hi : -1) + m;
+
+  for (i = 0; i < 2; ++i) {
+    if (part_lo[i] > part_hi[i])
+      continue;
+
+    if (!vm->dumb_mode) {
+      rssb_regions_value_extend(
+          i == 0 ? noskip : skip,
+          part_lo[i],
+          part_hi[i]);
+      continue;
+    }
+
+    /* The sign bit tells */
+    if (part_lo[i] < half)
+      rssb_regions_value_extend(
+          noskip,
+          part_lo[i],
+          part_hi[i] < half ? part_hi[i] : half - 1);
+
+    if (part_hi[i] >= half)
+      rssb_regions_value_extend(
+          skip,
+          part_lo[i] < half ? half : part_lo[i],
+          part_hi[i]);
+  }
+}
+
+PRIVATE void
+rssb_regions_term_plain(
+    struct rssb_regions_term *term,
+    const struct rssb_regions_value *value)
+{
+  term->value = *value;
+  term->root  = RSSB_REGIONS_NO_ROOT;
+}
+
+PRIVATE void
+rssb_regions_term_link(
+    struct rssb_regions_term *term,
+    word_t root,
+    word_t k,
+    word_t o)
+{
+  rssb_regions_value_clear(&term->value);
+  term->root = root;
+  term->k    = k;
+  term->o    = o;
+}
+
+PRIVATE BOOL
+rssb_regions_give_up(struct rssb_regions_pass *pass, word_t ip, const char *why)
+{
+  pass->regions->bounded = FALSE;
+  pass->regions->stop    = ip;
+  pass->regions->why     = why;
+
+  return FALSE;
+}
+
+PRIVATE void
+rssb_regions_queue(struct rssb_regions_pass *pass, unsigned int index)
+{
+  if (!pass->queued[index]) {
+    pass->queued[index] = 1;
+    pass->stack[pass->stack_count++] = index;
+  }
+}
+
+PRIVATE void
+rssb_regions_image(
+    const struct rssb_regions_pass *pass,
+    word_t addr,
+    struct rssb_regions_value *value)
+{
+  rssb_regions_value_const(
+      value,
+      rssb_vm_peek(pass->vm, addr) & pass->vm->mem_mask);
+}
+
+PRIVATE void
+rssb_regions_mark_written(struct rssb_regions_pass *pass, word_t addr)
+{
+  if (!pass->written[addr]) {
+    pass->written[addr] = 1;
+    pass->stores[pass->store_count++] = addr;
+  }
+}
+
+PRIVATE void rssb_regions_eval(
+    const struct rssb_regions_pass *pass,
+    const struct rssb_regions_term *env,
+    const struct rssb_regions_term *term,
+    struct rssb_regions_value *value);
+
+/* What reading `addr' may give, with `env' the row of the current node */
+PRIVATE void
+rssb_regions_read(
+    const struct rssb_regions_pass *pass,
+    const struct rssb_regions_term *env,
+    word_t addr,
+    struct rssb_regions_value *value)
+{
+  unsigned int slot = pass->slot[addr];
+
+  if (slot != 0
+      && (env[slot - 1].root != RSSB_REGIONS_NO_ROOT
+        || env[slot - 1].value.count != 0))
+    rssb_regions_eval(pass, env, env + slot - 1, value);
+  else
+    rssb_regions_image(pass, addr, value);
+
+  if (pass->contents[addr] != 0)
+    rssb_regions_value_join(value, pass->values + pass->contents[addr] - 1);
+}
+
+PRIVATE void
+rssb_regions_eval(
+    const struct rssb_regions_pass *pass,
+    const struct rssb_regions_term *env,
+    const struct rssb_regions_term *term,
+    struct rssb_regions_value *value)
+{
+  struct rssb_regions_value root;
+
+  if (term->root == RSSB_REGIONS_NO_ROOT) {
+    *value = term->value;
+    return;
+  }
+
+  rssb_regions_read(pass, env, term->root, &root);
+  rssb_regions_value_affine(pass, &root, term->k, term->o, value);
+}
+
+/*
+ * Rebuilds `term' on the word the one it is built on is built on, and
+ * so on, as long as what they hold is known along this path.
+ */
+PRIVATE void
+rssb_regions_resolve(
+    const struct rssb_regions_pass *pass,
+    const struct rssb_regions_term *env,
+    struct rssb_regions_term *term)
+{
+  const struct rssb_regions_term *link;
+  unsigned int slot, n;
+
+  for (n = 0; n < pass->slot_count && term->root != RSSB_REGIONS_NO_ROOT; ++n) {
+    slot = pass->slot[term->root];
+    if (slot == 0 || pass->contents[term->root] != 0)
+      break;
+
+    link = env + slot - 1;
+    if (link->root == RSSB_REGIONS_NO_ROOT)
+      break;
+
+    term->o    = term->k * link->o + term->o;
+    term->k    = term->k * link->k;
+    term->root = link->root;
+  }
+}
+
+/* Terms in `row' built on `root' become plain values: it is changing */
+PRIVATE void
+rssb_regions_unlink(
+    const struct rssb_regions_pass *pass,
+    struct rssb_regions_term *row,
+    word_t lo,
+    word_t hi)
+{
+  struct rssb_regions_value value;
+  unsigned int i;
+
+  for (i = 0; i < pass->slot_count; ++i)
+    if (row[i].root != RSSB_REGIONS_NO_ROOT
+        && row[i].root >= lo
+        && row[i].root <= hi) {
+      rssb_regions_eval(pass, row, row + i, &value);
+      rssb_regions_term_plain(row + i, &value);
+    }
+}
+
+/* Rows are `slot_alloc' terms long: growing it moves every row */
+PRIVATE BOOL
+rssb_regions_grow_slots(struct rssb_regions_pass *pass)
+{
+  struct rssb_regions_term *env = NULL;
+  struct rssb_regions_term *tmp;
+  unsigned int alloc = 2 * pass->slot_alloc;
+  unsigned int i;
+  word_t *addrs;
+
+  TRYCATCH(
+      env = calloc(
+          (size_t) pass->node_alloc * alloc,
+          sizeof(struct rssb_regions_term)),
+      return FALSE);
+
+  for (i = 0; i < pass->reached_count; ++i)
+    memcpy(
+        env + (size_t) i * alloc,
+        pass->env + (size_t) i * pass->slot_alloc,
+        pass->slot_count * sizeof(struct rssb_regions_term));
+
+  free(pass->env);
+  pass->env = env;
+
+  TRYCATCH(
+      addrs = realloc(pass->slot_addr, alloc * sizeof(word_t)),
+      return FALSE);
+  pass->slot_addr = addrs;
+
+  TRYCATCH(
+      tmp = realloc(pass->scratch, alloc * sizeof(struct rssb_regions_term)),
+      return FALSE);
+  pass->scratch = tmp;
+
+  TRYCATCH(
+      tmp = realloc(pass->out, alloc * sizeof(struct rssb_regions_term)),
+      return FALSE);
+  pass->out = tmp;
+
+  pass->slot_alloc = alloc;
+
+  return TRUE;
+}
+
+PRIVATE void
+rssb_regions_row_init(
+    const struct rssb_regions_pass *pass,
+    struct rssb_regions_term *row,
+    unsigned int from)
+{
+  unsigned int i;
+
+  for (i = from; i < pass->slot_alloc; ++i) {
+    rssb_regions_value_clear(&row[i].value);
+    row[i].root = RSSB_REGIONS_NO_ROOT;
+  }
+}
+
+/* Gives `addr' a slot, still as in the image on every row */
+PRIVATE BOOL
+rssb_regions_track(struct rssb_regions_pass *pass, word_t addr)
+{
+  struct rssb_regions_value empty;
+  unsigned int i, alloc;
+
+  if (pass->slot[addr] != 0)
+    return TRUE;
+
+  rssb_regions_value_clear(&empty);
+
+  if (pass->slot_count == pass->slot_alloc) {
+    alloc = pass->slot_alloc;
+
+    if (!rssb_regions_grow_slots(pass))
+      return rssb_regions_give_up(pass, addr, "out of memory");
+
+    for (i = 0; i < pass->reached_count; ++i)
+      rssb_regions_row_init(
+          pass,
+          pass->env + (size_t) i * pass->slot_alloc,
+          alloc);
+
+    rssb_regions_row_init(pass, pass->scratch, alloc);
+    rssb_regions_row_init(pass, pass->out, alloc);
+  }
+
+  /* The rows of the node being stepped were copied without it */
+  rssb_regions_term_plain(pass->scratch + pass->slot_count, &empty);
+  rssb_regions_term_plain(pass->out + pass->slot_count, &empty);
+
+  pass->slot_addr[pass->slot_count] = addr;
+  pass->slot[addr] = ++pass->slot_count;
+
+  return TRUE;
+}
+
+PRIVATE BOOL
+rssb_regions_grow_nodes(struct rssb_regions_pass *pass)
+{
+  struct rssb_regions_term *env;
+  struct rssb_regions_term *acc;
+  word_t *reached;
+  unsigned int *next, *trail, *stack;
+  uint8_t *queued;
+  unsigned int alloc = 2 * pass->node_alloc;
+
+  TRYCATCH(
+      acc = realloc(pass->acc, alloc * sizeof(struct rssb_regions_term)),
+      return FALSE);
+  pass->acc = acc;
+
+  TRYCATCH(
+      reached = realloc(pass->reached, alloc * sizeof(word_t)),
+      return FALSE);
+  pass->reached = reached;
+
+  TRYCATCH(
+      next = realloc(pass->next, alloc * sizeof(unsigned int)),
+      return FALSE);
+  pass->next = next;
+
+  TRYCATCH(
+      trail = realloc(pass->trail, alloc * sizeof(unsigned int)),
+      return FALSE);
+  pass->trail = trail;
+
+  TRYCATCH(
+      stack = realloc(pass->stack, alloc * sizeof(unsigned int)),
+      return FALSE);
+  pass->stack = stack;
+
+  TRYCATCH(
+      queued = realloc(pass->queued, alloc * sizeof(uint8_t)),
+      return FALSE);
+  memset(queued + pass->node_alloc, 0, alloc - pass->node_alloc);
+  pass->queued = queued;
+
+  TRYCATCH(
+      env = realloc(
+          pass->env,
+          (size_t) alloc * pass->slot_alloc
+            * sizeof(struct rssb_regions_term)),
+      return FALSE);
+  pass->env = env;
+
+  pass->node_alloc = alloc;
+
+  return TRUE;
+}
+
+/* Whether storing `value' to `addr' leaves it as in the image */
+PRIVATE BOOL
+rssb_regions_unchanged(
+    const struct rssb_regions_pass *pass,
+    word_t addr,
+    const struct rssb_regions_value *value)
+{
+  return value->count == 1
+    && rssb_regions_truncate(pass->vm, value->v[0])
+      == rssb_vm_peek(pass->vm, addr);
+}
+
+/* Records that `addr' may be stored `value', from anywhere */
+PRIVATE BOOL
+rssb_regions_write_any(
+    struct rssb_regions_pass *pass,
+    word_t addr,
+    const struct rssb_regions_value *value)
+{
+  struct rssb_regions_value *tmp;
+  unsigned int alloc;
+
+  if (value->count == 0)
+    return TRUE;
+
+  if (pass->contents[addr] == 0) {
+    if (rssb_regions_unchanged(pass, addr, value))
+      return TRUE;
+
+    if (pass->value_count == pass->value_alloc) {
+      alloc = pass->value_alloc == 0 ? 256 : 2 * pass->value_alloc;
+
+      TRYCATCH(
+          tmp = realloc(
+              pass->values,
+              alloc * sizeof(struct rssb_regions_value)),
+          return rssb_regions_give_up(pass, addr, "out of memory"));
+
+      pass->values      = tmp;
+      pass->value_alloc = alloc;
+    }
+
+    rssb_regions_image(pass, addr, pass->values + pass->value_count);
+    pass->contents[addr] = ++pass->value_count;
+    rssb_regions_mark_written(pass, addr);
+    pass->grown = TRUE;
+  }
+
+  if (rssb_regions_value_merge(
+      pass,
+      pass->values + pass->contents[addr] - 1,
+      value))
+    pass->grown = TRUE;
+
+  return TRUE;
+}
+
+/*
+ * Stores `term' to `addr' in the outgoing row, or joins it to what was
+ * there if `weak'. Words stored to this way the first time get their
+ * own slot.
+ */
+PRIVATE BOOL
+rssb_regions_write(
+    struct rssb_regions_pass *pass,
+    word_t addr,
+    const struct rssb_regions_term *term,
+    BOOL weak)
+{
+  struct rssb_regions_value value, old;
+
+  rssb_regions_eval(pass, pass->out, term, &value);
+  if (value.count == 0)
+    return TRUE;
+
+  if (!rssb_regions_unchanged(pass, addr, &value))
+    rssb_regions_mark_written(pass, addr);
+  else if (pass->slot[addr] == 0)
+    return TRUE;
+
+  if (!rssb_regions_track(pass, addr))
+    return FALSE;
+
+  if (weak) {
+    rssb_regions_read(pass, pass->out, addr, &old);
+    rssb_regions_value_join(&value, &old);
+    rssb_regions_unlink(pass, pass->out, addr, addr);
+    rssb_regions_term_plain(pass->out + pass->slot[addr] - 1, &value);
+  } else if (term->root == addr) {
+    /* Words linked to this one still hold what they did if it is kept */
+    if (term->k != 1 || term->o != 0)
+      rssb_regions_unlink(pass, pass->out, addr, addr);
+    rssb_regions_term_plain(pass->out + pass->slot[addr] - 1, &value);
+  } else {
+    rssb_regions_unlink(pass, pass->out, addr, addr);
+    pass->out[pass->slot[addr] - 1] = *term;
+  }
+
+  return TRUE;
+}
+
+/* Whether `term' gives `value', and only that, seen from `env' */
+PRIVATE BOOL
+rssb_regions_holds(
+    const struct rssb_regions_pass *pass,
+    const struct rssb_regions_term *env,
+    const struct rssb_regions_term *term,
+    const struct rssb_regions_value *value)
+{
+  struct rssb_regions_value result;
+
+  if (value->count != 1)
+    return FALSE;
+
+  rssb_regions_eval(pass, env, term, &result);
+
+  return result.count == 1 && result.v[0] == value->v[0];
+}
+
+/* Joins `from', as seen from `from_env', into `term', as seen from `env' */
+PRIVATE BOOL
+rssb_regions_term_merge(
+    const struct rssb_regions_pass *pass,
+    word_t addr,
+    const struct rssb_regions_term *env,
+    struct rssb_regions_term *term,
+    const struct rssb_regions_term *from_env,
+    const struct rssb_regions_term *from)
+{
+  struct rssb_regions_value value, from_value;
+
+  if (term->root != RSSB_REGIONS_NO_ROOT
+      && term->root == from->root
+      && term->k == from->k
+      && term->o == from->o)
+    return FALSE;
+
+  if (term->root == RSSB_REGIONS_NO_ROOT
+      && from->root == RSSB_REGIONS_NO_ROOT) {
+    /* Both values: an empty one in a row is the image */
+    if (from->value.count == 0 && term->value.count == 0)
+      return FALSE;
+
+    if (from->value.count == 0) {
+      rssb_regions_image(pass, addr, &from_value);
+      return rssb_regions_value_merge(pass, &term->value, &from_value);
+    }
+
+    if (term->value.count == 0) {
+      rssb_regions_image(pass, addr, &value);
+      if (!rssb_regions_value_merge(pass, &value, &from->value))
+        return FALSE;
+      term->value = value;
+      return TRUE;
+    }
+
+    return rssb_regions_value_merge(pass, &term->value, &from->value);
+  }
+
+  if (addr == RSSB_REGIONS_NO_ROOT) {
+    rssb_regions_eval(pass, env, term, &value);
+    rssb_regions_eval(pass, from_env, from, &from_value);
+  } else {
+    rssb_regions_read(pass, env, addr, &value);
+    rssb_regions_read(pass, from_env, addr, &from_value);
+  }
+
+  /* A term still holds where the other side is the one value it gives */
+  if (term->root != RSSB_REGIONS_NO_ROOT
+      && rssb_regions_holds(pass, from_env, term, &from_value))
+    return FALSE;
+
+  if (from->root != RSSB_REGIONS_NO_ROOT
+      && rssb_regions_holds(pass, env, from, &value)) {
+    *term = *from;
+    return TRUE;
+  }
+
+  rssb_regions_value_merge(pass, &value, &from_value);
+  rssb_regions_term_plain(term, &value);
+
+  return TRUE;
+}
+
+/* Joins what is known when $IP gets to `ip' */
+PRIVATE BOOL
+rssb_regions_flow(
+    struct rssb_regions_pass *pass,
+    word_t ip,
+    const struct rssb_regions_term *acc,
+    const struct rssb_regions_term *env)
+{
+  struct rssb_regions_term a = *acc;
+  struct rssb_regions_value value;
+  struct rssb_regions_term *row;
+  unsigned int i, index;
+  BOOL grown;
+
+  ip &= pass->vm->mem_mask;
+
+  if (pass->full && ip == RSSB_REGIONS_EXIT_IP) {
+    /* The VM halts here with $A = 1: only the rest goes on */
+    rssb_regions_eval(pass, env, acc, &value);
+    if (value.count != RSSB_REGIONS_RANGE) {
+      for (i = 0; i < value.count; ++i)
+        if (value.v[i] == RSSB_REGIONS_EXIT_A) {
+          value.v[i] = value.v[--value.count];
+          break;
+        }
+
+      rssb_regions_term_plain(&a, &value);
+    }
+  }
+
+  if (a.root == RSSB_REGIONS_NO_ROOT && a.value.count == 0)
+    return TRUE;
+
+  /* Faults */
+  if (ip >= pass->vm->mem_size)
+    return TRUE;
+
+  for (index = pass->node[ip]; index != 0; index = pass->next[index - 1])
+    if (pass->trail[index - 1] == pass->path)
+      break;
+
+  if (index == 0) {
+    if (pass->reached_count == pass->node_alloc
+        && !rssb_regions_grow_nodes(pass))
+      return rssb_regions_give_up(pass, ip, "out of memory");
+
+    index = pass->reached_count++;
+    row   = pass->env + (size_t) index * pass->slot_alloc;
+    memcpy(row, env, pass->slot_count * sizeof(struct rssb_regions_term));
+    rssb_regions_row_init(pass, row, pass->slot_count);
+
+    pass->acc[index]     = a;
+    pass->reached[index] = ip;
+    pass->next[index]    = pass->node[ip];
+    pass->trail[index]   = pass->path;
+    pass->node[ip]       = index + 1;
+    rssb_regions_queue(pass, index);
+
+    return TRUE;
+  }
+
+  row = pass->env + (size_t) --index * pass->slot_alloc;
+
+  /*
+   * Terms built on a word are joined while what it holds is still as
+   * it was on either side, words themselves after.
+   */
+  grown = rssb_regions_term_merge(
+      pass,
+      RSSB_REGIONS_NO_ROOT,
+      row,
+      pass->acc + index,
+      env,
+      &a);
+
+  for (i = 0; i < pass->slot_count; ++i)
+    if (row[i].root != RSSB_REGIONS_NO_ROOT
+        || env[i].root != RSSB_REGIONS_NO_ROOT)
+      grown |= rssb_regions_term_merge(
+          pass,
+          pass->slot_addr[i],
+          row,
+          row + i,
+          env,
+          env + i);
+
+  for (i = 0; i < pass->slot_count; ++i)
+    if (row[i].root == RSSB_REGIONS_NO_ROOT
+        && env[i].root == RSSB_REGIONS_NO_ROOT)
+      grown |= rssb_regions_term_merge(
+          pass,
+          pass->slot_addr[i],
+          row,
+          row + i,
+          env,
+          env + i);
+
+  if (grown)
+    rssb_regions_queue(pass, index);
+
+  return TRUE;
+}
+
+/* Follows `rssb $IP': $IP becomes each result, then skips or not */
+PRIVATE BOOL
+rssb_regions_jump(
+    struct rssb_regions_pass *pass,
+    word_t ip,
+    const struct rssb_regions_value *targets,
+    word_t step)
+{
+  struct rssb_regions_term a;
+  struct rssb_regions_value target;
+  uint64_t i, size = rssb_regions_value_size(targets);
+
+  if (size > RSSB_REGIONS_SPREAD)
+    return rssb_regions_give_up(
+        pass,
+        ip,
+        "computed jump to too many addresses");
+
+  for (i = 0; i < size; ++i) {
+    rssb_regions_value_const(&target, rssb_regions_value_at(targets, i));
+    rssb_regions_term_plain(&a, &target);
+    if (!rssb_regions_flow(pass, target.v[0] + step, &a, pass->scratch))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* What `term' is for one value of the word it is built on */
+PRIVATE word_t
+rssb_regions_term_at(
+    const struct rssb_regions_pass *pass,
+    const struct rssb_regions_term *term,
+    word_t root)
+{
+  if (term->root == RSSB_REGIONS_NO_ROOT)
+    return term->value.v[0];
+
+  return (term->k * root + term->o) & pass->vm->mem_mask;
+}
+
+/* Steepest term split by halving ranges, and most pieces it takes */
+#define RSSB_REGIONS_SLOPE 16
+#define RSSB_REGIONS_PIECES 1024
+
+/* k as a signed slope, 0 for plain terms */
+PRIVATE int64_t
+rssb_regions_term_slope(
+    const struct rssb_regions_pass *pass,
+    const struct rssb_regions_term *term)
+{
+  int64_t m = (int64_t) pass->vm->mem_mask + 1;
+  word_t k;
+
+  if (term->root == RSSB_REGIONS_NO_ROOT)
+    return 0;
+
+  k = term->k & pass->vm->mem_mask;
+
+  return k < pass->vm->mem_neg_mask ? (int64_t) k : (int64_t) k - m;
+}
+
+/* `term' for `root' before masking */
+PRIVATE int64_t
+rssb_regions_term_raw(
+    const struct rssb_regions_pass *pass,
+    const struct rssb_regions_term *term,
+    word_t root)
+{
+  if (term->root == RSSB_REGIONS_NO_ROOT)
+    return term->value.v[0];
+
+  return rssb_regions_term_slope(pass, term) * root
+    + (term->o & pass->vm->mem_mask);
+}
+
+/* Floor of x / m */
+PRIVATE int64_t
+rssb_regions_wrap(int64_t x, int64_t m)
+{
+  return x >= 0 ? x / m : -((-x + m - 1) / m);
+}
+
+/*
+ * Whether no step of `rssb' from `lo' to `hi' wraps around: then
+ * whether it skips can only change once, and the same at both ends
+ * means the same all along.
+ */
+PRIVATE BOOL
+rssb_regions_straight(
+    const struct rssb_regions_pass *pass,
+    const struct rssb_regions_term *word,
+    const struct rssb_regions_term *acc,
+    word_t lo,
+    word_t hi)
+{
+  int64_t m = (int64_t) pass->vm->mem_mask + 1;
+  int64_t w[2], a[2];
+
+  w[0] = rssb_regions_term_raw(pass, word, lo);
+  w[1] = rssb_regions_term_raw(pass, word, hi);
+  a[0] = rssb_regions_term_raw(pass, acc, lo);
+  a[1] = rssb_regions_term_raw(pass, acc, hi);
+
+  if (rssb_regions_wrap(w[0], m) != rssb_regions_wrap(w[1], m)
+      || rssb_regions_wrap(a[0], m) != rssb_regions_wrap(a[1], m))
+    return FALSE;
+
+  /* The sign of the difference, in dumb mode */
+  w[0] -= rssb_regions_wrap(w[0], m) * m;
+  w[1] -= rssb_regions_wrap(w[1], m) * m;
+  a[0] -= rssb_regions_wrap(a[0], m) * m;
+  a[1] -= rssb_regions_wrap(a[1], m) * m;
+
+  return !pass->vm->dumb_mode || (w[0] < a[0]) == (w[1] < a[1]);
+}
+
+/*
+ * Splits the values `root' may hold between those for which `rssb'
+ * goes on (roots[0]) and those it skips (roots[1]). Ranges are halved
+ * until each piece goes one way. Returns FALSE if that takes too long.
+ */
+PRIVATE BOOL
+rssb_regions_split(
+    const struct rssb_regions_pass *pass,
+    const struct rssb_regions_term *word,
+    const struct rssb_regions_term *acc,
+    const struct rssb_regions_value *value,
+    struct rssb_regions_value *roots)
+{
+  word_t lo[64], hi[64], l, h, mid;
+  unsigned int depth = 0, pieces = 0;
+  uint64_t i, size = rssb_regions_value_size(value);
+  BOOL skip;
+
+  rssb_regions_value_clear(roots);
+  rssb_regions_value_clear(roots + 1);
+
+  if (size <= RSSB_REGIONS_PAIRS || value->count != RSSB_REGIONS_RANGE) {
+    if (size > RSSB_REGIONS_SPREAD)
+      return FALSE;
+
+    for (i = 0; i < size; ++i) {
+      l = rssb_regions_value_at(value, i);
+      skip = rssb_regions_skips(
+          pass->vm,
+          rssb_regions_term_at(pass, word, l),
+          rssb_regions_term_at(pass, acc, l));
+      rssb_regions_value_add(roots + skip, l);
+    }
+
+    return TRUE;
+  }
+
+  if (llabs(rssb_regions_term_slope(pass, word)) > RSSB_REGIONS_SLOPE
+      || llabs(rssb_regions_term_slope(pass, acc)) > RSSB_REGIONS_SLOPE)
+    return FALSE;
+
+  lo[0] = value->v[0];
+  hi[0] = value->v[1];
+  depth = 1;
+
+  while (depth > 0) {
+    --depth;
+    l = lo[depth];
+    h = hi[depth];
+
+    if (++pieces > RSSB_REGIONS_PIECES)
+      return FALSE;
+
+    skip = rssb_regions_skips(
+        pass->vm,
+        rssb_regions_term_at(pass, word, l),
+        rssb_regions_term_at(pass, acc, l));
+
+    if (l == h
+        || (rssb_regions_straight(pass, word, acc, l, h)
+          && skip == rssb_regions_skips(
+            pass->vm,
+            rssb_regions_term_at(pass, word, h),
+            rssb_regions_term_at(pass, acc, h)))) {
+      rssb_regions_value_extend(roots + skip, l, h);
+      continue;
+    }
+
+    mid = l + (h - l) / 2;
+    lo[depth] = mid + 1;
+    hi[depth] = h;
+    ++depth;
+    lo[depth] = l;
+    hi[depth] = mid;
+    ++depth;
+  }
+
+  return TRUE;
+}
+
+/*
+ * Goes on to `ip' with `addr' stored `result' (unless it is not stored
+ * to, NO_ROOT), $A the same, and `root' holding `values' if given.
+ */
+PRIVATE BOOL
+rssb_regions_branch(
+    struct rssb_regions_pass *pass,
+    word_t ip,
+    word_t addr,
+    const struct rssb_regions_term *result,
+    word_t root,
+    const struct rssb_regions_value *values)
+{
+  struct rssb_regions_term acc = *result;
+  struct rssb_regions_value value;
+
+  memcpy(
+      pass->out,
+      pass->scratch,
+      pass->slot_count * sizeof(struct rssb_regions_term));
+
+  if (values != NULL) {
+    if (values->count == 0)
+      return TRUE;
+
+    if (pass->slot[root] != 0 || root == addr) {
+      if (!rssb_regions_track(pass, root))
+        return FALSE;
+
+      /* Terms built on it still hold: it only holds fewer values */
+      rssb_regions_term_plain(pass->out + pass->slot[root] - 1, values);
+    }
+  }
+
+  if (addr != RSSB_REGIONS_NO_ROOT) {
+    if (!rssb_regions_write(pass, addr, result, FALSE))
+      return FALSE;
+
+    /* $A holds what `addr' does */
+    rssb_regions_term_link(&acc, addr, 1, 0);
+  } else if (acc.root != RSSB_REGIONS_NO_ROOT) {
+    rssb_regions_eval(pass, pass->out, &acc, &value);
+    if (value.count == 0)
+      return TRUE;
+  }
+
+  return rssb_regions_flow(pass, ip, &acc, pass->out);
+}
+
+/* Trail of the side `skip' of a skip that goes both ways if `fork' */
+PRIVATE unsigned int
+rssb_regions_fork(unsigned int trail, BOOL fork, unsigned int skip)
+{
+  if (!fork)
+    return trail;
+
+  return ((trail << 1) | skip) & ((1u << RSSB_REGIONS_TRAIL) - 1);
+}
+
+/*
+ * `rssb X' for an instruction naming a single address: X - $A as a
+ * term where it can be one. When the result is built on a word, that
+ * word is split between the two branches by trying its values.
+ */
+PRIVATE BOOL
+rssb_regions_step_single(
+    struct rssb_regions_pass *pass,
+    word_t ip,
+    word_t addr,
+    const struct rssb_regions_term *acc)
+{
+  const rssb_vm_t *vm = pass->vm;
+  struct rssb_regions_term word, a, result, branch;
+  struct rssb_regions_value value, word_value, acc_value;
+  struct rssb_regions_value roots[2], results[2];
+  word_t root = RSSB_REGIONS_NO_ROOT;
+  unsigned int i, trail = pass->path;
+  BOOL store, fork;
+
+  store = addr != RSSB_ADDR_ZERO && addr != RSSB_ADDR_OUT;
+
+  rssb_regions_eval(pass, pass->scratch, acc, &acc_value);
+
+  if (addr == RSSB_ADDR_IN) {
+    /* Input, whatever was stored there */
+    rssb_regions_value_any(pass, &word_value);
+    rssb_regions_term_plain(&word, &word_value);
+  } else if (addr == RSSB_ADDR_ZERO || addr == RSSB_ADDR_OUT) {
+    rssb_regions_image(pass, addr, &word_value);
+    rssb_regions_term_plain(&word, &word_value);
+  } else {
+    rssb_regions_term_link(&word, addr, 1, 0);
+    rssb_regions_eval(pass, pass->scratch, &word, &word_value);
+  }
+
+  /* Both as built on the words that are not built on others */
+  rssb_regions_resolve(pass, pass->scratch, &word);
+  a = *acc;
+  rssb_regions_resolve(pass, pass->scratch, &a);
+  acc = &a;
+
+  /* Constants are terms on any word */
+  if (word.root != RSSB_REGIONS_NO_ROOT && word_value.count == 1)
+    rssb_regions_term_plain(&word, &word_value);
+
+  if (acc->root != RSSB_REGIONS_NO_ROOT && acc_value.count == 1) {
+    rssb_regions_term_plain(&a, &acc_value);
+    acc = &a;
+  }
+
+  if (word.root != RSSB_REGIONS_NO_ROOT && word.root == acc->root) {
+    root = word.root;
+    rssb_regions_term_link(&result, root, word.k - acc->k, word.o - acc->o);
+  } else if (word.root != RSSB_REGIONS_NO_ROOT && acc_value.count == 1) {
+    root = word.root;
+    rssb_regions_term_link(&result, root, word.k, word.o - acc_value.v[0]);
+  } else if (acc->root != RSSB_REGIONS_NO_ROOT && word_value.count == 1) {
+    root = acc->root;
+    rssb_regions_term_link(
+        &result,
+        root,
+        -acc->k,
+        word_value.v[0] - acc->o);
+  }
+
+  if (root != RSSB_REGIONS_NO_ROOT && (result.k & vm->mem_mask) == 0) {
+    /* Whatever the word holds, the difference is the same */
+    rssb_regions_value_const(&value, result.o & vm->mem_mask);
+    rssb_regions_term_plain(&result, &value);
+  }
+
+  if (root != RSSB_REGIONS_NO_ROOT) {
+    rssb_regions_read(pass, pass->scratch, root, &value);
+
+    if (rssb_regions_split(pass, &word, acc, &value, roots)) {
+      fork = roots[0].count != 0 && roots[1].count != 0;
+
+      for (i = 0; i < 2; ++i) {
+        pass->path = rssb_regions_fork(trail, fork, i);
+
+        if (!rssb_regions_branch(
+            pass,
+            ip + 1 + i,
+            store ? addr : RSSB_REGIONS_NO_ROOT,
+            &result,
+            root,
+            roots + i))
+          return FALSE;
+      }
+
+      return TRUE;
+    }
+  }
+
+  /* No word to split: each branch gets what it can */
+  rssb_regions_value_clear(results);
+  rssb_regions_value_clear(results + 1);
+  rssb_regions_sub(pass, &word_value, &acc_value, results, results + 1);
+  fork = results[0].count != 0 && results[1].count != 0;
+
+  for (i = 0; i < 2; ++i) {
+    if (results[i].count == 0)
+      continue;
+
+    pass->path = rssb_regions_fork(trail, fork, i);
+
+    if (root != RSSB_REGIONS_NO_ROOT)
+      branch = result;
+    else
+      rssb_regions_term_plain(&branch, results + i);
+
+    if (!rssb_regions_branch(
+        pass,
+        ip + 1 + i,
+        store ? addr : RSSB_REGIONS_NO_ROOT,
+        &branch,
+        RSSB_REGIONS_NO_ROOT,
+        NULL))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/*
+ * Same steps as rssb_vm_exec, on what is known statically. An
+ * instruction that may be rewritten names any of the addresses its
+ * word may hold: only those are read and written. A single address is
+ * followed along each path, a few are joined into what each may hold,
+ * and a range of them is stored to from anywhere.
+ */
+PRIVATE BOOL
+rssb_regions_step(struct rssb_regions_pass *pass, unsigned int index)
+{
+  const rssb_vm_t *vm = pass->vm;
+  struct rssb_regions_term acc = pass->acc[index];
+  struct rssb_regions_term result;
+  struct rssb_regions_value addrs, acc_value, word, noskip, skip, stored;
+  struct rssb_regions_value one[2];
+  word_t ip = pass->reached[index];
+  word_t addr;
+  uint64_t i, size;
+
+  pass->path = pass->trail[index];
+
+  memcpy(
+      pass->scratch,
+      pass->env + (size_t) index * pass->slot_alloc,
+      pass->slot_count * sizeof(struct rssb_regions_term));
+  memcpy(
+      pass->out,
+      pass->scratch,
+      pass->slot_count * sizeof(struct rssb_regions_term));
+
+  rssb_regions_eval(pass, pass->scratch, &acc, &acc_value);
+
+  if (ip == RSSB_ADDR_IP)
+    rssb_regions_value_const(&addrs, ip);
+  else if (ip == RSSB_ADDR_A)
+    addrs = acc_value;
+  else
+    rssb_regions_read(pass, pass->scratch, ip, &addrs);
+
+  /* Faults past the end of memory */
+  if (addrs.count == RSSB_REGIONS_RANGE && addrs.v[1] >= vm->mem_size)
+    addrs.v[1] = vm->mem_size - 1;
+
+  size = addrs.count == RSSB_REGIONS_RANGE && addrs.v[0] >= vm->mem_size
+    ? 0
+    : rssb_regions_value_size(&addrs);
+
+  if (size == 1) {
+    addr = addrs.v[0];
+    if (addr >= vm->mem_size)
+      return TRUE;
+
+    switch (addr) {
+      case RSSB_ADDR_A:
+        /* $A minus itself */
+        rssb_regions_value_const(&word, 0);
+        rssb_regions_term_plain(&result, &word);
+        return rssb_regions_flow(pass, ip + 1, &result, pass->scratch);
+
+      case RSSB_ADDR_IP:
+        rssb_regions_value_clear(one);
+        rssb_regions_value_clear(one + 1);
+        rssb_regions_value_const(&word, ip);
+        rssb_regions_sub(pass, &word, &acc_value, one, one + 1);
+
+        return rssb_regions_jump(pass, ip, one, 1)
+          && rssb_regions_jump(pass, ip, one + 1, 2);
+
+      case RSSB_ADDR_OUT:
+        if (vm->dumb_mode) {
+          /* What is written is $A itself, and $A stays */
+          rssb_regions_value_clear(one);
+          rssb_regions_value_clear(one + 1);
+          rssb_regions_value_const(&word, 0);
+          rssb_regions_sub(pass, &acc_value, &word, one, one + 1);
+
+          return (one[0].count == 0
+              || rssb_regions_flow(pass, ip + 1, &acc, pass->scratch))
+            && (one[1].count == 0
+              || rssb_regions_flow(pass, ip + 2, &acc, pass->scratch));
+        }
+        break;
+    }
+
+    return rssb_regions_step_single(pass, ip, addr, &acc);
+  }
+
+  /* Several addresses: what each may hold, $A as a value */
+  rssb_regions_value_clear(&noskip);
+  rssb_regions_value_clear(&skip);
+
+  if (addrs.count == RSSB_REGIONS_RANGE)
+    rssb_regions_unlink(pass, pass->out, addrs.v[0], addrs.v[1]);
+
+  for (i = 0; i < size; ++i) {
+    addr = rssb_regions_value_at(&addrs, i);
+    if (addr >= vm->mem_size)
+      continue;
+
+    rssb_regions_value_clear(one);
+    rssb_regions_value_clear(one + 1);
+
+    switch (addr) {
+      case RSSB_ADDR_A:
+        rssb_regions_value_add(one, 0);
+        break;
+
+      case RSSB_ADDR_IP:
+        rssb_regions_value_const(&word, ip);
+        rssb_regions_sub(pass, &word, &acc_value, one, one + 1);
+
+        if (!rssb_regions_jump(pass, ip, one, 1)
+            || !rssb_regions_jump(pass, ip, one + 1, 2))
+          return FALSE;
+        continue;
+
+      case RSSB_ADDR_OUT:
+        if (vm->dumb_mode) {
+          rssb_regions_value_const(&word, 0);
+          rssb_regions_sub(pass, &acc_value, &word, one, one + 1);
+          break;
+        }
+        /* Fall through */
+
+      case RSSB_ADDR_ZERO:
+        rssb_regions_image(pass, addr, &word);
+        rssb_regions_sub(pass, &word, &acc_value, one, one + 1);
+        break;
+
+      default:
+        if (addr == RSSB_ADDR_IN)
+          rssb_regions_value_any(pass, &word);
+        else
+          rssb_regions_read(pass, pass->scratch, addr, &word);
+
+        rssb_regions_sub(pass, &word, &acc_value, one, one + 1);
+
+        /* Minus 0 leaves the word as it was */
+        if (acc_value.count == 1 && acc_value.v[0] == 0)
+          break;
+
+        stored = one[0];
+        rssb_regions_value_join(&stored, one + 1);
+
+        if (addrs.count == RSSB_REGIONS_RANGE) {
+          if (!rssb_regions_write_any(pass, addr, &stored))
+            return FALSE;
+        } else {
+          rssb_regions_term_plain(&result, &stored);
+          if (!rssb_regions_write(pass, addr, &result, TRUE))
+            return FALSE;
+        }
+    }
+
+    rssb_regions_value_join(&noskip, one);
+    rssb_regions_value_join(&skip, one + 1);
+  }
+
+  if (noskip.count != 0) {
+    rssb_regions_term_plain(&result, &noskip);
+    if (!rssb_regions_flow(pass, ip + 1, &result, pass->out))
+      return FALSE;
+  }
+
+  if (skip.count != 0) {
+    rssb_regions_term_plain(&result, &skip);
+    if (!rssb_regions_flow(pass, ip + 2, &result, pass->out))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+PRIVATE BOOL
+rssb_regions_run(struct rssb_regions_pass *pass)
+{
+  const rssb_vm_t *vm = pass->vm;
+  struct rssb_regions_value value;
+  struct rssb_regions_term a;
+  unsigned int i, index;
+
+  rssb_regions_mark_written(pass, RSSB_ADDR_IP);
+  rssb_regions_mark_written(pass, RSSB_ADDR_A);
+
+  rssb_regions_value_const(&value, rssb_vm_peek(vm, RSSB_ADDR_A) & vm->mem_mask);
+  rssb_regions_term_plain(&a, &value);
+  if (!rssb_regions_flow(pass, rssb_vm_peek(vm, RSSB_ADDR_IP), &a, pass->scratch))
+    return FALSE;
+
+  /*
+   * Whatever was worked out from a word stored to from anywhere is
+   * stale once it grows: go over everything reached again until
+   * nothing does.
+   */
+  do {
+    pass->grown = FALSE;
+
+    while (pass->stack_count > 0) {
+      index = pass->stack[--pass->stack_count];
+      pass->queued[index] = 0;
+
+      if (!rssb_regions_step(pass, index))
+        return FALSE;
+    }
+
+    if (pass->grown)
+      for (i = 0; i < pass->reached_count; ++i)
+        rssb_regions_queue(pass, i);
+  } while (pass->grown);
+
+  return TRUE;
+}
+
+/* Classifies the memory of `vm', from its current $IP and $A */
+rssb_regions_t *
+rssb_regions_new(const rssb_vm_t *vm)
+{
+  rssb_regions_t *new = NULL;
+  struct rssb_regions_pass pass;
+  unsigned int size = vm->mem_size;
+  unsigned int i;
+
+  memset(&pass, 0, sizeof(struct rssb_regions_pass));
+
+  TRYCATCH(new = calloc(1, sizeof(rssb_regions_t)), goto fail);
+
+  new->size    = size;
+  new->bounded = TRUE;
+
+  pass.vm      = vm;
+  pass.regions = new;
+  pass.full    = vm->mem_mask == rssb_regions_truncate(vm, ~0u);
+
+  pass.node_alloc = RSSB_REGIONS_NODES;
+  pass.slot_alloc = RSSB_REGIONS_SLOTS;
+
+  TRYCATCH(pass.node     = calloc(size, sizeof(unsigned int)), goto fail);
+  TRYCATCH(pass.slot     = calloc(size, sizeof(unsigned int)), goto fail);
+  TRYCATCH(pass.contents = calloc(size, sizeof(unsigned int)), goto fail);
+  TRYCATCH(pass.written  = calloc(size, sizeof(uint8_t)), goto fail);
+  TRYCATCH(pass.stores   = calloc(size, sizeof(word_t)), goto fail);
+
+  TRYCATCH(
+      pass.acc = calloc(pass.node_alloc, sizeof(struct rssb_regions_term)),
+      goto fail);
+  TRYCATCH(
+      pass.reached = calloc(pass.node_alloc, sizeof(word_t)),
+      goto fail);
+  TRYCATCH(
+      pass.next = calloc(pass.node_alloc, sizeof(unsigned int)),
+      goto fail);
+  TRYCATCH(
+      pass.trail = calloc(pass.node_alloc, sizeof(unsigned int)),
+      goto fail);
+  TRYCATCH(
+      pass.queued = calloc(pass.node_alloc, sizeof(uint8_t)),
+      goto fail);
+  TRYCATCH(
+      pass.stack = calloc(pass.node_alloc, sizeof(unsigned int)),
+      goto fail);
+  TRYCATCH(
+      pass.env = calloc(
+          (size_t) pass.node_alloc * pass.slot_alloc,
+          sizeof(struct rssb_regions_term)),
+      goto fail);
+  TRYCATCH(
+      pass.slot_addr = calloc(pass.slot_alloc, sizeof(word_t)),
+      goto fail);
+  TRYCATCH(
+      pass.scratch = calloc(pass.slot_alloc, sizeof(struct rssb_regions_term)),
+      goto fail);
+  TRYCATCH(
+      pass.out = calloc(pass.slot_alloc, sizeof(struct rssb_regions_term)),
+      goto fail);
+
+  if (!rssb_regions_run(&pass)) {
+    new->written = size;
+    new->last    = size - 1;
+    goto done;
+  }
+
+  TRYCATCH(new->class = calloc(size, sizeof(uint8_t)), goto fail);
+
+  for (i = 0; i < pass.reached_count; ++i)
+    new->class[pass.reached[i]] = RSSB_REGION_CODE;
+
+  for (i = 0; i < pass.store_count; ++i)
+    new->class[pass.stores[i]] = RSSB_REGION_WRITTEN;
+
+  for (i = 0; i < size; ++i)
+    if (new->class[i] == RSSB_REGION_CODE)
+      ++new->code;
+
+  new->written = pass.store_count;
+  new->data    = size - new->code - new->written;
+
+  for (i = 0; i < pass.reached_count; ++i)
+    if (pass.reached[i] > new->last)
+      new->last = pass.reached[i];
+
+  for (i = 0; i < pass.store_count; ++i)
+    if (pass.stores[i] > new->last)
+      new->last = pass.stores[i];
+
+done:
+  rssb_regions_pass_finalize(&pass);
+
+  return new;
+
+fail:
+  rssb_regions_pass_finalize(&pass);
+
+  if (new != NULL)
+    rssb_regions_destroy(new);
+
+  return NULL;
+}
+
+PRIVATE void
+rssb_regions_print_loc(const rssb_dbginfo_t *dbg, word_t addr, FILE *fp)
+{
+  const struct rssb_dbginfo_loc *loc;
+
+  if (dbg != NULL && (loc = rssb_dbginfo_get_loc(dbg, addr)) != NULL)
+    fprintf(fp, " # %s:%d", loc->file, loc->line);
+
+  fputc('\n', fp);
+}
+
+/*
+ * Prints runs of words of the same class, up to `limit' or the last
+ * word that is not data, with the source line each run starts at.
+ */
+BOOL
+rssb_regions_report(
+    const rssb_regions_t *regions,
+    const rssb_dbginfo_t *dbg,
+    word_t limit,
+    FILE *fp)
+{
+  word_t addr, start;
+  enum rssb_region region;
+
+  if (!regions->bounded) {
+    fprintf(fp, "# analysis stopped at 0x%08x: %s", regions->stop, regions->why);
+    rssb_regions_print_loc(dbg, regions->stop, fp);
+    fprintf(fp, "# every word may be written\n");
+    return ferror(fp) == 0;
+  }
+
+  if (limit > regions->size)
+    limit = regions->size;
+
+  if (limit <= regions->last)
+    limit = regions->last + 1;
+
+  for (start = 0; start < limit; start = addr) {
+    region = rssb_regions_get(regions, start);
+
+    for (addr = start + 1; addr < limit; ++addr)
+      if (rssb_regions_get(regions, addr) != region)
+        break;
+
+    fprintf(
+        fp,
+        "0x%08x-0x%08x %s",
+        start,
+        addr - 1,
+        rssb_regions_name(region));
+    rssb_regions_print_loc(dbg, start, fp);
+  }
+
+  fprintf(
+      fp,
+      "# %u code, %u data, %u possibly written words\n",
+      regions->code,
+      regions->data,
+      regions->written);
+
+  return ferror(fp) == 0;
+}
@@ -0,0 +1,81 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+
+
+#ifndef _RSSB_REGIONS_H
+#define _RSSB_REGIONS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "rssb.h"
+#include "dbginfo.h"
+
+/*
+ * Static classification of VM memory into code, data and words that
+ * may be written, from the image as it is when analysed. Every
+ * statement assembles to `rssb X' with X resolved by the assembler, so
+ * what is code is what can be reached from $IP: the analysis follows
+ * control flow from there, keeping what $A and each written word may
+ * hold (a few values, a range of them, or a multiple of another word
+ * plus an offset) apart for each way the last few skips went, and
+ * grows the set of written words until nothing changes.
+ *
+ * Stores that leave a word as it was (`rssb X' with $A = 0) do not
+ * count as writes. An instruction that may be rewritten only reads and
+ * writes the addresses its word may hold, and a computed jump is
+ * followed to each address it may land on. The analysis only gives up,
+ * reporting every word as possibly written, when a jump may land on
+ * too many of them.
+ */
+typedef struct rssb_regions {
+  unsigned int size;
+  uint8_t *class;      /* enum rssb_region, per word */
+
+  BOOL bounded;        /* FALSE if it gave up */
+  word_t stop;         /* Where it gave up */
+  const char *why;
+
+  unsigned int code;   /* Words in each class */
+  unsigned int data;
+  unsigned int written;
+  word_t last;         /* Highest word that is not data */
+} rssb_regions_t;
+
+static inline enum rssb_region
+rssb_regions_get(const rssb_regions_t *regions, word_t addr)
+{
+  if (!regions->bounded || addr >= regions->size)
+    return RSSB_REGION_WRITTEN;
+
+  return regions->class[addr];
+}
+
+rssb_regions_t *rssb_regions_new(const rssb_vm_t *vm);
+const char *rssb_regions_name(enum rssb_region region);
+BOOL rssb_regions_report(
+    const rssb_regions_t *regions,
+    const rssb_dbginfo_t *dbg,
+    word_t limit,
+    FILE *fp);
+void rssb_regions_destroy(rssb_regions_t *regions);
+
+#endif /* _RSSB_REGIONS_H */
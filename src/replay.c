@@ -0,0 +1,262 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include "replay.h"
+
+#define RSSB_REPLAY_MAGIC   "RSSBINP"
+#define RSSB_REPLAY_VERSION 1
+
+struct rssb_replay_header {
+  char     magic[8];
+  uint32_t version;
+  uint32_t word_size; /* sizeof(word_t) of the recording */
+};
+
+PRIVATE void
+rssb_replay_put(rssb_replay_t *replay, uint64_t value)
+{
+  while (value >= 0x80) {
+    putc((value & 0x7f) | 0x80, replay->fp);
+    value >>= 7;
+  }
+
+  putc(value, replay->fp);
+}
+
+PRIVATE BOOL
+rssb_replay_get(rssb_replay_t *replay, uint64_t *value)
+{
+  unsigned int shift = 0;
+  uint8_t byte;
+
+  *value = 0;
+
+  do {
+    if (replay->pos == replay->size || shift > 63) {
+      replay->truncated = TRUE;
+      return FALSE;
+    }
+
+    byte = replay->log[replay->pos++];
+    *value |= (uint64_t) (byte & 0x7f) << shift;
+    shift += 7;
+  } while (byte & 0x80);
+
+  return TRUE;
+}
+
+PRIVATE enum rssb_vm_input
+rssb_replay_record_input(void *private, word_t *ch)
+{
+  rssb_replay_t *replay = private;
+  int c = getchar();
+
+  *ch = c;
+
+  rssb_replay_put(replay, replay->vm->in_step - replay->step);
+  rssb_replay_put(replay, (word_t) (*ch + 1));
+
+  replay->step = replay->vm->in_step;
+  ++replay->count;
+
+  return c == EOF ? RSSB_VM_INPUT_EOF : RSSB_VM_INPUT_READY;
+}
+
+/* Past the end of the log, $IN reads as EOF */
+PRIVATE enum rssb_vm_input
+rssb_replay_replay_input(void *private, word_t *ch)
+{
+  rssb_replay_t *replay = private;
+  uint64_t delta, value;
+
+  if (replay->pos == replay->size
+      || !rssb_replay_get(replay, &delta)
+      || !rssb_replay_get(replay, &value))
+    return RSSB_VM_INPUT_EOF;
+
+  replay->step += delta;
+  ++replay->count;
+
+  if (replay->step != replay->vm->in_step && replay->diverged++ == 0)
+    fprintf(
+        stderr,
+        "replay: read %" PRIu64 " at step %" PRIu64 ", logged at step %" PRIu64 "\n",
+        replay->count,
+        replay->vm->in_step,
+        replay->step);
+
+  *ch = value - 1;
+
+  return value == 0 ? RSSB_VM_INPUT_EOF : RSSB_VM_INPUT_READY;
+}
+
+PRIVATE BOOL
+rssb_replay_load(rssb_replay_t *replay, const char *path)
+{
+  struct rssb_replay_header header;
+  FILE *fp = NULL;
+  long size;
+  BOOL ok = FALSE;
+
+  if ((fp = fopen(path, "rb")) == NULL) {
+    fprintf(stderr, "%s: cannot open `%s': %s\n", __FUNCTION__, path, strerror(errno));
+    goto done;
+  }
+
+  if (fread(&header, sizeof(struct rssb_replay_header), 1, fp) != 1
+      || memcmp(header.magic, RSSB_REPLAY_MAGIC, sizeof(RSSB_REPLAY_MAGIC)) != 0
+      || header.version != RSSB_REPLAY_VERSION
+      || header.word_size != sizeof(word_t)) {
+    fprintf(stderr, "%s: `%s' is not an input log\n", __FUNCTION__, path);
+    goto done;
+  }
+
+  TRYCATCH(fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) >= 0, goto done);
+
+  replay->size = size - sizeof(struct rssb_replay_header);
+
+  TRYCATCH(replay->log = malloc(replay->size + 1), goto done);
+  TRYCATCH(
+      fseek(fp, sizeof(struct rssb_replay_header), SEEK_SET) == 0,
+      goto done);
+
+  if (fread(replay->log, 1, replay->size, fp) != replay->size) {
+    fprintf(stderr, "%s: cannot read `%s'\n", __FUNCTION__, path);
+    goto done;
+  }
+
+  ok = TRUE;
+
+done:
+  if (fp != NULL)
+    fclose(fp);
+
+  return ok;
+}
+
+PRIVATE BOOL
+rssb_replay_create(rssb_replay_t *replay, const char *path)
+{
+  struct rssb_replay_header header;
+
+  if ((replay->fp = fopen(path, "wb")) == NULL) {
+    fprintf(stderr, "%s: cannot open `%s': %s\n", __FUNCTION__, path, strerror(errno));
+    return FALSE;
+  }
+
+  memset(&header, 0, sizeof(struct rssb_replay_header));
+  memcpy(header.magic, RSSB_REPLAY_MAGIC, sizeof(RSSB_REPLAY_MAGIC));
+  header.version   = RSSB_REPLAY_VERSION;
+  header.word_size = sizeof(word_t);
+
+  if (fwrite(&header, sizeof(struct rssb_replay_header), 1, replay->fp) != 1) {
+    fprintf(stderr, "%s: cannot write `%s'\n", __FUNCTION__, path);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+rssb_replay_t *
+rssb_replay_new(const char *path, enum rssb_replay_mode mode)
+{
+  rssb_replay_t *new = NULL;
+
+  TRYCATCH(new = calloc(1, sizeof(rssb_replay_t)), goto fail);
+
+  new->mode = mode;
+
+  if (mode == RSSB_REPLAY_MODE_RECORD) {
+    if (!rssb_replay_create(new, path))
+      goto fail;
+  } else if (!rssb_replay_load(new, path)) {
+    goto fail;
+  }
+
+  return new;
+
+fail:
+  if (new != NULL)
+    rssb_replay_destroy(new);
+
+  return NULL;
+}
+
+void
+rssb_replay_attach(rssb_replay_t *replay, rssb_vm_t *vm)
+{
+  replay->vm = vm;
+
+  rssb_vm_set_io(
+      vm,
+      replay,
+      replay->mode == RSSB_REPLAY_MODE_RECORD
+          ? rssb_replay_record_input
+          : rssb_replay_replay_input,
+      NULL);
+}
+
+/* Finishes the log being recorded, or checks the one replayed */
+BOOL
+rssb_replay_close(rssb_replay_t *replay)
+{
+  BOOL ok = TRUE;
+
+  if (replay->fp != NULL) {
+    if (ferror(replay->fp) | (fclose(replay->fp) != 0)) {
+      fprintf(stderr, "%s: cannot write input log\n", __FUNCTION__);
+      ok = FALSE;
+    }
+    replay->fp = NULL;
+  }
+
+  if (replay->truncated) {
+    fprintf(stderr, "%s: input log is truncated\n", __FUNCTION__);
+    ok = FALSE;
+  }
+
+  if (replay->diverged > 0)
+    fprintf(
+        stderr,
+        "%s: %" PRIu64 " of %" PRIu64 " reads at other steps than logged\n",
+        __FUNCTION__,
+        replay->diverged,
+        replay->count);
+
+  return ok;
+}
+
+void
+rssb_replay_destroy(rssb_replay_t *replay)
+{
+  if (replay->fp != NULL)
+    fclose(replay->fp);
+
+  if (replay->log != NULL)
+    free(replay->log);
+
+  free(replay);
+}
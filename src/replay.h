@@ -0,0 +1,62 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+
+#ifndef _RSSB_REPLAY_H
+#define _RSSB_REPLAY_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "rssb.h"
+
+enum rssb_replay_mode {
+  RSSB_REPLAY_MODE_RECORD, /* Log what stdin gives to $IN */
+  RSSB_REPLAY_MODE_REPLAY  /* Give $IN what the log says */
+};
+
+/*
+ * $IN record and replay. Every read is logged with the step it
+ * happened at, both as LEB128 varints: the steps since the previous
+ * read, and the value plus one (so EOF takes a single byte). Replay
+ * loads the whole log beforehand, and runs without system calls.
+ */
+typedef struct rssb_replay {
+  enum rssb_replay_mode mode;
+  rssb_vm_t *vm;
+
+  FILE *fp;        /* Log being recorded */
+
+  uint8_t *log;    /* Log being replayed */
+  size_t size;
+  size_t pos;
+
+  uint64_t step;     /* Step of the last read */
+  uint64_t count;    /* Reads so far */
+  uint64_t diverged; /* Replayed reads at other steps than logged */
+  BOOL truncated;
+} rssb_replay_t;
+
+rssb_replay_t *rssb_replay_new(const char *path, enum rssb_replay_mode mode);
+void rssb_replay_attach(rssb_replay_t *replay, rssb_vm_t *vm);
+BOOL rssb_replay_close(rssb_replay_t *replay);
+void rssb_replay_destroy(rssb_replay_t *replay);
+
+#endif /* _RSSB_REPLAY_H */
@@ -0,0 +1,257 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "ring.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define RSSB_RING_PAUSE() __builtin_ia32_pause()
+#else
+#  define RSSB_RING_PAUSE() __asm__ __volatile__ ("" ::: "memory")
+#endif
+
+PRIVATE void
+rssb_ring_futex_wait(uint32_t *addr, uint32_t value)
+{
+  (void) syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+PRIVATE void
+rssb_ring_futex_wake(uint32_t *addr)
+{
+  __atomic_fetch_add(addr, 1, __ATOMIC_SEQ_CST);
+  (void) syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/* Polls `ready' for a while before the caller sleeps */
+PRIVATE void
+rssb_ring_backoff(const rssb_ring_t *ring, unsigned int spins)
+{
+  /* Spinning rings must not starve the other side of a shared CPU */
+  if (ring->spin && (spins & (RSSB_RING_SPINS - 1)) == 0)
+    sched_yield();
+  else
+    RSSB_RING_PAUSE();
+}
+
+/*
+ * Index updates and the other side's `waiting' flag form a Dekker pair:
+ * both are sequentially consistent, so either the sleeper sees the new
+ * index when it rechecks, or the waker sees it waiting.
+ */
+void
+rssb_ring_publish(rssb_ring_t *ring)
+{
+  __atomic_store_n(&ring->head, ring->write, __ATOMIC_SEQ_CST);
+
+  /* A sleeping consumer is only worth waking for a full batch */
+  if (__atomic_load_n(&ring->consumer_waiting, __ATOMIC_SEQ_CST)
+      && ring->write - __atomic_load_n(&ring->tail, __ATOMIC_RELAXED)
+          >= ring->wake_batch)
+    rssb_ring_futex_wake(&ring->data_seq);
+}
+
+/* Like publish, but always wakes the consumer */
+void
+rssb_ring_flush(rssb_ring_t *ring)
+{
+  __atomic_store_n(&ring->head, ring->write, __ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(&ring->consumer_waiting, __ATOMIC_SEQ_CST))
+    rssb_ring_futex_wake(&ring->data_seq);
+}
+
+void
+rssb_ring_release(rssb_ring_t *ring)
+{
+  __atomic_store_n(&ring->tail, ring->read, __ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(&ring->producer_waiting, __ATOMIC_SEQ_CST))
+    rssb_ring_futex_wake(&ring->space_seq);
+}
+
+/* At most `limit' items still unread */
+PRIVATE BOOL
+rssb_ring_has_space(rssb_ring_t *ring, uint64_t limit)
+{
+  ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+
+  return ring->write - ring->tail_cache <= limit;
+}
+
+PRIVATE BOOL
+rssb_ring_wait_tail(rssb_ring_t *ring, uint64_t limit)
+{
+  unsigned int spins = 0;
+  uint32_t seq;
+
+  rssb_ring_flush(ring);
+
+  for (;;) {
+    if (rssb_ring_has_space(ring, limit))
+      return TRUE;
+
+    if (__atomic_load_n(&ring->abandoned, __ATOMIC_ACQUIRE))
+      return FALSE;
+
+    if (ring->spin || spins < RSSB_RING_SPINS) {
+      rssb_ring_backoff(ring, ++spins);
+      continue;
+    }
+
+    seq = __atomic_load_n(&ring->space_seq, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&ring->producer_waiting, 1, __ATOMIC_SEQ_CST);
+
+    if (!rssb_ring_has_space(ring, limit)
+        && !__atomic_load_n(&ring->abandoned, __ATOMIC_SEQ_CST))
+      rssb_ring_futex_wait(&ring->space_seq, seq);
+
+    __atomic_store_n(&ring->producer_waiting, 0, __ATOMIC_SEQ_CST);
+    spins = 0;
+  }
+}
+
+BOOL
+rssb_ring_wait_space(rssb_ring_t *ring)
+{
+  return rssb_ring_wait_tail(ring, ring->mask);
+}
+
+/* Producer side: waits until the consumer has taken everything */
+BOOL
+rssb_ring_drain(rssb_ring_t *ring)
+{
+  return rssb_ring_wait_tail(ring, 0);
+}
+
+PRIVATE BOOL
+rssb_ring_has_data(rssb_ring_t *ring)
+{
+  ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+
+  return ring->read != ring->head_cache;
+}
+
+BOOL
+rssb_ring_wait_data(rssb_ring_t *ring)
+{
+  unsigned int spins = 0;
+  uint32_t seq;
+
+  rssb_ring_release(ring);
+
+  for (;;) {
+    if (rssb_ring_has_data(ring))
+      return TRUE;
+
+    /* Whatever came before closing is visible once `closed' is */
+    if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE))
+      return rssb_ring_has_data(ring);
+
+    if (ring->spin || spins < RSSB_RING_SPINS) {
+      rssb_ring_backoff(ring, ++spins);
+      continue;
+    }
+
+    seq = __atomic_load_n(&ring->data_seq, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&ring->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+
+    if (!rssb_ring_has_data(ring)
+        && !__atomic_load_n(&ring->closed, __ATOMIC_SEQ_CST))
+      rssb_ring_futex_wait(&ring->data_seq, seq);
+
+    __atomic_store_n(&ring->consumer_waiting, 0, __ATOMIC_SEQ_CST);
+    spins = 0;
+  }
+}
+
+/* Producer is done: the consumer gets EOF after the last item */
+void
+rssb_ring_close(rssb_ring_t *ring)
+{
+  __atomic_store_n(&ring->head, ring->write, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&ring->closed, 1, __ATOMIC_SEQ_CST);
+  rssb_ring_futex_wake(&ring->data_seq);
+}
+
+/* Consumer is done: further pushes fail, as writes to a broken pipe */
+void
+rssb_ring_abandon(rssb_ring_t *ring)
+{
+  __atomic_store_n(&ring->abandoned, 1, __ATOMIC_SEQ_CST);
+  rssb_ring_futex_wake(&ring->space_seq);
+}
+
+/* Lets a sleeping consumer sleep until `size' bytes are waiting */
+void
+rssb_ring_set_wake_batch(rssb_ring_t *ring, uint64_t size)
+{
+  ring->wake_batch = size < ring->mask ? size : ring->mask;
+}
+
+void
+rssb_ring_destroy(rssb_ring_t *ring)
+{
+  if (ring->slots != NULL)
+    free(ring->slots);
+
+  free(ring);
+}
+
+rssb_ring_t *
+rssb_ring_new(uint64_t size, BOOL spin)
+{
+  rssb_ring_t *new = NULL;
+  uint64_t capacity = 2 * RSSB_RING_BATCH;
+
+  while (capacity < size)
+    capacity <<= 1;
+
+  TRYCATCH(
+      posix_memalign((void **) &new, RSSB_RING_LINE, sizeof(rssb_ring_t)) == 0,
+      return NULL);
+
+  memset(new, 0, sizeof(rssb_ring_t));
+
+  TRYCATCH(
+      posix_memalign(
+          (void **) &new->slots,
+          RSSB_RING_LINE,
+          capacity) == 0,
+      goto fail);
+
+  new->mask       = capacity - 1;
+  new->spin       = spin;
+  new->wake_batch = RSSB_RING_BATCH;
+
+  return new;
+
+fail:
+  rssb_ring_destroy(new);
+
+  return NULL;
+}
@@ -0,0 +1,164 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+
+#ifndef _RSSB_RING_H
+#define _RSSB_RING_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "rssb.h"
+
+#define RSSB_RING_LINE   64
+#define RSSB_RING_BATCH  64   /* Items moved between index updates */
+#define RSSB_RING_SPINS  1024 /* Polls before going to sleep */
+
+#define RSSB_RING_ALIGNED __attribute__((aligned(RSSB_RING_LINE)))
+
+/*
+ * Single-producer, single-consumer ring of bytes. Each side works on a
+ * private copy of its index and publishes it every RSSB_RING_BATCH
+ * items, or before it has to wait, so the shared lines only change
+ * hands once per batch. A side that finds the ring full (or empty)
+ * polls for a while and then sleeps on a futex, unless `spin' is set.
+ * A sleeping consumer is woken up once `wake_batch' bytes are waiting,
+ * or when the producer flushes, waits or closes.
+ */
+typedef struct rssb_ring {
+  /* Producer only */
+  uint64_t write RSSB_RING_ALIGNED;
+  uint64_t tail_cache;
+
+  /* Written by the producer */
+  uint64_t head RSSB_RING_ALIGNED;
+  uint32_t closed;
+  uint32_t data_seq;
+
+  /* Consumer only */
+  uint64_t read RSSB_RING_ALIGNED;
+  uint64_t head_cache;
+
+  /* Written by the consumer */
+  uint64_t tail RSSB_RING_ALIGNED;
+  uint32_t abandoned;
+  uint32_t space_seq;
+
+  /* Set by whoever is about to sleep */
+  uint32_t consumer_waiting RSSB_RING_ALIGNED;
+  uint32_t producer_waiting;
+
+  uint8_t *slots RSSB_RING_ALIGNED;
+  uint64_t mask;
+  uint64_t wake_batch;
+  BOOL spin;
+} rssb_ring_t;
+
+rssb_ring_t *rssb_ring_new(uint64_t size, BOOL spin);
+void rssb_ring_set_wake_batch(rssb_ring_t *ring, uint64_t size);
+void rssb_ring_publish(rssb_ring_t *ring);
+void rssb_ring_flush(rssb_ring_t *ring);
+void rssb_ring_release(rssb_ring_t *ring);
+BOOL rssb_ring_wait_space(rssb_ring_t *ring);
+BOOL rssb_ring_drain(rssb_ring_t *ring);
+BOOL rssb_ring_wait_data(rssb_ring_t *ring);
+void rssb_ring_close(rssb_ring_t *ring);
+void rssb_ring_abandon(rssb_ring_t *ring);
+void rssb_ring_destroy(rssb_ring_t *ring);
+
+/* Producer side. Fails once the consumer has abandoned the ring */
+static inline BOOL
+rssb_ring_push(rssb_ring_t *ring, uint8_t value)
+{
+  if (ring->write - ring->tail_cache > ring->mask
+      && !rssb_ring_wait_space(ring))
+    return FALSE;
+
+  ring->slots[ring->write++ & ring->mask] = value;
+
+  if ((ring->write & (RSSB_RING_BATCH - 1)) == 0)
+    rssb_ring_publish(ring);
+
+  return TRUE;
+}
+
+/* Consumer side. TRUE if pop would not have to wait */
+static inline BOOL
+rssb_ring_ready(rssb_ring_t *ring)
+{
+  if (ring->read != ring->head_cache)
+    return TRUE;
+
+  ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+  return ring->read != ring->head_cache;
+}
+
+/* Consumer side. FALSE once the ring is closed and drained */
+static inline BOOL
+rssb_ring_pop(rssb_ring_t *ring, uint8_t *value)
+{
+  if (ring->read == ring->head_cache && !rssb_ring_wait_data(ring))
+    return FALSE;
+
+  *value = ring->slots[ring->read++ & ring->mask];
+
+  if ((ring->read & (RSSB_RING_BATCH - 1)) == 0)
+    rssb_ring_release(ring);
+
+  return TRUE;
+}
+
+/*
+ * Consumer side, for bulk readers: describes what can be read right now
+ * (at most two spans, as it may wrap around) without taking it.
+ */
+static inline unsigned int
+rssb_ring_spans(const rssb_ring_t *ring, struct iovec *iov)
+{
+  uint64_t size  = ring->head_cache - ring->read;
+  uint64_t start = ring->read & ring->mask;
+  uint64_t first = ring->mask + 1 - start;
+
+  if (size == 0)
+    return 0;
+
+  iov[0].iov_base = ring->slots + start;
+
+  if (size <= first) {
+    iov[0].iov_len = size;
+    return 1;
+  }
+
+  iov[0].iov_len  = first;
+  iov[1].iov_base = ring->slots;
+  iov[1].iov_len  = size - first;
+
+  return 2;
+}
+
+static inline void
+rssb_ring_consume(rssb_ring_t *ring, uint64_t size)
+{
+  ring->read += size;
+  rssb_ring_release(ring);
+}
+
+#endif /* _RSSB_RING_H */
@@ -22,7 +22,9 @@
 #define _MAIN_INCLUDE_H
 
 #include <config.h> /* General compile-time configuration parameters */
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/time.h>
 #include <util.h>
 
 #define PRIVATE static
@@ -39,6 +41,9 @@
 
 typedef uint32_t word_t;
 
+/* Largest VM memory, in words. Memory is committed lazily */
+#define RSSB_MEMORY_MAX (1U << 31)
+
 enum rssb_bool {
   FALSE,
   TRUE
@@ -55,27 +60,172 @@ enum rssb_addr {
   RSSB_ADDR_MIN
 };
 
+#define RSSB_VM_HUGE_PAGE_SIZE (2 << 20)
+
+/* Granularity of dirty tracking and checkpoints, in bytes */
+#define RSSB_VM_PAGE_SHIFT 12
+#define RSSB_VM_PAGE_SIZE  (1 << RSSB_VM_PAGE_SHIFT)
+
+/* Per-page flags in rssb_vm_t.pages */
+#define RSSB_VM_PAGE_DIRTY 1 /* Written since the last checkpoint */
+#define RSSB_VM_PAGE_USED  2 /* Ever written: may hold non-zero words */
+#define RSSB_VM_PAGE_WRITTEN (RSSB_VM_PAGE_DIRTY | RSSB_VM_PAGE_USED)
+
+enum rssb_vm_backing {
+  RSSB_VM_BACKING_DEFAULT, /* Whatever the system does by default */
+  RSSB_VM_BACKING_THP,     /* Transparent huge pages, via madvise() */
+  RSSB_VM_BACKING_HUGETLB  /* Reserved huge pages, via MAP_HUGETLB */
+};
+
+/* Why rssb_vm_run_until or rssb_vm_run_for returned */
+enum rssb_vm_reason {
+  RSSB_VM_REASON_HALTED,     /* Reached the exit sequence */
+  RSSB_VM_REASON_FAULT,      /* Invalid address or failed output */
+  RSSB_VM_REASON_INPUT,      /* Next step reads $IN */
+  RSSB_VM_REASON_OUTPUT,     /* Next step writes $OUT */
+  RSSB_VM_REASON_BREAKPOINT, /* $IP reached the breakpoint */
+  RSSB_VM_REASON_BUDGET,     /* Ran the steps it was given */
+  RSSB_VM_REASON_LOOP,       /* Stuck in a loop without I/O */
+  RSSB_VM_REASON_COUNT
+};
+
+/* What an input callback has for the VM */
+enum rssb_vm_input {
+  RSSB_VM_INPUT_READY, /* Next character left in *ch */
+  RSSB_VM_INPUT_EOF,   /* Reads as EOF, like getchar() */
+  RSSB_VM_INPUT_AGAIN  /* Nothing yet: the VM stops before the read */
+};
+
+/* What static analysis proved about a word (see regions.h) */
+enum rssb_region {
+  RSSB_REGION_DATA,   /* Never executed nor written */
+  RSSB_REGION_CODE,   /* May be executed, never written */
+  RSSB_REGION_WRITTEN /* May be written */
+};
+
+typedef enum rssb_vm_input (*rssb_vm_input_t) (void *private, word_t *ch);
+typedef BOOL (*rssb_vm_output_t) (void *private, word_t ch);
+
+#define RSSB_VM_NO_BREAKPOINT ((word_t) -1)
+#define RSSB_VM_UNLIMITED     UINT64_MAX
+
+/* Cheap counters, always maintained by rssb_vm_run */
+struct rssb_vm_stats {
+  uint64_t steps;       /* Instructions retired */
+  uint64_t skips;       /* Skips taken */
+  uint64_t inputs;      /* Reads from $IN */
+  uint64_t outputs;     /* Writes to $OUT */
+  uint64_t ip_writes;   /* Writes to $IP (jumps) */
+  uint64_t code_writes; /* Writes inside the assembled footprint */
+  uint64_t in_bytes;    /* Bytes taken from $IN, EOF excluded */
+  uint64_t out_bytes;   /* Bytes given to $OUT */
+  struct timeval wall_time;
+};
+
+struct rssb_profile;
+struct rssb_dbginfo;
+struct rssb_trace;
+struct rssb_loop_check;
+struct rssb_regions;
+
+struct rssb_vm_binary;
+
 typedef struct rssb_vm {
   BOOL dumb_mode;
-  word_t *mem;
+  BOOL binary_io;   /* $IN and $OUT move whole native-endian words */
+  void *mem;        /* word_size bytes per word */
+  unsigned int word_size;
+  size_t mem_bytes; /* Reserved, not committed */
+  enum rssb_vm_backing backing;
   word_t footprint;
   unsigned int mem_neg_mask;
   unsigned int mem_mask;
   unsigned int mem_size;
   unsigned int mem_ptr;
 
+  /*
+   * One byte per page, set on every store. A plain byte store is
+   * cheaper than setting a bit: there is no read-modify-write.
+   */
+  uint8_t *pages;
+  size_t page_count;
+  unsigned int page_shift; /* log2(words per page) */
+
+  char *checkpoint_path;   /* Checkpoint that later ones append to */
+  uint64_t checkpoint_end; /* Its valid length */
+
+  struct rssb_vm_stats stats;
+
+  struct rssb_profile *profile; /* Optional, not owned */
+  struct rssb_trace *trace;     /* Optional, not owned */
+  struct rssb_loop_check *loop_check; /* Optional, not owned */
+  struct rssb_regions *regions;       /* Optional, not owned */
+  uint64_t regions_steps;             /* stats.steps it was set at */
+
   void *private;
-  BOOL (*input) (void *private, word_t *ch);
-  BOOL (*output) (void *private, word_t ch);
+  rssb_vm_input_t input;   /* stdin if NULL */
+  rssb_vm_output_t output; /* stdout if NULL */
+  uint64_t in_step;         /* Steps retired before the $IN read under way */
+
+  /*
+   * Memory windows served inline, before the callbacks: $IN reads from
+   * [in_ptr, in_end) and $OUT fills [out_ptr, out_end). Once a window
+   * is used up, the callback is called as usual and may move it.
+   */
+  const uint8_t *in_ptr;
+  const uint8_t *in_end;
+  uint8_t *out_ptr;
+  uint8_t *out_end;
+
+  /* Binary I/O: a word read halfway, and block buffers for stdio */
+  uint8_t in_word[sizeof(word_t)];
+  unsigned int in_have;
+  struct rssb_vm_binary *binary;
 } rssb_vm_t;
 
 rssb_vm_t *rssb_vm_new(unsigned int size);
+rssb_vm_t *rssb_vm_clone(const rssb_vm_t *vm);
+rssb_vm_t *rssb_vm_new_with_backing(
+    unsigned int size,
+    enum rssb_vm_backing backing);
 BOOL   rssb_vm_put_word(rssb_vm_t *vm, word_t word);
+word_t rssb_vm_peek(const rssb_vm_t *vm, word_t addr);
+void   rssb_vm_poke(rssb_vm_t *vm, word_t addr, word_t word);
 word_t rssb_vm_get_ptr(const rssb_vm_t *vm);
-void   rssb_vm_disas(const rssb_vm_t *vm);
+void   rssb_vm_disas(const rssb_vm_t *vm, const struct rssb_dbginfo *dbg);
 void   rssb_vm_set_ptr(rssb_vm_t *vm, word_t ptr);
 void   rssb_vm_set_dumb(rssb_vm_t *vm, BOOL dumb);
+void   rssb_vm_set_binary(rssb_vm_t *vm, BOOL binary);
+void   rssb_vm_set_profile(rssb_vm_t *vm, struct rssb_profile *profile);
+void   rssb_vm_set_trace(rssb_vm_t *vm, struct rssb_trace *trace);
+void   rssb_vm_set_loop_check(rssb_vm_t *vm, struct rssb_loop_check *check);
+void   rssb_vm_set_regions(rssb_vm_t *vm, struct rssb_regions *regions);
+enum rssb_region rssb_vm_get_region(const rssb_vm_t *vm, word_t addr);
+void   rssb_vm_set_io(
+    rssb_vm_t *vm,
+    void *private,
+    rssb_vm_input_t input,
+    rssb_vm_output_t output);
+void   rssb_vm_set_io_window(
+    rssb_vm_t *vm,
+    const uint8_t *in,
+    size_t in_size,
+    uint8_t *out,
+    size_t out_size);
+void   rssb_vm_get_stats(const rssb_vm_t *vm, struct rssb_vm_stats *stats);
+size_t rssb_vm_get_resident(const rssb_vm_t *vm);
+size_t rssb_vm_get_huge_resident(const rssb_vm_t *vm);
 BOOL   rssb_vm_run(rssb_vm_t *vm);
+uint64_t rssb_vm_run_for(
+    rssb_vm_t *vm,
+    uint64_t max_steps,
+    enum rssb_vm_reason *reason);
+enum rssb_vm_reason rssb_vm_run_until(
+    rssb_vm_t *vm,
+    word_t breakpoint,
+    uint64_t max_steps);
+BOOL   rssb_vm_checkpoint(rssb_vm_t *vm, const char *path);
+rssb_vm_t *rssb_vm_restore(const char *path);
 void   rssb_vm_destroy(rssb_vm_t *vm);
 
 #endif /* _MAIN_INCLUDE_H */
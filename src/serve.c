@@ -0,0 +1,403 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE /* accept4 */
+#endif /* _GNU_SOURCE */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "serve.h"
+#include "host.h"
+#include "parser.h"
+
+struct rssb_serve_request {
+  rssb_serve_t *serve;
+
+  char header[RSSB_SERVE_MAX_HEADER];
+  size_t header_len;
+  BOOL have_header;
+
+  char *source;
+  size_t source_size;
+  size_t source_len;
+
+  BOOL hit;
+  struct timeval start;
+};
+
+PRIVATE const char *g_serve_reasons[] = {
+  "halted",
+  "fault",
+  "input",
+  "output",
+  "breakpoint",
+  "budget",
+  "loop"
+};
+
+_Static_assert(
+    sizeof(g_serve_reasons) / sizeof(g_serve_reasons[0]) == RSSB_VM_REASON_COUNT,
+    "g_serve_reasons must name every enum rssb_vm_reason");
+
+PRIVATE uint64_t
+rssb_serve_hash(const char *data, size_t size)
+{
+  uint64_t hash = 0xcbf29ce484222325ull;
+  size_t i;
+
+  for (i = 0; i < size; ++i) {
+    hash ^= (uint8_t) data[i];
+    hash *= 0x100000001b3ull;
+  }
+
+  return hash;
+}
+
+PRIVATE void
+rssb_serve_image_destroy(struct rssb_serve_image *image)
+{
+  if (image->vm != NULL)
+    rssb_vm_destroy(image->vm);
+
+  if (image->source != NULL)
+    free(image->source);
+
+  free(image);
+}
+
+/* Called with the lock held */
+PRIVATE void
+rssb_serve_image_unref(struct rssb_serve_image *image)
+{
+  if (--image->refs == 0)
+    rssb_serve_image_destroy(image);
+}
+
+PRIVATE struct rssb_serve_image *
+rssb_serve_image_new(
+    const rssb_serve_t *serve,
+    const char *source,
+    size_t size,
+    uint64_t hash)
+{
+  struct rssb_serve_image *new = NULL;
+  rssb_program_t *program = NULL;
+
+  TRYCATCH(new = calloc(1, sizeof(struct rssb_serve_image)), goto fail);
+  TRYCATCH(new->source = malloc(size > 0 ? size : 1), goto fail);
+
+  memcpy(new->source, source, size);
+  new->size = size;
+  new->hash = hash;
+
+  TRYCATCH(program = rssb_program_new(), goto fail);
+  TRYCATCH(
+      new->vm = rssb_vm_new_with_backing(serve->memory_size, serve->backing),
+      goto fail);
+  TRYCATCH(
+      rssb_program_load_buffer(program, "<request>", source, size),
+      goto fail);
+  TRYCATCH(rssb_program_compile(program, new->vm), goto fail);
+
+  rssb_program_destroy(program);
+
+  return new;
+
+fail:
+  if (program != NULL)
+    rssb_program_destroy(program);
+
+  if (new != NULL)
+    rssb_serve_image_destroy(new);
+
+  return NULL;
+}
+
+/* Called with the lock held */
+PRIVATE struct rssb_serve_image *
+rssb_serve_lookup(
+    rssb_serve_t *serve,
+    const char *source,
+    size_t size,
+    uint64_t hash)
+{
+  struct rssb_serve_image *image;
+  unsigned int i;
+
+  for (i = 0; i < RSSB_SERVE_CACHE_SIZE; ++i)
+    if ((image = serve->cache[i]) != NULL
+        && image->hash == hash
+        && image->size == size
+        && memcmp(image->source, source, size) == 0) {
+      ++image->refs;
+      image->last_use = ++serve->clock;
+      return image;
+    }
+
+  return NULL;
+}
+
+/* Called with the lock held. The least recently used image makes room */
+PRIVATE void
+rssb_serve_insert(rssb_serve_t *serve, struct rssb_serve_image *image)
+{
+  unsigned int i, victim = 0;
+
+  for (i = 0; i < RSSB_SERVE_CACHE_SIZE; ++i) {
+    if (serve->cache[i] == NULL) {
+      victim = i;
+      break;
+    }
+
+    if (serve->cache[i]->last_use < serve->cache[victim]->last_use)
+      victim = i;
+  }
+
+  if (serve->cache[victim] != NULL)
+    rssb_serve_image_unref(serve->cache[victim]);
+
+  ++image->refs;
+  image->last_use = ++serve->clock;
+  serve->cache[victim] = image;
+}
+
+/*
+ * Returns a clone of the image assembled from `source', assembling and
+ * caching it first if needed. Assembly runs outside the lock: the same
+ * source arriving twice at once may be assembled twice, once cached.
+ */
+PRIVATE rssb_vm_t *
+rssb_serve_instantiate(
+    rssb_serve_t *serve,
+    const char *source,
+    size_t size,
+    BOOL *hit)
+{
+  struct rssb_serve_image *image, *cached;
+  uint64_t hash = rssb_serve_hash(source, size);
+  rssb_vm_t *vm;
+
+  pthread_mutex_lock(&serve->lock);
+  image = rssb_serve_lookup(serve, source, size, hash);
+  pthread_mutex_unlock(&serve->lock);
+
+  if ((*hit = image != NULL) == FALSE) {
+    if ((image = rssb_serve_image_new(serve, source, size, hash)) == NULL)
+      return NULL;
+
+    image->refs = 1;
+
+    pthread_mutex_lock(&serve->lock);
+    if ((cached = rssb_serve_lookup(serve, source, size, hash)) != NULL) {
+      rssb_serve_image_unref(image);
+      image = cached;
+    } else {
+      rssb_serve_insert(serve, image);
+    }
+    pthread_mutex_unlock(&serve->lock);
+  }
+
+  vm = rssb_vm_clone(image->vm);
+
+  pthread_mutex_lock(&serve->lock);
+  rssb_serve_image_unref(image);
+  pthread_mutex_unlock(&serve->lock);
+
+  return vm;
+}
+
+PRIVATE void
+rssb_serve_request_destroy(struct rssb_serve_request *req)
+{
+  if (req->source != NULL)
+    free(req->source);
+
+  free(req);
+}
+
+PRIVATE BOOL
+rssb_serve_error(rssb_host_session_t *s, const char *message)
+{
+  (void) rssb_host_write(s, "X ", 2);
+  (void) rssb_host_write(s, message, strlen(message));
+  (void) rssb_host_write(s, "\n", 1);
+
+  return FALSE;
+}
+
+/* Reads the request header and source, then attaches a fresh clone */
+PRIVATE BOOL
+rssb_serve_prepare(rssb_host_session_t *s)
+{
+  struct rssb_serve_request *req = s->private;
+  enum rssb_vm_input got = RSSB_VM_INPUT_READY;
+  rssb_vm_t *vm;
+  uint8_t c;
+  char extra;
+
+  while (!req->have_header
+      && (got = rssb_host_getc(s, &c)) == RSSB_VM_INPUT_READY) {
+    if (c == '\n') {
+      req->header[req->header_len] = '\0';
+
+      if (sscanf(req->header, "RSSB %zu%c", &req->source_size, &extra) != 1)
+        return rssb_serve_error(s, "bad request header");
+
+      if (req->source_size > RSSB_SERVE_MAX_SOURCE)
+        return rssb_serve_error(s, "source too large");
+
+      TRYCATCH(
+          req->source = malloc(req->source_size > 0 ? req->source_size : 1),
+          return rssb_serve_error(s, "out of memory"));
+
+      req->have_header = TRUE;
+    } else if (req->header_len == RSSB_SERVE_MAX_HEADER - 1) {
+      return rssb_serve_error(s, "bad request header");
+    } else {
+      req->header[req->header_len++] = c;
+    }
+  }
+
+  while (req->have_header
+      && req->source_len < req->source_size
+      && (got = rssb_host_getc(s, &c)) == RSSB_VM_INPUT_READY)
+    req->source[req->source_len++] = c;
+
+  if (got == RSSB_VM_INPUT_AGAIN)
+    return TRUE;
+
+  if (got == RSSB_VM_INPUT_EOF)
+    return rssb_serve_error(s, "truncated request");
+
+  if ((vm = rssb_serve_instantiate(
+      req->serve,
+      req->source,
+      req->source_size,
+      &req->hit)) == NULL)
+    return rssb_serve_error(s, "assembly failed");
+
+  free(req->source);
+  req->source = NULL;
+
+  rssb_host_attach(s, vm);
+  s->framed = TRUE;
+
+  gettimeofday(&req->start, NULL);
+
+  return TRUE;
+}
+
+PRIVATE void
+rssb_serve_done(rssb_host_session_t *s)
+{
+  struct rssb_serve_request *req = s->private;
+  struct rssb_vm_stats stats;
+  struct timeval end, elapsed;
+  char line[128];
+
+  if (s->vm != NULL) {
+    gettimeofday(&end, NULL);
+    timersub(&end, &req->start, &elapsed);
+    rssb_vm_get_stats(s->vm, &stats);
+
+    snprintf(
+        line,
+        sizeof(line),
+        "S reason=%s steps=%" PRIu64 " usec=%" PRIu64 " cache=%s\n",
+        g_serve_reasons[s->reason],
+        stats.steps,
+        (uint64_t) elapsed.tv_sec * 1000000 + elapsed.tv_usec,
+        req->hit ? "hit" : "miss");
+
+    (void) rssb_host_write(s, line, strlen(line));
+  }
+
+  rssb_serve_request_destroy(req);
+  s->private = NULL;
+}
+
+PRIVATE void
+rssb_serve_accept(rssb_host_t *host, int fd, void *private)
+{
+  struct rssb_serve_request *req;
+  rssb_host_session_t *s;
+  int conn;
+
+  while ((conn = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) != -1) {
+    if ((req = calloc(1, sizeof(struct rssb_serve_request))) == NULL) {
+      close(conn);
+      continue;
+    }
+
+    req->serve = private;
+
+    if ((s = rssb_host_add(host, NULL, conn, conn)) == NULL) {
+      rssb_serve_request_destroy(req);
+      close(conn);
+      continue;
+    }
+
+    s->prepare = rssb_serve_prepare;
+    s->done    = rssb_serve_done;
+    s->private = req;
+  }
+}
+
+void
+rssb_serve_destroy(rssb_serve_t *serve)
+{
+  unsigned int i;
+
+  for (i = 0; i < RSSB_SERVE_CACHE_SIZE; ++i)
+    if (serve->cache[i] != NULL)
+      rssb_serve_image_unref(serve->cache[i]);
+
+  pthread_mutex_destroy(&serve->lock);
+
+  free(serve);
+}
+
+rssb_serve_t *
+rssb_serve_new(uint64_t memory_size, enum rssb_vm_backing backing)
+{
+  rssb_serve_t *new = NULL;
+
+  TRYCATCH(new = calloc(1, sizeof(rssb_serve_t)), return NULL);
+
+  new->memory_size = memory_size;
+  new->backing     = backing;
+
+  pthread_mutex_init(&new->lock, NULL);
+
+  return new;
+}
+
+BOOL
+rssb_serve_run(rssb_serve_t *serve, const char *path, unsigned int threads)
+{
+  return rssb_host_serve_unix(path, threads, rssb_serve_accept, serve);
+}
@@ -0,0 +1,64 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+
+#ifndef _RSSB_SERVE_H
+#define _RSSB_SERVE_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "rssb.h"
+
+#define RSSB_SERVE_CACHE_SIZE  64         /* Assembled images kept */
+#define RSSB_SERVE_MAX_SOURCE  (16 << 20) /* Bytes of source per request */
+#define RSSB_SERVE_MAX_HEADER  64
+
+/* One assembled program. Its VM is never run: requests run clones */
+struct rssb_serve_image {
+  uint64_t hash;
+  char *source;
+  size_t size;
+  rssb_vm_t *vm;
+  unsigned int refs;  /* The cache holds one while the image is cached */
+  uint64_t last_use;
+};
+
+/*
+ * Daemon mode. A request is a "RSSB <source bytes>\n" line followed by
+ * the program source and then its $IN stream, up to the client's end of
+ * the connection. The reply is made of "O <hex len>\n" frames carrying
+ * $OUT and a final "S ...\n" line with run statistics, or a single
+ * "X <error>\n" line if the request cannot be run.
+ */
+typedef struct rssb_serve {
+  uint64_t memory_size;
+  enum rssb_vm_backing backing;
+
+  pthread_mutex_t lock;
+  struct rssb_serve_image *cache[RSSB_SERVE_CACHE_SIZE];
+  uint64_t clock;
+} rssb_serve_t;
+
+rssb_serve_t *rssb_serve_new(uint64_t memory_size, enum rssb_vm_backing backing);
+BOOL rssb_serve_run(rssb_serve_t *serve, const char *path, unsigned int threads);
+void rssb_serve_destroy(rssb_serve_t *serve);
+
+#endif /* _RSSB_SERVE_H */
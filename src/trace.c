@@ -0,0 +1,274 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "trace.h"
+
+#define RSSB_TRACE_MAGIC   "RSSBTRC"
+#define RSSB_TRACE_VERSION 1
+
+/* Dumps are native-endian: decode them on the same architecture */
+struct rssb_trace_header {
+  char     magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint64_t count; /* Records in this dump */
+  uint64_t total; /* Records ever produced */
+};
+
+PRIVATE const rssb_trace_t *g_signal_trace;
+PRIVATE char g_signal_path[256];
+
+void
+rssb_trace_destroy(rssb_trace_t *trace)
+{
+  if (trace->records != NULL)
+    free(trace->records);
+
+  free(trace);
+}
+
+rssb_trace_t *
+rssb_trace_new(uint64_t size)
+{
+  rssb_trace_t *new = NULL;
+  uint64_t capacity = 2;
+
+  while (capacity < size)
+    capacity <<= 1;
+
+  TRYCATCH(new = calloc(1, sizeof(rssb_trace_t)), goto fail);
+  TRYCATCH(
+      new->records = calloc(capacity, sizeof(struct rssb_trace_record)),
+      goto fail);
+
+  new->mask = capacity - 1;
+
+  return new;
+
+fail:
+  if (new != NULL)
+    rssb_trace_destroy(new);
+
+  return NULL;
+}
+
+PRIVATE BOOL
+rssb_trace_write_all(int fd, const void *data, size_t size)
+{
+  ssize_t got;
+
+  while (size > 0) {
+    if ((got = write(fd, data, size)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return FALSE;
+    }
+
+    data  = (const char *) data + got;
+    size -= got;
+  }
+
+  return TRUE;
+}
+
+/* Only async-signal-safe calls from here on: this runs in handlers */
+PRIVATE BOOL
+rssb_trace_dump_fd(const rssb_trace_t *trace, int fd)
+{
+  struct rssb_trace_header header;
+  uint64_t head, count, first, capacity = trace->mask + 1;
+  uint64_t chunk;
+
+  head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+
+  /* The oldest slot may be getting overwritten right now: leave it out */
+  count = head < capacity ? head : capacity - 1;
+  first = (head - count) & trace->mask;
+
+  memset(&header, 0, sizeof(struct rssb_trace_header));
+  memcpy(header.magic, RSSB_TRACE_MAGIC, sizeof(RSSB_TRACE_MAGIC));
+  header.version     = RSSB_TRACE_VERSION;
+  header.record_size = sizeof(struct rssb_trace_record);
+  header.count       = count;
+  header.total       = head;
+
+  if (!rssb_trace_write_all(fd, &header, sizeof(struct rssb_trace_header)))
+    return FALSE;
+
+  chunk = count < capacity - first ? count : capacity - first;
+
+  if (!rssb_trace_write_all(
+      fd,
+      trace->records + first,
+      chunk * sizeof(struct rssb_trace_record)))
+    return FALSE;
+
+  return rssb_trace_write_all(
+      fd,
+      trace->records,
+      (count - chunk) * sizeof(struct rssb_trace_record));
+}
+
+BOOL
+rssb_trace_dump(const rssb_trace_t *trace, const char *path)
+{
+  int fd;
+  BOOL ok;
+
+  if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+    fprintf(
+        stderr,
+        "%s: cannot open `%s': %s\n",
+        __FUNCTION__,
+        path,
+        strerror(errno));
+    return FALSE;
+  }
+
+  ok = rssb_trace_dump_fd(trace, fd);
+
+  if (close(fd) == -1)
+    ok = FALSE;
+
+  return ok;
+}
+
+PRIVATE void
+rssb_trace_signal_handler(int sig)
+{
+  int fd;
+
+  if ((fd = open(g_signal_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) != -1) {
+    (void) rssb_trace_dump_fd(g_signal_trace, fd);
+    close(fd);
+  }
+
+  /* SIGUSR1 is a snapshot request. Anything else is fatal */
+  if (sig != SIGUSR1) {
+    signal(sig, SIG_DFL);
+    raise(sig);
+  }
+}
+
+/*
+ * Dumps `trace' to `path' on SIGUSR1 (and keeps running) or when the
+ * process is killed by a fatal signal.
+ */
+BOOL
+rssb_trace_dump_on_signal(const rssb_trace_t *trace, const char *path)
+{
+  static const int signals[] = {
+    SIGUSR1, SIGINT, SIGTERM, SIGSEGV, SIGBUS, SIGFPE, SIGABRT
+  };
+  struct sigaction sa;
+  unsigned int i;
+
+  if (strlen(path) >= sizeof(g_signal_path)) {
+    fprintf(stderr, "%s: trace path too long\n", __FUNCTION__);
+    return FALSE;
+  }
+
+  strncpy(g_signal_path, path, sizeof(g_signal_path) - 1);
+  g_signal_trace = trace;
+
+  memset(&sa, 0, sizeof(struct sigaction));
+  sa.sa_handler = rssb_trace_signal_handler;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+
+  for (i = 0; i < sizeof(signals) / sizeof(signals[0]); ++i)
+    TRYCATCH(sigaction(signals[i], &sa, NULL) == 0, return FALSE);
+
+  return TRUE;
+}
+
+BOOL
+rssb_trace_decode(const char *path, const rssb_dbginfo_t *dbg, FILE *fp)
+{
+  struct rssb_trace_header header;
+  struct rssb_trace_record rec;
+  const struct rssb_dbginfo_loc *loc;
+  uint64_t i;
+  FILE *in = NULL;
+  BOOL ok = FALSE;
+
+  if ((in = fopen(path, "rb")) == NULL) {
+    fprintf(
+        stderr,
+        "%s: cannot open `%s': %s\n",
+        __FUNCTION__,
+        path,
+        strerror(errno));
+    goto done;
+  }
+
+  if (fread(&header, sizeof(struct rssb_trace_header), 1, in) != 1
+      || memcmp(header.magic, RSSB_TRACE_MAGIC, sizeof(RSSB_TRACE_MAGIC)) != 0
+      || header.version != RSSB_TRACE_VERSION
+      || header.record_size != sizeof(struct rssb_trace_record)) {
+    fprintf(stderr, "%s: `%s' is not a trace dump\n", __FUNCTION__, path);
+    goto done;
+  }
+
+  fprintf(
+      fp,
+      "# %" PRIu64 " of %" PRIu64 " steps\n",
+      header.count,
+      header.total);
+
+  for (i = 0; i < header.count; ++i) {
+    if (fread(&rec, sizeof(struct rssb_trace_record), 1, in) != 1) {
+      fprintf(stderr, "%s: `%s' is truncated\n", __FUNCTION__, path);
+      goto done;
+    }
+
+    fprintf(
+        fp,
+        "%12" PRIu64 " [%04x] rssb 0x%04x: %04x - %04x = %04x [%c]",
+        header.total - header.count + i,
+        rec.ip,
+        rec.addr,
+        rec.word,
+        rec.acc,
+        rec.result,
+        rec.skip ? 'S' : ' ');
+
+    if (dbg != NULL && (loc = rssb_dbginfo_get_loc(dbg, rec.ip)) != NULL)
+      fprintf(fp, " # %s:%d", loc->file, loc->line);
+
+    fputc('\n', fp);
+  }
+
+  ok = TRUE;
+
+done:
+  if (in != NULL)
+    fclose(in);
+
+  return ok;
+}
@@ -0,0 +1,83 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _RSSB_TRACE_H
+#define _RSSB_TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "rssb.h"
+#include "dbginfo.h"
+
+#define RSSB_TRACE_DEFAULT_SIZE (1 << 20)
+
+/* One executed instruction. Fixed size, written as-is to dumps */
+struct rssb_trace_record {
+  uint32_t ip;
+  uint32_t addr;
+  uint32_t word;
+  uint32_t acc;
+  uint32_t result;
+  uint32_t skip;
+};
+
+/*
+ * Single-producer ring: only the VM thread writes records, and `head'
+ * counts every record ever written. Readers (dumps, signal handlers)
+ * never take locks: they snapshot `head' and skip the slot that may be
+ * in the middle of being overwritten.
+ */
+typedef struct rssb_trace {
+  struct rssb_trace_record *records;
+  uint64_t mask; /* Capacity - 1, capacity is a power of two */
+  uint64_t head;
+} rssb_trace_t;
+
+static inline void
+rssb_trace_push(
+    rssb_trace_t *trace,
+    word_t ip,
+    word_t addr,
+    word_t word,
+    word_t acc,
+    word_t result,
+    BOOL skip)
+{
+  uint64_t head = trace->head;
+  struct rssb_trace_record *rec = trace->records + (head & trace->mask);
+
+  rec->ip     = ip;
+  rec->addr   = addr;
+  rec->word   = word;
+  rec->acc    = acc;
+  rec->result = result;
+  rec->skip   = skip;
+
+  __atomic_store_n(&trace->head, head + 1, __ATOMIC_RELEASE);
+}
+
+rssb_trace_t *rssb_trace_new(uint64_t size);
+BOOL rssb_trace_dump(const rssb_trace_t *trace, const char *path);
+BOOL rssb_trace_dump_on_signal(const rssb_trace_t *trace, const char *path);
+BOOL rssb_trace_decode(const char *path, const rssb_dbginfo_t *dbg, FILE *fp);
+void rssb_trace_destroy(rssb_trace_t *trace);
+
+#endif /* _RSSB_TRACE_H */
@@ -0,0 +1,389 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifdef HAVE_IO_URING
+#  include <linux/io_uring.h>
+#  include <sys/syscall.h>
+#endif /* HAVE_IO_URING */
+
+#include "uring.h"
+
+void
+rssb_uring_destroy(rssb_uring_t *ring)
+{
+  if (ring->sqes != NULL)
+    munmap(ring->sqes, ring->sqes_size);
+
+  if (ring->cq_ring != NULL)
+    munmap(ring->cq_ring, ring->cq_ring_size);
+
+  if (ring->sq_ring != NULL)
+    munmap(ring->sq_ring, ring->sq_ring_size);
+
+  if (ring->fd != -1)
+    close(ring->fd);
+
+  if (ring->done != NULL)
+    free(ring->done);
+
+  free(ring);
+}
+
+#ifdef HAVE_IO_URING
+PRIVATE BOOL
+rssb_uring_setup(rssb_uring_t *ring, unsigned int entries)
+{
+  struct io_uring_params params;
+  char *sq, *cq;
+
+  memset(&params, 0, sizeof(struct io_uring_params));
+
+  if ((ring->fd = syscall(__NR_io_uring_setup, entries, &params)) == -1)
+    return FALSE;
+
+  ++ring->syscalls;
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  ring->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  if ((sq = mmap(
+      NULL,
+      ring->sq_ring_size,
+      PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE,
+      ring->fd,
+      IORING_OFF_SQ_RING)) == MAP_FAILED)
+    return FALSE;
+  ring->sq_ring = sq;
+
+  if ((cq = mmap(
+      NULL,
+      ring->cq_ring_size,
+      PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE,
+      ring->fd,
+      IORING_OFF_CQ_RING)) == MAP_FAILED)
+    return FALSE;
+  ring->cq_ring = cq;
+
+  if ((ring->sqes = mmap(
+      NULL,
+      ring->sqes_size,
+      PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE,
+      ring->fd,
+      IORING_OFF_SQES)) == MAP_FAILED) {
+    ring->sqes = NULL;
+    return FALSE;
+  }
+
+  ring->sq_head    = (uint32_t *) (sq + params.sq_off.head);
+  ring->sq_tail    = (uint32_t *) (sq + params.sq_off.tail);
+  ring->sq_mask    = *(uint32_t *) (sq + params.sq_off.ring_mask);
+  ring->sq_array   = (uint32_t *) (sq + params.sq_off.array);
+  ring->sq_entries = params.sq_entries;
+
+  ring->cq_head = (uint32_t *) (cq + params.cq_off.head);
+  ring->cq_tail = (uint32_t *) (cq + params.cq_off.tail);
+  ring->cq_mask = *(uint32_t *) (cq + params.cq_off.ring_mask);
+  ring->cqes    = cq + params.cq_off.cqes;
+
+  return TRUE;
+}
+
+PRIVATE BOOL
+rssb_uring_queue(
+    rssb_uring_t *ring,
+    uint8_t opcode,
+    int fd,
+    const void *buf,
+    size_t size,
+    uint64_t offset,
+    int buf_index,
+    uint64_t user_data)
+{
+  struct io_uring_sqe *sqe;
+  uint32_t tail, index;
+
+  /* Room is only made by the kernel consuming what we queued */
+  if (ring->queued >= ring->sq_entries && !rssb_uring_submit(ring, 0))
+    return FALSE;
+
+  tail  = *ring->sq_tail;
+  index = tail & ring->sq_mask;
+  sqe   = (struct io_uring_sqe *) ring->sqes + index;
+
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->opcode    = opcode;
+  sqe->fd        = fd;
+  sqe->addr      = (uint64_t) (uintptr_t) buf;
+  sqe->len       = size;
+  sqe->off       = offset;
+  sqe->user_data = user_data;
+
+  if (buf_index >= 0 && ring->registered) {
+    sqe->opcode    = opcode == IORING_OP_READ
+        ? IORING_OP_READ_FIXED
+        : IORING_OP_WRITE_FIXED;
+    sqe->buf_index = buf_index;
+  }
+
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  ++ring->queued;
+
+  return TRUE;
+}
+#endif /* HAVE_IO_URING */
+
+PRIVATE void
+rssb_uring_push_done(rssb_uring_t *ring, uint64_t user_data, int32_t res)
+{
+  struct rssb_uring_cqe *cqe = ring->done + (ring->done_tail++ % ring->done_size);
+
+  cqe->user_data = user_data;
+  cqe->res       = res;
+}
+
+/*
+ * Requests in flight are bounded by `entries': callers never have more
+ * outstanding than that, which also bounds the fallback completions.
+ */
+rssb_uring_t *
+rssb_uring_new(unsigned int entries, BOOL native)
+{
+  rssb_uring_t *new = NULL;
+
+  TRYCATCH(new = calloc(1, sizeof(rssb_uring_t)), goto fail);
+  TRYCATCH(
+      new->done = calloc(entries, sizeof(struct rssb_uring_cqe)),
+      goto fail);
+
+  new->fd        = -1;
+  new->done_size = entries;
+
+#ifdef HAVE_IO_URING
+  if (native) {
+    if (rssb_uring_setup(new, entries))
+      new->native = TRUE;
+    else if (new->fd != -1) {
+      /* Set up, but unusable: start over with plain syscalls */
+      rssb_uring_destroy(new);
+      return rssb_uring_new(entries, FALSE);
+    }
+  }
+#endif /* HAVE_IO_URING */
+
+  return new;
+
+fail:
+  if (new != NULL)
+    rssb_uring_destroy(new);
+
+  return NULL;
+}
+
+const char *
+rssb_uring_backend(const rssb_uring_t *ring)
+{
+  if (!ring->native)
+    return "read/write";
+
+  return ring->registered ? "io_uring, registered buffers" : "io_uring";
+}
+
+/* Lets reads and writes into these buffers skip per-request mapping */
+BOOL
+rssb_uring_register(rssb_uring_t *ring, const struct iovec *iov, unsigned int count)
+{
+#ifdef HAVE_IO_URING
+  if (ring->native) {
+    ++ring->syscalls;
+
+    /* Usually RLIMIT_MEMLOCK: plain requests still work */
+    if (syscall(
+        __NR_io_uring_register,
+        ring->fd,
+        IORING_REGISTER_BUFFERS,
+        iov,
+        count) == -1)
+      return FALSE;
+
+    ring->registered = TRUE;
+  }
+#endif /* HAVE_IO_URING */
+
+  return ring->registered;
+}
+
+BOOL
+rssb_uring_read(
+    rssb_uring_t *ring,
+    int fd,
+    void *buf,
+    size_t size,
+    uint64_t offset,
+    int buf_index,
+    uint64_t user_data)
+{
+  ssize_t got;
+
+#ifdef HAVE_IO_URING
+  if (ring->native)
+    return rssb_uring_queue(
+        ring,
+        IORING_OP_READ,
+        fd,
+        buf,
+        size,
+        offset,
+        buf_index,
+        user_data);
+#endif /* HAVE_IO_URING */
+
+  ++ring->syscalls;
+
+  while ((got = pread(fd, buf, size, offset)) == -1 && errno == EINTR)
+    ++ring->syscalls;
+
+  rssb_uring_push_done(ring, user_data, got == -1 ? -errno : got);
+
+  return TRUE;
+}
+
+BOOL
+rssb_uring_write(
+    rssb_uring_t *ring,
+    int fd,
+    const void *buf,
+    size_t size,
+    uint64_t offset,
+    int buf_index,
+    uint64_t user_data)
+{
+  ssize_t sent;
+
+#ifdef HAVE_IO_URING
+  if (ring->native)
+    return rssb_uring_queue(
+        ring,
+        IORING_OP_WRITE,
+        fd,
+        buf,
+        size,
+        offset,
+        buf_index,
+        user_data);
+#endif /* HAVE_IO_URING */
+
+  ++ring->syscalls;
+
+  while ((sent = pwrite(fd, buf, size, offset)) == -1 && errno == EINTR)
+    ++ring->syscalls;
+
+  rssb_uring_push_done(ring, user_data, sent == -1 ? -errno : sent);
+
+  return TRUE;
+}
+
+/* Hands queued requests to the kernel, waiting for `wait' completions */
+BOOL
+rssb_uring_submit(rssb_uring_t *ring, unsigned int wait)
+{
+#ifdef HAVE_IO_URING
+  int done;
+
+  if (!ring->native || (ring->queued == 0 && (wait == 0 || ring->inflight == 0)))
+    return TRUE;
+
+  for (;;) {
+    ++ring->syscalls;
+
+    done = syscall(
+        __NR_io_uring_enter,
+        ring->fd,
+        ring->queued,
+        wait,
+        wait > 0 ? IORING_ENTER_GETEVENTS : 0,
+        NULL,
+        0);
+
+    if (done >= 0)
+      break;
+
+    if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      fprintf(stderr, "%s: io_uring_enter: %s\n", __FUNCTION__, strerror(errno));
+      return FALSE;
+    }
+  }
+
+  ring->inflight += done;
+  ring->queued   -= done;
+#endif /* HAVE_IO_URING */
+
+  return TRUE;
+}
+
+BOOL
+rssb_uring_complete(rssb_uring_t *ring, struct rssb_uring_cqe *cqe)
+{
+#ifdef HAVE_IO_URING
+  struct io_uring_cqe *entry;
+  uint32_t head;
+
+  if (ring->native) {
+    head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+      return FALSE;
+
+    entry = (struct io_uring_cqe *) ring->cqes + (head & ring->cq_mask);
+    cqe->user_data = entry->user_data;
+    cqe->res       = entry->res;
+
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    --ring->inflight;
+
+    return TRUE;
+  }
+#endif /* HAVE_IO_URING */
+
+  if (ring->done_head == ring->done_tail)
+    return FALSE;
+
+  *cqe = ring->done[ring->done_head++ % ring->done_size];
+
+  return TRUE;
+}
@@ -0,0 +1,98 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+
+#ifndef _RSSB_URING_H
+#define _RSSB_URING_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "rssb.h"
+
+struct rssb_uring_cqe {
+  uint64_t user_data;
+  int32_t res;        /* Bytes transferred, or -errno */
+};
+
+/*
+ * Batched file I/O. Reads and writes are queued and go to the kernel
+ * together, in one io_uring_enter() per rssb_uring_submit(). When
+ * io_uring is missing (or not allowed) every request is carried out
+ * right away with pread()/pwrite(), and completes just the same.
+ */
+typedef struct rssb_uring {
+  BOOL native;
+  BOOL registered;    /* Buffers passed to rssb_uring_register() */
+  int fd;
+
+  void *sq_ring;
+  size_t sq_ring_size;
+  uint32_t *sq_head;
+  uint32_t *sq_tail;
+  uint32_t sq_mask;
+  uint32_t *sq_array;
+  void *sqes;
+  size_t sqes_size;
+  uint32_t sq_entries;
+
+  void *cq_ring;
+  size_t cq_ring_size;
+  uint32_t *cq_head;
+  uint32_t *cq_tail;
+  uint32_t cq_mask;
+  void *cqes;
+
+  unsigned int queued;   /* Not submitted yet */
+  unsigned int inflight; /* Submitted, not completed */
+
+  /* Completions of the fallback path */
+  struct rssb_uring_cqe *done;
+  unsigned int done_head;
+  unsigned int done_tail;
+  unsigned int done_size;
+
+  uint64_t syscalls;
+} rssb_uring_t;
+
+rssb_uring_t *rssb_uring_new(unsigned int entries, BOOL native);
+const char *rssb_uring_backend(const rssb_uring_t *ring);
+BOOL rssb_uring_register(rssb_uring_t *ring, const struct iovec *iov, unsigned int count);
+BOOL rssb_uring_read(
+    rssb_uring_t *ring,
+    int fd,
+    void *buf,
+    size_t size,
+    uint64_t offset,
+    int buf_index,
+    uint64_t user_data);
+BOOL rssb_uring_write(
+    rssb_uring_t *ring,
+    int fd,
+    const void *buf,
+    size_t size,
+    uint64_t offset,
+    int buf_index,
+    uint64_t user_data);
+BOOL rssb_uring_submit(rssb_uring_t *ring, unsigned int wait);
+BOOL rssb_uring_complete(rssb_uring_t *ring, struct rssb_uring_cqe *cqe);
+void rssb_uring_destroy(rssb_uring_t *ring);
+
+#endif /* _RSSB_URING_H */
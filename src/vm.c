@@ -21,8 +21,77 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "rssb.h"
+#include "profile.h"
+#include "dbginfo.h"
+#include "trace.h"
+#include "loopcheck.h"
+#include "regions.h"
+
+#define RSSB_VM_BINARY_BUFFER_SIZE 65536
+
+/*
+ * stdio for binary I/O. Words go through the I/O windows, which point
+ * into these buffers: they are refilled with one read() and drained
+ * with one write() each.
+ */
+struct rssb_vm_binary {
+  uint8_t in[RSSB_VM_BINARY_BUFFER_SIZE];
+  uint8_t out[RSSB_VM_BINARY_BUFFER_SIZE];
+};
+
+word_t
+rssb_vm_peek(const rssb_vm_t *vm, word_t addr)
+{
+  if (addr >= vm->mem_size)
+    return 0;
+
+  switch (vm->word_size) {
+    case 1:
+      return ((const uint8_t *) vm->mem)[addr];
+
+    case 2:
+      return ((const uint16_t *) vm->mem)[addr];
+
+    default:
+      return ((const uint32_t *) vm->mem)[addr];
+  }
+}
+
+void
+rssb_vm_poke(rssb_vm_t *vm, word_t addr, word_t word)
+{
+  uint64_t old;
+
+  if (addr >= vm->mem_size)
+    return;
+
+  vm->pages[addr >> vm->page_shift] = RSSB_VM_PAGE_WRITTEN;
+  vm->regions = NULL;
+
+  old = vm->loop_check != NULL ? rssb_vm_peek(vm, addr) : 0;
+
+  switch (vm->word_size) {
+    case 1:
+      ((uint8_t *) vm->mem)[addr] = word;
+      break;
+
+    case 2:
+      ((uint16_t *) vm->mem)[addr] = word;
+      break;
+
+    default:
+      ((uint32_t *) vm->mem)[addr] = word;
+  }
+
+  if (vm->loop_check != NULL && addr >= RSSB_ADDR_IN)
+    vm->loop_check->hash +=
+        (rssb_vm_peek(vm, addr) - old) * rssb_loop_check_key(addr);
+}
 
 BOOL
 rssb_vm_put_word(rssb_vm_t *vm, word_t word)
@@ -35,17 +104,29 @@ rssb_vm_put_word(rssb_vm_t *vm, word_t word)
   if (vm->mem_ptr > vm->footprint)
     vm->footprint = vm->mem_ptr;
 
-  vm->mem[vm->mem_ptr++] = word;
+  rssb_vm_poke(vm, vm->mem_ptr++, word);
   return TRUE;
 }
 
 void
-rssb_vm_disas(const rssb_vm_t *vm)
+rssb_vm_disas(const rssb_vm_t *vm, const struct rssb_dbginfo *dbg)
 {
+  const struct rssb_dbginfo_loc *loc;
   unsigned int i;
 
-  for (i = 0; i <= vm->footprint; ++i)
-    printf("0x%08x: rssb 0x%08x\n", i, vm->mem[i]);
+  for (i = 0; i <= vm->footprint; ++i) {
+    printf("0x%08x: rssb 0x%08x", i, rssb_vm_peek(vm, i));
+
+    if (vm->regions != NULL)
+      printf(" [%s]", rssb_regions_name(rssb_vm_get_region(vm, i)));
+
+    if (dbg != NULL && (loc = rssb_dbginfo_get_loc(dbg, i)) != NULL) {
+      printf(" # %s:%d, in ", loc->file, loc->line);
+      rssb_dbginfo_print_stack(dbg, loc->frame, stdout);
+    }
+
+    putchar('\n');
+  }
 }
 
 word_t
@@ -66,34 +147,269 @@ rssb_vm_set_dumb(rssb_vm_t *vm, BOOL dumb)
   vm->dumb_mode = dumb;
 }
 
+void
+rssb_vm_set_binary(rssb_vm_t *vm, BOOL binary)
+{
+  vm->binary_io = binary;
+}
+
+void
+rssb_vm_set_profile(rssb_vm_t *vm, struct rssb_profile *profile)
+{
+  vm->profile = profile;
+}
+
+void
+rssb_vm_set_trace(rssb_vm_t *vm, struct rssb_trace *trace)
+{
+  vm->trace = trace;
+}
+
+/* Memory must not change behind the VM's back while a check is set */
+void
+rssb_vm_set_loop_check(rssb_vm_t *vm, struct rssb_loop_check *check)
+{
+  vm->loop_check = check;
+
+  if (check != NULL)
+    rssb_loop_check_reset(check, vm);
+}
+
+/*
+ * Only valid while memory has not changed since `regions' was built:
+ * it is dropped on rssb_vm_poke and ignored once the VM has run.
+ */
+void
+rssb_vm_set_regions(rssb_vm_t *vm, struct rssb_regions *regions)
+{
+  vm->regions       = regions;
+  vm->regions_steps = vm->stats.steps;
+}
+
+/* Without an analysis, or with a stale one, any word may be written */
+enum rssb_region
+rssb_vm_get_region(const rssb_vm_t *vm, word_t addr)
+{
+  if (vm->regions == NULL || vm->stats.steps != vm->regions_steps)
+    return RSSB_REGION_WRITTEN;
+
+  return rssb_regions_get(vm->regions, addr);
+}
+
+void
+rssb_vm_set_io(
+    rssb_vm_t *vm,
+    void *private,
+    rssb_vm_input_t input,
+    rssb_vm_output_t output)
+{
+  vm->private = private;
+  vm->input   = input;
+  vm->output  = output;
+}
+
+void
+rssb_vm_set_io_window(
+    rssb_vm_t *vm,
+    const uint8_t *in,
+    size_t in_size,
+    uint8_t *out,
+    size_t out_size)
+{
+  vm->in_ptr  = in;
+  vm->in_end  = in + in_size;
+  vm->out_ptr = out;
+  vm->out_end = out + out_size;
+}
+
+/* Bytes of VM memory actually backed by physical pages */
+size_t
+rssb_vm_get_resident(const rssb_vm_t *vm)
+{
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t pages = (vm->mem_bytes + page - 1) / page;
+  size_t i, resident = 0;
+  unsigned char *vec;
+
+  if ((vec = malloc(pages)) == NULL)
+    return 0;
+
+  if (mincore(vm->mem, vm->mem_bytes, vec) == 0)
+    for (i = 0; i < pages; ++i)
+      resident += vec[i] & 1;
+
+  free(vec);
+
+  return resident * page;
+}
+
+/*
+ * Bytes of VM memory backed by huge pages, as accounted by the kernel
+ * in /proc/self/smaps. This is what madvise() actually got us.
+ */
+size_t
+rssb_vm_get_huge_resident(const rssb_vm_t *vm)
+{
+  uintptr_t start = (uintptr_t) vm->mem, end = start + vm->mem_bytes;
+  unsigned long vma_start, vma_end, kb;
+  BOOL inside = FALSE;
+  size_t total = 0;
+  char line[256];
+  FILE *fp;
+
+  if ((fp = fopen("/proc/self/smaps", "r")) == NULL)
+    return 0;
+
+  while (fgets(line, sizeof(line), fp) != NULL)
+    if (sscanf(line, "%lx-%lx ", &vma_start, &vma_end) == 2)
+      inside = vma_start < end && vma_end > start;
+    else if (inside
+        && (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1
+         || sscanf(line, "Private_Hugetlb: %lu kB", &kb) == 1))
+      total += (size_t) kb << 10;
+
+  fclose(fp);
+
+  return total;
+}
+
 void
 rssb_vm_destroy(rssb_vm_t *vm)
 {
   if (vm->mem != NULL)
-    free(vm->mem);
+    munmap(vm->mem, vm->mem_bytes);
+
+  if (vm->pages != NULL)
+    free(vm->pages);
+
+  if (vm->checkpoint_path != NULL)
+    free(vm->checkpoint_path);
+
+  if (vm->binary != NULL)
+    free(vm->binary);
 
   free(vm);
 }
 
+/*
+ * Maps `*bytes' of memory with the requested backing or, failing that,
+ * the next best one. On return `*backing' holds what was granted, and
+ * `*bytes' the mapped length, rounded up for huge pages.
+ */
+PRIVATE void *
+rssb_vm_map(size_t *bytes, enum rssb_vm_backing *backing)
+{
+  const int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+  const size_t huge_mask = RSSB_VM_HUGE_PAGE_SIZE - 1;
+  size_t huge_bytes = (*bytes + huge_mask) & ~huge_mask;
+  char *mem, *aligned;
+
+#ifdef MAP_HUGETLB
+  if (*backing == RSSB_VM_BACKING_HUGETLB) {
+    /*
+     * Needs pages reserved in /proc/sys/vm/nr_hugepages. No
+     * MAP_NORESERVE here: the mapping would succeed with an empty pool
+     * and then SIGBUS on first touch. Reserving up front makes mmap()
+     * fail instead, and we fall back.
+     */
+    if ((mem = mmap(
+        NULL,
+        huge_bytes,
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+        -1,
+        0)) != MAP_FAILED) {
+      *bytes = huge_bytes;
+      return mem;
+    }
+
+    *backing = RSSB_VM_BACKING_THP;
+  }
+#else
+  if (*backing == RSSB_VM_BACKING_HUGETLB)
+    *backing = RSSB_VM_BACKING_THP;
+#endif /* MAP_HUGETLB */
+
+#ifdef MADV_HUGEPAGE
+  if (*backing == RSSB_VM_BACKING_THP) {
+    /* Huge pages must be aligned: map a bit more and trim both ends */
+    if ((mem = mmap(
+        NULL,
+        huge_bytes + RSSB_VM_HUGE_PAGE_SIZE,
+        PROT_READ | PROT_WRITE,
+        flags,
+        -1,
+        0)) != MAP_FAILED) {
+      aligned = (char *) (((uintptr_t) mem + huge_mask) & ~(uintptr_t) huge_mask);
+
+      if (aligned > mem)
+        munmap(mem, aligned - mem);
+      munmap(aligned + huge_bytes, RSSB_VM_HUGE_PAGE_SIZE - (aligned - mem));
+
+      if (madvise(aligned, huge_bytes, MADV_HUGEPAGE) == 0) {
+        *bytes = huge_bytes;
+        return aligned;
+      }
+
+      munmap(aligned, huge_bytes);
+    }
+
+    *backing = RSSB_VM_BACKING_DEFAULT;
+  }
+#else
+  if (*backing == RSSB_VM_BACKING_THP)
+    *backing = RSSB_VM_BACKING_DEFAULT;
+#endif /* MADV_HUGEPAGE */
+
+  mem = mmap(NULL, *bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+
+  return mem != MAP_FAILED ? mem : NULL;
+}
+
+/*
+ * VM memory is a private anonymous mapping with no swap reservation:
+ * the kernel only commits a page the first time it is written (reads
+ * of untouched pages hit the shared zero page), so a large address
+ * space costs nothing until the program touches it.
+ *
+ * Words are as wide as addresses, so each one is stored in the
+ * narrowest of 8, 16 or 32 bits that holds an address.
+ */
 rssb_vm_t *
-rssb_vm_new(unsigned int size)
+rssb_vm_new_with_backing(unsigned int size, enum rssb_vm_backing backing)
 {
   rssb_vm_t *new = NULL;
   unsigned int mask = 1;
 
-  TRYCATCH(size > RSSB_ADDR_MIN, goto fail);
+  TRYCATCH(size > RSSB_ADDR_MIN && size <= RSSB_MEMORY_MAX, goto fail);
 
   TRYCATCH(new = calloc(1, sizeof(rssb_vm_t)), goto fail);
-  TRYCATCH(new->mem = calloc(size, sizeof(word_t)), goto fail);
 
   while (mask < size)
     mask <<= 1;
 
+  if (mask <= 0x100)
+    new->word_size = sizeof(uint8_t);
+  else if (mask <= 0x10000)
+    new->word_size = sizeof(uint16_t);
+  else
+    new->word_size = sizeof(uint32_t);
+
+  new->mem_bytes = (size_t) size * new->word_size;
+  new->backing = backing;
+  TRYCATCH(new->mem = rssb_vm_map(&new->mem_bytes, &new->backing), goto fail);
+
+  new->page_count =
+      (new->mem_bytes + RSSB_VM_PAGE_SIZE - 1) >> RSSB_VM_PAGE_SHIFT;
+  TRYCATCH(new->pages = calloc(new->page_count, 1), goto fail);
+
+  new->page_shift = RSSB_VM_PAGE_SHIFT - (new->word_size == 4 ? 2 : new->word_size - 1);
+
   new->mem_mask = mask - 1;
   new->mem_neg_mask = mask >> 1;
   new->mem_size = size;
   new->mem_ptr = RSSB_ADDR_MIN;
-  new->mem[RSSB_ADDR_IP] = RSSB_ADDR_MIN;
+  rssb_vm_poke(new, RSSB_ADDR_IP, RSSB_ADDR_MIN);
 
   return new;
 
@@ -104,43 +420,454 @@ fail:
   return NULL;
 }
 
+rssb_vm_t *
+rssb_vm_new(unsigned int size)
+{
+  return rssb_vm_new_with_backing(size, RSSB_VM_BACKING_DEFAULT);
+}
+
+/*
+ * A fresh VM with the memory and mode of `vm', which is only read, so
+ * one base VM can be cloned from several threads at once. Counters,
+ * hooks and checkpoint state are not copied.
+ */
+rssb_vm_t *
+rssb_vm_clone(const rssb_vm_t *vm)
+{
+  rssb_vm_t *new = NULL;
+  size_t i;
+
+  TRYCATCH(
+      new = rssb_vm_new_with_backing(vm->mem_size, vm->backing),
+      return NULL);
+
+  /* Only pages ever written can differ from zero */
+  for (i = 0; i < vm->page_count; ++i)
+    if (vm->pages[i] & RSSB_VM_PAGE_USED) {
+      memcpy(
+          (char *) new->mem + (i << RSSB_VM_PAGE_SHIFT),
+          (const char *) vm->mem + (i << RSSB_VM_PAGE_SHIFT),
+          RSSB_VM_PAGE_SIZE);
+      new->pages[i] = RSSB_VM_PAGE_USED;
+    }
+
+  new->dumb_mode = vm->dumb_mode;
+  new->binary_io = vm->binary_io;
+  new->footprint = vm->footprint;
+  new->mem_ptr   = vm->mem_ptr;
+
+  return new;
+}
+
+PRIVATE struct rssb_vm_binary *
+rssb_vm_binary_buffers(rssb_vm_t *vm)
+{
+  if (vm->binary == NULL && (vm->binary = malloc(sizeof(struct rssb_vm_binary))) == NULL)
+    fprintf(stderr, "vm: cannot allocate I/O buffers\n");
+
+  return vm->binary;
+}
+
+/* Writes out what the output window holds, if it is the stdio buffer */
+PRIVATE BOOL
+rssb_vm_binary_flush(rssb_vm_t *vm)
+{
+  struct rssb_vm_binary *binary = vm->binary;
+  const uint8_t *data;
+  ssize_t got;
+
+  if (binary == NULL || vm->out_end != binary->out + RSSB_VM_BINARY_BUFFER_SIZE)
+    return TRUE;
+
+  for (data = binary->out; data < vm->out_ptr; data += got)
+    if ((got = write(STDOUT_FILENO, data, vm->out_ptr - data)) < 0) {
+      if (errno == EINTR) {
+        got = 0;
+        continue;
+      }
+      return FALSE;
+    }
+
+  vm->out_ptr = binary->out;
+
+  return TRUE;
+}
+
+PRIVATE word_t
+rssb_vm_binary_fill(rssb_vm_t *vm)
+{
+  struct rssb_vm_binary *binary;
+  ssize_t got;
+
+  if ((binary = rssb_vm_binary_buffers(vm)) == NULL)
+    return (word_t) EOF;
+
+  /* Whoever feeds us may be waiting for what we wrote */
+  (void) rssb_vm_binary_flush(vm);
+
+  do
+    got = read(STDIN_FILENO, binary->in, RSSB_VM_BINARY_BUFFER_SIZE);
+  while (got < 0 && errno == EINTR);
+
+  if (got <= 0)
+    return (word_t) EOF;
+
+  vm->in_ptr = binary->in + 1;
+  vm->in_end = binary->in + got;
+
+  return binary->in[0];
+}
+
 PRIVATE BOOL
-rssb_vm_exec(rssb_vm_t *vm)
+rssb_vm_binary_drain(rssb_vm_t *vm, uint8_t byte)
+{
+  struct rssb_vm_binary *binary;
+
+  if ((binary = rssb_vm_binary_buffers(vm)) == NULL
+      || !rssb_vm_binary_flush(vm))
+    return FALSE;
+
+  vm->out_ptr = binary->out;
+  vm->out_end = binary->out + RSSB_VM_BINARY_BUFFER_SIZE;
+
+  *vm->out_ptr++ = byte;
+
+  return TRUE;
+}
+
+/*
+ * Bytes of $IN and $OUT come from the I/O windows while they last,
+ * then go through the host callbacks when set, stdio otherwise.
+ * Returns FALSE if the input callback has nothing yet: the step that
+ * reads $IN must then be left for later.
+ */
+static inline BOOL
+rssb_vm_read_byte(rssb_vm_t *vm, word_t *word)
+{
+  if (vm->in_ptr < vm->in_end) {
+    *word = *vm->in_ptr++;
+    ++vm->stats.in_bytes;
+    return TRUE;
+  }
+
+  if (vm->input == NULL) {
+    *word = vm->binary_io ? rssb_vm_binary_fill(vm) : (word_t) getchar();
+    if (*word != (word_t) EOF)
+      ++vm->stats.in_bytes;
+    return TRUE;
+  }
+
+  switch ((vm->input) (vm->private, word)) {
+    case RSSB_VM_INPUT_READY:
+      ++vm->stats.in_bytes;
+      return TRUE;
+
+    case RSSB_VM_INPUT_EOF:
+      *word = (word_t) EOF;
+      return TRUE;
+
+    default:
+      return FALSE;
+  }
+}
+
+static inline BOOL
+rssb_vm_write_byte(rssb_vm_t *vm, word_t ch)
+{
+  ++vm->stats.out_bytes;
+
+  if (vm->out_ptr < vm->out_end) {
+    *vm->out_ptr++ = ch;
+    return TRUE;
+  }
+
+  if (vm->output == NULL) {
+    if (vm->binary_io)
+      return rssb_vm_binary_drain(vm, ch);
+
+    putchar(ch);
+    return TRUE;
+  }
+
+  return (vm->output) (vm->private, ch);
+}
+
+/*
+ * A word of binary input. If the input callback runs dry halfway, the
+ * bytes read so far wait in `in_word' for the retry. A short last word
+ * is padded with zeros; after it, $IN reads as EOF.
+ */
+PRIVATE BOOL
+rssb_vm_read_word(rssb_vm_t *vm, word_t *word)
+{
+  word_t byte;
+
+  if (vm->in_have == 0 && vm->in_end - vm->in_ptr >= (ptrdiff_t) sizeof(word_t)) {
+    memcpy(word, vm->in_ptr, sizeof(word_t));
+    vm->in_ptr += sizeof(word_t);
+    vm->stats.in_bytes += sizeof(word_t);
+    return TRUE;
+  }
+
+  while (vm->in_have < sizeof(word_t)) {
+    if (!rssb_vm_read_byte(vm, &byte))
+      return FALSE;
+
+    if (byte == (word_t) EOF)
+      break;
+
+    vm->in_word[vm->in_have++] = byte;
+  }
+
+  if (vm->in_have == 0) {
+    *word = (word_t) EOF;
+    return TRUE;
+  }
+
+  memset(vm->in_word + vm->in_have, 0, sizeof(word_t) - vm->in_have);
+  memcpy(word, vm->in_word, sizeof(word_t));
+  vm->in_have = 0;
+
+  return TRUE;
+}
+
+PRIVATE BOOL
+rssb_vm_write_word(rssb_vm_t *vm, word_t word)
+{
+  uint8_t bytes[sizeof(word_t)];
+  unsigned int i;
+
+  /* Results are computed wider than memory words: drop the excess */
+  word &= vm->mem_mask;
+
+  if (vm->out_end - vm->out_ptr >= (ptrdiff_t) sizeof(word_t)) {
+    memcpy(vm->out_ptr, &word, sizeof(word_t));
+    vm->out_ptr += sizeof(word_t);
+    vm->stats.out_bytes += sizeof(word_t);
+    return TRUE;
+  }
+
+  memcpy(bytes, &word, sizeof(word_t));
+
+  for (i = 0; i < sizeof(word_t); ++i)
+    if (!rssb_vm_write_byte(vm, bytes[i]))
+      return FALSE;
+
+  return TRUE;
+}
+
+static inline BOOL
+rssb_vm_read_input(rssb_vm_t *vm, word_t *word)
+{
+  return vm->binary_io ? rssb_vm_read_word(vm, word) : rssb_vm_read_byte(vm, word);
+}
+
+static inline BOOL
+rssb_vm_write_output(rssb_vm_t *vm, word_t ch)
+{
+  return vm->binary_io ? rssb_vm_write_word(vm, ch) : rssb_vm_write_byte(vm, ch);
+}
+
+#define RSSB_VM_LOOP_NAME    rssb_vm_loop_u8_borrow
+#define RSSB_VM_LOOP_TYPE    uint8_t
+#define RSSB_VM_LOOP_DUMB    0
+#define RSSB_VM_LOOP_CHECKED 0
+#define RSSB_VM_LOOP_HASH    0
+#include "vm_loop.h"
+
+#define RSSB_VM_LOOP_NAME    rssb_vm_loop_u8_borrow_checked
+#define RSSB_VM_LOOP_TYPE    uint8_t
+#define RSSB_VM_LOOP_DUMB    0
+#define RSSB_VM_LOOP_CHECKED 1
+#define RSSB_VM_LOOP_HASH    0
+#include "vm_loop.h"
+
+#define RSSB_VM_LOOP_NAME    rssb_vm_loop_u8_sign
+#define RSSB_VM_LOOP_TYPE    uint8_t
+#define RSSB_VM_LOOP_DUMB    1
+#define RSSB_VM_LOOP_CHECKED 0
+#define RSSB_VM_LOOP_HASH    0
+#include "vm_loop.h"
+
+#define RSSB_VM_LOOP_NAME    rssb_vm_loop_u8_sign_checked
+#define RSSB_VM_LOOP_TYPE    uint8_t
+#define RSSB_VM_LOOP_DUMB    1
+#define RSSB_VM_LOOP_CHECKED 1
+#define RSSB_VM_LOOP_HASH    0
+#include "vm_loop.h"
+
+#define RSSB_VM_LOOP_NAME    rssb_vm_loop_u16_borrow
+#define RSSB_VM_LOOP_TYPE    uint16_t
+#define RSSB_VM_LOOP_DUMB    0
+#define RSSB_VM_LOOP_CHECKED 0
+#define RSSB_VM_LOOP_HASH    0
+#include "vm_loop.h"
+
+#define RSSB_VM_LOOP_NAME    rssb_vm_loop_u16_borrow_checked
+#define RSSB_VM_LOOP_TYPE    uint16_t
+#define RSSB_VM_LOOP_DUMB    0
+#define RSSB_VM_LOOP_CHECKED 1
+#define RSSB_VM_LOOP_HASH    0
+#include "vm_loop.h"
+
+#define RSSB_VM_LOOP_NAME    rssb_vm_loop_u16_sign
+#define RSSB_VM_LOOP_TYPE    uint16_t
+#define RSSB_VM_LOOP_DUMB    1
+#define RSSB_VM_LOOP_CHECKED 0
+#define RSSB_VM_LOOP_HASH    0
+#include "vm_loop.h"
+
+#define RSSB_VM_LOOP_NAME    rssb_vm_loop_u16_sign_checked
+#define RSSB_VM_LOOP_TYPE    uint16_t
+#define RSSB_VM_LOOP_DUMB    1
+#define RSSB_VM_LOOP_CHECKED 1
+#define RSSB_VM_LOOP_HASH    0
+#include "vm_loop.h"
+
+#define RSSB_VM_LOOP_NAME    rssb_vm_loop_u32_borrow
+#define RSSB_VM_LOOP_TYPE    uint32_t
+#define RSSB_VM_LOOP_DUMB    0
+#define RSSB_VM_LOOP_CHECKED 0
+#define RSSB_VM_LOOP_HASH    0
+#include "vm_loop.h"
+
+#define RSSB_VM_LOOP_NAME    rssb_vm_loop_u32_borrow_checked
+#define RSSB_VM_LOOP_TYPE    uint32_t
+#define RSSB_VM_LOOP_DUMB    0
+#define RSSB_VM_LOOP_CHECKED 1
+#define RSSB_VM_LOOP_HASH    0
+#include "vm_loop.h"
+
+#define RSSB_VM_LOOP_NAME    rssb_vm_loop_u32_sign
+#define RSSB_VM_LOOP_TYPE    uint32_t
+#define RSSB_VM_LOOP_DUMB    1
+#define RSSB_VM_LOOP_CHECKED 0
+#define RSSB_VM_LOOP_HASH    0
+#include "vm_loop.h"
+
+#define RSSB_VM_LOOP_NAME    rssb_vm_loop_u32_sign_checked
+#define RSSB_VM_LOOP_TYPE    uint32_t
+#define RSSB_VM_LOOP_DUMB    1
+#define RSSB_VM_LOOP_CHECKED 1
+#define RSSB_VM_LOOP_HASH    0
+#include "vm_loop.h"
+
+#define RSSB_VM_LOOP_NAME    rssb_vm_loop_u8_borrow_hash
+#define RSSB_VM_LOOP_TYPE    uint8_t
+#define RSSB_VM_LOOP_DUMB    0
+#define RSSB_VM_LOOP_CHECKED 1
+#define RSSB_VM_LOOP_HASH    1
+#include "vm_loop.h"
+
+#define RSSB_VM_LOOP_NAME    rssb_vm_loop_u8_sign_hash
+#define RSSB_VM_LOOP_TYPE    uint8_t
+#define RSSB_VM_LOOP_DUMB    1
+#define RSSB_VM_LOOP_CHECKED 1
+#define RSSB_VM_LOOP_HASH    1
+#include "vm_loop.h"
+
+#define RSSB_VM_LOOP_NAME    rssb_vm_loop_u16_borrow_hash
+#define RSSB_VM_LOOP_TYPE    uint16_t
+#define RSSB_VM_LOOP_DUMB    0
+#define RSSB_VM_LOOP_CHECKED 1
+#define RSSB_VM_LOOP_HASH    1
+#include "vm_loop.h"
+
+#define RSSB_VM_LOOP_NAME    rssb_vm_loop_u16_sign_hash
+#define RSSB_VM_LOOP_TYPE    uint16_t
+#define RSSB_VM_LOOP_DUMB    1
+#define RSSB_VM_LOOP_CHECKED 1
+#define RSSB_VM_LOOP_HASH    1
+#include "vm_loop.h"
+
+#define RSSB_VM_LOOP_NAME    rssb_vm_loop_u32_borrow_hash
+#define RSSB_VM_LOOP_TYPE    uint32_t
+#define RSSB_VM_LOOP_DUMB    0
+#define RSSB_VM_LOOP_CHECKED 1
+#define RSSB_VM_LOOP_HASH    1
+#include "vm_loop.h"
+
+#define RSSB_VM_LOOP_NAME    rssb_vm_loop_u32_sign_hash
+#define RSSB_VM_LOOP_TYPE    uint32_t
+#define RSSB_VM_LOOP_DUMB    1
+#define RSSB_VM_LOOP_CHECKED 1
+#define RSSB_VM_LOOP_HASH    1
+#include "vm_loop.h"
+
+typedef enum rssb_vm_reason (*rssb_vm_loop_t) (rssb_vm_t *vm, uint64_t budget);
+
+/* Indexed by [log2(word_size)][dumb_mode][unchecked] */
+PRIVATE const rssb_vm_loop_t g_rssb_vm_loops[3][2][2] = {
+  {
+    {rssb_vm_loop_u8_borrow_checked, rssb_vm_loop_u8_borrow},
+    {rssb_vm_loop_u8_sign_checked,   rssb_vm_loop_u8_sign}
+  },
+  {
+    {rssb_vm_loop_u16_borrow_checked, rssb_vm_loop_u16_borrow},
+    {rssb_vm_loop_u16_sign_checked,   rssb_vm_loop_u16_sign}
+  },
+  {
+    {rssb_vm_loop_u32_borrow_checked, rssb_vm_loop_u32_borrow},
+    {rssb_vm_loop_u32_sign_checked,   rssb_vm_loop_u32_sign}
+  }
+};
+
+/* Loop checks: indexed by [log2(word_size)][dumb_mode] */
+PRIVATE const rssb_vm_loop_t g_rssb_vm_hash_loops[3][2] = {
+  {rssb_vm_loop_u8_borrow_hash,  rssb_vm_loop_u8_sign_hash},
+  {rssb_vm_loop_u16_borrow_hash, rssb_vm_loop_u16_sign_hash},
+  {rssb_vm_loop_u32_borrow_hash, rssb_vm_loop_u32_sign_hash}
+};
+
+/*
+ * Generic single step, used when profiling or tracing. Returns FALSE if
+ * the step could not run, with `reason' telling why.
+ */
+PRIVATE BOOL
+rssb_vm_exec(rssb_vm_t *vm, enum rssb_vm_reason *reason)
 {
   word_t addr, word, acc, ip, result;
   BOOL skip;
 
   /* STEP 0: RETRIEVE INSTRUCTION */
-  acc = vm->mem[RSSB_ADDR_A]  & vm->mem_mask;
-  ip  = vm->mem[RSSB_ADDR_IP] & vm->mem_mask;
+  acc = rssb_vm_peek(vm, RSSB_ADDR_A)  & vm->mem_mask;
+  ip  = rssb_vm_peek(vm, RSSB_ADDR_IP) & vm->mem_mask;
   if (ip >= vm->mem_size) {
     fprintf(stderr, "vm: invalid code address 0x%x\n", ip);
+    *reason = RSSB_VM_REASON_FAULT;
     return FALSE;
   }
 
+  if (vm->loop_check != NULL) {
+    if (ip < vm->loop_check->lo)
+      vm->loop_check->lo = ip;
+    if (ip > vm->loop_check->hi)
+      vm->loop_check->hi = ip;
+  }
+
   /* STEP 1: DECODE INSTRUCTION */
-  addr = vm->mem[ip] & vm->mem_mask;
+  addr = rssb_vm_peek(vm, ip) & vm->mem_mask;
   if (addr >= vm->mem_size) {
     fprintf(stderr, "vm: invalid memory access to 0x%x at 0x%x\n", addr, ip);
+    *reason = RSSB_VM_REASON_FAULT;
     return FALSE;
   }
 
   /* STEP 2: RETRIEVE MEMORY */
   switch (addr) {
     case RSSB_ADDR_IN:
-      word = getchar(); /* TODO: use input() */
+      vm->in_step = vm->stats.steps;
+      if (!rssb_vm_read_input(vm, &word)) {
+        *reason = RSSB_VM_REASON_INPUT;
+        return FALSE;
+      }
+      ++vm->stats.inputs;
       break;
 
     default:
-      word = vm->mem[addr] & vm->mem_mask;
+      word = rssb_vm_peek(vm, addr) & vm->mem_mask;
   }
 
-#ifdef VM_DEBUG
-  fprintf(
-      stderr,
-      "[%04x] rssb 0x%04x: %04x - %04x = ", ip, addr, word, acc);
-#endif
-
   /* STEP 3: COMPUTE */
   if (vm->dumb_mode) {
     /* DUMB MODE: looks for result sign */
@@ -156,27 +883,84 @@ rssb_vm_exec(rssb_vm_t *vm)
     result = word - acc;
   }
 
-#ifdef VM_DEBUG
-  fprintf(stderr, "%04x [%c]\n", result & vm->mem_mask, skip ? 'S' : ' ');
-#endif
+  if (vm->trace != NULL)
+    rssb_trace_push(
+        vm->trace,
+        ip,
+        addr,
+        word,
+        acc,
+        result & vm->mem_mask,
+        !!skip);
+
+  if (vm->profile != NULL) {
+    ++vm->profile->exec[ip];
+    vm->profile->skip[ip] += !!skip;
+  }
+
+  ++vm->stats.steps;
+  vm->stats.skips += !!skip;
 
   /* STEP 4: UPDATE REGISTERS AND MEMORY */
-  vm->mem[RSSB_ADDR_A] = result;
+  rssb_vm_poke(vm, RSSB_ADDR_A, result);
 
-  if (addr == RSSB_ADDR_OUT)
-    putchar(result);
-  else if (addr != RSSB_ADDR_ZERO)
-    vm->mem[addr] = vm->mem[RSSB_ADDR_A];
+  if (addr == RSSB_ADDR_OUT) {
+    if (!rssb_vm_write_output(vm, result)) {
+      fprintf(stderr, "vm: output failed at 0x%x\n", ip);
+      *reason = RSSB_VM_REASON_FAULT;
+      return FALSE;
+    }
+    ++vm->stats.outputs;
+  } else if (addr != RSSB_ADDR_ZERO) {
+    rssb_vm_poke(vm, addr, result);
+
+    if (addr == RSSB_ADDR_IP)
+      ++vm->stats.ip_writes;
+    else if (addr >= RSSB_ADDR_MIN && addr <= vm->footprint)
+      ++vm->stats.code_writes;
+  }
 
   /* STEP 5: Increment instruction pointer */
-  vm->mem[RSSB_ADDR_IP] += 1 + !!skip;
+  rssb_vm_poke(vm, RSSB_ADDR_IP, rssb_vm_peek(vm, RSSB_ADDR_IP) + 1 + !!skip);
+
+  if (vm->loop_check != NULL
+      && vm->loop_check->armed
+      && rssb_loop_check_state(
+          vm->loop_check->hash,
+          rssb_vm_peek(vm, RSSB_ADDR_IP),
+          rssb_vm_peek(vm, RSSB_ADDR_A)) == vm->loop_check->saved) {
+    *reason = RSSB_VM_REASON_LOOP;
+    return FALSE;
+  }
 
   return TRUE;
 }
 
-BOOL
-rssb_vm_run(rssb_vm_t *vm)
+void
+rssb_vm_get_stats(const rssb_vm_t *vm, struct rssb_vm_stats *stats)
+{
+  *stats = vm->stats;
+}
+
+/* Masked addresses can only fall outside power-of-two memories */
+PRIVATE rssb_vm_loop_t
+rssb_vm_select_loop(const rssb_vm_t *vm)
+{
+  unsigned int width = vm->word_size == 1 ? 0 : vm->word_size == 2 ? 1 : 2;
+  BOOL unchecked = vm->mem_size == vm->mem_mask + 1;
+
+  if (vm->loop_check != NULL)
+    return g_rssb_vm_hash_loops[width][!!vm->dumb_mode];
+
+  return g_rssb_vm_loops[width][!!vm->dumb_mode][unchecked];
+}
+
+PRIVATE enum rssb_vm_reason
+rssb_vm_run_slice(rssb_vm_t *vm, uint64_t max_steps)
 {
+  enum rssb_vm_reason reason = RSSB_VM_REASON_HALTED;
+  uint64_t steps = vm->stats.steps;
+
   /*
    * Exit procedure:
    *   rssb $ip # $a_1 = $ip - $a. $ip_1 = $a_1 + 1
@@ -185,9 +969,153 @@ rssb_vm_run(rssb_vm_t *vm)
    *   $a_2  = 1
    *   $ip_2 = 2
    */
-  while (vm->mem[RSSB_ADDR_IP] != 2 || vm->mem[RSSB_ADDR_A] != 1)
-    if (!rssb_vm_exec(vm))
-      return FALSE;
+  if (vm->profile != NULL || vm->trace != NULL) {
+    while (rssb_vm_peek(vm, RSSB_ADDR_IP) != 2
+        || rssb_vm_peek(vm, RSSB_ADDR_A) != 1) {
+      if (vm->stats.steps - steps == max_steps)
+        return RSSB_VM_REASON_BUDGET;
 
-  return TRUE;
+      if (!rssb_vm_exec(vm, &reason))
+        break;
+    }
+
+    return reason;
+  }
+
+  return (rssb_vm_select_loop(vm)) (vm, max_steps);
+}
+
+/* Runs in slices that end where the loop check saves the state */
+PRIVATE enum rssb_vm_reason
+rssb_vm_run_checked(rssb_vm_t *vm, uint64_t max_steps)
+{
+  struct rssb_loop_check *check = vm->loop_check;
+  enum rssb_vm_reason reason;
+  uint64_t left = max_steps, slice, steps;
+
+  do {
+    slice = check->next - vm->stats.steps;
+    if (slice > left)
+      slice = left;
+
+    steps = vm->stats.steps;
+    reason = rssb_vm_run_slice(vm, slice);
+    left -= vm->stats.steps - steps;
+
+    if (reason == RSSB_VM_REASON_LOOP) {
+      if (rssb_loop_check_confirm(check, vm)) {
+        fprintf(
+            stderr,
+            "vm: no I/O and the same state every %" PRIu64 " steps: "
+            "looping in 0x%x-0x%x\n",
+            check->period,
+            check->first,
+            check->last);
+        return reason;
+      }
+    } else if (reason != RSSB_VM_REASON_BUDGET) {
+      return reason;
+    } else if (vm->stats.steps == check->next) {
+      rssb_loop_check_advance(check, vm);
+    }
+  } while (left > 0);
+
+  return RSSB_VM_REASON_BUDGET;
+}
+
+/*
+ * Runs at most `max_steps' steps and tells why it stopped: the program
+ * halted, faulted, ran out of steps (RSSB_VM_REASON_BUDGET) or waits
+ * for input its input callback does not have yet (RSSB_VM_REASON_INPUT).
+ * In the last two cases, calling it again carries on. With a loop
+ * check set, it also stops for good once the program is found stuck
+ * (RSSB_VM_REASON_LOOP). Returns the steps run.
+ */
+uint64_t
+rssb_vm_run_for(
+    rssb_vm_t *vm,
+    uint64_t max_steps,
+    enum rssb_vm_reason *reason)
+{
+  struct timeval start, end, elapsed;
+  uint64_t steps = vm->stats.steps;
+
+  gettimeofday(&start, NULL);
+
+  if (vm->loop_check != NULL)
+    *reason = rssb_vm_run_checked(vm, max_steps);
+  else
+    *reason = rssb_vm_run_slice(vm, max_steps);
+
+  if (!rssb_vm_binary_flush(vm) && *reason != RSSB_VM_REASON_FAULT) {
+    fprintf(stderr, "vm: output failed: %s\n", strerror(errno));
+    *reason = RSSB_VM_REASON_FAULT;
+  }
+
+  gettimeofday(&end, NULL);
+  timersub(&end, &start, &elapsed);
+  timeradd(&vm->stats.wall_time, &elapsed, &vm->stats.wall_time);
+
+  return vm->stats.steps - steps;
+}
+
+BOOL
+rssb_vm_run(rssb_vm_t *vm)
+{
+  enum rssb_vm_reason reason;
+
+  rssb_vm_run_for(vm, RSSB_VM_UNLIMITED, &reason);
+
+  return reason == RSSB_VM_REASON_HALTED;
+}
+
+/*
+ * Runs until the program halts or faults, $IP reaches `breakpoint', or
+ * right before a step that would touch $IN or $OUT. That step is left
+ * unexecuted, so everything up to it is deterministic and can be
+ * saved as an image. Also stops after `max_steps' steps, with
+ * RSSB_VM_REASON_BUDGET. Goes through the generic step, as it is meant
+ * for one-off runs.
+ */
+enum rssb_vm_reason
+rssb_vm_run_until(rssb_vm_t *vm, word_t breakpoint, uint64_t max_steps)
+{
+  struct timeval start, end, elapsed;
+  enum rssb_vm_reason reason = RSSB_VM_REASON_HALTED;
+  uint64_t steps = 0;
+  word_t ip, addr;
+
+  gettimeofday(&start, NULL);
+
+  while (rssb_vm_peek(vm, RSSB_ADDR_IP) != 2
+      || rssb_vm_peek(vm, RSSB_ADDR_A) != 1) {
+    ip = rssb_vm_peek(vm, RSSB_ADDR_IP) & vm->mem_mask;
+    if (ip == breakpoint) {
+      reason = RSSB_VM_REASON_BREAKPOINT;
+      break;
+    }
+
+    addr = rssb_vm_peek(vm, ip) & vm->mem_mask;
+    if (addr == RSSB_ADDR_IN) {
+      reason = RSSB_VM_REASON_INPUT;
+      break;
+    } else if (addr == RSSB_ADDR_OUT) {
+      reason = RSSB_VM_REASON_OUTPUT;
+      break;
+    }
+
+    if (steps++ == max_steps) {
+      reason = RSSB_VM_REASON_BUDGET;
+      break;
+    }
+
+    if (!rssb_vm_exec(vm, &reason))
+      break;
+  }
+
+  gettimeofday(&end, NULL);
+  timersub(&end, &start, &elapsed);
+  timeradd(&vm->stats.wall_time, &elapsed, &vm->stats.wall_time);
+
+  return reason;
 }
@@ -0,0 +1,254 @@
+/*
+
+  Copyright (C) 2018 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+/*
+ * Specialised interpreter loop. This file has no include guard: vm.c
+ * includes it once per combination of
+ *
+ *   RSSB_VM_LOOP_NAME     Name of the generated function
+ *   RSSB_VM_LOOP_TYPE     Storage type of a memory word
+ *   RSSB_VM_LOOP_DUMB     Skip on the sign of the result (1) or on
+ *                         borrow (0)
+ *   RSSB_VM_LOOP_CHECKED  Check addresses against the memory size. Not
+ *                         needed when the size is a power of two, as
+ *                         masked addresses are always in range
+ *   RSSB_VM_LOOP_HASH     Keep the loop check's memory hash and $IP
+ *                         range up to date, and stop with
+ *                         RSSB_VM_REASON_LOOP after any step that
+ *                         leaves the saved state hash
+ *
+ * and undefines them afterwards. Profiling and tracing go through
+ * rssb_vm_exec instead, so the loop only keeps the cheap counters, in
+ * locals, and writes them back on exit. It must behave exactly like
+ * rssb_vm_exec otherwise.
+ *
+ * At most `budget' steps are run. The budget replaces the step
+ * counter, so bounding a run costs nothing more than counting it.
+ */
+
+PRIVATE enum rssb_vm_reason
+RSSB_VM_LOOP_NAME(rssb_vm_t *vm, uint64_t budget)
+{
+  RSSB_VM_LOOP_TYPE *mem = vm->mem;
+  uint8_t *pages = vm->pages;
+  const unsigned int page_shift = vm->page_shift;
+  RSSB_VM_LOOP_TYPE reg_ip = mem[RSSB_ADDR_IP];
+  RSSB_VM_LOOP_TYPE reg_a  = mem[RSSB_ADDR_A];
+  const word_t mask = vm->mem_mask;
+#if RSSB_VM_LOOP_DUMB
+  const word_t neg_mask = vm->mem_neg_mask;
+#endif
+#if RSSB_VM_LOOP_CHECKED
+  const word_t size = vm->mem_size;
+#endif
+  const word_t footprint = vm->footprint;
+  const uint64_t steps = vm->stats.steps;
+  uint64_t left = budget, skips = 0, inputs = 0, outputs = 0;
+  uint64_t ip_writes = 0, code_writes = 0;
+#if RSSB_VM_LOOP_HASH
+  struct rssb_loop_check *check = vm->loop_check;
+  uint64_t hash = check->hash;
+  word_t ip_lo = check->lo, ip_hi = check->hi;
+  const uint64_t saved = check->saved;
+  const BOOL armed = check->armed;
+#endif
+  word_t addr, word, acc, ip, result;
+  unsigned int skip;
+  enum rssb_vm_reason reason = RSSB_VM_REASON_HALTED;
+
+  /*
+   * $IP and $A live in locals: every step reads and writes both, and
+   * going through memory would serialise steps on store forwarding.
+   * They are written back before anything can read them from memory.
+   */
+  while (reg_ip != 2 || reg_a != 1) {
+    if (left == 0) {
+      reason = RSSB_VM_REASON_BUDGET;
+      break;
+    }
+
+    acc = reg_a  & mask;
+    ip  = reg_ip & mask;
+#if RSSB_VM_LOOP_CHECKED
+    if (ip >= size) {
+      fprintf(stderr, "vm: invalid code address 0x%x\n", ip);
+      reason = RSSB_VM_REASON_FAULT;
+      break;
+    }
+#endif
+
+#if RSSB_VM_LOOP_HASH
+    ip_lo = ip < ip_lo ? ip : ip_lo;
+    ip_hi = ip > ip_hi ? ip : ip_hi;
+#endif
+
+    if (ip < RSSB_ADDR_MIN) {
+      mem[RSSB_ADDR_IP] = reg_ip;
+      mem[RSSB_ADDR_A]  = reg_a;
+    }
+
+    addr = mem[ip] & mask;
+#if RSSB_VM_LOOP_CHECKED
+    if (addr >= size) {
+      fprintf(stderr, "vm: invalid memory access to 0x%x at 0x%x\n", addr, ip);
+      reason = RSSB_VM_REASON_FAULT;
+      break;
+    }
+#endif
+
+    /* Common case: a plain memory operand */
+    if (addr >= RSSB_ADDR_MIN) {
+      word = mem[addr] & mask;
+
+      result = word - acc;
+#if RSSB_VM_LOOP_DUMB
+      skip = !!(result & neg_mask);
+#else
+      skip = acc > word;
+#endif
+
+      reg_a = result;
+#if RSSB_VM_LOOP_HASH
+      hash += ((uint64_t) (RSSB_VM_LOOP_TYPE) result - mem[addr])
+        * rssb_loop_check_key(addr);
+#endif
+      mem[addr] = result;
+      pages[addr >> page_shift] = RSSB_VM_PAGE_WRITTEN;
+      code_writes += addr <= footprint;
+
+      --left;
+      skips += skip;
+      reg_ip += 1 + skip;
+
+#if RSSB_VM_LOOP_HASH
+      if (armed && rssb_loop_check_state(hash, reg_ip, reg_a) == saved) {
+        reason = RSSB_VM_REASON_LOOP;
+        break;
+      }
+#endif
+      continue;
+    }
+
+    switch (addr) {
+      case RSSB_ADDR_IP:
+        word = reg_ip & mask;
+        break;
+
+      case RSSB_ADDR_A:
+        word = acc;
+        break;
+
+      case RSSB_ADDR_IN:
+        vm->in_step = steps + budget - left;
+        if (!rssb_vm_read_input(vm, &word)) {
+          reason = RSSB_VM_REASON_INPUT;
+          break;
+        }
+        ++inputs;
+        break;
+
+      default:
+        word = mem[addr] & mask;
+    }
+
+    /* Nothing to read yet: leave the step for the next call */
+    if (reason == RSSB_VM_REASON_INPUT)
+      break;
+
+#if RSSB_VM_LOOP_DUMB
+    if (addr == RSSB_ADDR_OUT)
+      result = acc;
+    else
+      result = word - acc;
+
+    skip = !!(result & neg_mask);
+#else
+    skip = acc > word;
+    result = word - acc;
+#endif
+
+    --left;
+    skips += skip;
+
+    reg_a = result;
+
+    switch (addr) {
+      case RSSB_ADDR_IP:
+        reg_ip = result;
+        ++ip_writes;
+        break;
+
+      case RSSB_ADDR_IN:
+#if RSSB_VM_LOOP_HASH
+        hash += ((uint64_t) (RSSB_VM_LOOP_TYPE) result - mem[addr])
+          * rssb_loop_check_key(addr);
+#endif
+        mem[addr] = result;
+        pages[0] = RSSB_VM_PAGE_WRITTEN;
+        break;
+
+      case RSSB_ADDR_OUT:
+        if (!rssb_vm_write_output(vm, result)) {
+          fprintf(stderr, "vm: output failed at 0x%x\n", ip);
+          reason = RSSB_VM_REASON_FAULT;
+          break;
+        }
+        ++outputs;
+        break;
+    }
+
+    if (reason == RSSB_VM_REASON_FAULT)
+      break;
+
+    reg_ip += 1 + skip;
+
+#if RSSB_VM_LOOP_HASH
+    if (armed && rssb_loop_check_state(hash, reg_ip, reg_a) == saved) {
+      reason = RSSB_VM_REASON_LOOP;
+      break;
+    }
+#endif
+  }
+
+  mem[RSSB_ADDR_IP] = reg_ip;
+  mem[RSSB_ADDR_A]  = reg_a;
+  pages[0] = RSSB_VM_PAGE_WRITTEN;
+
+#if RSSB_VM_LOOP_HASH
+  check->hash = hash;
+  check->lo   = ip_lo;
+  check->hi   = ip_hi;
+#endif
+
+  vm->stats.steps       += budget - left;
+  vm->stats.skips       += skips;
+  vm->stats.inputs      += inputs;
+  vm->stats.outputs     += outputs;
+  vm->stats.ip_writes   += ip_writes;
+  vm->stats.code_writes += code_writes;
+
+  return reason;
+}
+
+#undef RSSB_VM_LOOP_NAME
+#undef RSSB_VM_LOOP_TYPE
+#undef RSSB_VM_LOOP_DUMB
+#undef RSSB_VM_LOOP_CHECKED
+#undef RSSB_VM_LOOP_HASH
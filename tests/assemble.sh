@@ -0,0 +1,16 @@
+#!/bin/sh
+#
+# assemble.sh: every regression source must assemble and run to the
+# end. The exit sequence leaves nothing on the standard output.
+#
+
+status=0
+
+for file in unused_macro.rssb; do
+  if ! ../src/rssb "$srcdir/$file" < /dev/null > /dev/null; then
+    echo "FAIL: $file"
+    status=1
+  fi
+done
+
+exit $status
@@ -0,0 +1,56 @@
+#!/bin/sh
+#
+# checkpoint.sh: a run that reads input, stopped halfway, checkpointed
+# and restored, must write the same output as an uninterrupted one,
+# through --input-file/--output-file and through stdio.
+#
+
+RSSB=../src/rssb
+LIB="$srcdir/../bench/workloads/lib.rssb"
+TMP=checkpoint.tmp
+
+rm -rf $TMP
+mkdir $TMP || exit 1
+trap 'rm -rf $TMP' EXIT
+
+# Some input, a few thousand bytes long
+i=0
+while [ $i -lt 100 ]; do
+  echo "line $i of the checkpoint test input"
+  i=`expr $i + 1`
+done > $TMP/in.txt
+
+$RSSB "$srcdir/shift.rssb" "$LIB" < $TMP/in.txt > $TMP/ref.out || exit 1
+
+# Mapped files
+$RSSB "$srcdir/shift.rssb" "$LIB" --max-steps=100000 --checkpoint=$TMP/map.ckp \
+  --input-file=$TMP/in.txt --output-file=$TMP/map.out 2> /dev/null
+if [ ! -s $TMP/map.out ] || cmp -s $TMP/map.out $TMP/ref.out; then
+  echo "FAIL: the first run did not stop halfway"
+  exit 1
+fi
+
+$RSSB --restore=$TMP/map.ckp --input-file=$TMP/in.txt --output-file=$TMP/map.out \
+  || exit 1
+if ! cmp $TMP/map.out $TMP/ref.out; then
+  echo "FAIL: restored run with mapped files"
+  exit 1
+fi
+
+# Standard input from a file, standard output appended to
+$RSSB "$srcdir/shift.rssb" "$LIB" --max-steps=100000 --checkpoint=$TMP/std.ckp \
+  < $TMP/in.txt > $TMP/std.out 2> /dev/null
+$RSSB --restore=$TMP/std.ckp < $TMP/in.txt >> $TMP/std.out || exit 1
+if ! cmp $TMP/std.out $TMP/ref.out; then
+  echo "FAIL: restored run with stdio"
+  exit 1
+fi
+
+# Input shorter than what the checkpoint has read already
+head -c 10 $TMP/in.txt > $TMP/short.txt
+if $RSSB --restore=$TMP/map.ckp --input-file=$TMP/short.txt 2> /dev/null; then
+  echo "FAIL: resumed past the end of the input"
+  exit 1
+fi
+
+exit 0
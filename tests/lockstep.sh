@@ -0,0 +1,79 @@
+#!/bin/sh
+#
+# lockstep.sh: --batch over inputs that make the program take different
+# paths must write the same outputs and count the same steps per input
+# with --lockstep as without, with every kernel this CPU runs.
+#
+
+RSSB=../src/rssb
+LIB="$srcdir/../bench/workloads/lib.rssb"
+TMP=lockstep.tmp
+
+rm -rf $TMP
+mkdir $TMP || exit 1
+trap 'rm -rf $TMP' EXIT
+
+# Inputs of different lengths, one of them empty, with every byte value
+i=0
+while [ $i -lt 40 ]; do
+  j=0
+  n=`expr $i \* $i % 37`
+  while [ $j -lt $n ]; do
+    printf "\\`printf %o \`expr \( $i \* 31 + $j \* 17 \) % 256\``"
+    j=`expr $j + 1`
+  done > $TMP/in$i
+  echo $TMP/in$i
+  i=`expr $i + 1`
+done > $TMP/list
+
+# The `ok, N steps' line of each input
+run()
+{
+  dir=$TMP/$1
+  shift
+  mkdir $dir || exit 1
+  $RSSB "$srcdir/shift.rssb" "$LIB" --batch=$TMP/list --batch-output=$dir "$@" \
+    2> $dir.err
+  status=$?
+  grep ": ok, \|: failed, " $dir.err > $dir.steps
+  return $status
+}
+
+run ref || exit 1
+if [ `grep -c ": ok, " $TMP/ref.steps` -ne 40 ]; then
+  echo "FAIL: reference batch"
+  exit 1
+fi
+
+kernels=0
+for isa in avx512f avx2 sse2 scalar; do
+  if ! run $isa --lockstep=$isa; then
+    if grep -q "kernel \`$isa' not available" $TMP/$isa.err; then
+      continue
+    fi
+    echo "FAIL: --lockstep=$isa"
+    exit 1
+  fi
+  kernels=`expr $kernels + 1`
+
+  if ! cmp $TMP/ref.steps $TMP/$isa.steps; then
+    echo "FAIL: step counts differ with --lockstep=$isa"
+    exit 1
+  fi
+
+  i=0
+  while [ $i -lt 40 ]; do
+    if ! cmp $TMP/ref/in$i.out $TMP/$isa/in$i.out; then
+      echo "FAIL: output of in$i differs with --lockstep=$isa"
+      exit 1
+    fi
+    i=`expr $i + 1`
+  done
+done
+
+if [ $kernels -eq 0 ]; then
+  echo "FAIL: no lockstep kernel runs"
+  exit 1
+fi
+
+exit 0
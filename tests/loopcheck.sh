@@ -0,0 +1,42 @@
+#!/bin/sh
+#
+# loopcheck.sh: --loop-check must stop a program cycling through the
+# same states without I/O, and must let one that counts for a long
+# time without I/O run to its end.
+#
+
+RSSB=../src/rssb
+LIB="$srcdir/../bench/workloads/lib.rssb"
+TMP=loopcheck.tmp
+
+rm -rf $TMP
+mkdir $TMP || exit 1
+trap 'rm -rf $TMP' EXIT
+
+# --max-steps keeps a detector that never fires from hanging the test
+if $RSSB "$srcdir/spin.rssb" "$LIB" --loop-check=1000 --max-steps=10000000 \
+    < /dev/null > /dev/null 2> $TMP/spin.err; then
+  echo "FAIL: endless loop ran to completion"
+  exit 1
+fi
+
+if ! grep -q 'the same state every' $TMP/spin.err; then
+  echo "FAIL: endless loop not detected"
+  exit 1
+fi
+
+# Millions of steps, well past the first check
+if ! $RSSB "$srcdir/count.rssb" "$LIB" --loop-check=1000 \
+    < /dev/null > $TMP/count.out 2> $TMP/count.err; then
+  echo "FAIL: counting loop stopped"
+  cat $TMP/count.err
+  exit 1
+fi
+
+echo > $TMP/nl
+if ! cmp -s $TMP/count.out $TMP/nl; then
+  echo "FAIL: counting loop did not reach its end"
+  exit 1
+fi
+
+exit 0
@@ -0,0 +1,63 @@
+#!/bin/sh
+#
+# regions.sh: --regions on a loop that walks a pointer over a table
+# must not give up, must keep the table as data and must only report
+# the pointer and the words the loop stores to as written.
+#
+
+RSSB=../src/rssb
+LIB="$srcdir/../bench/workloads/lib.rssb"
+SRC="$srcdir/walk.rssb"
+TMP=regions.tmp
+
+rm -rf $TMP
+mkdir $TMP || exit 1
+trap 'rm -rf $TMP' EXIT
+
+if [ "`$RSSB "$SRC" "$LIB" < /dev/null`" != "walk" ]; then
+  echo "FAIL: walk.rssb does not print its table"
+  exit 1
+fi
+
+$RSSB --regions "$SRC" "$LIB" < /dev/null > $TMP/regions.txt || exit 1
+if ! grep -q "^# [0-9]* code, [0-9]* data, [0-9]* possibly written words" \
+    $TMP/regions.txt; then
+  echo "FAIL: the analysis gave up"
+  cat $TMP/regions.txt
+  exit 1
+fi
+
+written=`sed -n 's/.*data, \([0-9]*\) possibly written.*/\1/p' $TMP/regions.txt`
+if [ "$written" -gt 16 ]; then
+  echo "FAIL: $written possibly written words"
+  exit 1
+fi
+
+# Each word tagged with what it is, by source line
+$RSSB --disas --regions "$SRC" "$LIB" < /dev/null > $TMP/disas.txt || exit 1
+
+tagged()
+{
+  grep "walk.rssb:$1," $TMP/disas.txt | grep -q "\[$2\]"
+}
+
+first=`grep -n "^TABLE:" "$SRC" | cut -d: -f1`
+last=`grep -n "^TABLE_END:" "$SRC" | cut -d: -f1`
+line=`expr $first + 1`
+while [ $line -lt $last ]; do
+  if ! tagged $line data; then
+    echo "FAIL: table word at walk.rssb:$line is not data"
+    exit 1
+  fi
+  line=`expr $line + 1`
+done
+
+for label in CH PTR; do
+  line=`grep -n "^$label:" "$SRC" | cut -d: -f1`
+  if ! tagged `expr $line + 1` written; then
+    echo "FAIL: $label is not reported as written"
+    exit 1
+  fi
+done
+
+exit 0
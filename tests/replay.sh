@@ -0,0 +1,64 @@
+#!/bin/sh
+#
+# replay.sh: a run fed from a log saved with --record-input must write
+# the same output in as many steps as the recorded one, and a log whose
+# read steps were tampered with must be reported as diverging.
+#
+
+RSSB=../src/rssb
+LIB="$srcdir/../bench/workloads/lib.rssb"
+TMP=replay.tmp
+
+rm -rf $TMP
+mkdir $TMP || exit 1
+trap 'rm -rf $TMP' EXIT
+
+i=0
+while [ $i -lt 50 ]; do
+  echo "line $i of the replay test input"
+  i=`expr $i + 1`
+done > $TMP/in.txt
+
+# The `Instructions retired' line of a run
+steps()
+{
+  grep 'Instructions retired' $1
+}
+
+$RSSB "$srcdir/shift.rssb" "$LIB" -s --record-input=$TMP/in.log \
+  < $TMP/in.txt > $TMP/rec.out 2> $TMP/rec.err || exit 1
+
+$RSSB "$srcdir/shift.rssb" "$LIB" -s --replay-input=$TMP/in.log \
+  < /dev/null > $TMP/play.out 2> $TMP/play.err || exit 1
+
+if ! cmp $TMP/rec.out $TMP/play.out; then
+  echo "FAIL: replayed output differs from the recorded one"
+  exit 1
+fi
+
+if [ "`steps $TMP/rec.err`" != "`steps $TMP/play.err`" ] \
+    || [ -z "`steps $TMP/rec.err`" ]; then
+  echo "FAIL: replayed run took another number of steps"
+  exit 1
+fi
+
+if grep -q 'other steps than logged' $TMP/play.err; then
+  echo "FAIL: faithful replay reported as diverging"
+  exit 1
+fi
+
+# Flip the low bit of the first read's step delta, right after the
+# 16 byte header. The continuation bit is kept, so the log still parses.
+byte=`od -An -tu1 -j16 -N1 $TMP/in.log | tr -d ' '`
+printf "\\`printf %o \`expr $byte - $byte % 2 + 1 - $byte % 2\``" \
+  | dd of=$TMP/in.log bs=1 seek=16 conv=notrunc 2> /dev/null
+
+$RSSB "$srcdir/shift.rssb" "$LIB" --replay-input=$TMP/in.log \
+  < /dev/null > /dev/null 2> $TMP/bad.err
+
+if ! grep -q 'other steps than logged' $TMP/bad.err; then
+  echo "FAIL: tampered log not reported as diverging"
+  exit 1
+fi
+
+exit 0